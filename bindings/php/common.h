@@ -63,9 +63,14 @@ typedef size_t zend_strlen_t;
     RETVAL_STRINGL(string, length)
 # define add_next_index_string_copy(zval, str) \
     add_next_index_string(zval, str)
+# define add_next_index_stringl_copy(zval, str, length) \
+    add_next_index_stringl(zval, str, length)
 // hashtable with CE names
 # define ce_hash_exists(h, ce) \
     zend_hash_exists(h, ce->name)
+// is the method (its lowercased name) defined by the class?
+# define ce_has_method(ce, name) \
+    zend_hash_str_exists(&(ce)->function_table, S(name))
 # define REGISTER_INTERNAL_CLASS_EX(ceptr, parentceptr) \
     zend_register_internal_class_ex(ceptr, parentceptr);
 
@@ -105,8 +110,12 @@ typedef int zend_strlen_t;
     RETVAL_STRINGL(string, length, 1)
 # define add_next_index_string_copy(zval, str) \
     add_next_index_string(zval, str, 1)
+# define add_next_index_stringl_copy(zval, str, length) \
+    add_next_index_stringl(zval, str, length, 1)
 # define ce_hash_exists(h, ce) \
     zend_hash_exists(h, ce->name, ce->name_length + 1)
+# define ce_has_method(ce, name) \
+    zend_hash_exists(&(ce)->function_table, S(name))
 # define REGISTER_INTERNAL_CLASS_EX(ceptr, parentceptr) \
     zend_register_internal_class_ex(ceptr, parentceptr, NULL TSRMLS_CC);
 
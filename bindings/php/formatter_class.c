@@ -18,8 +18,9 @@ static union {
         zval ZVALPX(end_token);
         zval ZVALPX(start_lexing);
         zval ZVALPX(end_lexing);
+        zval ZVALPX(format_tokens);
     };
-    zval ZVALPX(all)[7];
+    zval ZVALPX(all)[8];
 } fmt_callback_names;
 
 /* interface/callbacks */
@@ -87,9 +88,75 @@ static void PHP_CALLBACK(
     }
 }
 
+/**
+ * A subclass of Shall\Formatter\Base which implements a format_tokens($tokens)
+ * method receives the tokens as arrays of [type, text] pairs, at most
+ * FORMAT_TOKENS_BATCH at once, instead of calls to start_token, write_token
+ * and end_token for each of them. The array is flushed before start_lexing,
+ * end_lexing and end_document, which are still called.
+ */
+#define FORMAT_TOKENS_BATCH 1024
+
+/**
+ * Adds the current token, if any, to the batch
+ */
+static void php_batch_push(PHPFormatterData *mydata)
+{
+    if (!string_empty(mydata->batch_text)) {
+        zval ZVALPX(item);
+
+        if (Z_ISUNDEF(mydata->batch)) {
+            MAKE_STD_ZVAL(mydata->batch);
+            array_init(ZVALRX(mydata->batch));
+        }
+        MAKE_STD_ZVAL(item);
+        array_init(ZVALRX(item));
+        add_next_index_long(ZVALRX(item), mydata->batch_type);
+        add_next_index_stringl_copy(ZVALRX(item), mydata->batch_text->ptr, mydata->batch_text->len);
+        add_next_index_zval(ZVALRX(mydata->batch), ZVALRX(item));
+        string_truncate(mydata->batch_text);
+    }
+}
+
+/**
+ * Gives the pending tokens to the format_tokens method in a single call
+ */
+static void php_batch_flush(String *out, PHPFormatterData *mydata TSRMLS_DC)
+{
+    php_batch_push(mydata);
+    if (!Z_ISUNDEF(mydata->batch)) {
+#if PHP_MAJOR_VERSION >= 7
+        PHP_CALLBACK(fmt_callback_names.format_tokens, 1, &mydata->batch, out, mydata TSRMLS_CC);
+#else
+        zval **params[1];
+
+        params[0] = &mydata->batch;
+        PHP_CALLBACK(fmt_callback_names.format_tokens, 1, params, out, mydata TSRMLS_CC);
+#endif /* PHP >= 7 */
+        // the method may have kept a reference on it: start a new array
+        zval_ptr_dtor(&mydata->batch);
+        ZVAL_UNDEF(ZVALRX(mydata->batch));
+    }
+}
+
 static int php_start_document(String *out, FormatterData *data)
 {
+    PHPFormatterData *mydata;
+
     TSRMLS_FETCH();
+    mydata = (PHPFormatterData *) data;
+    if ((mydata->batching = ce_has_method(Z_OBJCE_P(ZVALRX(mydata->this)), "format_tokens"))) {
+        if (NULL == mydata->batch_text) {
+            mydata->batch_text = string_new();
+        } else {
+            // leftovers of an interrupted document
+            string_truncate(mydata->batch_text);
+            if (!Z_ISUNDEF(mydata->batch)) {
+                zval_ptr_dtor(&mydata->batch);
+                ZVAL_UNDEF(ZVALRX(mydata->batch));
+            }
+        }
+    }
     PHP_CALLBACK(fmt_callback_names.start_document, 0, NULL, out, data TSRMLS_CC);
 
     return 0;
@@ -97,7 +164,13 @@ static int php_start_document(String *out, FormatterData *data)
 
 static int php_end_document(String *out, FormatterData *data)
 {
+    PHPFormatterData *mydata;
+
     TSRMLS_FETCH();
+    mydata = (PHPFormatterData *) data;
+    if (mydata->batching) {
+        php_batch_flush(out, mydata TSRMLS_CC);
+    }
     PHP_CALLBACK(fmt_callback_names.end_document, 0, NULL, out, data TSRMLS_CC);
 
     return 0;
@@ -119,36 +192,61 @@ static int php_end_document(String *out, FormatterData *data)
 
 static int php_start_token(int token, String *out, FormatterData *data)
 {
-    PARAM_1_DECL;
+    PHPFormatterData *mydata;
 
-    TSRMLS_FETCH();
-    ZVAL_LONG(ZVALRX(PARAM_1_NAME), token);
-    PHP_CALLBACK(fmt_callback_names.start_token, 1, params, out, data TSRMLS_CC);
-    zval_ptr_dtor(&PARAM_1_NAME);
+    mydata = (PHPFormatterData *) data;
+    if (mydata->batching) {
+        php_batch_push(mydata);
+        mydata->batch_type = token;
+    } else {
+        PARAM_1_DECL;
+
+        TSRMLS_FETCH();
+        ZVAL_LONG(ZVALRX(PARAM_1_NAME), token);
+        PHP_CALLBACK(fmt_callback_names.start_token, 1, params, out, data TSRMLS_CC);
+        zval_ptr_dtor(&PARAM_1_NAME);
+    }
 
     return 0;
 }
 
 static int php_end_token(int token, String *out, FormatterData *data)
 {
-    PARAM_1_DECL;
+    PHPFormatterData *mydata;
 
     TSRMLS_FETCH();
-    ZVAL_LONG(ZVALRX(PARAM_1_NAME), token);
-    PHP_CALLBACK(fmt_callback_names.end_token, 1, params, out, data TSRMLS_CC);
-    zval_ptr_dtor(&PARAM_1_NAME);
+    mydata = (PHPFormatterData *) data;
+    if (mydata->batching) {
+        php_batch_push(mydata);
+        if (!Z_ISUNDEF(mydata->batch) && zend_hash_num_elements(Z_ARRVAL_P(ZVALRX(mydata->batch))) >= FORMAT_TOKENS_BATCH) {
+            php_batch_flush(out, mydata TSRMLS_CC);
+        }
+    } else {
+        PARAM_1_DECL;
+
+        ZVAL_LONG(ZVALRX(PARAM_1_NAME), token);
+        PHP_CALLBACK(fmt_callback_names.end_token, 1, params, out, data TSRMLS_CC);
+        zval_ptr_dtor(&PARAM_1_NAME);
+    }
 
     return 0;
 }
 
 static int php_write_token(String *out, const char *token, size_t token_len, FormatterData *data)
 {
-    PARAM_1_DECL;
+    PHPFormatterData *mydata;
 
-    TSRMLS_FETCH();
-    ZVAL_STRINGL_COPY(ZVALRX(PARAM_1_NAME), token, token_len);
-    PHP_CALLBACK(fmt_callback_names.write_token, 1, params, out, data TSRMLS_CC);
-    zval_ptr_dtor(&PARAM_1_NAME);
+    mydata = (PHPFormatterData *) data;
+    if (mydata->batching) {
+        string_append_string_len(mydata->batch_text, token, token_len);
+    } else {
+        PARAM_1_DECL;
+
+        TSRMLS_FETCH();
+        ZVAL_STRINGL_COPY(ZVALRX(PARAM_1_NAME), token, token_len);
+        PHP_CALLBACK(fmt_callback_names.write_token, 1, params, out, data TSRMLS_CC);
+        zval_ptr_dtor(&PARAM_1_NAME);
+    }
 
     return 0;
 }
@@ -158,6 +256,9 @@ static int php_start_lexing(const char *lexname, String *out, FormatterData *dat
     PARAM_1_DECL;
 
     TSRMLS_FETCH();
+    if (((PHPFormatterData *) data)->batching) {
+        php_batch_flush(out, (PHPFormatterData *) data TSRMLS_CC);
+    }
     ZVAL_STRING_COPY(ZVALRX(PARAM_1_NAME), lexname);
     PHP_CALLBACK(fmt_callback_names.start_lexing, 1, params, out, data TSRMLS_CC);
     zval_ptr_dtor(&PARAM_1_NAME);
@@ -170,6 +271,9 @@ static int php_end_lexing(const char *lexname, String *out, FormatterData *data)
     PARAM_1_DECL;
 
     TSRMLS_FETCH();
+    if (((PHPFormatterData *) data)->batching) {
+        php_batch_flush(out, (PHPFormatterData *) data TSRMLS_CC);
+    }
     ZVAL_STRING_COPY(ZVALRX(PARAM_1_NAME), lexname);
     PHP_CALLBACK(fmt_callback_names.end_lexing, 1, params, out, data TSRMLS_CC);
     zval_ptr_dtor(&PARAM_1_NAME);
@@ -276,8 +380,16 @@ debug("%s %p", formatter_implementation_name(formatter_implementation(o->formatt
 
         mydata = (PHPFormatterData *) &o->formatter->optvals;
         zend_hash_destroy(&mydata->options);
+        if (!Z_ISUNDEF(mydata->batch)) {
+            zval_ptr_dtor(&mydata->batch);
+        }
+        if (NULL != mydata->batch_text) {
+            string_destroy(mydata->batch_text);
+        }
+    }
+    if (!o->persistent) {
+        formatter_destroy(o->formatter);
     }
-    formatter_destroy(o->formatter);
     zend_object_std_dtor(&o->zo TSRMLS_CC);
 #if PHP_MAJOR_VERSION < 7
     efree(o);
@@ -310,6 +422,7 @@ Shall_Formatter_object_create(zend_class_entry *ce TSRMLS_DC)
         imp = &phpfmt;
     }
     intern->formatter = formatter_create(imp);
+    intern->persistent = false;
     zend_object_std_init(&intern->zo, ce TSRMLS_CC);
 #if PHP_MAJOR_VERSION >= 7
     intern->zo.handlers
@@ -333,6 +446,35 @@ Shall_Formatter_object_create(zend_class_entry *ce TSRMLS_DC)
     ;
 }
 
+/**
+ * Wraps a persistent (builtin) formatter into a new object of its class,
+ * which doesn't destroy it when freed
+ */
+void shall_formatter_wrap_persistent(Formatter *formatter, zval *out TSRMLS_DC)
+{
+    char buffer[1024];
+    Shall_Formatter_object *o;
+    zend_class_entry *ZVALPX(ceptr) = NULL;
+
+    ADD_NAMESPACE(buffer, "Shall\\Formatter\\", formatter_implementation_name(formatter_implementation(formatter)));
+#if PHP_MAJOR_VERSION >= 7
+    if (NULL != (ceptr = zend_hash_str_find_ptr(&formatters, buffer, strlen(buffer)))) {
+#else
+    if (SUCCESS == zend_hash_find(&formatters, buffer, strlen(buffer) + 1, (void **) &ceptr)) {
+#endif /* PHP >= 7 */
+        object_init_ex(out, ZVALPX(ceptr));
+#if PHP_MAJOR_VERSION >= 7
+        SHALL_FORMATTER_FETCH_OBJ_P(o, Z_OBJ_P(out));
+#else
+        o = (Shall_Formatter_object *) zend_object_store_get_object(out TSRMLS_CC);
+#endif /* PHP >= 7 */
+        // drop the formatter created along with the object
+        formatter_destroy(o->formatter);
+        o->formatter = formatter;
+        o->persistent = true;
+    }
+}
+
 ZEND_BEGIN_ARG_INFO_EX(ainfo_shall_void, 0, 0, 0)
 ZEND_END_ARG_INFO()
 
@@ -398,6 +540,7 @@ void shall_register_Formatter_class(TSRMLS_D)
     ZVAL_STRINGL_COPY(ZVALRX(fmt_callback_names.end_token), "end_token", STR_LEN("end_token"));
     ZVAL_STRINGL_COPY(ZVALRX(fmt_callback_names.start_lexing), "start_lexing", STR_LEN("start_lexing"));
     ZVAL_STRINGL_COPY(ZVALRX(fmt_callback_names.end_lexing), "end_lexing", STR_LEN("end_lexing"));
+    ZVAL_STRINGL_COPY(ZVALRX(fmt_callback_names.format_tokens), "format_tokens", STR_LEN("format_tokens"));
 
     // TEST
     zend_hash_init(&formatters, SHALL_FORMATTER_COUNT, NULL, NULL, 1);
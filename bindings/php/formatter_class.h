@@ -8,6 +8,11 @@ typedef struct {
 #endif /* PHP < 7 */
 
     Formatter *formatter;
+    /**
+     * true if formatter is one of the persistent formatters: it is shared
+     * by all requests, the object doesn't own it
+     */
+    bool persistent;
 #if 0
     // TODO: do it once for each class, not instance?
     // http://lxr.php.net/xref/PHP_5_6/ext/intl/converter/converter.c#252
@@ -45,11 +50,27 @@ typedef struct {
 typedef struct {
     zval ZVALPX(this);
     HashTable options;
+    /**
+     * true if the class implements format_tokens
+     */
+    bool batching;
+    /**
+     * The [type, text] pairs not yet given to format_tokens (undefined
+     * when there is none)
+     */
+    zval ZVALPX(batch);
+    /**
+     * The text of the current token, of type batch_type
+     */
+    String *batch_text;
+    int batch_type;
 } PHPFormatterData;
 
 extern HashTable formatters;
 extern const FormatterImplementation phpfmt;
 extern zend_class_entry *Shall_Formatter_ce_ptr;
 
+void shall_formatter_wrap_persistent(Formatter *, zval * TSRMLS_DC);
+
 void shall_register_Formatter_class(TSRMLS_D);
 void shall_unregister_Formatter_class(TSRMLS_D);
@@ -94,6 +94,10 @@ PHP_FUNCTION(Shall_Base_Formatter_setOption)
         RETURN_FALSE;
     }
     SHALL_FETCH_FORMATTER(o, object, true);
+    if (o->persistent) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Options of a persistent formatter can't be changed");
+        RETURN_FALSE;
+    }
     php_set_option((void *) o->formatter, name, value, 1, formatter_set_option_compat_cb TSRMLS_CC);
 }
 
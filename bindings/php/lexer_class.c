@@ -83,7 +83,9 @@ static void Shall_Lexer_objects_free(
 //         return;
 //     }
 debug("%s %p", lexer_implementation_name(lexer_implementation(o->lexer)), o->lexer);
-    lexer_destroy(o->lexer, zval_lexer_dec_ref);
+    if (!o->persistent) {
+        lexer_destroy(o->lexer, zval_lexer_dec_ref);
+    }
 //     o->lexer = NULL;
 #if PHP_MAJOR_VERSION < 7
     efree(o);
@@ -110,6 +112,7 @@ Shall_Lexer_object_create(zend_class_entry *ce TSRMLS_DC)
 #endif /* PHP >= 7 */
     zend_object_std_init(&intern->zo, ce TSRMLS_CC);
     intern->lexer = lexer_create(lexer_implementation_by_name(CE_NAME(ce) + STR_LEN("Shall\\Lexer\\")));
+    intern->persistent = false;
 debug("lexer is %s/%p/%p", lexer_implementation_name(lexer_implementation(intern->lexer)), intern->lexer, &intern->zo);
 #if PHP_MAJOR_VERSION >= 7
     intern->zo.handlers
@@ -158,6 +161,31 @@ debug("lexer is %p/%s", lexer, lexer_implementation_name(lexer_implementation(le
     }
 }
 
+/**
+ * Wraps a persistent lexer into a new object of its class, which doesn't
+ * destroy it when freed
+ */
+void shall_lexer_wrap_persistent(Lexer *lexer, zval *out TSRMLS_DC)
+{
+    const char *imp_name;
+    Shall_Lexer_object *o;
+    zend_class_entry *ZVALPX(ceptr) = NULL;
+
+    imp_name = lexer_implementation_name(lexer_implementation(lexer));
+#if PHP_MAJOR_VERSION >= 7
+    if (NULL != (ceptr = zend_hash_str_find_ptr(&lexer_classes, (char *) imp_name, strlen(imp_name)))) {
+#else
+    if (SUCCESS == zend_hash_find(&lexer_classes, (char *) imp_name, strlen(imp_name) + 1, (void **) &ceptr)) {
+#endif /* PHP >= 7 */
+        object_init_ex(out, ZVALPX(ceptr));
+        FETCH_SHALL_LEXER_FROM_ZVAL(o, out);
+        // drop the lexer created along with the object
+        lexer_destroy(o->lexer, NULL);
+        o->lexer = lexer;
+        o->persistent = true;
+    }
+}
+
 ZEND_BEGIN_ARG_INFO_EX(ainfo_shall_void, 0, 0, 0)
 ZEND_END_ARG_INFO()
 
@@ -178,6 +206,7 @@ zend_function_entry Shall_Lexer_Base_class_functions[] = {
     ZEND_RAW_FENTRY("__construct",  ZEND_FN(Shall_Base_Lexer__construct),   ainfo_shall_0or1arg, ZEND_ACC_PRIVATE)
     ZEND_RAW_FENTRY("getOption",    ZEND_FN(Shall_Base_Lexer_getOption),    ainfo_shall_1arg,    ZEND_ACC_PUBLIC)
     ZEND_RAW_FENTRY("setOption",    ZEND_FN(Shall_Base_Lexer_setOption),    ainfo_shall_2arg,    ZEND_ACC_PUBLIC)
+    ZEND_RAW_FENTRY("tokens",       ZEND_FN(Shall_Base_Lexer_tokens),       ainfo_shall_1arg,    ZEND_ACC_PUBLIC)
     ZEND_RAW_FENTRY("getName",      ZEND_FN(Shall_Base_Lexer_getName),      ainfo_shall_void,    ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
     ZEND_RAW_FENTRY("getAliases",   ZEND_FN(Shall_Base_Lexer_getAliases),   ainfo_shall_void,    ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
     ZEND_RAW_FENTRY("getMimeTypes", ZEND_FN(Shall_Base_Lexer_getMimeTypes), ainfo_shall_void,    ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
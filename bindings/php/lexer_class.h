@@ -8,6 +8,11 @@ typedef struct {
 #endif /* PHP < 7 */
 
     Lexer *lexer;
+    /**
+     * true if lexer is one of the persistent lexers: it is shared by all
+     * requests, the object doesn't own it
+     */
+    bool persistent;
 
 #if PHP_MAJOR_VERSION >= 7
     zend_object zo;
@@ -50,6 +55,7 @@ typedef struct {
 extern zend_class_entry *Shall_Lexer_ce_ptr;
 
 void shall_lexer_create(const LexerImplementation *, zval *, zval * TSRMLS_DC);
+void shall_lexer_wrap_persistent(Lexer *, zval * TSRMLS_DC);
 
 void shall_register_Lexer_class(TSRMLS_D);
 void shall_unregister_Lexer_class(TSRMLS_D);
@@ -2,6 +2,7 @@
 #include "helpers.h"
 #include "options.h"
 #include "lexer_class.h"
+#include "tokens_class.h"
 
 /* class methods */
 
@@ -89,6 +90,10 @@ PHP_FUNCTION(Shall_Base_Lexer_getOption)
     }
     SHALL_FETCH_LEXER(o, object, true);
     type = lexer_get_option(o->lexer, name, &optvalptr);
+    // the sublexers of a persistent lexer are not wrapped into PHP objects
+    if (o->persistent && OPT_TYPE_LEXER == type) {
+        RETURN_NULL();
+    }
     php_get_option(type, optvalptr, return_value);
 }
 
@@ -104,5 +109,29 @@ PHP_FUNCTION(Shall_Base_Lexer_setOption)
         RETURN_FALSE;
     }
     SHALL_FETCH_LEXER(o, object, true);
+    if (o->persistent) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Options of a persistent lexer can't be changed");
+        RETURN_FALSE;
+    }
     RETURN_BOOL(php_set_option((void *) o->lexer, name, value, 0, (set_option_t) lexer_set_option TSRMLS_CC));
 }
+
+/**
+ * Returns a Shall\TokenIterator over the [type, start, end] arrays of the
+ * tokens of the given string (positions are in bytes)
+ */
+PHP_FUNCTION(Shall_Base_Lexer_tokens)
+{
+    zend_strlen_t source_len = 0;
+    char *source = NULL;
+    zval *object = NULL;
+    Shall_Lexer_object *o;
+    HighlightTokens *tokens;
+
+    if (FAILURE == zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC, getThis(), "Os", &object, Shall_Lexer_ce_ptr, &source, &source_len)) {
+        RETURN_FALSE;
+    }
+    SHALL_FETCH_LEXER(o, object, true);
+    highlight_tokens(source, source_len, &tokens, 1, &o->lexer);
+    shall_token_iterator_create(tokens, return_value TSRMLS_CC);
+}
@@ -8,3 +8,4 @@ PHP_FUNCTION(Shall_Lexer__construct);
 
 PHP_FUNCTION(Shall_Base_Lexer_getOption);
 PHP_FUNCTION(Shall_Base_Lexer_setOption);
+PHP_FUNCTION(Shall_Base_Lexer_tokens);
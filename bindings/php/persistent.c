@@ -0,0 +1,299 @@
+#include "common.h"
+#include "php_shall.h"
+#include "lexer_class.h"
+#include "formatter_class.h"
+#include "persistent.h"
+
+/**
+ * Persistent lexers and formatters are named instances created once per
+ * worker, from the shall.lexers and shall.formatters INI settings or on
+ * the first call to Shall\persistent_lexer/Shall\persistent_formatter with
+ * a definition, then shared by all the requests it serves.
+ *
+ * A definition is an implementation name optionnaly followed by options,
+ * as a query string: "php?start_inline=on", "html?cssclass=highlight".
+ * The INI settings are lists of name=definition separated by commas or
+ * spaces: shall.lexers = "inline=php?start_inline=on, sql=mysql".
+ *
+ * With ZTS, the threads of a process share these definitions, so their
+ * tables are only accessed under persistent_mutex. A lexer is not modified
+ * by highlighting but a formatter keeps the state of the document it is
+ * writing: each thread is given its own copy of a persistent formatter
+ * (SHALL_G(formatters)), on its first use.
+ */
+
+static HashTable persistent_lexers;
+static HashTable persistent_formatters;
+
+#ifdef ZTS
+static MUTEX_T persistent_mutex;
+# define PERSISTENT_LOCK() \
+    tsrm_mutex_lock(persistent_mutex)
+# define PERSISTENT_UNLOCK() \
+    tsrm_mutex_unlock(persistent_mutex)
+#else
+# define PERSISTENT_LOCK() /* NOP */
+# define PERSISTENT_UNLOCK() /* NOP */
+#endif /* ZTS */
+
+typedef void *(*define_t)(const char *, size_t, const char * TSRMLS_DC);
+
+#if PHP_MAJOR_VERSION >= 7
+static void persistent_lexer_dtor(zval *zv)
+{
+    lexer_destroy((Lexer *) Z_PTR_P(zv), (on_lexer_destroy_cb_t) lexer_destroy);
+}
+
+static void persistent_formatter_dtor(zval *zv)
+{
+    formatter_destroy((Formatter *) Z_PTR_P(zv));
+}
+#else
+static void persistent_lexer_dtor(void *ptr)
+{
+    lexer_destroy(*(Lexer **) ptr, (on_lexer_destroy_cb_t) lexer_destroy);
+}
+
+static void persistent_formatter_dtor(void *ptr)
+{
+    formatter_destroy(*(Formatter **) ptr);
+}
+#endif /* PHP >= 7 */
+
+static void *persistent_find(HashTable *ht, const char *name, size_t name_len)
+{
+#if PHP_MAJOR_VERSION >= 7
+    return zend_hash_str_find_ptr(ht, name, name_len);
+#else
+    void **ptr;
+
+    if (SUCCESS == zend_hash_find(ht, name, name_len + 1, (void **) &ptr)) {
+        return *ptr;
+    }
+
+    return NULL;
+#endif /* PHP >= 7 */
+}
+
+static void persistent_add(HashTable *ht, const char *name, size_t name_len, void *object)
+{
+#if PHP_MAJOR_VERSION >= 7
+    zend_hash_str_add_new_ptr(ht, name, name_len, object);
+#else
+    zend_hash_add(ht, name, name_len + 1, (void *) &object, sizeof(object), NULL);
+#endif /* PHP >= 7 */
+}
+
+/**
+ * Creates a builtin formatter and sets its options from a definition
+ * (the formatter counterpart of lexer_from_string)
+ */
+static Formatter *formatter_from_string(const char *definition TSRMLS_DC)
+{
+    Formatter *fmt;
+    const FormatterImplementation *imp;
+    char *copy, *options, *pair, *eq, *saveptr;
+
+    fmt = NULL;
+    copy = strdup(definition);
+    if (NULL != (options = strchr(copy, '?'))) {
+        *options++ = '\0';
+    }
+    if (NULL != (imp = formatter_implementation_by_name(copy))) {
+        fmt = formatter_create(imp);
+        for (pair = NULL == options ? NULL : strtok_r(options, "&;", &saveptr); NULL != pair; pair = strtok_r(NULL, "&;", &saveptr)) {
+            const char *value;
+
+            value = "";
+            if (NULL != (eq = strchr(pair, '='))) {
+                *eq = '\0';
+                value = eq + 1;
+            }
+            if (0 != formatter_set_option_as_string(fmt, pair, value, strlen(value))) {
+                php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid option '%s' for formatter %s", pair, copy);
+            }
+        }
+    }
+    free(copy);
+
+    return fmt;
+}
+
+static void *persistent_lexer_define(const char *name, size_t name_len, const char *definition TSRMLS_DC)
+{
+    Lexer *lexer;
+
+    PERSISTENT_LOCK();
+    if (NULL == (lexer = persistent_find(&persistent_lexers, name, name_len))) {
+        if (NULL != (lexer = lexer_from_string(definition, NULL))) {
+            persistent_add(&persistent_lexers, name, name_len, lexer);
+        }
+    }
+    PERSISTENT_UNLOCK();
+    if (NULL == lexer) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Unknown lexer '%s'", definition);
+    }
+
+    return lexer;
+}
+
+static Lexer *persistent_lexer_find(const char *name, size_t name_len)
+{
+    Lexer *lexer;
+
+    PERSISTENT_LOCK();
+    lexer = persistent_find(&persistent_lexers, name, name_len);
+    PERSISTENT_UNLOCK();
+
+    return lexer;
+}
+
+/**
+ * The formatters defined here are never used to highlight, only to be
+ * copied by persistent_formatter_get
+ */
+static void *persistent_formatter_define(const char *name, size_t name_len, const char *definition TSRMLS_DC)
+{
+    Formatter *fmt;
+
+    PERSISTENT_LOCK();
+    if (NULL == (fmt = persistent_find(&persistent_formatters, name, name_len))) {
+        if (NULL != (fmt = formatter_from_string(definition TSRMLS_CC))) {
+            persistent_add(&persistent_formatters, name, name_len, fmt);
+        }
+    }
+    PERSISTENT_UNLOCK();
+    if (NULL == fmt) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Unknown formatter '%s'", definition);
+    }
+
+    return fmt;
+}
+
+/**
+ * @return the copy, for the current thread, of the persistent formatter
+ * called name or NULL if there is none
+ */
+static Formatter *persistent_formatter_get(const char *name, size_t name_len TSRMLS_DC)
+{
+    Formatter *fmt, *copy;
+
+    if (NULL == (copy = persistent_find(&SHALL_G(formatters), name, name_len))) {
+        PERSISTENT_LOCK();
+        if (NULL != (fmt = persistent_find(&persistent_formatters, name, name_len))) {
+            copy = formatter_copy(fmt);
+        }
+        PERSISTENT_UNLOCK();
+        if (NULL != copy) {
+            persistent_add(&SHALL_G(formatters), name, name_len, copy);
+        }
+    }
+
+    return copy;
+}
+
+/**
+ * Defines the instances listed by an INI setting
+ */
+static void persistent_define_all(const char *list, define_t define TSRMLS_DC)
+{
+    char *copy, *item, *eq, *saveptr;
+
+    if (NULL == list || '\0' == *list) {
+        return;
+    }
+    copy = strdup(list);
+    for (item = strtok_r(copy, ", \t\r\n", &saveptr); NULL != item; item = strtok_r(NULL, ", \t\r\n", &saveptr)) {
+        if (NULL == (eq = strchr(item, '=')) || eq == item) {
+            php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid definition '%s', name=definition expected", item);
+        } else {
+            *eq = '\0';
+            define(item, eq - item, eq + 1 TSRMLS_CC);
+        }
+    }
+    free(copy);
+}
+
+void shall_persistent_init(const char *lexers, const char *formatters TSRMLS_DC)
+{
+#ifdef ZTS
+    persistent_mutex = tsrm_mutex_alloc();
+#endif /* ZTS */
+    zend_hash_init(&persistent_lexers, 8, NULL, persistent_lexer_dtor, 1);
+    zend_hash_init(&persistent_formatters, 8, NULL, persistent_formatter_dtor, 1);
+    persistent_define_all(lexers, persistent_lexer_define TSRMLS_CC);
+    persistent_define_all(formatters, persistent_formatter_define TSRMLS_CC);
+}
+
+void shall_persistent_shutdown(TSRMLS_D)
+{
+    zend_hash_destroy(&persistent_lexers);
+    zend_hash_destroy(&persistent_formatters);
+#ifdef ZTS
+    tsrm_mutex_free(persistent_mutex);
+#endif /* ZTS */
+}
+
+void shall_persistent_globals_init(zend_shall_globals *globals)
+{
+    zend_hash_init(&globals->formatters, 8, NULL, persistent_formatter_dtor, 1);
+}
+
+void shall_persistent_globals_shutdown(zend_shall_globals *globals)
+{
+    zend_hash_destroy(&globals->formatters);
+}
+
+/* ========== functions ========== */
+
+/**
+ * Shall\persistent_lexer(string $name [, string $definition ])
+ *
+ * Returns the persistent lexer called $name, after its creation from
+ * $definition if it doesn't exist yet (else $definition is ignored)
+ */
+PHP_FUNCTION(Shall_persistent_lexer)
+{
+    Lexer *lexer;
+    char *name = NULL;
+    char *definition = NULL;
+    zend_strlen_t name_len = 0;
+    zend_strlen_t definition_len = 0;
+
+    if (FAILURE == zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|s", &name, &name_len, &definition, &definition_len)) {
+        RETURN_FALSE;
+    }
+    if (NULL == definition) {
+        lexer = persistent_lexer_find(name, name_len);
+    } else {
+        lexer = persistent_lexer_define(name, name_len, definition TSRMLS_CC);
+    }
+    if (NULL != lexer) {
+        shall_lexer_wrap_persistent(lexer, return_value TSRMLS_CC);
+    }
+}
+
+/**
+ * Shall\persistent_formatter(string $name [, string $definition ])
+ *
+ * Returns the persistent formatter called $name, after its creation from
+ * $definition if it doesn't exist yet (else $definition is ignored)
+ */
+PHP_FUNCTION(Shall_persistent_formatter)
+{
+    Formatter *fmt;
+    char *name = NULL;
+    char *definition = NULL;
+    zend_strlen_t name_len = 0;
+    zend_strlen_t definition_len = 0;
+
+    if (FAILURE == zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|s", &name, &name_len, &definition, &definition_len)) {
+        RETURN_FALSE;
+    }
+    if (NULL != definition) {
+        persistent_formatter_define(name, name_len, definition TSRMLS_CC);
+    }
+    if (NULL != (fmt = persistent_formatter_get(name, name_len TSRMLS_CC))) {
+        shall_formatter_wrap_persistent(fmt, return_value TSRMLS_CC);
+    }
+}
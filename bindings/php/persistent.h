@@ -0,0 +1,9 @@
+#pragma once
+
+void shall_persistent_init(const char *, const char * TSRMLS_DC);
+void shall_persistent_shutdown(TSRMLS_D);
+void shall_persistent_globals_init(zend_shall_globals *);
+void shall_persistent_globals_shutdown(zend_shall_globals *);
+
+PHP_FUNCTION(Shall_persistent_lexer);
+PHP_FUNCTION(Shall_persistent_formatter);
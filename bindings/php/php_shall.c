@@ -1,8 +1,11 @@
 #include "common.h"
+#include "php_shall.h"
 #include "lexer_class.h"
 #include "lexer_methods.h"
 #include "formatter_class.h"
 #include "formatter_methods.h"
+#include "tokens_class.h"
+#include "persistent.h"
 
 #if PHP_MAJOR_VERSION >= 7
 # define smart_str smart_string
@@ -63,17 +66,85 @@ PHP_FUNCTION(Shall_lexer_for_filename)
     }
 }
 
+/**
+ * The output of highlight_string_to, appended by chunks to the string to
+ * return: it is built directly, not copied from a whole output once done
+ */
+typedef struct {
+#if PHP_MAJOR_VERSION >= 7
+    zend_string *str;
+    // number of bytes used, ZSTR_LEN(str) being its allocated size until the end
+    size_t len;
+#else
+    smart_str str;
+#endif /* PHP >= 7 */
+} ReturnBuffer;
+
+static int return_buffer_write(const char *chunk, size_t chunk_len, void *data)
+{
+    ReturnBuffer *rb;
+
+    rb = (ReturnBuffer *) data;
+#if PHP_MAJOR_VERSION >= 7
+    if (NULL == rb->str) {
+        rb->str = zend_string_alloc(chunk_len, 0);
+    } else if (rb->len + chunk_len > ZSTR_LEN(rb->str)) {
+        rb->str = zend_string_extend(rb->str, MAX(rb->len + chunk_len, 2 * ZSTR_LEN(rb->str)), 0);
+    }
+    memcpy(ZSTR_VAL(rb->str) + rb->len, chunk, chunk_len);
+    rb->len += chunk_len;
+#else
+    smart_str_appendl(&rb->str, chunk, chunk_len);
+#endif /* PHP >= 7 */
+
+    return 0;
+}
+
+static void return_buffer_to_zval(ReturnBuffer *rb, zval *return_value)
+{
+#if PHP_MAJOR_VERSION >= 7
+    if (NULL == rb->str) {
+        RETVAL_EMPTY_STRING();
+    } else {
+        rb->str = zend_string_truncate(rb->str, rb->len, 0);
+        ZSTR_VAL(rb->str)[rb->len] = '\0';
+        RETVAL_NEW_STR(rb->str);
+    }
+#else
+    if (NULL == rb->str.c) {
+        RETVAL_EMPTY_STRING();
+    } else {
+        smart_str_0(&rb->str);
+        RETVAL_STRINGL(rb->str.c, rb->str.len, 0);
+    }
+#endif /* PHP >= 7 */
+}
+
+/**
+ * Writes the output to the output layer of PHP as it is produced, stops
+ * if the client is gone
+ */
+static int output_write(const char *chunk, size_t chunk_len, void *UNUSED(data))
+{
+    TSRMLS_FETCH();
+
+    php_output_write(chunk, chunk_len TSRMLS_CC);
+
+    return PHP_CONNECTION_NORMAL != PG(connection_status);
+}
+
 #define ARRAY_OF_LEXERS
-PHP_FUNCTION(Shall_highlight)
+static void shall_highlight(INTERNAL_FUNCTION_PARAMETERS, bool output)
 {
-    char *dest;
+    int ret;
     zval *lexers;
     size_t lexerc;
-    size_t dest_len;
     zval *lexer = NULL;
     zval *formatter = NULL;
     char *source = NULL;
     zend_strlen_t source_len = 0;
+    ReturnBuffer rb = { 0 };
+    HighlightSink sink = { 0 };
     Shall_Lexer_object *l = NULL;
     Shall_Formatter_object *f = NULL;
 
@@ -111,7 +182,7 @@ PHP_FUNCTION(Shall_highlight)
         Lexer *lexerv[lexerc];
 
         if (IS_OBJECT == Z_TYPE_P(lexers)) {
-            SHALL_FETCH_LEXER(l, lexer, true);
+            SHALL_FETCH_LEXER(l, lexers, true);
             lexerv[0] = l->lexer;
         } else {
             int i;
@@ -147,20 +218,52 @@ PHP_FUNCTION(Shall_highlight)
     SHALL_FETCH_LEXER(l, lexer, true);
 #endif
     SHALL_FETCH_FORMATTER(f, formatter, true);
-debug("HL WITH IMP = %s/%p/%p/%p", lexer_implementation_name(lexer_implementation(l->lexer)), l->lexer, lexer, Z_OBJ_P(lexer));
+    if (output) {
+        sink.write = output_write;
+    } else {
+        sink.write = return_buffer_write;
+        sink.data = &rb;
+    }
 #ifdef ARRAY_OF_LEXERS
-        highlight_string(source, source_len, &dest, &dest_len, f->formatter, lexerc, lexerv);
+        ret = highlight_string_to(source, source_len, &sink, f->formatter, lexerc, lexerv, NULL);
     }
 #else
-    highlight_string(source, source_len, &dest, &dest_len, f->formatter, 1, &l->lexer);
+    ret = highlight_string_to(source, source_len, &sink, f->formatter, 1, &l->lexer, NULL);
 #endif
 
-    RETURN_STRINGL_COPY(dest, dest_len);
+    if (output) {
+        RETURN_BOOL(HIGHLIGHT_SUCCESS == ret);
+    } else {
+        return_buffer_to_zval(&rb, return_value);
+    }
+}
+
+/**
+ * Shall\highlight(string $source, mixed $lexers, Shall\Formatter\Base $formatter)
+ *
+ * Returns the highlighted source
+ */
+PHP_FUNCTION(Shall_highlight)
+{
+    shall_highlight(INTERNAL_FUNCTION_PARAM_PASSTHRU, false);
+}
+
+/**
+ * Shall\highlight_output(string $source, mixed $lexers, Shall\Formatter\Base $formatter)
+ *
+ * Same as Shall\highlight but the output is written, by chunks, to the
+ * output layer (as echo does) as it is produced
+ */
+PHP_FUNCTION(Shall_highlight_output)
+{
+    shall_highlight(INTERNAL_FUNCTION_PARAM_PASSTHRU, true);
 }
 
 /* ========== registering ========== */
 
 PHP_INI_BEGIN()
+    PHP_INI_ENTRY("shall.lexers", "", PHP_INI_SYSTEM, NULL)
+    PHP_INI_ENTRY("shall.formatters", "", PHP_INI_SYSTEM, NULL)
 PHP_INI_END()
 
 /*
@@ -213,13 +316,28 @@ ZEND_END_ARG_INFO()
     ZEND_RAW_FENTRY(ZEND_NS_NAME(#ns, #name), ZEND_FN(ns##_##name), arg_info, 0)
 
 static const zend_function_entry shall_functions[] = {
-    SHALL_NS_FE(Shall, lexer_guess,        ainfo_shall_1or2arg)
-    SHALL_NS_FE(Shall, lexer_by_name,      ainfo_shall_0or1arg)
-    SHALL_NS_FE(Shall, lexer_for_filename, ainfo_shall_0or1arg)
-    SHALL_NS_FE(Shall, highlight,          ainfo_shall_3arg)
+    SHALL_NS_FE(Shall, lexer_guess,          ainfo_shall_1or2arg)
+    SHALL_NS_FE(Shall, lexer_by_name,        ainfo_shall_0or1arg)
+    SHALL_NS_FE(Shall, lexer_for_filename,   ainfo_shall_0or1arg)
+    SHALL_NS_FE(Shall, highlight,            ainfo_shall_3arg)
+    SHALL_NS_FE(Shall, highlight_output,     ainfo_shall_3arg)
+    SHALL_NS_FE(Shall, persistent_lexer,     ainfo_shall_1or2arg)
+    SHALL_NS_FE(Shall, persistent_formatter, ainfo_shall_1or2arg)
     PHP_FE_END
 };
 
+ZEND_DECLARE_MODULE_GLOBALS(shall)
+
+static PHP_GINIT_FUNCTION(shall)
+{
+    shall_persistent_globals_init(shall_globals);
+}
+
+static PHP_GSHUTDOWN_FUNCTION(shall)
+{
+    shall_persistent_globals_shutdown(shall_globals);
+}
+
 static PHP_RINIT_FUNCTION(shall)
 {
     return SUCCESS;
@@ -250,12 +368,15 @@ static PHP_MINIT_FUNCTION(shall)
 
     shall_register_Lexer_class(TSRMLS_C);
     shall_register_Formatter_class(TSRMLS_C);
+    shall_register_TokenIterator_class(TSRMLS_C);
+    shall_persistent_init(INI_STR("shall.lexers"), INI_STR("shall.formatters") TSRMLS_CC);
 
     return SUCCESS;
 }
 
 static PHP_MSHUTDOWN_FUNCTION(shall)
 {
+    shall_persistent_shutdown(TSRMLS_C);
     shall_unregister_Lexer_class(TSRMLS_C);
     shall_unregister_Formatter_class(TSRMLS_C);
 
@@ -304,7 +425,11 @@ zend_module_entry shall_module_entry = {
     PHP_RSHUTDOWN(shall),
     PHP_MINFO(shall),
     NO_VERSION_YET,
-    STANDARD_MODULE_PROPERTIES
+    PHP_MODULE_GLOBALS(shall),
+    PHP_GINIT(shall),
+    PHP_GSHUTDOWN(shall),
+    NULL,
+    STANDARD_MODULE_PROPERTIES_EX
 };
 
 #ifdef COMPILE_DL_SHALL
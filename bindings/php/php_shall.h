@@ -2,3 +2,18 @@
 
 extern zend_module_entry shall_module_entry;
 # define phpext_shall_ptr &shall_module_entry
+
+ZEND_BEGIN_MODULE_GLOBALS(shall)
+    // the copies, for the current thread, of the persistent formatters
+    HashTable formatters;
+ZEND_END_MODULE_GLOBALS(shall)
+
+ZEND_EXTERN_MODULE_GLOBALS(shall)
+
+#ifdef ZTS
+# define SHALL_G(v) \
+    TSRMG(shall_globals_id, zend_shall_globals *, v)
+#else
+# define SHALL_G(v) \
+    (shall_globals.v)
+#endif /* ZTS */
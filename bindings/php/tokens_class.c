@@ -0,0 +1,213 @@
+#include "common.h"
+#include "tokens_class.h"
+#include "zend_interfaces.h"
+
+zend_class_entry *Shall_TokenIterator_ce_ptr;
+static zend_object_handlers Shall_TokenIterator_handlers;
+
+static void Shall_TokenIterator_objects_dtor(
+#if PHP_MAJOR_VERSION >= 7
+    zend_object *object
+#else
+    void *object, zend_object_handle handle TSRMLS_DC
+#endif /* PHP >= 7 */
+) {
+    zend_objects_destroy_object(
+        object
+#if PHP_MAJOR_VERSION < 7
+        , handle TSRMLS_CC
+#endif /* PHP < 7 */
+    );
+}
+
+static void Shall_TokenIterator_objects_free(
+#if PHP_MAJOR_VERSION >= 7
+    zend_object *object
+#else
+    void *object TSRMLS_DC
+#endif /* PHP >= 7 */
+) {
+    Shall_TokenIterator_object *o;
+
+#if PHP_MAJOR_VERSION >= 7
+    o = (Shall_TokenIterator_object *)((char *) object - XtOffsetOf(Shall_TokenIterator_object, zo));
+#else
+    o = (Shall_TokenIterator_object *) object;
+#endif /* PHP >= 7 */
+    zend_object_std_dtor(&o->zo TSRMLS_CC);
+    if (NULL != o->tokens) {
+        highlight_tokens_destroy(o->tokens);
+    }
+#if PHP_MAJOR_VERSION < 7
+    efree(o);
+#endif /* PHP < 7 */
+}
+
+static
+#if PHP_MAJOR_VERSION >= 7
+zend_object *
+#else
+zend_object_value
+#endif /* PHP >= 7 */
+Shall_TokenIterator_object_create(zend_class_entry *ce TSRMLS_DC)
+{
+    Shall_TokenIterator_object *intern;
+
+#if PHP_MAJOR_VERSION >= 7
+    intern = ecalloc(1, sizeof(*intern) + zend_object_properties_size(ce));
+#else
+    zend_object_value retval;
+
+    intern = ecalloc(1, sizeof(*intern));
+#endif /* PHP >= 7 */
+    zend_object_std_init(&intern->zo, ce TSRMLS_CC);
+#if PHP_MAJOR_VERSION >= 7
+    intern->zo.handlers
+#else
+    retval.handle = zend_objects_store_put(intern, Shall_TokenIterator_objects_dtor, Shall_TokenIterator_objects_free, NULL TSRMLS_CC);
+    retval.handlers
+#endif /* PHP >= 7 */
+        = &Shall_TokenIterator_handlers;
+
+    return
+#if PHP_MAJOR_VERSION >= 7
+        &intern->zo
+#else
+        retval
+#endif /* PHP >= 7 */
+    ;
+}
+
+static void token_iterator_rewind(Shall_TokenIterator_object *o)
+{
+    o->chunk_index = o->position = o->index = 0;
+    o->chunk = highlight_tokens_chunk(o->tokens, 0, &o->chunk_len);
+}
+
+/**
+ * Wraps the tokens found by highlight_tokens into a Shall\TokenIterator
+ * (which takes their ownership)
+ */
+void shall_token_iterator_create(HighlightTokens *tokens, zval *out TSRMLS_DC)
+{
+    Shall_TokenIterator_object *o;
+
+    object_init_ex(out, Shall_TokenIterator_ce_ptr);
+    FETCH_SHALL_TOKEN_ITERATOR_FROM_ZVAL(o, out);
+    o->tokens = tokens;
+    token_iterator_rewind(o);
+}
+
+/* methods (Iterator interface) */
+
+PHP_FUNCTION(Shall_TokenIterator__construct)
+{
+    zend_throw_exception(zend_exception_get_default(TSRMLS_C), "Shall\\TokenIterator cannot be instantiated", 0 TSRMLS_CC);
+}
+
+/**
+ * The array [type, start, end] of the current token, built only when it is asked for
+ */
+PHP_FUNCTION(Shall_TokenIterator_current)
+{
+    zval *object;
+    Shall_TokenIterator_object *o;
+
+    object = getThis();
+    FETCH_SHALL_TOKEN_ITERATOR_FROM_ZVAL(o, object);
+    if (NULL == o->chunk || o->position >= o->chunk_len) {
+        RETURN_NULL();
+    }
+    array_init(return_value);
+    add_next_index_long(return_value, o->chunk[o->position].type);
+    add_next_index_long(return_value, o->chunk[o->position].start);
+    add_next_index_long(return_value, o->chunk[o->position].end);
+}
+
+PHP_FUNCTION(Shall_TokenIterator_key)
+{
+    zval *object;
+    Shall_TokenIterator_object *o;
+
+    object = getThis();
+    FETCH_SHALL_TOKEN_ITERATOR_FROM_ZVAL(o, object);
+    RETURN_LONG(o->index);
+}
+
+PHP_FUNCTION(Shall_TokenIterator_next)
+{
+    zval *object;
+    Shall_TokenIterator_object *o;
+
+    object = getThis();
+    FETCH_SHALL_TOKEN_ITERATOR_FROM_ZVAL(o, object);
+    if (NULL != o->chunk && ++o->position >= o->chunk_len) {
+        o->chunk = highlight_tokens_chunk(o->tokens, ++o->chunk_index, &o->chunk_len);
+        o->position = 0;
+    }
+    ++o->index;
+}
+
+PHP_FUNCTION(Shall_TokenIterator_rewind)
+{
+    zval *object;
+    Shall_TokenIterator_object *o;
+
+    object = getThis();
+    FETCH_SHALL_TOKEN_ITERATOR_FROM_ZVAL(o, object);
+    token_iterator_rewind(o);
+}
+
+PHP_FUNCTION(Shall_TokenIterator_valid)
+{
+    zval *object;
+    Shall_TokenIterator_object *o;
+
+    object = getThis();
+    FETCH_SHALL_TOKEN_ITERATOR_FROM_ZVAL(o, object);
+    RETURN_BOOL(NULL != o->chunk && o->position < o->chunk_len);
+}
+
+PHP_FUNCTION(Shall_TokenIterator_count)
+{
+    zval *object;
+    Shall_TokenIterator_object *o;
+
+    object = getThis();
+    FETCH_SHALL_TOKEN_ITERATOR_FROM_ZVAL(o, object);
+    RETURN_LONG(highlight_tokens_count(o->tokens));
+}
+
+/* registering */
+
+ZEND_BEGIN_ARG_INFO_EX(ainfo_shall_void, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+zend_function_entry Shall_TokenIterator_class_functions[] = {
+    ZEND_RAW_FENTRY("__construct", ZEND_FN(Shall_TokenIterator__construct), ainfo_shall_void, ZEND_ACC_PRIVATE)
+    ZEND_RAW_FENTRY("current",     ZEND_FN(Shall_TokenIterator_current),    ainfo_shall_void, ZEND_ACC_PUBLIC)
+    ZEND_RAW_FENTRY("key",         ZEND_FN(Shall_TokenIterator_key),        ainfo_shall_void, ZEND_ACC_PUBLIC)
+    ZEND_RAW_FENTRY("next",        ZEND_FN(Shall_TokenIterator_next),       ainfo_shall_void, ZEND_ACC_PUBLIC)
+    ZEND_RAW_FENTRY("rewind",      ZEND_FN(Shall_TokenIterator_rewind),     ainfo_shall_void, ZEND_ACC_PUBLIC)
+    ZEND_RAW_FENTRY("valid",       ZEND_FN(Shall_TokenIterator_valid),      ainfo_shall_void, ZEND_ACC_PUBLIC)
+    ZEND_RAW_FENTRY("count",       ZEND_FN(Shall_TokenIterator_count),      ainfo_shall_void, ZEND_ACC_PUBLIC)
+    PHP_FE_END
+};
+
+void shall_register_TokenIterator_class(TSRMLS_D)
+{
+    zend_class_entry ce;
+
+    INIT_NS_CLASS_ENTRY(ce, "Shall", "TokenIterator", Shall_TokenIterator_class_functions);
+    ce.create_object = Shall_TokenIterator_object_create;
+    Shall_TokenIterator_ce_ptr = zend_register_internal_class(&ce TSRMLS_CC);
+    Shall_TokenIterator_ce_ptr->ce_flags |= ZEND_ACC_FINAL_CLASS;
+    zend_class_implements(Shall_TokenIterator_ce_ptr TSRMLS_CC, 1, zend_ce_iterator);
+    memcpy(&Shall_TokenIterator_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+    Shall_TokenIterator_handlers.clone_obj = NULL;
+#if PHP_MAJOR_VERSION >= 7
+    Shall_TokenIterator_handlers.offset = XtOffsetOf(Shall_TokenIterator_object, zo);
+    Shall_TokenIterator_handlers.dtor_obj = Shall_TokenIterator_objects_dtor;
+    Shall_TokenIterator_handlers.free_obj = Shall_TokenIterator_objects_free;
+#endif /* PHP >= 7 */
+}
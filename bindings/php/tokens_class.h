@@ -0,0 +1,39 @@
+#pragma once
+
+#include "common.h"
+#include <shall/tokenize.h>
+
+typedef struct {
+#if PHP_MAJOR_VERSION < 7
+    zend_object zo;
+#endif /* PHP < 7 */
+
+    HighlightTokens *tokens;
+    /**
+     * The current chunk of tokens, its number and its length
+     */
+    const HighlightToken *chunk;
+    size_t chunk_index, chunk_len;
+    /**
+     * Position of the current token in chunk and among all tokens
+     */
+    size_t position, index;
+
+#if PHP_MAJOR_VERSION >= 7
+    zend_object zo;
+#endif /* PHP >= 7 */
+} Shall_TokenIterator_object;
+
+#if PHP_MAJOR_VERSION >= 7
+# define FETCH_SHALL_TOKEN_ITERATOR_FROM_ZVAL(/*Shall_TokenIterator_object **/ o, /*zval **/ object) \
+    o = (Shall_TokenIterator_object *)((char *) Z_OBJ_P(object) - XtOffsetOf(Shall_TokenIterator_object, zo))
+#else
+# define FETCH_SHALL_TOKEN_ITERATOR_FROM_ZVAL(/*Shall_TokenIterator_object **/ o, /*zval **/ object) \
+    o = (Shall_TokenIterator_object *) zend_object_store_get_object(object TSRMLS_CC)
+#endif /* PHP >= 7 */
+
+extern zend_class_entry *Shall_TokenIterator_ce_ptr;
+
+void shall_token_iterator_create(HighlightTokens *, zval * TSRMLS_DC);
+
+void shall_register_TokenIterator_class(TSRMLS_D);
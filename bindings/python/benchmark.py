@@ -0,0 +1,80 @@
+# -*- coding: utf-8 -*-
+"""
+Measure how the highlighting scales across cores: the same documents are
+highlighted serially, by a concurrent.futures thread pool calling
+shall.highlight (which releases the GIL) and by shall.highlight_many.
+
+usage: python benchmark.py [-l lexer] [-n documents] [-t threads] [file]
+"""
+
+import argparse
+import concurrent.futures
+import os
+import time
+
+import shall
+
+SAMPLE = """\
+--- a/lib/highlight.c
++++ b/lib/highlight.c
+@@ -1,7 +1,7 @@
+ #include <stdlib.h>
+-#include <string.h>
++#include <strings.h>
+
+ static int foo(const char *bar)
+ {
+-    return 0;
++    return NULL == bar;
+ }
+"""
+
+
+def measure(label, documents, function):
+    start = time.perf_counter()
+    results = function()
+    elapsed = time.perf_counter() - start
+    size = sum(len(document) for document in documents)
+    print("{:<32} {:8.3f} s {:10.1f} MB/s".format(label, elapsed, size / elapsed / 1e6))
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("-l", "--lexer", default="diff")
+    parser.add_argument("-n", "--documents", type=int, default=2000)
+    parser.add_argument("-t", "--threads", type=int, default=os.cpu_count())
+    parser.add_argument("file", nargs="?")
+    args = parser.parse_args()
+
+    if args.file is None:
+        source = SAMPLE * 64
+    else:
+        with open(args.file, encoding="utf-8") as fp:
+            source = fp.read()
+    documents = [source] * args.documents
+    lexers = [shall.lexer_by_name(args.lexer)]
+
+    serial = measure(
+        "serial",
+        documents,
+        lambda: [shall.highlight(document, lexers, shall.HTMLFormatter()) for document in documents],
+    )
+    for threads in sorted({1, 2, args.threads}):
+        # a formatter can't be used by two threads at once: one per task
+        with concurrent.futures.ThreadPoolExecutor(max_workers=threads) as executor:
+            pooled = measure(
+                "ThreadPoolExecutor ({} threads)".format(threads),
+                documents,
+                lambda: list(executor.map(lambda document: shall.highlight(document, lexers, shall.HTMLFormatter()), documents)),
+            )
+        many = measure(
+            "highlight_many ({} threads)".format(threads),
+            documents,
+            lambda: shall.highlight_many([(document, lexers) for document in documents], shall.HTMLFormatter(), threads=threads),
+        )
+        assert serial == pooled == many
+
+
+if "__main__" == __name__:
+    main()
@@ -39,8 +39,67 @@ static PyMethodDef Shall_Formatter_Methods[] = {
         } \
     } while (0);
 
+/**
+ * A subclass of BaseFormatter which implements a format_tokens(tokens)
+ * method receives the tokens as lists of (type, text) tuples, at most
+ * FORMAT_TOKENS_BATCH at once, instead of calls to start_token, write_token
+ * and end_token for each of them. The list is flushed before start_lexing,
+ * end_lexing and end_document, which are still called.
+ */
+#define FORMAT_TOKENS_BATCH 1024
+
+/**
+ * Adds the current token, if any, to the batch
+ */
+static void python_batch_push(PythonFormatterData *mydata)
+{
+    PyObject *item;
+
+    if (!string_empty(mydata->batch_text)) {
+        if (NULL != (item = Py_BuildValue("(is#)", mydata->batch_type, mydata->batch_text->ptr, (Py_ssize_t) mydata->batch_text->len))) {
+            PyList_Append(mydata->batch, item);
+            Py_DECREF(item);
+        }
+        string_truncate(mydata->batch_text);
+    }
+}
+
+/**
+ * Gives the pending tokens to the format_tokens method in a single call
+ */
+static void python_batch_flush(String *out, PythonFormatterData *mydata)
+{
+    PyObject *res;
+
+    python_batch_push(mydata);
+    if (PyList_GET_SIZE(mydata->batch) > 0) {
+        if (NULL != (res = PyObject_CallMethod(mydata->self, "format_tokens", "O", mydata->batch))) {
+            if (PyBytes_Check(res)) {
+                string_append_string_len(out, PyBytes_AS_STRING(res), PyBytes_GET_SIZE(res));
+            }
+            Py_DECREF(res);
+        }
+        // a new list, the method may have kept a reference on the previous one
+        Py_DECREF(mydata->batch);
+        mydata->batch = PyList_New(0);
+    }
+}
+
 static int python_start_document(String *out, FormatterData *data)
 {
+    PythonFormatterData *mydata;
+
+    mydata = (PythonFormatterData *) data;
+    if (PyObject_HasAttrString(mydata->self, "format_tokens")) {
+        if (NULL == mydata->batch) {
+            mydata->batch_text = string_new();
+        } else {
+            // leftovers of an interrupted document
+            Py_DECREF(mydata->batch);
+            string_truncate(mydata->batch_text);
+        }
+        mydata->batch = PyList_New(0);
+    }
     PYTHON_CALLBACK("start_document", "");
 
     return 0;
@@ -48,6 +107,12 @@ static int python_start_document(String *out, FormatterData *data)
 
 static int python_end_document(String *out, FormatterData *data)
 {
+    PythonFormatterData *mydata;
+
+    mydata = (PythonFormatterData *) data;
+    if (NULL != mydata->batch) {
+        python_batch_flush(out, mydata);
+    }
     PYTHON_CALLBACK("end_document", "");
 
     return 0;
@@ -55,35 +120,66 @@ static int python_end_document(String *out, FormatterData *data)
 
 static int python_start_token(int token, String *out, FormatterData *data)
 {
-    PYTHON_CALLBACK("start_token", "i", token);
+    PythonFormatterData *mydata;
+
+    mydata = (PythonFormatterData *) data;
+    if (NULL != mydata->batch) {
+        python_batch_push(mydata);
+        mydata->batch_type = token;
+    } else {
+        PYTHON_CALLBACK("start_token", "i", token);
+    }
 
     return 0;
 }
 
 static int python_end_token(int token, String *out, FormatterData *data)
 {
-    PYTHON_CALLBACK("end_token", "i", token);
+    PythonFormatterData *mydata;
+
+    mydata = (PythonFormatterData *) data;
+    if (NULL != mydata->batch) {
+        python_batch_push(mydata);
+        if (PyList_GET_SIZE(mydata->batch) >= FORMAT_TOKENS_BATCH) {
+            python_batch_flush(out, mydata);
+        }
+    } else {
+        PYTHON_CALLBACK("end_token", "i", token);
+    }
 
     return 0;
 }
 
 static int python_write_token(String *out, const char *token, size_t token_len, FormatterData *data)
 {
+    PythonFormatterData *mydata;
+
+    mydata = (PythonFormatterData *) data;
+    if (NULL != mydata->batch) {
+        string_append_string_len(mydata->batch_text, token, token_len);
+    } else {
 #if 0
 #if PY_MAJOR_VERSION >= 3
-    PYTHON_CALLBACK("write_token", "U#", token, token_len);
+        PYTHON_CALLBACK("write_token", "U#", token, token_len);
 #else
-    PYTHON_CALLBACK("write_token", "N", PyUnicode_FromStringAndSize(token, token_len));
+        PYTHON_CALLBACK("write_token", "N", PyUnicode_FromStringAndSize(token, token_len));
 #endif /* PY_MAJOR_VERSION >= 3 */
 #else
-    PYTHON_CALLBACK("write_token", "s#", token, token_len);
+        PYTHON_CALLBACK("write_token", "s#", token, token_len);
 #endif
+    }
 
     return 0;
 }
 
 static int python_start_lexing(const char *lexname, String *out, FormatterData *data)
 {
+    PythonFormatterData *mydata;
+
+    mydata = (PythonFormatterData *) data;
+    if (NULL != mydata->batch) {
+        python_batch_flush(out, mydata);
+    }
     PYTHON_CALLBACK("start_lexing", "s", lexname);
 
     return 0;
@@ -91,6 +187,12 @@ static int python_start_lexing(const char *lexname, String *out, FormatterData *
 
 static int python_end_lexing(const char *lexname, String *out, FormatterData *data)
 {
+    PythonFormatterData *mydata;
+
+    mydata = (PythonFormatterData *) data;
+    if (NULL != mydata->batch) {
+        python_batch_flush(out, mydata);
+    }
     PYTHON_CALLBACK("end_lexing", "s", lexname);
 
     return 0;
@@ -129,6 +231,15 @@ static const FormatterImplementation pythonfmt = {
     NULL
 };
 
+/**
+ * A native formatter calls no Python code: it can be used without the GIL
+ * (unlike a formatter written in Python, a subclass of BaseFormatter)
+ */
+bool python_formatter_is_native(ShallFormatterObject *self)
+{
+    return &pythonfmt != formatter_implementation(self->fmt);
+}
+
 /* ... base formatter class */
 
 static PyObject *Shall_Formatter_new(PyTypeObject *type, PyObject *args, PyObject *UNUSED(kwds))
@@ -147,6 +258,7 @@ static PyObject *Shall_Formatter_new(PyTypeObject *type, PyObject *args, PyObjec
             imp = formatter_implementation_by_name(imp_name);
         }
         self->fmt = formatter_create(imp);
+        self->lock = PyThread_allocate_lock();
         if (&pythonfmt == imp) {
             PythonFormatterData *mydata;
 
@@ -161,6 +273,18 @@ static PyObject *Shall_Formatter_new(PyTypeObject *type, PyObject *args, PyObjec
 
 static void Shall_Formatter_dealloc(ShallFormatterObject *self)
 {
+    if (&pythonfmt == self->fmt->imp) {
+        PythonFormatterData *mydata;
+
+        mydata = (PythonFormatterData *) &self->fmt->optvals;
+        if (NULL != mydata->batch) {
+            Py_DECREF(mydata->batch);
+            string_destroy(mydata->batch_text);
+        }
+    }
+    if (NULL != self->lock) {
+        PyThread_free_lock(self->lock);
+    }
     formatter_destroy(self->fmt);
     Py_TYPE(self)->tp_free((PyObject *) self);
 }
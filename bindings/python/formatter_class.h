@@ -5,12 +5,27 @@
 typedef struct {
     PyObject_HEAD
     Formatter *fmt;
+    /**
+     * Held while fmt is in use without the GIL
+     */
+    PyThread_type_lock lock;
 } ShallFormatterObject;
 
 typedef struct {
     PyObject *self, *options;
+    /**
+     * If the class implements format_tokens, the (type, text) tuples
+     * not yet given to it (else NULL)
+     */
+    PyObject *batch;
+    /**
+     * The text of the current token, of type batch_type
+     */
+    String *batch_text;
+    int batch_type;
 } PythonFormatterData;
 
 PyTypeObject ShallFormatterBaseType;
 
+bool python_formatter_is_native(ShallFormatterObject *);
 void register_formatter_class(PyObject *);
@@ -4,3 +4,44 @@ void list_append_string_cb(const char *string, void *data)
 {
     PyList_Append((PyObject *) data, PyUnicode_FromString(string));
 }
+
+/**
+ * Get the bytes to highlight, without copy: the UTF-8 representation of a
+ * str or the content of any object supporting the buffer protocol (bytes,
+ * bytearray, memoryview, mmap...). The object can't be resized nor freed
+ * until the view is released by PyBuffer_Release.
+ *
+ * @return false (with an exception set) if obj is none of them
+ */
+bool python_source_get(PyObject *obj, Py_buffer *view)
+{
+    if (PyUnicode_Check(obj)) {
+        const char *utf8;
+        Py_ssize_t utf8_len;
+
+        if (NULL == (utf8 = PyUnicode_AsUTF8AndSize(obj, &utf8_len))) {
+            return false;
+        }
+        return 0 == PyBuffer_FillInfo(view, obj, (void *) utf8, utf8_len, 1, PyBUF_SIMPLE);
+    }
+
+    return 0 == PyObject_GetBuffer(obj, view, PyBUF_SIMPLE);
+}
+
+/**
+ * Turn the result of a highlighting into a str or, if as_bytes, a bytes
+ * (no UTF-8 decoding), then free it
+ */
+PyObject *python_result(char *dest, size_t dest_len, bool as_bytes)
+{
+    PyObject *ret;
+
+    if (as_bytes) {
+        ret = PyBytes_FromStringAndSize(dest, dest_len);
+    } else {
+        ret = PyUnicode_FromStringAndSize(dest, dest_len);
+    }
+    free(dest);
+
+    return ret;
+}
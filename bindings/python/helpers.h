@@ -1,3 +1,5 @@
 #pragma once
 
 void list_append_string_cb(const char *, void *);
+bool python_source_get(PyObject *, Py_buffer *);
+PyObject *python_result(char *, size_t, bool);
@@ -9,6 +9,7 @@ static PyObject *lexers;
 static PyMethodDef Shall_Lexer_Methods[] = {
     { "get_option",    (PyCFunction) shall_lexer_get_option,    METH_VARARGS, "TODO" },
     { "set_option",    (PyCFunction) shall_lexer_set_option,    METH_VARARGS, "TODO" },
+    { "tokens",        (PyCFunction) shall_lexer_tokens,        METH_VARARGS, "Iterator over the (type, start, end) tuples of the tokens of a string" },
     { "get_name",      (PyCFunction) shall_lexer_get_name,      METH_CLASS | METH_NOARGS, "TODO" },
     { "get_aliases",   (PyCFunction) shall_lexer_get_aliases,   METH_CLASS | METH_NOARGS, "TODO" },
     { "get_mimetypes", (PyCFunction) shall_lexer_get_mimetypes, METH_CLASS | METH_NOARGS, "TODO" },
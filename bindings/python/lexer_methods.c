@@ -2,6 +2,7 @@
 #include "options.h"
 #include "helpers.h"
 #include "lexer_class.h"
+#include "tokens_class.h"
 
 /* class methods */
 
@@ -75,3 +76,31 @@ PyObject *shall_lexer_set_option(PyObject *self, PyObject *args)
 
     return ret;
 }
+
+/**
+ * lexer.tokens(source): an iterator over the (type, start, end) tuples of
+ * the tokens of source. Positions are in bytes (of its UTF-8 encoding for
+ * a str). The tokens are kept, by chunks, in native memory: the tuples are
+ * only created as the iteration goes on.
+ */
+PyObject *shall_lexer_tokens(PyObject *self, PyObject *args)
+{
+    PyObject *src, *ret;
+    Py_buffer source;
+
+    ret = NULL;
+    if (PyArg_ParseTuple(args, "O", &src) && python_source_get(src, &source)) {
+        Lexer *lexer;
+        HighlightTokens *tokens;
+
+        lexer = ((ShallLexerObject *) self)->lexer;
+        // self is held by the caller while the GIL is released
+        Py_BEGIN_ALLOW_THREADS
+        highlight_tokens(source.buf, (size_t) source.len, &tokens, 1, &lexer);
+        Py_END_ALLOW_THREADS
+        PyBuffer_Release(&source);
+        ret = python_token_iterator_new(tokens);
+    }
+
+    return ret;
+}
@@ -2,6 +2,7 @@
 
 PyObject *shall_lexer_get_option(PyObject *, PyObject *);
 PyObject *shall_lexer_set_option(PyObject *, PyObject *);
+PyObject *shall_lexer_tokens(PyObject *, PyObject *);
 PyObject *shall_lexer_get_name(PyObject *);
 PyObject *shall_lexer_get_aliases(PyObject *);
 PyObject *shall_lexer_get_mimetypes(PyObject *);
@@ -1,9 +1,11 @@
 #include <shall/tokens.h>
 
 #include "common.h"
+#include "helpers.h"
 #include "options.h"
 #include "lexer_class.h"
 #include "formatter_class.h"
+#include "tokens_class.h"
 
 #if 0
 PyObject* PyImport_AddModuleObject(PyObject *name);
@@ -74,13 +76,15 @@ static PyObject *shall_lexer_for_filename(PyObject *UNUSED(self), PyObject *args
     return ret;
 }
 
-static PyObject *shall_highlight(PyObject *self, PyObject *args)
+static PyObject *shall_highlight(PyObject *self, PyObject *args, PyObject *kwds)
 {
-    const char *string;
-    Py_ssize_t string_len;
-    PyObject *ret, *lexer, *fmt;
+    int as_bytes;
+    Py_buffer source;
+    PyObject *ret, *src, *lexer, *fmt;
+    static char *kwlist[] = { "source", "lexers", "formatter", "bytes", NULL };
 
-    ret = Py_None;
+    ret = NULL;
+    as_bytes = 0;
 #if 0
     if (PyArg_ParseTuple(args, "s#O!O!", &string, &string_len, &ShallLexerBaseType, &lexer, &ShallFormatterBaseType, &fmt)/* && 1 == PyObject_IsInstance(lexer, (PyObject *) &ShallLexerBaseType)*/) {
         char *dest;
@@ -92,7 +96,7 @@ static PyObject *shall_highlight(PyObject *self, PyObject *args)
         ret = PyUnicode_FromStringAndSize(dest, dest_len);
     }
 #else
-    if (PyArg_ParseTuple(args, "s#O!O!", &string, &string_len, &PyList_Type, &lexer, &ShallFormatterBaseType, &fmt)) {
+    if (PyArg_ParseTupleAndKeywords(args, kwds, "OO!O!|p", kwlist, &src, &PyList_Type, &lexer, &ShallFormatterBaseType, &fmt, &as_bytes) && python_source_get(src, &source)) {
         bool ok;
         char *dest;
         size_t dest_len;
@@ -112,15 +116,153 @@ static PyObject *shall_highlight(PyObject *self, PyObject *args)
             }
         }
         if (ok) {
-            highlight_string(string, (size_t) string_len, &dest, &dest_len, ((ShallFormatterObject *) fmt)->fmt, lexerc, lexerv);
-            ret = PyUnicode_FromStringAndSize(dest, dest_len);
+            ShallFormatterObject *formatter;
+
+            formatter = (ShallFormatterObject *) fmt;
+            if (python_formatter_is_native(formatter) && NULL != formatter->lock) {
+                PyObject *lexero[lexerc];
+
+                // the list may be modified by another thread while the GIL is released: hold its lexers
+                for (i = 0; i < lexerc; i++) {
+                    lexero[i] = PyList_GET_ITEM(lexer, i);
+                    Py_INCREF(lexero[i]);
+                }
+                Py_BEGIN_ALLOW_THREADS
+                PyThread_acquire_lock(formatter->lock, WAIT_LOCK);
+                highlight_string(source.buf, (size_t) source.len, &dest, &dest_len, formatter->fmt, lexerc, lexerv);
+                PyThread_release_lock(formatter->lock);
+                Py_END_ALLOW_THREADS
+                for (i = 0; i < lexerc; i++) {
+                    Py_DECREF(lexero[i]);
+                }
+            } else {
+                highlight_string(source.buf, (size_t) source.len, &dest, &dest_len, formatter->fmt, lexerc, lexerv);
+            }
+            ret = python_result(dest, dest_len, as_bytes);
         } else {
-            ret = NULL;
             PyErr_SetString(PyExc_TypeError, "lexers");
         }
+        PyBuffer_Release(&source);
     }
 #endif
-    Py_XINCREF(ret);
+
+    return ret;
+}
+
+/**
+ * highlight_many(items, formatter, threads=0, bytes=False): highlight a
+ * list of (source, [lexers...]) tuples on *threads* native threads (0 for
+ * the number of CPUs, see highlight_batch) and return the list of the
+ * results, in the same order
+ */
+static PyObject *shall_highlight_many(PyObject *UNUSED(self), PyObject *args, PyObject *kwds)
+{
+    int as_bytes;
+    unsigned int threads;
+    HighlightJob *jobs;
+    Py_buffer *sources;
+    HighlightResult *results;
+    Py_ssize_t i, j, jobs_len, items_len;
+    PyObject *ret, *items, *fmt, *seq, *refs;
+    static char *kwlist[] = { "items", "formatter", "threads", "bytes", NULL };
+
+    threads = 0;
+    as_bytes = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO!|Ip", kwlist, &items, &ShallFormatterBaseType, &fmt, &threads, &as_bytes)) {
+        return NULL;
+    }
+    if (NULL == (seq = PySequence_Fast(items, "items have to be a sequence of (source, [lexers...]) tuples"))) {
+        return NULL;
+    }
+    ret = NULL;
+    items_len = PySequence_Fast_GET_SIZE(seq);
+    // the lexers used without the GIL are held by refs (and the sources by their Py_buffer)
+    refs = PyList_New(0);
+    jobs = PyMem_New(HighlightJob, items_len);
+    sources = PyMem_New(Py_buffer, items_len);
+    results = PyMem_New(HighlightResult, items_len);
+    jobs_len = 0;
+    if (NULL == refs || NULL == jobs || NULL == sources || NULL == results) {
+        PyErr_NoMemory();
+        goto end;
+    }
+    for (; jobs_len < items_len; jobs_len++) {
+        HighlightJob *job;
+        PyObject *item, *lexers, *lexer;
+
+        job = &jobs[jobs_len];
+        item = PySequence_Fast_GET_ITEM(seq, jobs_len);
+        if (!PyTuple_Check(item) || 2 != PyTuple_GET_SIZE(item) || !PyList_Check(lexers = PyTuple_GET_ITEM(item, 1)) || 0 == PyList_GET_SIZE(lexers)) {
+            PyErr_SetString(PyExc_TypeError, "items have to be (source, [lexers...]) tuples");
+            goto end;
+        }
+        if (!python_source_get(PyTuple_GET_ITEM(item, 0), &sources[jobs_len])) {
+            goto end;
+        }
+        results[jobs_len].dst = NULL;
+        job->src = sources[jobs_len].buf;
+        job->src_len = (size_t) sources[jobs_len].len;
+        job->fmt = ((ShallFormatterObject *) fmt)->fmt;
+        job->budget = NULL;
+        job->lexerc = (size_t) PyList_GET_SIZE(lexers);
+        if (NULL == (job->lexerv = PyMem_New(Lexer *, job->lexerc))) {
+            PyErr_NoMemory();
+            ++jobs_len;
+            goto end;
+        }
+        for (j = 0; j < PyList_GET_SIZE(lexers); j++) {
+            lexer = PyList_GET_ITEM(lexers, j);
+            if (1 != PyObject_IsInstance(lexer, (PyObject *) &ShallLexerBaseType)) {
+                PyErr_SetString(PyExc_TypeError, "lexers");
+                ++jobs_len;
+                goto end;
+            }
+            PyList_Append(refs, lexer);
+            job->lexerv[j] = ((ShallLexerObject *) lexer)->lexer;
+        }
+    }
+    if (!python_formatter_is_native((ShallFormatterObject *) fmt)) {
+        // a formatter written in Python needs the GIL (and can't be copied)
+        highlight_batch(jobs, (size_t) jobs_len, results, 1);
+    } else {
+        PyThread_type_lock lock;
+
+        // the formatter is copied (or used as is by a single thread): no other thread may use it meanwhile
+        lock = ((ShallFormatterObject *) fmt)->lock;
+        Py_BEGIN_ALLOW_THREADS
+        if (NULL != lock) {
+            PyThread_acquire_lock(lock, WAIT_LOCK);
+        }
+        highlight_batch(jobs, (size_t) jobs_len, results, threads);
+        if (NULL != lock) {
+            PyThread_release_lock(lock);
+        }
+        Py_END_ALLOW_THREADS
+    }
+    ret = PyList_New(jobs_len);
+    for (i = 0; NULL != ret && i < jobs_len; i++) {
+        PyObject *result;
+
+        result = python_result(results[i].dst, results[i].dst_len, as_bytes);
+        // python_result frees it
+        results[i].dst = NULL;
+        if (NULL == result) {
+            Py_CLEAR(ret);
+        } else {
+            PyList_SET_ITEM(ret, i, result);
+        }
+    }
+end:
+    for (i = 0; i < jobs_len; i++) {
+        free(results[i].dst);
+        PyMem_Free(jobs[i].lexerv);
+        PyBuffer_Release(&sources[i]);
+    }
+    PyMem_Free(results);
+    PyMem_Free(sources);
+    PyMem_Free(jobs);
+    Py_XDECREF(refs);
+    Py_DECREF(seq);
 
     return ret;
 }
@@ -129,22 +271,22 @@ static PyObject *shall_sample(PyObject *self, PyObject *args)
 {
     PyObject *ret, *fmt;
 
-    ret = Py_None;
+    ret = NULL;
     if (PyArg_ParseTuple(args, "O!", &ShallFormatterBaseType, &fmt)) {
         char *dest;
         size_t dest_len;
 
         highlight_sample(&dest, &dest_len, ((ShallFormatterObject *) fmt)->fmt);
-        ret = PyUnicode_FromStringAndSize(dest, dest_len);
+        ret = python_result(dest, dest_len, false);
     }
-    Py_INCREF(ret);
 
     return ret;
 }
 
 static PyMethodDef ShallMethods[] = {
     { "sample",             (PyCFunction) shall_sample,             METH_VARARGS, "TODO" },
-    { "highlight",          (PyCFunction) shall_highlight,          METH_VARARGS, "TODO" },
+    { "highlight",          (PyCFunction) shall_highlight,          METH_VARARGS | METH_KEYWORDS, "highlight(source, lexers, formatter, bytes=False): source can be a str or any bytes-like object (no copy)" },
+    { "highlight_many",     (PyCFunction) shall_highlight_many,     METH_VARARGS | METH_KEYWORDS, "highlight_many(items, formatter, threads=0, bytes=False): highlight (source, [lexers...]) tuples in parallel" },
     { "lexer_guess",        (PyCFunction) shall_lexer_guess,        METH_VARARGS, "TODO" },
     { "lexer_by_name",      (PyCFunction) shall_lexer_by_name,      METH_VARARGS, "TODO" },
     { "lexer_for_filename", (PyCFunction) shall_lexer_for_filename, METH_VARARGS, "TODO" },
@@ -232,6 +374,7 @@ initshall
 
     register_lexer_class(shallmodulep);
     register_formatter_class(shallmodulep);
+    register_tokens_class(shallmodulep);
 
 #if 0
     tokens = PyDict_New();
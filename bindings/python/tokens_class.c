@@ -0,0 +1,106 @@
+#include "common.h"
+#include "tokens_class.h"
+
+/**
+ * Wraps the tokens found by highlight_tokens (the iterator takes their ownership)
+ */
+PyObject *python_token_iterator_new(HighlightTokens *tokens)
+{
+    ShallTokenIteratorObject *self;
+
+    if (NULL == (self = PyObject_New(ShallTokenIteratorObject, &ShallTokenIteratorType))) {
+        highlight_tokens_destroy(tokens);
+    } else {
+        self->tokens = tokens;
+        self->chunk_index = self->position = 0;
+        self->chunk = highlight_tokens_chunk(tokens, 0, &self->chunk_len);
+        self->remaining = highlight_tokens_count(tokens);
+    }
+
+    return (PyObject *) self;
+}
+
+static void Shall_TokenIterator_dealloc(ShallTokenIteratorObject *self)
+{
+    highlight_tokens_destroy(self->tokens);
+    PyObject_Del(self);
+}
+
+/**
+ * Builds the (type, start, end) tuple of a token only when it is asked for
+ */
+static PyObject *Shall_TokenIterator_next(ShallTokenIteratorObject *self)
+{
+    const HighlightToken *token;
+
+    if (0 == self->remaining) {
+        return NULL;
+    }
+    if (self->position >= self->chunk_len) {
+        self->chunk = highlight_tokens_chunk(self->tokens, ++self->chunk_index, &self->chunk_len);
+        self->position = 0;
+    }
+    token = &self->chunk[self->position++];
+    --self->remaining;
+
+    return Py_BuildValue("(inn)", token->type, (Py_ssize_t) token->start, (Py_ssize_t) token->end);
+}
+
+static PyObject *Shall_TokenIterator_length_hint(ShallTokenIteratorObject *self, PyObject *UNUSED(args))
+{
+    return PyLong_FromSize_t(self->remaining);
+}
+
+static PyMethodDef Shall_TokenIterator_Methods[] = {
+    { "__length_hint__", (PyCFunction) Shall_TokenIterator_length_hint, METH_NOARGS, "Number of tokens not yet returned" },
+    { NULL, NULL, 0, NULL }
+};
+
+PyTypeObject ShallTokenIteratorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "shall.TokenIterator",           /* tp_name */
+    sizeof(ShallTokenIteratorObject), /* tp_basicsize */
+    0,                           /* tp_itemsize */
+    (destructor) Shall_TokenIterator_dealloc, /* tp_dealloc */
+    0,                           /* tp_print */
+    0,                           /* tp_getattr */
+    0,                           /* tp_setattr */
+    0,                           /* tp_reserved */
+    0,                           /* tp_repr */
+    0,                           /* tp_as_number */
+    0,                           /* tp_as_sequence */
+    0,                           /* tp_as_mapping */
+    0,                           /* tp_hash  */
+    0,                           /* tp_call */
+    0,                           /* tp_str */
+    0,                           /* tp_getattro */
+    0,                           /* tp_setattro */
+    0,                           /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,          /* tp_flags */
+    "Iterator over the (type, start, end) tuples of the tokens of a string", /* tp_doc */
+    0,                           /* tp_traverse */
+    0,                           /* tp_clear */
+    0,                           /* tp_richcompare */
+    0,                           /* tp_weaklistoffset */
+    PyObject_SelfIter,           /* tp_iter */
+    (iternextfunc) Shall_TokenIterator_next, /* tp_iternext */
+    Shall_TokenIterator_Methods, /* tp_methods */
+    0,                           /* tp_members */
+    0,                           /* tp_getset */
+    0,                           /* tp_base */
+    0,                           /* tp_dict */
+    0,                           /* tp_descr_get */
+    0,                           /* tp_descr_set */
+    0,                           /* tp_dictoffset */
+    0,                           /* tp_init */
+    0,                           /* tp_alloc */
+    0,                           /* tp_new */
+};
+
+void register_tokens_class(PyObject *shallmodulep)
+{
+    if (PyType_Ready(&ShallTokenIteratorType) >= 0) {
+        Py_INCREF(&ShallTokenIteratorType);
+        PyModule_AddObject(shallmodulep, "TokenIterator", (PyObject *) &ShallTokenIteratorType);
+    }
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <shall/tokenize.h>
+
+typedef struct {
+    PyObject_HEAD
+    HighlightTokens *tokens;
+    /**
+     * The current chunk of tokens, its number and its length
+     */
+    const HighlightToken *chunk;
+    size_t chunk_index, chunk_len;
+    /**
+     * Position, in chunk, of the next token to return
+     */
+    size_t position;
+    /**
+     * Number of tokens not yet returned
+     */
+    size_t remaining;
+} ShallTokenIteratorObject;
+
+PyTypeObject ShallTokenIteratorType;
+
+PyObject *python_token_iterator_new(HighlightTokens *);
+void register_tokens_class(PyObject *);
@@ -32,6 +32,8 @@ module Shall
         class Lua < Base ; end
         # Lexer for the MySQL dialect of SQL
         class MySQL < Base ; end
+        # For newline delimited JSON (JSON Lines): each line is lexed on its own, an error doesn't go beyond its line
+        class NDJSON < Base ; end
         # Lexer for Nginx configuration files
         class Nginx < Base ; end
         # For PHP source code
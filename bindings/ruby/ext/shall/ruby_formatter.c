@@ -5,7 +5,7 @@ VALUE cBaseFormatter;
 static VALUE formatters;
 static VALUE mFormatter;
 
-static ID sStartLexing, sEndLexing, sStartDocument, sEndDocument, sStartToken, sEndToken, sWriteToken;
+static ID sStartLexing, sEndLexing, sStartDocument, sEndDocument, sStartToken, sEndToken, sWriteToken, sFormatTokens;
 
 /* ruby internal */
 
@@ -16,6 +16,23 @@ static int free_optionvalue(st_data_t UNUSED(key), st_data_t value, st_data_t UN
     return ST_CONTINUE;
 }
 
+typedef struct {
+    VALUE self;
+    st_table *options;
+    /**
+     * If the class implements format_tokens, the [type, text] pairs not
+     * yet given to it (else nil)
+     */
+    VALUE batch;
+    /**
+     * The text of the current token, of type batch_type
+     */
+    String *batch_text;
+    int batch_type;
+} RubyFormatterData;
+
+static const FormatterImplementation rubyfmt;
+
 #ifdef WITH_TYPED_DATA
 static void rb_formatter_free(void *ptr);
 #else
@@ -28,12 +45,16 @@ static void rb_formatter_mark(void *ptr)
     rb_formatter_object *o;
 
     o = (rb_formatter_object *) ptr;
-    (void) o;
 #else
 static void rb_formatter_mark(rb_formatter_object *o)
 {
 #endif /* WITH_TYPED_DATA */
-    // NOP (for now)
+    if (NULL != o->formatter && &rubyfmt == o->formatter->imp) {
+        RubyFormatterData *mydata;
+
+        mydata = (RubyFormatterData *) &o->formatter->optvals;
+        rb_gc_mark(mydata->batch);
+    }
 }
 
 #ifdef WITH_TYPED_DATA
@@ -48,11 +69,6 @@ const struct rb_data_type_struct formatter_type = {
 
 /* callbacks */
 
-typedef struct {
-    VALUE self;
-    st_table *options;
-} RubyFormatterData;
-
 #define RUBY_CALLBACK(/*ID*/ method, /*int*/ argc, ...) \
     do { \
         VALUE res; \
@@ -66,8 +82,59 @@ typedef struct {
         } \
     } while (0);
 
+/**
+ * A subclass of Shall::Formatter::Base which implements a format_tokens(tokens)
+ * method receives the tokens as arrays of [type, text] pairs, at most
+ * FORMAT_TOKENS_BATCH at once, instead of calls to start_token, write_token
+ * and end_token for each of them. The array is flushed before start_lexing,
+ * end_lexing and end_document, which are still called.
+ */
+#define FORMAT_TOKENS_BATCH 1024
+
+/**
+ * Adds the current token, if any, to the batch
+ */
+static void ruby_batch_push(RubyFormatterData *mydata)
+{
+    if (!string_empty(mydata->batch_text)) {
+        rb_ary_push(mydata->batch, rb_assoc_new(INT2FIX(mydata->batch_type), rb_str_new(mydata->batch_text->ptr, mydata->batch_text->len)));
+        string_truncate(mydata->batch_text);
+    }
+}
+
+/**
+ * Gives the pending tokens to the format_tokens method in a single call
+ */
+static void ruby_batch_flush(String *out, FormatterData *data)
+{
+    RubyFormatterData *mydata;
+
+    mydata = (RubyFormatterData *) data;
+    ruby_batch_push(mydata);
+    if (RARRAY_LEN(mydata->batch) > 0) {
+        VALUE batch;
+
+        batch = mydata->batch;
+        // a new array, the method may keep a reference on this one
+        mydata->batch = rb_ary_new();
+        RUBY_CALLBACK(sFormatTokens, 1, batch);
+    }
+}
+
 static int ruby_start_document(String *out, FormatterData *data)
 {
+    RubyFormatterData *mydata;
+
+    mydata = (RubyFormatterData *) data;
+    if (rb_respond_to(mydata->self, sFormatTokens)) {
+        if (NULL == mydata->batch_text) {
+            mydata->batch_text = string_new();
+        } else {
+            // leftovers of an interrupted document
+            string_truncate(mydata->batch_text);
+        }
+        mydata->batch = rb_ary_new();
+    }
     RUBY_CALLBACK(sStartDocument, 0);
 
     return 0;
@@ -75,6 +142,12 @@ static int ruby_start_document(String *out, FormatterData *data)
 
 static int ruby_end_document(String *out, FormatterData *data)
 {
+    RubyFormatterData *mydata;
+
+    mydata = (RubyFormatterData *) data;
+    if (!NIL_P(mydata->batch)) {
+        ruby_batch_flush(out, data);
+    }
     RUBY_CALLBACK(sEndDocument, 0);
 
     return 0;
@@ -82,27 +155,55 @@ static int ruby_end_document(String *out, FormatterData *data)
 
 static int ruby_start_token(int token, String *out, FormatterData *data)
 {
-    RUBY_CALLBACK(sStartToken, 1, INT2FIX(token));
+    RubyFormatterData *mydata;
+
+    mydata = (RubyFormatterData *) data;
+    if (!NIL_P(mydata->batch)) {
+        ruby_batch_push(mydata);
+        mydata->batch_type = token;
+    } else {
+        RUBY_CALLBACK(sStartToken, 1, INT2FIX(token));
+    }
 
     return 0;
 }
 
 static int ruby_end_token(int token, String *out, FormatterData *data)
 {
-    RUBY_CALLBACK(sEndToken, 1, INT2FIX(token));
+    RubyFormatterData *mydata;
+
+    mydata = (RubyFormatterData *) data;
+    if (!NIL_P(mydata->batch)) {
+        ruby_batch_push(mydata);
+        if (RARRAY_LEN(mydata->batch) >= FORMAT_TOKENS_BATCH) {
+            ruby_batch_flush(out, data);
+        }
+    } else {
+        RUBY_CALLBACK(sEndToken, 1, INT2FIX(token));
+    }
 
     return 0;
 }
 
 static int ruby_write_token(String *out, const char *token, size_t token_len, FormatterData *data)
 {
-    RUBY_CALLBACK(sWriteToken, 1, rb_str_new(token, token_len));
+    RubyFormatterData *mydata;
+
+    mydata = (RubyFormatterData *) data;
+    if (!NIL_P(mydata->batch)) {
+        string_append_string_len(mydata->batch_text, token, token_len);
+    } else {
+        RUBY_CALLBACK(sWriteToken, 1, rb_str_new(token, token_len));
+    }
 
     return 0;
 }
 
 static int ruby_start_lexing(const char *lexname, String *out, FormatterData *data)
 {
+    if (!NIL_P(((RubyFormatterData *) data)->batch)) {
+        ruby_batch_flush(out, data);
+    }
     RUBY_CALLBACK(sStartLexing, 1, rb_str_new_cstr(lexname));
 
     return 0;
@@ -110,6 +211,9 @@ static int ruby_start_lexing(const char *lexname, String *out, FormatterData *da
 
 static int ruby_end_lexing(const char *lexname, String *out, FormatterData *data)
 {
+    if (!NIL_P(((RubyFormatterData *) data)->batch)) {
+        ruby_batch_flush(out, data);
+    }
     RUBY_CALLBACK(sEndLexing, 1, rb_str_new_cstr(lexname));
 
     return 0;
@@ -166,11 +270,24 @@ static void rb_formatter_free(rb_formatter_object *o)
         mydata = (RubyFormatterData *) &o->formatter->optvals;
         st_foreach(mydata->options, free_optionvalue, 0);
         st_free_table(mydata->options);
+        if (NULL != mydata->batch_text) {
+            string_destroy(mydata->batch_text);
+        }
     }
+    rb_nativethread_lock_destroy(&o->lock);
     formatter_destroy(o->formatter);
     xfree(o);
 }
 
+/*
+ * A native formatter calls no Ruby code: it can be used without the GVL
+ * (unlike a formatter written in Ruby, a subclass of Shall::Formatter::Base)
+ */
+bool rb_formatter_is_native(rb_formatter_object *o)
+{
+    return &rubyfmt != o->formatter->imp;
+}
+
 static VALUE rb_formatter_alloc(VALUE klass)
 {
     VALUE o;
@@ -188,12 +305,14 @@ static VALUE rb_formatter_alloc(VALUE klass)
         imp = &rubyfmt;
     }
     f->formatter = formatter_create(imp);
+    rb_nativethread_lock_initialize(&f->lock);
     if (&rubyfmt == imp) {
         RubyFormatterData *mydata;
 
         mydata = (RubyFormatterData *) &f->formatter->optvals;
         mydata->self = o;
         mydata->options = st_init_strtable();
+        mydata->batch = Qnil;
 #if 1
         {
 /*
@@ -457,6 +576,7 @@ void rb_shall_init_formatter(void)
     sWriteToken = rb_intern("write_token");
     sStartLexing = rb_intern("start_lexing");
     sEndLexing = rb_intern("end_lexing");
+    sFormatTokens = rb_intern("format_tokens");
 
     mFormatter = rb_define_module_under(mShall, "Formatter");
 
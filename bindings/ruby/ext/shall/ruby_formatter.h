@@ -1,9 +1,15 @@
 #pragma once
 
+#include <ruby/thread_native.h>
+
 VALUE cBaseFormatter;
 
 typedef struct {
     Formatter *formatter;
+    /**
+     * Held while a native formatter is used without the GVL
+     */
+    rb_nativethread_lock_t lock;
 } rb_formatter_object;
 
 #ifdef WITH_TYPED_DATA
@@ -16,4 +22,5 @@ const struct rb_data_type_struct formatter_type;
     Data_Get_Struct(input, rb_formatter_object, output)
 #endif /* WITH_TYPED_DATA */
 
+bool rb_formatter_is_native(rb_formatter_object *);
 void rb_shall_init_formatter(void);
@@ -246,6 +246,57 @@ static VALUE rb_lexer_set_option(VALUE self, VALUE name, VALUE value)
     return Qnil;
 }
 
+static VALUE yield_tokens(VALUE ptr)
+{
+    size_t c, i, len;
+    HighlightTokens *tokens;
+    const HighlightToken *chunk;
+
+    tokens = (HighlightTokens *) ptr;
+    for (c = 0; NULL != (chunk = highlight_tokens_chunk(tokens, c, &len)); c++) {
+        for (i = 0; i < len; i++) {
+            rb_yield_values(3, INT2FIX(chunk[i].type), SIZET2NUM(chunk[i].start), SIZET2NUM(chunk[i].end));
+        }
+    }
+
+    return Qnil;
+}
+
+static VALUE free_tokens(VALUE ptr)
+{
+    highlight_tokens_destroy((HighlightTokens *) ptr);
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   lexer.tokens(string) { |type, start, stop| ... } -> lexer
+ *   lexer.tokens(string) -> Enumerator
+ *
+ * Tokenizes +string+ then yields, for each token, its type (see Shall::Token)
+ * and its position, in bytes, in +string+ (+stop+ excluded). The tokens are
+ * kept, by chunks, in native memory until the end of the iteration: they
+ * are only turned into Ruby objects as they are yielded.
+ * Without block, an Enumerator is returned.
+ *
+ *   lexer.tokens('echo 1;').each_slice(100) { |slice| ... }
+ */
+static VALUE rb_lexer_tokens(VALUE self, VALUE src)
+{
+    rb_lexer_object *o;
+    HighlightTokens *tokens;
+
+    RETURN_ENUMERATOR(self, 1, &src);
+    Check_Type(src, T_STRING);
+    UNWRAP_LEXER(self, o);
+    highlight_tokens(RSTRING_PTR(src), RSTRING_LEN(src), &tokens, 1, &o->lexer);
+    // the block may break or raise, the tokens have to be freed anyway
+    rb_ensure(yield_tokens, (VALUE) tokens, free_tokens, (VALUE) tokens);
+
+    return self;
+}
+
 /* ========== Shall module functions ========== */
 
 static VALUE _rb_create_lexer(const LexerImplementation *imp, VALUE options)
@@ -383,6 +434,7 @@ void rb_shall_init_lexer(void)
     // instance methods
     rb_define_method(cBaseLexer, "get_option", rb_lexer_get_option, 1);
     rb_define_method(cBaseLexer, "set_option", rb_lexer_set_option, 2);
+    rb_define_method(cBaseLexer, "tokens", rb_lexer_tokens, 1);
 //     rb_undef_method(CLASS_OF(cBaseLexer), "new");
     rb_undef_alloc_func(cBaseLexer);
 
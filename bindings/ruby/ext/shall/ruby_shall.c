@@ -9,52 +9,209 @@ static VALUE mToken;
 
 /* ========== Shall module functions ========== */
 
+typedef struct {
+    VALUE io;
+    // chunk to write
+    const char *chunk;
+    size_t chunk_len;
+    // true if the GVL was released for the highlighting
+    bool without_gvl;
+    // non-zero if io.write raised an exception (see rb_protect)
+    int state;
+} RubySink;
+
+typedef struct {
+    const char *src;
+    size_t src_len;
+    char *dest;
+    size_t dest_len;
+    // where to write the output (NULL to return it in dest/dest_len)
+    RubySink *sink;
+    rb_formatter_object *f;
+    size_t lexerc;
+    Lexer **lexerv;
+} RubyHighlightArgs;
+
+static VALUE sink_io_write(VALUE ptr)
+{
+    RubySink *rs;
+
+    rs = (RubySink *) ptr;
+
+    return rb_io_write(rs->io, rb_utf8_str_new(rs->chunk, rs->chunk_len));
+}
+
+static void *sink_write_with_gvl(void *ptr)
+{
+    RubySink *rs;
+
+    rs = (RubySink *) ptr;
+    // an exception can't cross the library, keep it until highlighting is over
+    rb_protect(sink_io_write, (VALUE) rs, &rs->state);
+
+    return NULL;
+}
+
+static int sink_write(const char *chunk, size_t chunk_len, void *data)
+{
+    RubySink *rs;
+
+    rs = (RubySink *) data;
+    rs->chunk = chunk;
+    rs->chunk_len = chunk_len;
+    if (rs->without_gvl) {
+        rb_thread_call_with_gvl(sink_write_with_gvl, rs);
+    } else {
+        sink_write_with_gvl(rs);
+    }
+
+    return rs->state;
+}
+
+static void *highlight_without_gvl(void *ptr)
+{
+    RubyHighlightArgs *args;
+
+    args = (RubyHighlightArgs *) ptr;
+    rb_nativethread_lock_lock(&args->f->lock);
+    if (NULL == args->sink) {
+        highlight_string(args->src, args->src_len, &args->dest, &args->dest_len, args->f->formatter, args->lexerc, args->lexerv);
+    } else {
+        HighlightSink sink = { sink_write, args->sink, 0 };
+
+        highlight_string_to(args->src, args->src_len, &sink, args->f->formatter, args->lexerc, args->lexerv, NULL);
+    }
+    rb_nativethread_lock_unlock(&args->f->lock);
+
+    return NULL;
+}
+
 /*
- * call-seq:
- *   Shall::highlight(string, lexer, formatter) -> string
- *
- * Highlights the given +string+, based on +lexer+ (a Shall::Lexer::Base object)
- * and +formatter+ (a Shall::Formatter::Base object)
+ * Checks the arguments of highlight and highlight_to, lexer is turned into
+ * an array of lexers, which is not shared with the caller
  */
-static VALUE rb_shall_highlight(VALUE module, VALUE string, VALUE lexer, VALUE formatter)
+static bool rb_shall_check_arguments(VALUE string, VALUE *lexer, VALUE formatter)
 {
     long i;
-    char *dest;
-    size_t dest_len;
-    rb_formatter_object *f;
 
     Check_Type(string, T_STRING);
-    if (T_ARRAY == TYPE(lexer)) {
-
-        for (i = 0; i < RARRAY_LEN(lexer); i++) {
-            if (Qtrue != rb_obj_is_kind_of(RARRAY_AREF(lexer, i), cBaseLexer)) {
-                return Qnil;
+    if (T_ARRAY == TYPE(*lexer)) {
+        if (0 == RARRAY_LEN(*lexer)) {
+            return false;
+        }
+        for (i = 0; i < RARRAY_LEN(*lexer); i++) {
+            if (Qtrue != rb_obj_is_kind_of(RARRAY_AREF(*lexer, i), cBaseLexer)) {
+                return false;
             }
         }
+        *lexer = rb_ary_dup(*lexer);
     } else {
-        if (Qtrue != rb_obj_is_kind_of(lexer, cBaseLexer)) {
-            return Qnil;
+        if (Qtrue != rb_obj_is_kind_of(*lexer, cBaseLexer)) {
+            return false;
         } else {
-            lexer = rb_ary_new4(1, &lexer);
+            *lexer = rb_ary_new4(1, lexer);
         }
     }
-    if (Qtrue != rb_obj_is_kind_of(formatter, cBaseFormatter)) {
+
+    return Qtrue == rb_obj_is_kind_of(formatter, cBaseFormatter);
+}
+
+/*
+ * Runs the highlighting, without the GVL if the formatter is a native one
+ * (a formatter written in Ruby needs it)
+ */
+static void rb_shall_highlight_real(VALUE string, VALUE lexer, VALUE formatter, RubyHighlightArgs *args)
+{
+    long i;
+    Lexer *lexers[RARRAY_LEN(lexer)];
+
+    for (i = 0; i < RARRAY_LEN(lexer); i++) {
+        rb_lexer_object *l;
+
+        UNWRAP_LEXER(RARRAY_AREF(lexer, i), l);
+        lexers[i] = l->lexer;
+    }
+    UNWRAP_FORMATTER(formatter, args->f);
+    // binary safe: the input is not required to be NUL terminated nor to be free of NUL
+    args->src = RSTRING_PTR(string);
+    args->src_len = (size_t) RSTRING_LEN(string);
+    args->lexerc = (size_t) RARRAY_LEN(lexer);
+    args->lexerv = lexers;
+    if (rb_formatter_is_native(args->f)) {
+        if (NULL != args->sink) {
+            args->sink->without_gvl = true;
+        }
+        rb_thread_call_without_gvl(highlight_without_gvl, args, NULL, NULL);
+    } else if (NULL == args->sink) {
+        highlight_string(args->src, args->src_len, &args->dest, &args->dest_len, args->f->formatter, args->lexerc, args->lexerv);
+    } else {
+        HighlightSink sink = { sink_write, args->sink, 0 };
+
+        highlight_string_to(args->src, args->src_len, &sink, args->f->formatter, args->lexerc, args->lexerv, NULL);
+    }
+    RB_GC_GUARD(string);
+    RB_GC_GUARD(lexer);
+    RB_GC_GUARD(formatter);
+}
+
+/*
+ * call-seq:
+ *   Shall::highlight(string, lexer, formatter) -> string
+ *
+ * Highlights the given +string+, based on +lexer+ (a Shall::Lexer::Base object)
+ * and +formatter+ (a Shall::Formatter::Base object)
+ *
+ * +string+ may contain any byte, including NUL. With a builtin formatter,
+ * other threads run while it is highlighted.
+ */
+static VALUE rb_shall_highlight(VALUE module, VALUE string, VALUE lexer, VALUE formatter)
+{
+    VALUE ret;
+    RubyHighlightArgs args = { 0 };
+
+    if (!rb_shall_check_arguments(string, &lexer, formatter)) {
         return Qnil;
     }
-    {
-        Lexer *lexers[RARRAY_LEN(lexer)];
+    // a frozen copy (it shares its buffer) can't be modified by another thread meanwhile
+    string = rb_str_new_frozen(string);
+    rb_shall_highlight_real(string, lexer, formatter, &args);
+    ret = rb_utf8_str_new(args.dest, args.dest_len);
+    free(args.dest);
+
+    return ret;
+}
 
-        for (i = 0; i < RARRAY_LEN(lexer); i++) {
-            rb_lexer_object *l;
+/*
+ * call-seq:
+ *   Shall::highlight_to(io, string, lexer, formatter) -> io
+ *
+ * Same as Shall::highlight but the output is written, by chunks, to +io+
+ * (any object with a write method) as it is produced instead of being
+ * returned as a whole.
+ *
+ *   File.open('out.html', 'w') do |fp|
+ *     Shall::highlight_to(fp, File.read('big.diff'), Shall::Lexer::Diff.new, Shall::Formatter::HTML.new)
+ *   end
+ */
+static VALUE rb_shall_highlight_to(VALUE module, VALUE io, VALUE string, VALUE lexer, VALUE formatter)
+{
+    RubySink rs = { 0 };
+    RubyHighlightArgs args = { 0 };
 
-            UNWRAP_LEXER(RARRAY_AREF(lexer, i), l);
-            lexers[i] = l->lexer;
-        }
-        UNWRAP_FORMATTER(formatter, f);
-        highlight_string(StringValueCStr(string), RSTRING_LEN(string), &dest, &dest_len, f->formatter, (size_t) RARRAY_LEN(lexer), lexers);
+    if (!rb_shall_check_arguments(string, &lexer, formatter)) {
+        return Qnil;
+    }
+    string = rb_str_new_frozen(string);
+    rs.io = io;
+    args.sink = &rs;
+    rb_shall_highlight_real(string, lexer, formatter, &args);
+    if (0 != rs.state) {
+        // re-raise the exception of io.write
+        rb_jump_tag(rs.state);
     }
+    RB_GC_GUARD(io);
 
-    return rb_utf8_str_new(dest, dest_len);
+    return io;
 }
 
 /*
@@ -65,6 +222,7 @@ static VALUE rb_shall_highlight(VALUE module, VALUE string, VALUE lexer, VALUE f
  */
 static VALUE rb_shall_sample(VALUE module, VALUE formatter)
 {
+    VALUE ret;
     char *dest;
     size_t dest_len;
     rb_formatter_object *f;
@@ -74,8 +232,10 @@ static VALUE rb_shall_sample(VALUE module, VALUE formatter)
     }
     UNWRAP_FORMATTER(formatter, f);
     highlight_sample(&dest, &dest_len, f->formatter);
+    ret = rb_utf8_str_new(dest, dest_len);
+    free(dest);
 
-    return rb_utf8_str_new(dest, dest_len);
+    return ret;
 }
 
 /* ========== Initialisation ========== */
@@ -96,6 +256,7 @@ void Init_shall(void)
     // Shall module functions
     rb_define_module_function(mShall, "sample", rb_shall_sample, 1);
     rb_define_module_function(mShall, "highlight", rb_shall_highlight, 3);
+    rb_define_module_function(mShall, "highlight_to", rb_shall_highlight_to, 4);
 
     {
 #include <shall/version.h>
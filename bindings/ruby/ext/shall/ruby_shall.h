@@ -1,9 +1,11 @@
 #pragma once
 
 #include <ruby.h>
+#include <ruby/thread.h>
 #include <shall/shall.h>
 #include <shall/formatter.h>
 #include <shall/tokens.h>
+#include <shall/tokenize.h>
 
 #define DEBUG
 #define WITH_TYPED_DATA 1
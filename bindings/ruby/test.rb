@@ -22,6 +22,13 @@ class MyFormatter < Shall::Formatter::Base
     end
 end
 
+# the same output as MyFormatter, with one call per chunk of tokens
+class MyBatchedFormatter < MyFormatter
+    def format_tokens(tokens)
+        tokens.map { |type, token| "<token>#{token}</token>" }.join
+    end
+end
+
 class MyInheritedFormatter < Shall::Formatter::HTML
     def start_document
         super
@@ -37,6 +44,7 @@ echo 'Hello world', 42;
 EOS
 
 puts Shall::highlight code, Shall::Lexer::PHP.new, MyFormatter.new
+puts Shall::highlight code, Shall::Lexer::PHP.new, MyBatchedFormatter.new
 
 puts '=' * 20
 
@@ -63,4 +71,12 @@ puts Shall::highlight code, Shall::lexer_guess(code, { start_inline: true }), Sh
 
 puts '=' * 20
 
+Shall::Lexer::PHP.new.tokens(code).each_slice(4) { |slice| p slice }
+
+puts '=' * 20
+
 # ruby -Ilib:ext -r shall test.rb
+
+puts '=' * 20
+
+Shall::highlight_to $stdout, code, Shall::Lexer::PHP.new, Shall::Formatter::Terminal.new
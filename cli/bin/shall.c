@@ -1,12 +1,23 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <getopt.h>
 #include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fts.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "cpp.h"
 #include "optparse.h"
 #include "shall.h"
+#include "cache.h"
+#include "stats.h"
+#include "trace.h"
 #include "xtring.h"
 #include "hashtable.h"
 #include "themes.h"
@@ -14,9 +25,12 @@
 #include "version.h"
 #include "encoding.h"
 #include "lexer_group.h"
+#include "hash.h"
+#include "manifest.h"
+#include "protocol.h"
+#include "server.h"
 
 #if defined(__FreeBSD__) && __FreeBSD__ >= 9
-# include <unistd.h>
 # include <sys/capsicum.h>
 
 # define CAP_RIGHTS_LIMIT(fd, ...) \
@@ -43,6 +57,17 @@
     /* NOP */
 #endif /* FreeBSD >= 9.0 */
 
+#ifndef CACHE_MEMORY_SIZE
+# define CACHE_MEMORY_SIZE (64 * 1024 * 1024)
+#endif /* !CACHE_MEMORY_SIZE */
+
+enum {
+    OPT_SERVE = 256,
+    OPT_CLIENT,
+    OPT_STATS,
+    OPT_TRACE
+};
+
 #ifndef EUSAGE
 # define EUSAGE -2
 #endif /* !EUSAGE */
@@ -55,21 +80,34 @@ extern char *__progname;
 
 static bool vFlag;
 static HashTable lexers;
+static HighlightCache *cache;
+static HighlightStats *stats; // --stats (NULL if not enabled)
+static HighlightTrace *trace; // --trace (NULL if not enabled)
+static const char *trace_filename;
 static const char *outputenc;
 static OptionsStore options[COUNT];
-static char optstr[] = "cef:l:o:t:vLO:";
+static OptionsStore client_lexer_options; // all -o, in order, for --client
+static char optstr[] = "cd:ef:j:l:o:r:t:vC:LO:";
 
 static struct option long_options[] = {
+    { "cache-dir",        required_argument, NULL, 'C' },
     { "chain",            no_argument,       NULL, 'c' },
+    { "output-dir",       required_argument, NULL, 'd' },
     { "example",          no_argument,       NULL, 'e' },
     { "list",             required_argument, NULL, 'L' },
     { "lexer",            required_argument, NULL, 'l' },
     { "formatter",        required_argument, NULL, 'f' },
     { "lexer-option",     required_argument, NULL, 'o' },
     { "formatter-option", required_argument, NULL, 'O' },
+    { "jobs",             required_argument, NULL, 'j' },
+    { "recursive",        required_argument, NULL, 'r' },
     { "theme",            required_argument, NULL, 't' },
     { "sample",           no_argument,       NULL, 'e' },
     { "scope",            required_argument, NULL, 's' }, // TODO: optional CSS scope to generate CSS rules for theme
+    { "serve",            required_argument, NULL, OPT_SERVE },
+    { "client",           required_argument, NULL, OPT_CLIENT },
+    { "stats",            no_argument,       NULL, OPT_STATS },
+    { "trace",            required_argument, NULL, OPT_TRACE },
     { "verbose",          no_argument,       NULL, 'v' },
     { NULL,               no_argument,       NULL, 0   }
 };
@@ -85,46 +123,44 @@ static void usage(void)
     exit(EUSAGE);
 }
 
-static void procfile(const char *filename, FILE *fp, Formatter *fmt)
+/**
+ * Read a whole file and convert it, if needed, to UTF-8
+ *
+ * @param filename the name of the file ("-" for stdin)
+ * @param fp the file to read
+ *
+ * @return NULL on failure (including binary files) else its content
+ */
+static String *read_input(const char *filename, FILE *fp)
 {
-    size_t o;
-    char *result;
-    Lexer *lexer;
-    LexerGroup *g;
+    size_t read;
     String *buffer;
-    size_t result_len;
+    char bufraw[1024];
     const char *inputenc;
-    const LexerImplementation *limp;
 
-    result = NULL;
     inputenc = NULL;
-    {
-        size_t read;
-        char bufraw[1024];
-
-        if (0 == strcmp(filename, "-")) {
-            inputenc = encoding_stdin_get();
+    if (0 == strcmp(filename, "-")) {
+        inputenc = encoding_stdin_get();
+    }
+    buffer = string_new();
+    read = fread(bufraw, sizeof(bufraw[0]), ARRAY_SIZE(bufraw), fp);
+    if (read > 0) {
+        string_append_string_len(buffer, bufraw, read);
+        if (NULL != memchr(buffer->ptr, '\0', buffer->len)) {
+            fprintf(stderr, "%s: binary file found, skip\n", filename);
+            goto failure;
+        } else {
+            inputenc = encoding_guess(buffer->ptr, buffer->len, NULL);
         }
-        buffer = string_new();
-        read = fread(bufraw, sizeof(bufraw[0]), ARRAY_SIZE(bufraw), fp);
-        if (read > 0) {
+        while (ARRAY_SIZE(bufraw) == read) {
+            read = fread(bufraw, sizeof(bufraw[0]), ARRAY_SIZE(bufraw), fp);
             string_append_string_len(buffer, bufraw, read);
-            if (NULL != memchr(buffer->ptr, '\0', buffer->len)) {
-                fprintf(stderr, "%s: binary file found, skip\n", filename);
-                goto failure;
-            } else {
-                inputenc = encoding_guess(buffer->ptr, buffer->len, NULL);
-            }
-            while (ARRAY_SIZE(bufraw) == read) {
-                read = fread(bufraw, sizeof(bufraw[0]), ARRAY_SIZE(bufraw), fp);
-                string_append_string_len(buffer, bufraw, read);
-            }
-        }
-        if (ferror(fp)) {
-            fprintf(stderr, "failed to read %s\n", filename);
-            goto failure;
         }
     }
+    if (ferror(fp)) {
+        fprintf(stderr, "failed to read %s\n", filename);
+        goto failure;
+    }
     if (NULL != inputenc && 0 != strcmp("UTF-8", inputenc)) {
         bool ok;
         char *utf8;
@@ -136,9 +172,35 @@ static void procfile(const char *filename, FILE *fp, Formatter *fmt)
             buffer = string_adopt_string_len(utf8, utf8_len);
         } else {
             fprintf(stderr, "failed to convert '%s' (from %s) to UTF-8\n", inputenc, filename);
-            goto failure;
+            return NULL;
         }
     }
+
+    return buffer;
+failure:
+    string_destroy(buffer);
+
+    return NULL;
+}
+
+/**
+ * Find out the lexer(s) to use for a file
+ *
+ * Lexers are created on first use (with the options given by -o) and kept
+ * in the global *lexers* table for the next files.
+ *
+ * @param filename the name of the file
+ * @param buffer its content
+ *
+ * @return the group of lexers to highlight it
+ */
+static LexerGroup *lexer_group_for(const char *filename, const String *buffer)
+{
+    size_t o;
+    Lexer *lexer;
+    LexerGroup *g;
+    const LexerImplementation *limp;
+
     if (NULL == (limp = lexer_implementation_for_filename(filename))) {
         if (NULL == (limp = lexer_implementation_guess(buffer->ptr, buffer->len))) {
             // if at least one -l was used, use first one
@@ -146,58 +208,708 @@ static void procfile(const char *filename, FILE *fp, Formatter *fmt)
                 // else use text (acts as cat)
                 limp = lexer_implementation_by_name("text");
             } else {
-                lexer = g->lexers[0];
+                return g;
             }
         }
     }
-    if (NULL == limp) {
-        // set implementation from lexer to avoid segfault
-        // (we are using the first registered one)
-        limp = lexer_implementation(lexer);
-    } else {
-        if (!hashtable_direct_get(&lexers, limp, &g)) {
-            g = group_new(lexer = lexer_create(limp));
-            for (o = 0; o < options[LEXER].options_len; o++) {
-                if (0 != lexer_set_option_as_string(lexer, options[LEXER].options[o].name, options[LEXER].options[o].value, options[LEXER].options[o].value_len)) {
-                    fprintf(stderr, "option '%s' rejected by %s lexer\n", options[LEXER].options[o].name, lexer_implementation_name(lexer_implementation(lexer)));
-                }
+    if (!hashtable_direct_get(&lexers, limp, &g)) {
+        g = group_new(lexer = lexer_create(limp));
+        for (o = 0; o < options[LEXER].options_len; o++) {
+            if (0 != lexer_set_option_as_string(lexer, options[LEXER].options[o].name, options[LEXER].options[o].value, options[LEXER].options[o].value_len)) {
+                fprintf(stderr, "option '%s' rejected by %s lexer\n", options[LEXER].options[o].name, lexer_implementation_name(lexer_implementation(lexer)));
             }
-            hashtable_direct_put(&lexers, 0, limp, g, NULL);
+        }
+        hashtable_direct_put(&lexers, 0, limp, g, NULL);
 #ifdef DEBUG
-        } else {
-            debug("[CACHE] Hit for %s", lexer_implementation_name(lexer_implementation(g->lexers[0])));
+    } else {
+        debug("[CACHE] Hit for %s", lexer_implementation_name(lexer_implementation(g->lexers[0])));
 #endif /* DEBUG */
+    }
+
+    return g;
+}
+
+/**
+ * Create a formatter and apply it the options given by -O
+ *
+ * @param fimp the formatter implementation
+ * @param verbose false to not report rejected options
+ * (they were already reported for the first formatter)
+ *
+ * @return the formatter
+ */
+static Formatter *formatter_create_with_options(const FormatterImplementation *fimp, bool verbose)
+{
+    size_t i;
+    Formatter *fmt;
+
+    fmt = formatter_create(fimp);
+    for (i = 0; i < options[FORMATTER].options_len; i++) {
+        if (0 != formatter_set_option_as_string(fmt, options[FORMATTER].options[i].name, options[FORMATTER].options[i].value, options[FORMATTER].options[i].value_len) && verbose) {
+            fprintf(stderr, "option '%s' rejected by %s formatter\n", options[FORMATTER].options[i].name, formatter_implementation_name(formatter_implementation(fmt)));
         }
     }
-    if (vFlag) {
-        fprintf(stdout, "%s:\n", filename);
+
+    return fmt;
+}
+
+/**
+ * Highlight a string with the lexers of *g*, through the cache if enabled (--cache-dir)
+ */
+static int highlight(const String *buffer, char **result, size_t *result_len, Formatter *fmt, LexerGroup *g)
+{
+    if (NULL == cache) {
+        return highlight_string(buffer->ptr, buffer->len, result, result_len, fmt, g->count, g->lexers);
+    } else {
+        return highlight_string_cached(cache, buffer->ptr, buffer->len, result, result_len, fmt, g->count, g->lexers, NULL);
     }
-    highlight_string(buffer->ptr, buffer->len, &result, &result_len, fmt, g->count, g->lexers);
+}
+
+/**
+ * Print a result on stdout, converted from UTF-8 to the output encoding if needed
+ *
+ * @return false if the conversion failed
+ */
+static bool print_result(const char *result, size_t result_len)
+{
     if (0 != strcmp("UTF-8", outputenc)) {
-        bool ok;
         char *nonutf8;
         size_t nonutf8_len;
 
-        ok = encoding_convert_from_utf8(outputenc, result, result_len, &nonutf8, &nonutf8_len);
-        free(result);
-        if (ok) {
-            result = nonutf8;
-        } else {
+        if (!encoding_convert_from_utf8(outputenc, result, result_len, &nonutf8, &nonutf8_len)) {
             fprintf(stderr, "failed to convert result from UTF-8 to %s\n", outputenc);
-            goto failure;
+            return false;
         }
+        puts(nonutf8);
+        free(nonutf8);
+    } else {
+        puts(result);
+    }
+
+    return true;
+}
+
+/**
+ * Highlight a file and print the result. If *threads* is greater than 1
+ * (-j was explicitly given), the lexing of a large file may be spread over
+ * that many threads (see highlight_string_parallel)
+ *
+ * @return false on failure
+ */
+static bool procfile(const char *filename, FILE *fp, Formatter *fmt, unsigned long threads)
+{
+    int ret;
+    char *result;
+    LexerGroup *g;
+    String *buffer;
+    size_t result_len;
+
+    ret = -1;
+    result = NULL;
+    if (NULL == (buffer = read_input(filename, fp))) {
+        goto failure;
+    }
+    g = lexer_group_for(filename, buffer);
+    if (vFlag) {
+        fprintf(stdout, "%s:\n", filename);
+    }
+    if (threads > 1 && NULL == cache) {
+        ret = highlight_string_parallel(buffer->ptr, buffer->len, &result, &result_len, fmt, g->count, g->lexers, NULL, (unsigned) threads, 0);
+    } else {
+        ret = highlight(buffer, &result, &result_len, fmt, g);
+    }
+    if (HIGHLIGHT_SUCCESS != ret) {
+        fprintf(stderr, "highlighting of %s failed (%d)\n", filename, ret);
+    }
+    if (!print_result(result, result_len)) {
+        ret = -1;
     }
-    // print result
-    puts(result);
 failure:
     // free
-    string_destroy(buffer);
+    if (NULL != buffer) {
+        string_destroy(buffer);
+    }
     if (NULL != result) {
         free(result);
     }
     if (stdin != fp) {
         fclose(fp);
     }
+
+    return HIGHLIGHT_SUCCESS == ret;
+}
+
+/* ========== recursive (-r) mode ========== */
+
+#ifndef TREE_WORKER_STACK_SIZE
+/* highlight_string keeps its token buffer on the stack */
+# define TREE_WORKER_STACK_SIZE (8 * 1024 * 1024)
+#endif /* !TREE_WORKER_STACK_SIZE */
+
+typedef enum {
+    TREE_FAILED,
+    TREE_SKIPPED,
+    TREE_UNCHANGED,
+    TREE_HIGHLIGHTED,
+    TREE_DUPLICATE,
+} TreeEntryState;
+
+typedef struct TreeEntry {
+    char *path;
+    char *outpath;
+    char *relpath;
+    off_t size;
+    time_t mtime;
+    Hash128 hash;
+    LexerGroup *group;
+    TreeEntryState state;
+    /* its entry of the previous run (with the same settings), if any */
+    const ManifestEntry *previous;
+    /* the file with the same content and lexers which is actually highlighted */
+    struct TreeEntry *same;
+} TreeEntry;
+
+typedef struct {
+    const FormatterImplementation *fimp;
+    TreeEntry **entries;
+    size_t entries_len;
+    size_t next;
+    HashTable dedup;
+    pthread_mutex_t lock;
+} TreeQueue;
+
+static ht_hash_t tree_entry_hash(ht_key_t k)
+{
+    const TreeEntry *entry;
+
+    entry = (const TreeEntry *) k;
+
+    return (ht_hash_t) (entry->hash.h1 ^ (uintptr_t) entry->group);
+}
+
+static bool tree_entry_equal(ht_key_t a, ht_key_t b)
+{
+    const TreeEntry *ea, *eb;
+
+    ea = (const TreeEntry *) a;
+    eb = (const TreeEntry *) b;
+
+    return ea->group == eb->group && 0 == hash128_cmp(&ea->hash, &eb->hash);
+}
+
+static void tree_entry_destroy(TreeEntry *entry)
+{
+    free(entry->path);
+    free(entry->outpath);
+    free(entry->relpath);
+    free(entry);
+}
+
+/**
+ * Create, if needed, all the parent directories of a file
+ *
+ * @param path the path of the file
+ *
+ * @return false on failure
+ */
+static bool mkdir_parents(const char *path)
+{
+    char *p, buffer[PATH_MAX];
+
+    if (strlen(path) >= sizeof(buffer)) {
+        return false;
+    }
+    strcpy(buffer, path);
+    for (p = strchr(buffer + 1, '/'); NULL != p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (0 != mkdir(buffer, 0755) && EEXIST != errno) {
+            fprintf(stderr, "failed to create directory %s: %s\n", buffer, strerror(errno));
+            return false;
+        }
+        *p = '/';
+    }
+
+    return true;
+}
+
+static bool write_output(const char *path, const char *content, size_t content_len)
+{
+    FILE *fp;
+    bool ok;
+
+    if (NULL == (fp = fopen(path, "w"))) {
+        fprintf(stderr, "failed to open %s for writing: %s\n", path, strerror(errno));
+        return false;
+    }
+    ok = content_len == fwrite(content, sizeof(content[0]), content_len, fp);
+    ok &= 0 == fclose(fp);
+    if (!ok) {
+        fprintf(stderr, "failed to write %s\n", path);
+    }
+
+    return ok;
+}
+
+/**
+ * Copy the output of a file to the one of another file with the same content
+ */
+static bool copy_output(const char *from, const char *to)
+{
+    bool ok;
+    size_t read;
+    FILE *in, *out;
+    char buffer[8192];
+
+    if (NULL == (in = fopen(from, "r"))) {
+        fprintf(stderr, "failed to open %s: %s\n", from, strerror(errno));
+        return false;
+    }
+    if (NULL == (out = fopen(to, "w"))) {
+        fprintf(stderr, "failed to open %s for writing: %s\n", to, strerror(errno));
+        fclose(in);
+        return false;
+    }
+    ok = true;
+    while (ok && 0 != (read = fread(buffer, sizeof(buffer[0]), ARRAY_SIZE(buffer), in))) {
+        ok = read == fwrite(buffer, sizeof(buffer[0]), read, out);
+    }
+    ok &= 0 == ferror(in);
+    fclose(in);
+    ok &= 0 == fclose(out);
+    if (!ok) {
+        fprintf(stderr, "failed to copy %s to %s\n", from, to);
+    }
+
+    return ok;
+}
+
+/**
+ * Read and highlight a single file of the tree
+ *
+ * The source is only read here, by the worker, so at most one file per
+ * thread is held in memory.
+ */
+static void tree_process(TreeQueue *queue, Formatter *fmt, TreeEntry *entry)
+{
+    int ret;
+    FILE *fp;
+    String *buffer;
+    TreeEntry *same;
+    char *result;
+    size_t result_len;
+
+    if (NULL == (fp = fopen(entry->path, "r"))) {
+        fprintf(stderr, "unable to open '%s', skip\n", entry->path);
+        return;
+    }
+    buffer = read_input(entry->path, fp);
+    fclose(fp);
+    if (NULL == buffer) {
+        entry->state = TREE_SKIPPED;
+        return;
+    }
+    hash128(buffer->ptr, buffer->len, 0, &entry->hash);
+    if (NULL != entry->previous && 0 == hash128_cmp(&entry->previous->hash, &entry->hash)) {
+        // touched but not modified
+        entry->state = TREE_UNCHANGED;
+        string_destroy(buffer);
+        return;
+    }
+    if (!mkdir_parents(entry->outpath)) {
+        string_destroy(buffer);
+        return;
+    }
+    pthread_mutex_lock(&queue->lock);
+    // lexer_group_for caches the lexers it creates in the global table lexers
+    entry->group = lexer_group_for(entry->path, buffer);
+    if (hashtable_get(&queue->dedup, entry, &same)) {
+        entry->same = same;
+    } else {
+        hashtable_put(&queue->dedup, 0, entry, entry, NULL);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    if (NULL != entry->same) {
+        // its output is copied from the one of entry->same once all the files are done
+        entry->state = TREE_DUPLICATE;
+    } else {
+        if (vFlag) {
+            fprintf(stderr, "%s\n", entry->path);
+        }
+        if (HIGHLIGHT_SUCCESS != (ret = highlight(buffer, &result, &result_len, fmt, entry->group))) {
+            // left TREE_FAILED: not recorded by the manifest, it is retried on the next run
+            fprintf(stderr, "highlighting of %s failed (%d)\n", entry->path, ret);
+        } else if (write_output(entry->outpath, result, result_len)) {
+            entry->state = TREE_HIGHLIGHTED;
+        }
+        free(result);
+    }
+    string_destroy(buffer);
+}
+
+static void *tree_worker(void *arg)
+{
+    Formatter *fmt;
+    TreeQueue *queue;
+    HighlightTrace *mytrace, *previous_trace;
+    HighlightStats *mystats, *previous;
+
+    queue = (TreeQueue *) arg;
+    fmt = formatter_create_with_options(queue->fimp, false);
+    // statistics are collected per thread then merged
+    mystats = NULL;
+    if (NULL != stats) {
+        mystats = highlight_stats_create();
+        previous = highlight_stats_bind(mystats);
+    }
+    // as for tokens
+    mytrace = NULL;
+    if (NULL != trace) {
+        mytrace = highlight_trace_create(0);
+        previous_trace = highlight_trace_bind(mytrace);
+    }
+    while (1) {
+        TreeEntry *entry;
+
+        pthread_mutex_lock(&queue->lock);
+        entry = queue->next < queue->entries_len ? queue->entries[queue->next++] : NULL;
+        pthread_mutex_unlock(&queue->lock);
+        if (NULL == entry) {
+            break;
+        }
+        tree_process(queue, fmt, entry);
+    }
+    formatter_destroy(fmt);
+    if (NULL != mystats) {
+        highlight_stats_bind(previous);
+        pthread_mutex_lock(&queue->lock);
+        highlight_stats_merge(stats, mystats);
+        pthread_mutex_unlock(&queue->lock);
+        highlight_stats_destroy(mystats);
+    }
+    if (NULL != mytrace) {
+        highlight_trace_bind(previous_trace);
+        pthread_mutex_lock(&queue->lock);
+        highlight_trace_merge(trace, mytrace);
+        pthread_mutex_unlock(&queue->lock);
+        highlight_trace_destroy(mytrace);
+    }
+
+    return NULL;
+}
+
+/**
+ * Highlight the files of the queue on *threads* threads
+ */
+static void tree_run(TreeQueue *queue, unsigned long threads)
+{
+    pthread_t *tids;
+    pthread_attr_t attr;
+    unsigned long i, started;
+
+    if (threads > queue->entries_len) {
+        threads = queue->entries_len;
+    }
+    started = 0;
+    if (NULL == (tids = mem_new_n(*tids, threads))) {
+        // no thread: the work is done below, by ourselves
+        threads = 0;
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, TREE_WORKER_STACK_SIZE);
+    for (i = 0; i < threads; i++) {
+        if (0 == pthread_create(&tids[started], &attr, tree_worker, queue)) {
+            ++started;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    if (0 == started && queue->entries_len > 0) {
+        // can't create any thread? Do the work ourselves (but it will fail too on a too small stack)
+        tree_worker(queue);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+}
+
+/**
+ * Compute a fingerprint of all the settings which affect the output:
+ * version of the library, formatter, its options, lexer options and forced
+ * lexers (-l)
+ */
+static void tree_config_fingerprint(const FormatterImplementation *fimp, char fingerprint[HASH128_HEX_SIZE])
+{
+    int o;
+    size_t i;
+    Hash128 h;
+    Iterator it;
+    LexerGroup *g;
+    Version version;
+    Hash128Context ctxt;
+    const char *name;
+
+    version_get(version);
+    // outputs of an other version of the library may differ
+    hash128_init(&ctxt, (uint64_t) version[0] << 16 | (uint64_t) version[1] << 8 | version[2]);
+    name = formatter_implementation_name(fimp);
+    hash128_update(&ctxt, name, strlen(name) + 1);
+    for (o = 0; o < COUNT; o++) {
+        for (i = 0; i < options[o].options_len; i++) {
+            hash128_update(&ctxt, options[o].options[i].name, strlen(options[o].options[i].name) + 1);
+            hash128_update(&ctxt, options[o].options[i].value, options[o].options[i].value_len + 1);
+        }
+        hash128_update(&ctxt, "", 1);
+    }
+    hashtable_to_iterator(&it, &lexers);
+    for (iterator_first(&it); iterator_is_valid(&it, NULL, &g); iterator_next(&it)) {
+        for (i = 0; i < g->count; i++) {
+            name = lexer_implementation_name(lexer_implementation(g->lexers[i]));
+            hash128_update(&ctxt, name, strlen(name) + 1);
+        }
+        hash128_update(&ctxt, "", 1);
+    }
+    iterator_close(&it);
+    hash128_final(&ctxt, &h);
+    hash128_to_hex(&h, fingerprint);
+}
+
+/**
+ * Highlight all files of the tree *srcdir* into *outdir*
+ *
+ * Each file srcdir/path is written to outdir/path.<formatter name>.
+ * A manifest of the processed files is kept in *outdir* so that files
+ * which haven't changed since the previous run are not highlighted again.
+ * Files with the same content (and lexers) are only highlighted once.
+ * Hidden directories (.git, ...) are skipped.
+ *
+ * @return false if at least one file failed
+ */
+static bool proctree(const char *srcdir, const char *outdir, const FormatterImplementation *fimp, unsigned long threads)
+{
+    FTS *fts;
+    FTSENT *p;
+    bool ret;
+    TreeQueue queue;
+    struct stat outst;
+    char *paths[] = { (char *) srcdir, NULL };
+    Manifest old, new;
+    size_t i, entries_size, highlighted, unchanged, duplicates;
+    char ext[64], manifest_path[PATH_MAX], config[HASH128_HEX_SIZE];
+
+    ret = true;
+    entries_size = highlighted = unchanged = duplicates = 0;
+    for (i = 0; i < ARRAY_SIZE(ext) - 1 && '\0' != formatter_implementation_name(fimp)[i]; i++) {
+        ext[i] = tolower((unsigned char) formatter_implementation_name(fimp)[i]);
+    }
+    ext[i] = '\0';
+    if (0 != mkdir(outdir, 0755) && EEXIST != errno) {
+        fprintf(stderr, "failed to create directory %s: %s\n", outdir, strerror(errno));
+        return false;
+    }
+    if (0 != stat(outdir, &outst)) {
+        fprintf(stderr, "can't stat %s: %s\n", outdir, strerror(errno));
+        return false;
+    }
+    if ((size_t) snprintf(manifest_path, sizeof(manifest_path), "%s/%s", outdir, MANIFEST_FILENAME) >= sizeof(manifest_path)) {
+        return false;
+    }
+    tree_config_fingerprint(fimp, config);
+    manifest_init(&old);
+    manifest_init(&new);
+    manifest_load(&old, manifest_path);
+    if (NULL == (fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, NULL))) {
+        fprintf(stderr, "can't fts_open %s: %s\n", srcdir, strerror(errno));
+        return false;
+    }
+    bzero(&queue, sizeof(queue));
+    // only the paths are collected here, the files are read by the workers
+    while (NULL != (p = fts_read(fts))) {
+        TreeEntry *entry;
+        const char *relpath;
+        ManifestEntry *e;
+        char outpath[PATH_MAX];
+
+        switch (p->fts_info) {
+            case FTS_DNR:
+            case FTS_ERR:
+                fprintf(stderr, "fts_read failed on %s: %s\n", p->fts_path, strerror(p->fts_errno));
+                ret = false;
+                continue;
+            case FTS_D:
+                if (p->fts_level > 0 && ('.' == *p->fts_name || (p->fts_statp->st_dev == outst.st_dev && p->fts_statp->st_ino == outst.st_ino))) {
+                    fts_set(fts, p, FTS_SKIP);
+                }
+                continue;
+            case FTS_F:
+                break;
+            default:
+                continue;
+        }
+        relpath = p->fts_path + strlen(srcdir);
+        while ('/' == *relpath) {
+            ++relpath;
+        }
+        if ('\0' == *relpath) {
+            // srcdir is a file
+            relpath = p->fts_name;
+        }
+        if ((size_t) snprintf(outpath, sizeof(outpath), "%s/%s.%s", outdir, relpath, ext) >= sizeof(outpath)) {
+            fprintf(stderr, "path too long for %s, skip\n", p->fts_path);
+            ret = false;
+            continue;
+        }
+        e = manifest_get(&old, relpath);
+        if (NULL != e && 0 == strcmp(e->config, config) && 0 == access(outpath, F_OK)) {
+            if (e->size == p->fts_statp->st_size && e->mtime == p->fts_statp->st_mtime) {
+                manifest_put(&new, relpath, e->size, e->mtime, &e->hash, e->lexer, config);
+                ++unchanged;
+                continue;
+            }
+        } else {
+            e = NULL;
+        }
+        entry = mem_new(*entry);
+        bzero(entry, sizeof(*entry));
+        entry->path = strdup(p->fts_path);
+        entry->relpath = strdup(relpath);
+        entry->outpath = strdup(outpath);
+        entry->size = p->fts_statp->st_size;
+        entry->mtime = p->fts_statp->st_mtime;
+        entry->previous = e;
+        if (queue.entries_len >= entries_size) {
+            entries_size = 0 == entries_size ? 64 : entries_size << 1;
+            queue.entries = realloc(queue.entries, entries_size * sizeof(*queue.entries));
+        }
+        queue.entries[queue.entries_len++] = entry;
+    }
+    fts_close(fts);
+
+    queue.fimp = fimp;
+    hashtable_init(&queue.dedup, 0, tree_entry_hash, tree_entry_equal, NULL, NULL, NULL);
+    pthread_mutex_init(&queue.lock, NULL);
+    tree_run(&queue, threads);
+    pthread_mutex_destroy(&queue.lock);
+    hashtable_destroy(&queue.dedup);
+
+    // only record files we successfully wrote so that failures are retried on the next run
+    for (i = 0; i < queue.entries_len; i++) {
+        TreeEntry *entry;
+
+        entry = queue.entries[i];
+        switch (entry->state) {
+            case TREE_UNCHANGED:
+                manifest_put(&new, entry->relpath, entry->size, entry->mtime, &entry->hash, entry->previous->lexer, config);
+                ++unchanged;
+                break;
+            case TREE_DUPLICATE:
+                if (TREE_HIGHLIGHTED != entry->same->state || !copy_output(entry->same->outpath, entry->outpath)) {
+                    ret = false;
+                    break;
+                }
+                manifest_put(&new, entry->relpath, entry->size, entry->mtime, &entry->hash, lexer_implementation_name(lexer_implementation(entry->group->lexers[0])), config);
+                ++duplicates;
+                break;
+            case TREE_HIGHLIGHTED:
+                manifest_put(&new, entry->relpath, entry->size, entry->mtime, &entry->hash, lexer_implementation_name(lexer_implementation(entry->group->lexers[0])), config);
+                ++highlighted;
+                break;
+            case TREE_SKIPPED:
+                break;
+            case TREE_FAILED:
+                ret = false;
+                break;
+        }
+    }
+    for (i = 0; i < queue.entries_len; i++) {
+        tree_entry_destroy(queue.entries[i]);
+    }
+    free(queue.entries);
+    if (!manifest_save(&new, manifest_path)) {
+        fprintf(stderr, "failed to write manifest %s\n", manifest_path);
+        ret = false;
+    }
+    if (vFlag) {
+        fprintf(stderr, "%zu highlighted, %zu duplicate(s), %zu unchanged\n", highlighted, duplicates, unchanged);
+    }
+    manifest_destroy(&old);
+    manifest_destroy(&new);
+
+    return ret;
+}
+
+/* ========== client (--client) mode ========== */
+
+/**
+ * Send a file to a server (--serve) and print the result
+ *
+ * The request carries the formatter (-f, else the one of the server), its options (-O), the filename
+ * as hint for the lexer, the lexers forced with -l (if any) and all the
+ * lexer options (-o), which apply to the top lexer.
+ *
+ * @return false on failure
+ */
+static bool client_procfile(int sfd, const char *filename, FILE *fp, const FormatterImplementation *fimp)
+{
+    bool ok, sendable;
+    size_t i;
+    LexerGroup *g;
+    String *buffer, *head;
+    char *body;
+    const char *message, *result;
+    size_t body_len, result_len;
+
+    ok = false;
+    body = NULL;
+    head = string_new();
+    if (NULL == (buffer = read_input(filename, fp))) {
+        goto failure;
+    }
+    sendable = NULL == fimp || request_header_append(head, "formatter", formatter_implementation_name(fimp));
+    if (0 != strcmp(filename, "-")) {
+        sendable &= request_header_append(head, "filename", filename);
+    }
+    if (NULL != (g = hashtable_first(&lexers))) {
+        for (i = 0; i < g->count; i++) {
+            sendable &= request_header_append(head, "lexer", lexer_implementation_name(lexer_implementation(g->lexers[i])));
+        }
+    }
+    for (i = 0; i < client_lexer_options.options_len; i++) {
+        sendable &= request_option_append(head, "lexer-option", client_lexer_options.options[i].name, client_lexer_options.options[i].value, client_lexer_options.options[i].value_len);
+    }
+    for (i = 0; i < options[FORMATTER].options_len; i++) {
+        sendable &= request_option_append(head, "formatter-option", options[FORMATTER].options[i].name, options[FORMATTER].options[i].value, options[FORMATTER].options[i].value_len);
+    }
+    if (!sendable) {
+        fprintf(stderr, "%s: a new line can't be sent to the server (in the filename or an option)\n", filename);
+        goto failure;
+    }
+    string_append_char(head, '\n');
+    if (!frame_write(sfd, head->ptr, head->len, buffer->ptr, buffer->len, 0) || !frame_read(sfd, &body, &body_len, 0)) {
+        fprintf(stderr, "%s: communication with server failed\n", filename);
+        goto failure;
+    }
+    if (RESPONSE_OK != response_parse(body, body_len, &message, &result, &result_len)) {
+        fprintf(stderr, "%s: %s\n", filename, message);
+        goto failure;
+    }
+    if (NULL != message) {
+        fprintf(stderr, "%s: partially highlighted (%s)\n", filename, message);
+    }
+    if (vFlag) {
+        fprintf(stdout, "%s:\n", filename);
+    }
+    ok = print_result(result, result_len);
+failure:
+    if (NULL != buffer) {
+        string_destroy(buffer);
+    }
+    string_destroy(head);
+    free(body);
+    if (stdin != fp) {
+        fclose(fp);
+    }
+
+    return ok;
 }
 
 static const char *type2string[] = {
@@ -289,13 +1001,67 @@ static void destroy_lexer_cb(void *ptr)
 }
 */
 
+static void print_lexer_stats_cb(const LexerImplementation *imp, const HighlightLexerStats *ls, void *data)
+{
+    bool *first;
+
+    first = (bool *) data;
+    fprintf(stderr, "%s\"%s\":{\"tokens\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"delegations\":%" PRIu64 ",\"time_ns\":%" PRIu64 "}", *first ? "" : ",", lexer_implementation_name(imp), ls->tokens, ls->bytes, ls->delegations, ls->time_ns);
+    *first = false;
+}
+
+/**
+ * Print the statistics (--stats), as JSON, on stderr
+ */
+static void print_stats(void)
+{
+    bool first;
+    HighlightStatsTotals totals;
+
+    first = true;
+    highlight_stats_totals(stats, &totals);
+    fprintf(
+        stderr,
+        "{\"documents\":%" PRIu64 ",\"bytes_in\":%" PRIu64 ",\"bytes_out\":%" PRIu64 ",\"tokens\":%" PRIu64 ",\"delegations\":%" PRIu64 ",\"flushes\":%" PRIu64 ",\"parser_fallbacks\":%" PRIu64 ",\"cursor_resets\":%" PRIu64 ",\"bytes_rescanned\":%" PRIu64 ",\"peak_buffer\":%" PRIu64 ",\"resyncs\":%" PRIu64 ",\"resync_misses\":%" PRIu64 ",\"time_ns\":%" PRIu64 ",\"format_ns\":%" PRIu64 ",\"lexers\":{",
+        totals.documents, totals.bytes_in, totals.bytes_out, totals.tokens, totals.delegations, totals.flushes, totals.parser_fallbacks, totals.cursor_resets, totals.bytes_rescanned, totals.peak_buffer, totals.resyncs, totals.resync_misses, totals.time_ns, totals.format_ns
+    );
+    highlight_stats_each_lexer(stats, print_lexer_stats_cb, &first);
+    fputs("}}\n", stderr);
+}
+
 static void on_exit_cb(void)
 {
     int o;
 
+    if (NULL != stats) {
+        print_stats();
+        highlight_stats_destroy(stats);
+    }
+    if (NULL != trace) {
+        FILE *fp;
+
+        if (NULL == (fp = fopen(trace_filename, "wb")) || !highlight_trace_write(trace, fp)) {
+            fprintf(stderr, "failed to write trace into %s\n", trace_filename);
+        }
+        if (NULL != fp) {
+            fclose(fp);
+        }
+        highlight_trace_destroy(trace);
+    }
+
+    if (NULL != cache) {
+        if (vFlag) {
+            HighlightCacheStats stats;
+
+            highlight_cache_stats(cache, &stats);
+            fprintf(stderr, "cache: %" PRIu64 " hit(s), %" PRIu64 " disk hit(s), %" PRIu64 " miss(es)\n", stats.hits, stats.disk_hits, stats.misses);
+        }
+        highlight_cache_destroy(cache);
+    }
     for (o = 0; o < COUNT; o++) {
         options_store_free(&options[o]);
     }
+    options_store_free(&client_lexer_options);
     hashtable_destroy(&lexers);
 }
 
@@ -305,7 +1071,9 @@ int main(int argc, char **argv)
     size_t i;
     LexerGroup *g;
     Formatter *fmt;
-    bool cFlag, eFlag;
+    bool ok, cFlag, eFlag;
+    unsigned long threads, lex_threads;
+    const char *srcdir, *outdir, *serve, *client;
     const FormatterImplementation *fimp;
 
     {
@@ -318,11 +1086,17 @@ int main(int argc, char **argv)
     }
     g = NULL;
     fmt = NULL;
-    fimp = termfmt;
+    fimp = NULL; // default to termfmt, once we know we are not a client (--client)
+    srcdir = outdir = serve = client = NULL;
+    ok = true;
     eFlag = cFlag = vFlag = false;
+    threads = (unsigned long) MAX(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+    // a single file is lexed on a single thread unless -j says otherwise
+    lex_threads = 1;
     for (o = 0; o < COUNT; o++) {
         options_store_init(&options[o]);
     }
+    options_store_init(&client_lexer_options);
     outputenc = encoding_stdout_get();
     hashtable_ascii_cs_init(&lexers, NULL, NULL, group_destroy);
     atexit(on_exit_cb);
@@ -439,6 +1213,7 @@ int main(int argc, char **argv)
              */
             case 'o':
                 options_store_add(&options[LEXER], optarg);
+                options_store_add(&client_lexer_options, optarg);
                 break;
             case 'O':
                 options_store_add(&options[FORMATTER], optarg);
@@ -466,6 +1241,52 @@ int main(int argc, char **argv)
             case 'e':
                 eFlag = true;
                 break;
+            case 'r':
+                srcdir = optarg;
+                break;
+            case 'd':
+                outdir = optarg;
+                break;
+            case 'C':
+                if (NULL != cache) {
+                    highlight_cache_destroy(cache);
+                }
+                if (NULL == (cache = highlight_cache_create(CACHE_MEMORY_SIZE, optarg))) {
+                    fprintf(stderr, "can't use %s as cache directory: %s\n", optarg, strerror(errno));
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_SERVE:
+                serve = optarg;
+                break;
+            case OPT_CLIENT:
+                client = optarg;
+                break;
+            case OPT_STATS:
+                if (NULL == stats) {
+                    stats = highlight_stats_create();
+                    highlight_stats_bind(stats);
+                }
+                break;
+            case OPT_TRACE:
+                trace_filename = optarg;
+                if (NULL == trace) {
+                    trace = highlight_trace_create(0);
+                    highlight_trace_bind(trace);
+                }
+                break;
+            case 'j':
+            {
+                char *endptr;
+
+                threads = strtoul(optarg, &endptr, 10);
+                if ('\0' != *endptr || 0 == threads) {
+                    fprintf(stderr, "invalid number of jobs '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                lex_threads = threads;
+                break;
+            }
             default:
                 usage();
         }
@@ -473,17 +1294,62 @@ int main(int argc, char **argv)
     argc -= optind;
     argv += optind;
 
-    fmt = formatter_create(fimp);
-    for (i = 0; i < options[FORMATTER].options_len; i++) {
-        if (0 != formatter_set_option_as_string(fmt, options[FORMATTER].options[i].name, options[FORMATTER].options[i].value, options[FORMATTER].options[i].value_len)) {
-            fprintf(stderr, "option '%s' rejected by %s formatter\n", options[FORMATTER].options[i].name, formatter_implementation_name(formatter_implementation(fmt)));
+    if (NULL != serve) {
+        if (NULL != client || NULL != srcdir || NULL != outdir || 0 != argc || eFlag) {
+            usage();
         }
+        return server_run(serve, NULL == fimp ? termfmt : fimp, threads, cache) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (NULL != client) {
+        int sfd;
+
+        if (NULL != srcdir || NULL != outdir || eFlag) {
+            usage();
+        }
+        if (-1 == (sfd = client_connect(client))) {
+            fprintf(stderr, "can't connect to %s: %s\n", client, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        if (0 == argc) {
+            ok = client_procfile(sfd, "-", stdin, fimp);
+        } else {
+            for (i = 0; i < (size_t) argc; i++) {
+                FILE *fp;
+
+                if (0 == strcmp(argv[i], "-")) {
+                    fp = stdin;
+                } else if (NULL == (fp = fopen(argv[i], "r"))) {
+                    fprintf(stderr, "unable to open '%s', skip\n", argv[i]);
+                    ok = false;
+                    continue;
+                }
+                ok &= client_procfile(sfd, argv[i], fp, fimp);
+            }
+        }
+        close(sfd);
+
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (NULL == fimp) {
+        fimp = termfmt;
+    }
+    // NOTE: also done in recursive mode to report rejected options once
+    fmt = formatter_create_with_options(fimp, true);
+    if (NULL != srcdir || NULL != outdir) {
+        if (NULL == srcdir || NULL == outdir || 0 != argc || eFlag) {
+            usage();
+        }
+        ok = proctree(srcdir, outdir, fimp, threads);
+        formatter_destroy(fmt);
+
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
     }
     {
         FILE *fp[argc + 1];
 
 #if defined(__OpenBSD__) && OpenBSD >= 201605
-        if (-1 == pledge("stdio rpath", NULL)) {
+        // the cache directory (--cache-dir) needs to be written
+        if (-1 == pledge(NULL == cache ? "stdio rpath" : "stdio rpath wpath cpath", NULL)) {
             perror("pledge");
         }
 #endif /* OpenBSD >= 5.9 */
@@ -509,7 +1375,10 @@ int main(int argc, char **argv)
                 }
             }
         }
-        CAP_ENTER();
+        // capability mode forbids to open the files of the cache directory (--cache-dir)
+        if (NULL == cache) {
+            CAP_ENTER();
+        }
         if (eFlag) {
             char *result;
 
@@ -518,13 +1387,13 @@ int main(int argc, char **argv)
             free(result);
         } else {
             if (0 == argc) {
-                procfile("-", fp[0], fmt);
+                ok = procfile("-", fp[0], fmt, lex_threads);
             } else {
                 char **p;
 
                 for (p = argv; 0 != argc--; ++p) {
                     if (NULL != fp[p - argv]) {
-                        procfile(*p, fp[p - argv], fmt);
+                        ok &= procfile(*p, fp[p - argv], fmt, lex_threads);
                     }
                 }
             }
@@ -532,5 +1401,5 @@ int main(int argc, char **argv)
     }
     formatter_destroy(fmt);
 
-    return EXIT_SUCCESS;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,1031 @@
+/**
+ * @file cli/bin/shallbench.c
+ * @brief throughput benchmark of every lexer × formatter pair
+ *
+ * The corpus of a lexer is built from the sources of the tests (.ssc files
+ * found in the directories given as arguments) which use it, completed by
+ * a deterministic generator of pseudo-code for this language (a generic
+ * one for lexers without dedicated fragments) up to the requested size.
+ * Two runs, on the same machine, with the same options, work on the same
+ * input.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <fts.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "cpp.h"
+#include "shall.h"
+#include "formatter.h"
+#include "xtring.h"
+#include "version.h"
+#include "allocations.h"
+
+#ifndef EUSAGE
+# define EUSAGE -2
+#endif /* !EUSAGE */
+
+#ifdef _MSC_VER
+extern char __progname[];
+#else
+extern char *__progname;
+#endif /* _MSC_VER */
+
+#define STERR(format, ...) \
+    fprintf(stderr, "[ ERR ] " format "\n", ## __VA_ARGS__)
+
+#define STWARN(format, ...) \
+    fprintf(stderr, "[ WARN ] " format "\n", ## __VA_ARGS__)
+
+#define DEFAULT_ITERATIONS 10
+#define DEFAULT_WARMUP 2
+#define DEFAULT_CORPUS_SIZE (256 * 1024)
+#define DEFAULT_THRESHOLD 10.0
+#define MAX_FILTERS 64
+
+static char optstr[] = "b:d:f:j:l:n:o:ps:t:vw:";
+
+static struct option long_options[] = {
+    { "baseline",   required_argument, NULL, 'b' },
+    { "documents",  required_argument, NULL, 'd' },
+    { "formatter",  required_argument, NULL, 'f' },
+    { "jobs",       required_argument, NULL, 'j' },
+    { "lexer",      required_argument, NULL, 'l' },
+    { "iterations", required_argument, NULL, 'n' },
+    { "output",     required_argument, NULL, 'o' },
+    { "pipelined",  no_argument,       NULL, 'p' },
+    { "size",       required_argument, NULL, 's' },
+    { "threshold",  required_argument, NULL, 't' },
+    { "verbose",    no_argument,       NULL, 'v' },
+    { "warmup",     required_argument, NULL, 'w' },
+    { NULL,         no_argument,       NULL, 0   }
+};
+
+static void usage(void)
+{
+    fprintf(
+        stderr,
+        "usage: %s [-%s] [directory of .ssc files ...]\n",
+        __progname,
+        optstr
+    );
+    exit(EUSAGE);
+}
+
+/* ========== corpora ========== */
+
+/**
+ * Fragments of code for a language. Placeholders: @i is replaced by an
+ * identifier, @n by a number and @w by a word.
+ */
+typedef struct {
+    const char *lexer;
+    const char *prologue;
+    const char *fragments[8];
+} Generator;
+
+static const Generator generators[] = {
+    { "C", NULL, {
+        "#include <@i.h>\n",
+        "#define @i @n\n",
+        "/* @w @w @w */\n",
+        "static const char *@i = \"@w @w\\n\";\n",
+        "int @i(int @i, const char *@i)\n{\n    return @i + @n;\n}\n",
+        "    for (@i = 0; @i < @n; @i++) {\n        @i[@i] = @i * @n.@n;\n    }\n",
+        NULL
+    } },
+    { "Python", NULL, {
+        "# @w @w @w\n",
+        "def @i(@i, @i=@n):\n    return @i + @i\n\n",
+        "class @i(object):\n    \"\"\"@w @w\"\"\"\n    @i = '@w'\n\n",
+        "for @i in range(@n):\n    print(@i, @n.@n)\n",
+        "@i = [@n, @n, '@w', None, True]\n",
+        NULL
+    } },
+    { "Javascript", NULL, {
+        "// @w @w\n",
+        "function @i(@i, @i) {\n    return @i + @n;\n}\n",
+        "var @i = { @i: '@w', @i: [@n, @n.@n], @i: null };\n",
+        "if (@i === @n) { @i.@i(\"@w\"); } else { @i = /@w+/g; }\n",
+        NULL
+    } },
+    { "PHP", "<?php\n", {
+        "// @w @w\n",
+        "function @i($@i, $@i = @n) {\n    return $@i . '@w';\n}\n",
+        "$@i = array('@i' => @n, '@w' => \"@w $@i\");\n",
+        "class @i extends @i {\n    public function @i() { return self::@i; }\n}\n",
+        NULL
+    } },
+    { "Ruby", NULL, {
+        "# @w @w\n",
+        "def @i(@i, @i = @n)\n  @i + @n\nend\n",
+        "@i = { :@i => '@w', @i: @n }\n",
+        "class @i < @i\n  attr_reader :@i\nend\n",
+        NULL
+    } },
+    { "Go", "package main\n\n", {
+        "// @w @w\n",
+        "func @i(@i int, @i string) int {\n\treturn @i + @n\n}\n",
+        "var @i = map[string]int{\"@w\": @n}\n",
+        NULL
+    } },
+    { "Lua", NULL, {
+        "-- @w @w\n",
+        "function @i(@i, @i)\n  return @i .. \"@w\"\nend\n",
+        "local @i = { @i = @n, '@w' }\n",
+        NULL
+    } },
+    { "Bash", "#!/bin/bash\n", {
+        "# @w @w\n",
+        "@i() {\n    echo \"@w $@i\" | grep -c @w\n}\n",
+        "export @i=@n\n",
+        "if [ -n \"$@i\" ]; then @i=$((@i + @n)); fi\n",
+        NULL
+    } },
+    { "CSS", NULL, {
+        "/* @w @w */\n",
+        ".@i #@i > @i:hover {\n    color: #@n;\n    margin: @npx @nem;\n}\n",
+        "@media screen and (max-width: @npx) { .@i { display: none; } }\n",
+        NULL
+    } },
+    { "JSON", "[\n", {
+        "{\"@i\": @n, \"@w\": [true, false, null, @n.@n], \"@i\": \"@w @w\"},\n",
+        NULL
+    } },
+    { "NDJSON", NULL, {
+        "{\"@i\": @n, \"@w\": [true, false, null, @n.@n], \"@i\": \"@w @w\"}\n",
+        "{\"@i\": \"@w\", \"@i\": {\"@i\": @n}}\n",
+        NULL
+    } },
+    { "MySQL", NULL, {
+        "-- @w @w\n",
+        "SELECT @i, @i FROM @i WHERE @i = @n AND @i LIKE '@w%';\n",
+        "INSERT INTO @i (@i, @i) VALUES (@n, '@w');\n",
+        "CREATE TABLE @i (@i INTEGER NOT NULL, @i VARCHAR(@n));\n",
+        NULL
+    } },
+    { "PostgreSQL", NULL, {
+        "-- @w @w\n",
+        "SELECT @i, @i FROM @i WHERE @i = @n AND @i LIKE '@w%';\n",
+        "INSERT INTO @i (@i, @i) VALUES (@n, '@w');\n",
+        "CREATE TABLE @i (@i INTEGER NOT NULL, @i VARCHAR(@n));\n",
+        NULL
+    } },
+    { "XML", "<?xml version=\"1.0\"?>\n", {
+        "<!-- @w @w -->\n",
+        "<@i @i=\"@w\">@w @w</@i>\n",
+        "<@i/>\n",
+        NULL
+    } },
+};
+
+static const Generator generic_generator = { NULL, NULL, {
+    "@w @w @w\n",
+    "@i @w = @n; \"@w\" (@i, @n.@n) # @w\n",
+    NULL
+} };
+
+static const char * const syllables[] = {
+    "foo", "bar", "baz", "qux", "data", "len", "ptr", "item", "node", "value", "count", "name"
+};
+
+static const char * const words[] = {
+    "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit", "sed", "do", "eiusmod", "tempor"
+};
+
+/**
+ * A xorshift generator: the corpora don't depend on the libc
+ */
+static uint32_t prng_next(uint32_t *state)
+{
+    uint32_t x;
+
+    x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return *state = x;
+}
+
+static void generate(String *buffer, const Generator *g, size_t size)
+{
+    uint32_t state;
+    size_t fragments_len;
+
+    state = 2463534242U;
+    for (fragments_len = 0; NULL != g->fragments[fragments_len]; fragments_len++)
+        ;
+    if (NULL != g->prologue) {
+        string_append_string(buffer, g->prologue);
+    }
+    while (buffer->len < size) {
+        const char *p;
+
+        for (p = g->fragments[prng_next(&state) % fragments_len]; '\0' != *p; p++) {
+            if ('@' == p[0] && 'i' == p[1]) {
+                uint32_t i, n;
+
+                n = 1 + prng_next(&state) % 3;
+                for (i = 0; i < n; i++) {
+                    if (0 != i) {
+                        string_append_char(buffer, '_');
+                    }
+                    string_append_string(buffer, syllables[prng_next(&state) % ARRAY_SIZE(syllables)]);
+                }
+                ++p;
+            } else if ('@' == p[0] && 'n' == p[1]) {
+                string_append_formatted(buffer, "%" PRIu32, prng_next(&state) % 10000);
+                ++p;
+            } else if ('@' == p[0] && 'w' == p[1]) {
+                string_append_string(buffer, words[prng_next(&state) % ARRAY_SIZE(words)]);
+                ++p;
+            } else {
+                string_append_char(buffer, *p);
+            }
+        }
+    }
+}
+
+typedef struct {
+    const char *ptr;
+    size_t len;
+} Document;
+
+typedef struct {
+    const LexerImplementation *imp;
+    String *corpus;
+    // what is highlighted: the whole corpus or a part of it per document (-d)
+    Document *documents;
+    size_t documents_len;
+    size_t bytes;
+} Corpus;
+
+static Corpus *corpora;
+static size_t corpora_len;
+
+static void corpus_add_cb(const LexerImplementation *imp, void *UNUSED(data))
+{
+    corpora[corpora_len].imp = imp;
+    corpora[corpora_len].corpus = string_new();
+    ++corpora_len;
+}
+
+static Corpus *corpus_for(const LexerImplementation *imp)
+{
+    size_t i;
+
+    for (i = 0; i < corpora_len; i++) {
+        if (imp == corpora[i].imp) {
+            return &corpora[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Check if line is the section delimiter "--<name>--"
+ */
+static bool is_section(const char *line, const char *name)
+{
+    size_t name_len;
+
+    name_len = strlen(name);
+    if ('-' != line[0] || '-' != line[1]) {
+        return false;
+    }
+    line += STR_LEN("--");
+    while (' ' == *line || '\t' == *line) {
+        ++line;
+    }
+    if (0 != strncmp(line, name, name_len)) {
+        return false;
+    }
+    line += name_len;
+    while (' ' == *line || '\t' == *line) {
+        ++line;
+    }
+
+    return '-' == line[0] && '-' == line[1] && ('\n' == line[2] || '\0' == line[2]);
+}
+
+/**
+ * Append the source of a test to the corpus of its (top) lexer
+ */
+static void corpus_add_test(const char *filename)
+{
+    FILE *fp;
+    char *line;
+    size_t line_size;
+    String *lexer, *source;
+    enum { PART_OTHER, PART_SOURCE, PART_LEXER } part;
+
+    line = NULL;
+    line_size = 0;
+    part = PART_OTHER;
+    if (NULL == (fp = fopen(filename, "r"))) {
+        STWARN("can't open %s: %s", filename, strerror(errno));
+        return;
+    }
+    lexer = string_new();
+    source = string_new();
+    while (-1 != getline(&line, &line_size, fp)) {
+        if ('-' == line[0] && '-' == line[1]) {
+            if (is_section(line, "SOURCE")) {
+                part = PART_SOURCE;
+                continue;
+            } else if (is_section(line, "LEXER")) {
+                part = PART_LEXER;
+                continue;
+            } else if (is_section(line, "TEST") || is_section(line, "EXPECT") || is_section(line, "FORMATTER")) {
+                part = PART_OTHER;
+                continue;
+            }
+        }
+        if (PART_SOURCE == part) {
+            string_append_string(source, line);
+        } else if (PART_LEXER == part && string_empty(lexer) && NULL == strchr(line, '=')) {
+            string_append_string(lexer, line);
+            string_chomp(lexer);
+        }
+    }
+    free(line);
+    fclose(fp);
+    if (!string_empty(lexer)) {
+        Corpus *c;
+        const LexerImplementation *imp;
+
+        if (0 == strcmp(lexer->ptr, "guess")) {
+            imp = lexer_implementation_guess(source->ptr, source->len);
+        } else {
+            imp = lexer_implementation_by_name(lexer->ptr);
+        }
+        if (NULL != imp && NULL != (c = corpus_for(imp))) {
+            string_append_string_len(c->corpus, source->ptr, source->len);
+        }
+    }
+    string_destroy(lexer);
+    string_destroy(source);
+}
+
+static bool strendswith(const char *string, size_t string_len, const char *suffix, size_t suffix_len)
+{
+    return string_len >= suffix_len && 0 == strcmp(string + string_len - suffix_len, suffix);
+}
+
+static void corpora_load(char **argv)
+{
+    FTS *fts;
+    FTSENT *p;
+
+    if (NULL == (fts = fts_open(argv, FTS_NOSTAT | FTS_NOCHDIR, NULL))) {
+        STERR("can't fts_open: %s", strerror(errno));
+        return;
+    }
+    while (NULL != (p = fts_read(fts))) {
+        switch (p->fts_info) {
+            case FTS_DNR:
+            case FTS_ERR:
+                STERR("fts_read failed on %s: %s", p->fts_path, strerror(p->fts_errno));
+                break;
+            case FTS_D:
+            case FTS_DP:
+                break;
+            case FTS_DC:
+                STWARN("recursive directory loop on %s", p->fts_path);
+                break;
+            default:
+                if (strendswith(p->fts_path, p->fts_pathlen, ".ssc", STR_LEN(".ssc"))) {
+                    corpus_add_test(p->fts_path);
+                }
+                break;
+        }
+    }
+    fts_close(fts);
+}
+
+/**
+ * Split the corpora into documents
+ *
+ * @param count 0 to make a single document of the whole corpus, else the
+ * number of documents to make, each of a single line of the corpus (the
+ * corpus is reused from its beginning when its end is reached)
+ */
+static void corpora_split(size_t count)
+{
+    size_t i, j;
+
+    for (i = 0; i < corpora_len; i++) {
+        Corpus *c;
+
+        c = &corpora[i];
+        c->bytes = 0;
+        if (0 == count) {
+            c->documents_len = 1;
+            c->documents = mem_new(*c->documents);
+            c->documents[0].ptr = c->corpus->ptr;
+            c->documents[0].len = c->bytes = c->corpus->len;
+        } else {
+            const char *p, *end;
+
+            c->documents_len = count;
+            c->documents = mem_new_n(*c->documents, count);
+            p = c->corpus->ptr;
+            end = c->corpus->ptr + c->corpus->len;
+            for (j = 0; j < count; j++) {
+                const char *eol;
+
+                if (p >= end) {
+                    p = c->corpus->ptr;
+                }
+                if (NULL == (eol = memchr(p, '\n', end - p))) {
+                    eol = end;
+                } else {
+                    ++eol;
+                }
+                c->documents[j].ptr = p;
+                c->bytes += c->documents[j].len = eol - p;
+                p = eol;
+            }
+        }
+    }
+}
+
+// lex and format on two threads (highlight_string_pipelined)
+static bool pipelined;
+
+// lex on this number of threads (highlight_string_parallel), -1 for no
+static int parallel = -1;
+
+static int count_write(const char *UNUSED(data), size_t data_len, void *user)
+{
+    *(size_t *) user += data_len;
+
+    return 0;
+}
+
+/**
+ * Highlight each document of a corpus
+ *
+ * @param output_bytes if not NULL, set to the total size of the results
+ *
+ * @return false if the highlighting of a document failed
+ */
+static bool highlight_documents(Corpus *c, Formatter *fmt, Lexer *lexer, size_t *output_bytes)
+{
+    size_t i;
+    bool ok;
+
+    ok = true;
+    if (NULL != output_bytes) {
+        *output_bytes = 0;
+    }
+    for (i = 0; i < c->documents_len; i++) {
+        char *dest;
+        size_t dest_len;
+
+        if (pipelined) {
+            HighlightSink sink = { count_write, &dest_len, 0 };
+
+            dest_len = 0;
+            ok &= 0 == highlight_string_pipelined(c->documents[i].ptr, c->documents[i].len, &sink, fmt, 1, &lexer, NULL, 0);
+        } else if (-1 != parallel) {
+            ok &= 0 == highlight_string_parallel(c->documents[i].ptr, c->documents[i].len, &dest, &dest_len, fmt, 1, &lexer, NULL, (unsigned) parallel, 0);
+            free(dest);
+        } else {
+            ok &= 0 == highlight_string(c->documents[i].ptr, c->documents[i].len, &dest, &dest_len, fmt, 1, &lexer);
+            free(dest);
+        }
+        if (NULL != output_bytes) {
+            *output_bytes += dest_len;
+        }
+    }
+
+    return ok;
+}
+
+static void corpora_complete(size_t size)
+{
+    size_t i, j;
+
+    for (i = 0; i < corpora_len; i++) {
+        const Generator *g;
+        const char *name;
+
+        g = &generic_generator;
+        name = lexer_implementation_name(corpora[i].imp);
+        for (j = 0; j < ARRAY_SIZE(generators); j++) {
+            if (0 == strcasecmp(name, generators[j].lexer)) {
+                g = &generators[j];
+                break;
+            }
+        }
+        generate(corpora[i].corpus, g, size);
+    }
+}
+
+/* ========== measures ========== */
+
+static size_t tokens_count;
+
+static int count_start_token(int UNUSED(token), String *UNUSED(out), FormatterData *UNUSED(data))
+{
+    return 0;
+}
+
+static int count_end_token(int UNUSED(token), String *UNUSED(out), FormatterData *UNUSED(data))
+{
+    return 0;
+}
+
+static int count_write_token(String *UNUSED(out), const char *UNUSED(token), size_t UNUSED(token_len), FormatterData *UNUSED(data))
+{
+    ++tokens_count;
+
+    return 0;
+}
+
+/**
+ * A formatter which only counts tokens
+ */
+static const FormatterImplementation countfmt = {
+    "Count",
+    "Count tokens, writes nothing",
+    formatter_implementation_default_get_option_ptr,
+    NULL,
+    NULL,
+    count_start_token,
+    count_end_token,
+    count_write_token,
+    NULL,
+    NULL,
+    NULL,
+    0,
+    NULL
+};
+
+typedef struct {
+    const char *lexer;
+    const char *formatter;
+    size_t bytes;
+    size_t tokens;
+    size_t output_bytes;
+    double median;
+    double p95;
+    double mbps;
+    double tps;
+    long allocations;
+    long peak_rss;
+} Result;
+
+typedef struct {
+    char *lexer;
+    char *formatter;
+    double mbps;
+} BaselineEntry;
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int double_cmp(const void *a, const void *b)
+{
+    double da, db;
+
+    da = *(const double *) a;
+    db = *(const double *) b;
+
+    return (da > db) - (da < db);
+}
+
+/**
+ * @return the peak resident set size of the process, in kilobytes
+ */
+static long peak_rss(void)
+{
+    struct rusage ru;
+
+    if (0 != getrusage(RUSAGE_SELF, &ru)) {
+        return -1;
+    }
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1024;
+#else
+    return ru.ru_maxrss;
+#endif /* __APPLE__ */
+}
+
+static void measure(Result *r, Corpus *c, const FormatterImplementation *fimp, size_t tokens, int iterations, int warmup)
+{
+    int i;
+    Lexer *lexer;
+    double *times;
+    Formatter *fmt;
+#ifdef WITH_ALLOCATION_COUNTING
+    size_t allocations_before;
+#endif /* WITH_ALLOCATION_COUNTING */
+
+    lexer = lexer_create(c->imp);
+    fmt = formatter_create(fimp);
+    times = malloc(sizeof(*times) * iterations);
+    for (i = 0; i < warmup; i++) {
+        highlight_documents(c, fmt, lexer, NULL);
+    }
+#ifdef WITH_ALLOCATION_COUNTING
+    allocations_before = allocations_count();
+#endif /* WITH_ALLOCATION_COUNTING */
+    for (i = 0; i < iterations; i++) {
+        double start;
+
+        start = now_ms();
+        highlight_documents(c, fmt, lexer, &r->output_bytes);
+        times[i] = now_ms() - start;
+    }
+#ifdef WITH_ALLOCATION_COUNTING
+    // do not count the allocation of dest made for the caller, it is a part of the result
+    r->allocations = (long) ((allocations_count() - allocations_before) / iterations - (pipelined ? 0 : c->documents_len));
+#else
+    r->allocations = -1;
+#endif /* WITH_ALLOCATION_COUNTING */
+    qsort(times, iterations, sizeof(*times), double_cmp);
+    r->lexer = lexer_implementation_name(c->imp);
+    r->formatter = formatter_implementation_name(fimp);
+    r->bytes = c->bytes;
+    r->tokens = tokens;
+    r->median = 0 == iterations % 2 ? (times[iterations / 2 - 1] + times[iterations / 2]) / 2 : times[iterations / 2];
+    r->p95 = times[(95 * iterations + 99) / 100 - 1];
+    r->mbps = 0.0 == r->median ? 0.0 : (r->bytes / (1024.0 * 1024.0)) / (r->median / 1000.0);
+    r->tps = 0.0 == r->median ? 0.0 : r->tokens / (r->median / 1000.0);
+    r->peak_rss = peak_rss();
+    free(times);
+    formatter_destroy(fmt);
+    lexer_destroy(lexer, NULL);
+}
+
+/* ========== reports ========== */
+
+static void results_to_json(String *buffer, const Result *results, size_t results_len, size_t size, size_t documents, int iterations, int warmup)
+{
+    size_t i;
+    Version v;
+    char version[VERSION_STRING_MAX_LENGTH];
+
+    version_get(v);
+    version_to_string(v, version, ARRAY_SIZE(version));
+    STRING_APPEND_STRING(buffer, "{\n    \"version\": ");
+    string_append_json_string(buffer, version);
+    string_append_formatted(buffer, ",\n    \"pipelined\": %s,\n    \"parallel\": %d,\n    \"corpus_size\": %zu,\n    \"documents\": %zu,\n    \"iterations\": %d,\n    \"warmup\": %d,\n    \"peak_rss_kb\": %ld,\n    \"results\": [\n", pipelined ? "true" : "false", parallel, size, documents, iterations, warmup, peak_rss());
+    // one result per line: that's what baseline_load expects
+    for (i = 0; i < results_len; i++) {
+        STRING_APPEND_STRING(buffer, "        {\"lexer\": ");
+        string_append_json_string(buffer, results[i].lexer);
+        STRING_APPEND_STRING(buffer, ", \"formatter\": ");
+        string_append_json_string(buffer, results[i].formatter);
+        string_append_formatted(
+            buffer,
+            ", \"bytes\": %zu, \"tokens\": %zu, \"output_bytes\": %zu, \"median_ms\": %.3f, \"p95_ms\": %.3f, \"mb_per_s\": %.3f, \"tokens_per_s\": %.0f, \"allocations\": ",
+            results[i].bytes, results[i].tokens, results[i].output_bytes, results[i].median, results[i].p95, results[i].mbps, results[i].tps
+        );
+        if (results[i].allocations < 0) {
+            STRING_APPEND_STRING(buffer, "null");
+        } else {
+            string_append_formatted(buffer, "%ld", results[i].allocations);
+        }
+        string_append_formatted(buffer, ", \"peak_rss_kb\": %ld}%s\n", results[i].peak_rss, i + 1 < results_len ? "," : "");
+    }
+    STRING_APPEND_STRING(buffer, "    ]\n}\n");
+}
+
+/**
+ * Find the value of a member in a line of JSON written by results_to_json
+ * (strings are not unescaped, it is not a JSON parser)
+ */
+static bool json_line_get(const char *line, const char *key, const char **value, size_t *value_len)
+{
+    const char *p;
+    char needle[64];
+
+    snprintf(needle, ARRAY_SIZE(needle), "\"%s\":", key);
+    if (NULL == (p = strstr(line, needle))) {
+        return false;
+    }
+    p += strlen(needle);
+    while (' ' == *p) {
+        ++p;
+    }
+    if ('"' == *p) {
+        *value = ++p;
+        *value_len = strcspn(p, "\"");
+    } else {
+        *value = p;
+        *value_len = strcspn(p, ",}\n");
+    }
+
+    return true;
+}
+
+static BaselineEntry *baseline_load(const char *filename, size_t *entries_len)
+{
+    FILE *fp;
+    char *line;
+    size_t line_size, entries_size;
+    BaselineEntry *entries;
+
+    line = NULL;
+    line_size = 0;
+    entries = NULL;
+    *entries_len = entries_size = 0;
+    if (NULL == (fp = fopen(filename, "r"))) {
+        STERR("can't open %s: %s", filename, strerror(errno));
+        return NULL;
+    }
+    while (-1 != getline(&line, &line_size, fp)) {
+        size_t lexer_len, formatter_len, mbps_len;
+        const char *lexer, *formatter, *mbps;
+
+        if (json_line_get(line, "lexer", &lexer, &lexer_len) && json_line_get(line, "formatter", &formatter, &formatter_len) && json_line_get(line, "mb_per_s", &mbps, &mbps_len)) {
+            if (*entries_len >= entries_size) {
+                entries_size = 0 == entries_size ? 64 : entries_size * 2;
+                entries = mem_renew(entries, *entries, entries_size);
+            }
+            entries[*entries_len].lexer = strndup(lexer, lexer_len);
+            entries[*entries_len].formatter = strndup(formatter, formatter_len);
+            entries[*entries_len].mbps = strtod(mbps, NULL);
+            ++*entries_len;
+        }
+    }
+    free(line);
+    fclose(fp);
+    if (0 == *entries_len) {
+        STERR("no result found in %s", filename);
+    }
+
+    return entries;
+}
+
+static void baseline_free(BaselineEntry *entries, size_t entries_len)
+{
+    size_t i;
+
+    for (i = 0; i < entries_len; i++) {
+        free(entries[i].lexer);
+        free(entries[i].formatter);
+    }
+    free(entries);
+}
+
+/**
+ * @return the number of pairs slower than baseline by more than threshold percents
+ */
+static size_t baseline_compare(const BaselineEntry *entries, size_t entries_len, const Result *results, size_t results_len, double threshold, int verbosity)
+{
+    size_t i, j, regressions;
+
+    regressions = 0;
+    for (i = 0; i < results_len; i++) {
+        for (j = 0; j < entries_len; j++) {
+            if (0 == strcmp(results[i].lexer, entries[j].lexer) && 0 == strcmp(results[i].formatter, entries[j].formatter)) {
+                double delta;
+
+                if (entries[j].mbps <= 0.0) {
+                    break;
+                }
+                delta = (results[i].mbps - entries[j].mbps) * 100.0 / entries[j].mbps;
+                if (delta < -threshold) {
+                    ++regressions;
+                    fprintf(stderr, "[ REGRESSION ] %s × %s: %.3f MB/s, baseline: %.3f MB/s (%+.1f%%)\n", results[i].lexer, results[i].formatter, results[i].mbps, entries[j].mbps, delta);
+                } else if (verbosity) {
+                    fprintf(stderr, "%s × %s: %.3f MB/s, baseline: %.3f MB/s (%+.1f%%)\n", results[i].lexer, results[i].formatter, results[i].mbps, entries[j].mbps, delta);
+                }
+                break;
+            }
+        }
+    }
+
+    return regressions;
+}
+
+static bool filtered(const char **filters, size_t filters_len, const char *name)
+{
+    size_t i;
+
+    if (0 == filters_len) {
+        return false;
+    }
+    for (i = 0; i < filters_len; i++) {
+        if (0 == strcasecmp(filters[i], name)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static const FormatterImplementation **formatters;
+static size_t formatters_len;
+
+static void formatter_add_cb(const FormatterImplementation *imp, void *UNUSED(data))
+{
+    formatters[formatters_len++] = imp;
+}
+
+int main(int argc, char **argv)
+{
+    Result *results;
+    unsigned long ul;
+    double threshold;
+    const char *output, *baseline;
+    int o, ret, iterations, warmup, verbosity;
+    const char *lexer_filters[MAX_FILTERS], *formatter_filters[MAX_FILTERS];
+    size_t i, j, size, documents, results_len, lexer_filters_len, formatter_filters_len;
+
+    ret = EXIT_SUCCESS;
+    verbosity = 0;
+    output = baseline = NULL;
+    documents = 0;
+    size = DEFAULT_CORPUS_SIZE;
+    warmup = DEFAULT_WARMUP;
+    iterations = DEFAULT_ITERATIONS;
+    threshold = DEFAULT_THRESHOLD;
+    lexer_filters_len = formatter_filters_len = 0;
+    while (-1 != (o = getopt_long(argc, argv, optstr, long_options, NULL))) {
+        switch (o) {
+            case 'b':
+                baseline = optarg;
+                break;
+            case 'd':
+                documents = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                if (formatter_filters_len >= ARRAY_SIZE(formatter_filters)) {
+                    usage();
+                }
+                if (NULL == formatter_implementation_by_name(optarg)) {
+                    STERR("there is no formatter named %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                formatter_filters[formatter_filters_len++] = optarg;
+                break;
+            case 'j':
+                ul = strtoul(optarg, NULL, 10);
+                if (ul > 256) {
+                    usage();
+                }
+                parallel = (int) ul;
+                break;
+            case 'l':
+                if (lexer_filters_len >= ARRAY_SIZE(lexer_filters)) {
+                    usage();
+                }
+                if (NULL == lexer_implementation_by_name(optarg)) {
+                    STERR("there is no lexer named %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                lexer_filters[lexer_filters_len++] = lexer_implementation_name(lexer_implementation_by_name(optarg));
+                break;
+            case 'n':
+            case 'w':
+                ul = strtoul(optarg, NULL, 10);
+                if (ul > 1000000 || ('n' == o && 0 == ul)) {
+                    usage();
+                }
+                *('n' == o ? &iterations : &warmup) = (int) ul;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'p':
+                pipelined = true;
+                break;
+            case 's':
+                if (0 == (size = strtoul(optarg, NULL, 10))) {
+                    usage();
+                }
+                break;
+            case 't':
+                if ((threshold = strtod(optarg, NULL)) < 0.0) {
+                    usage();
+                }
+                break;
+            case 'v':
+                ++verbosity;
+                break;
+            default:
+                usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    corpora = mem_new_n(*corpora, SHALL_LEXER_COUNT);
+    lexer_implementation_each(corpus_add_cb, NULL);
+    formatters = mem_new_n(*formatters, SHALL_FORMATTER_COUNT);
+    formatter_implementation_each(formatter_add_cb, NULL);
+    if (argc > 0) {
+        corpora_load(argv);
+    }
+    corpora_complete(size);
+    corpora_split(documents);
+
+    results_len = 0;
+    results = mem_new_n(*results, corpora_len * formatters_len);
+    for (i = 0; i < corpora_len; i++) {
+        size_t tokens;
+        Lexer *lexer;
+        Formatter *fmt;
+
+        if (filtered(lexer_filters, lexer_filters_len, lexer_implementation_name(corpora[i].imp))) {
+            continue;
+        }
+        // tokens don't depend on the formatter, count them once
+        lexer = lexer_create(corpora[i].imp);
+        fmt = formatter_create(&countfmt);
+        tokens_count = 0;
+        if (!highlight_documents(&corpora[i], fmt, lexer, NULL)) {
+            STWARN("%s lexer failed on its corpus", lexer_implementation_name(corpora[i].imp));
+        }
+        tokens = tokens_count;
+        formatter_destroy(fmt);
+        lexer_destroy(lexer, NULL);
+        for (j = 0; j < formatters_len; j++) {
+            Result *r;
+
+            if (filtered(formatter_filters, formatter_filters_len, formatter_implementation_name(formatters[j]))) {
+                continue;
+            }
+            r = &results[results_len++];
+            measure(r, &corpora[i], formatters[j], tokens, iterations, warmup);
+            if (NULL == output || 0 != strcmp(output, "-")) {
+                printf("%-12s %-10s %10.3f MB/s %14.0f tokens/s median %9.3f ms p95 %9.3f ms output %10zu bytes", r->lexer, r->formatter, r->mbps, r->tps, r->median, r->p95, r->output_bytes);
+                if (r->allocations >= 0) {
+                    printf(" %8ld allocs", r->allocations);
+                }
+                printf("\n");
+                fflush(stdout);
+            }
+        }
+    }
+    if (NULL == output || 0 != strcmp(output, "-")) {
+        printf("peak RSS: %ld kB\n", peak_rss());
+    }
+
+    if (NULL != output) {
+        FILE *fp;
+        String *buffer;
+
+        buffer = string_new();
+        results_to_json(buffer, results, results_len, size, documents, iterations, warmup);
+        if (0 == strcmp(output, "-")) {
+            fp = stdout;
+        } else if (NULL == (fp = fopen(output, "w"))) {
+            STERR("can't open %s: %s", output, strerror(errno));
+            ret = EXIT_FAILURE;
+        }
+        if (NULL != fp) {
+            fwrite(buffer->ptr, 1, buffer->len, fp);
+            if (stdout != fp) {
+                fclose(fp);
+            }
+        }
+        string_destroy(buffer);
+    }
+    if (NULL != baseline) {
+        size_t entries_len;
+        BaselineEntry *entries;
+
+        if (NULL == (entries = baseline_load(baseline, &entries_len))) {
+            ret = EXIT_FAILURE;
+        } else {
+            if (baseline_compare(entries, entries_len, results, results_len, threshold, verbosity) > 0) {
+                ret = EXIT_FAILURE;
+            }
+            baseline_free(entries, entries_len);
+        }
+    }
+
+    for (i = 0; i < corpora_len; i++) {
+        string_destroy(corpora[i].corpus);
+        free(corpora[i].documents);
+    }
+    free(corpora);
+    free(formatters);
+    free(results);
+
+    return ret;
+}
@@ -0,0 +1,617 @@
+/**
+ * @file cli/bin/shallfuzz.c
+ * @brief fuzzer of the lexers for super-linear (pathological) performances
+ *
+ * The work done by a lexer on an input is measured by deterministic
+ * counters: tokens produced, bytes rescanned after a move backward of the
+ * cursor (see HighlightStats) and, if shall is built with the PROFILING
+ * option, transitions between the states of the re2c automatons. Each
+ * input is repeated to reach SCALE_MIN_BYTES, then SCALE_RATIO times
+ * more: a linear lexer does about SCALE_RATIO times more work. The
+ * input is flagged when the exponent of the growth of the work exceeds a
+ * threshold (1.5 by default) or when the budget of the highlighting is
+ * exhausted.
+ *
+ * Built with WITH_LIBFUZZER (-fsanitize=fuzzer), this file provides the
+ * LLVMFuzzerTestOneInput entry point: the first byte of the input selects
+ * the lexer, the rest is the input to tokenize, and a flagged input aborts
+ * so libFuzzer saves it.
+ *
+ * Else it is a standalone program which checks the given files (-F for the
+ * test cases written by libFuzzer) and, with -n, mutates them (or an empty
+ * input) at random in search of new pathological inputs. The flagged inputs
+ * can be minimized (-m) and written (-o) as test cases for shalltest.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <ctype.h>
+
+#include "cpp.h"
+#include "shall.h"
+#include "formatter.h"
+#include "stats.h"
+#include "profile.h"
+#include "xtring.h"
+
+#ifndef EUSAGE
+# define EUSAGE -2
+#endif /* !EUSAGE */
+
+#ifdef _MSC_VER
+extern char __progname[];
+#else
+extern char *__progname;
+#endif /* _MSC_VER */
+
+#define STERR(format, ...) \
+    fprintf(stderr, "[ ERR ] " format "\n", ## __VA_ARGS__)
+
+#define STWARN(format, ...) \
+    fprintf(stderr, "[ WARN ] " format "\n", ## __VA_ARGS__)
+
+// the input is repeated to reach at least SCALE_MIN_BYTES, then SCALE_RATIO times more
+#define SCALE_MIN_BYTES 1024
+#define SCALE_RATIO 4
+#define SCALE(input_len) \
+    ((SCALE_MIN_BYTES + (input_len) - 1) / (input_len))
+#define DEFAULT_EXPONENT 1.5
+// below this amount of work, the constant costs dominate: never flag
+#define MIN_WORK 256
+#define MAX_INPUT_LEN 4096
+// per byte of input, far beyond what any lexer needs
+#define MAX_TOKENS_PER_BYTE 64
+#define TIMEOUT_MS 10000
+#define MAX_CORPUS 256
+// minimum speed required by the test cases (see the --PERF-- section of shalltest),
+// about a tenth of the one of a lexer on an input made of small tokens
+#define CASE_MIN_SPEED 0.005
+
+static int null_start_token(int UNUSED(token), String *UNUSED(out), FormatterData *UNUSED(data))
+{
+    return 0;
+}
+
+static int null_end_token(int UNUSED(token), String *UNUSED(out), FormatterData *UNUSED(data))
+{
+    return 0;
+}
+
+static int null_write_token(String *UNUSED(out), const char *UNUSED(token), size_t UNUSED(token_len), FormatterData *UNUSED(data))
+{
+    return 0;
+}
+
+/**
+ * A formatter which writes nothing
+ */
+static const FormatterImplementation nullfmt = {
+    "Null",
+    "Writes nothing",
+    formatter_implementation_default_get_option_ptr,
+    NULL,
+    NULL,
+    null_start_token,
+    null_end_token,
+    null_write_token,
+    NULL,
+    NULL,
+    NULL,
+    0,
+    NULL
+};
+
+static const LexerImplementation **imps;
+static size_t imps_len;
+static Formatter *fmt;
+static HighlightStats *stats;
+static String *scaled;
+static double max_exponent = DEFAULT_EXPONENT;
+
+static void imp_add_cb(const LexerImplementation *imp, void *UNUSED(data))
+{
+    imps[imps_len++] = imp;
+}
+
+static void setup(void)
+{
+    if (NULL == imps) {
+        imps = mem_new_n(*imps, SHALL_LEXER_COUNT);
+        lexer_implementation_each(imp_add_cb, NULL);
+        fmt = formatter_create(&nullfmt);
+        stats = highlight_stats_create();
+        highlight_stats_bind(stats);
+        scaled = string_new();
+    }
+}
+
+static void transitions_cb(const LexerProfileEntry *entry, void *data)
+{
+    if (0 == entry->line) {
+        *((uint64_t *) data) += entry->hits;
+    }
+}
+
+/**
+ * Measure the work of a lexer on an input repeated *scale* times
+ *
+ * @return the work, UINT64_MAX if the budget was exhausted
+ */
+static uint64_t work(const LexerImplementation *imp, const char *input, size_t input_len, size_t scale)
+{
+    int ret;
+    size_t i;
+    char *dest;
+    Lexer *lexer;
+    uint64_t transitions;
+    HighlightBudget budget;
+    HighlightStatsTotals totals;
+
+    string_truncate(scaled);
+    for (i = 0; i < scale; i++) {
+        string_append_string_len(scaled, input, input_len);
+    }
+    bzero(&budget, sizeof(budget));
+    budget.timeout = TIMEOUT_MS;
+    budget.max_tokens = scaled->len * MAX_TOKENS_PER_BYTE + MIN_WORK;
+    highlight_stats_reset(stats);
+    lexer_profile_reset();
+    lexer = lexer_create(imp);
+    ret = highlight_string_with_budget(scaled->ptr, scaled->len, &dest, NULL, fmt, 1, &lexer, &budget);
+    free(dest);
+    lexer_destroy(lexer, NULL);
+    if (HIGHLIGHT_TIMEOUT == ret || HIGHLIGHT_MAX_TOKENS_EXCEEDED == ret) {
+        return UINT64_MAX;
+    }
+    highlight_stats_totals(stats, &totals);
+    transitions = 0;
+    lexer_profile_each(transitions_cb, &transitions);
+
+    return totals.tokens + totals.bytes_rescanned + transitions;
+}
+
+/**
+ * Estimate how the work of a lexer grows with the size of the input
+ *
+ * @param exponent set to the exponent of the growth (1 for linear, INFINITY
+ * if the budget was exhausted)
+ *
+ * @return true if it exceeds max_exponent
+ */
+static bool pathological(const LexerImplementation *imp, const char *input, size_t input_len, double *exponent)
+{
+    size_t scale;
+    uint64_t small, large;
+
+    *exponent = 1.0;
+    if (0 == input_len) {
+        return false;
+    }
+    scale = SCALE(input_len);
+    if (UINT64_MAX == (small = work(imp, input, input_len, scale)) || UINT64_MAX == (large = work(imp, input, input_len, scale * SCALE_RATIO))) {
+        *exponent = INFINITY;
+        return true;
+    }
+    if (0 == small || large < MIN_WORK) {
+        return false;
+    }
+    *exponent = log((double) large / small) / log((double) SCALE_RATIO);
+
+    return *exponent > max_exponent;
+}
+
+static void report(const LexerImplementation *imp, size_t input_len, double exponent, const char *origin)
+{
+    fprintf(stderr, "[ SLOW ] %s: work grows as n^%.2f on %s (%zu bytes)\n", lexer_implementation_name(imp), exponent, origin, input_len);
+}
+
+#ifdef WITH_LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    double exponent;
+    const LexerImplementation *imp;
+
+    if (size < 1 || size > MAX_INPUT_LEN) {
+        return 0;
+    }
+    setup();
+    imp = imps[data[0] % imps_len];
+    if (pathological(imp, (const char *) data + 1, size - 1, &exponent)) {
+        report(imp, size - 1, exponent, "the current input");
+        abort();
+    }
+
+    return 0;
+}
+#else
+static char optstr[] = "e:Fl:mn:o:s:";
+
+static struct option long_options[] = {
+    { "exponent",  required_argument, NULL, 'e' },
+    { "libfuzzer", no_argument,       NULL, 'F' },
+    { "lexer",     required_argument, NULL, 'l' },
+    { "minimize",  no_argument,       NULL, 'm' },
+    { "runs",      required_argument, NULL, 'n' },
+    { "output",    required_argument, NULL, 'o' },
+    { "seed",      required_argument, NULL, 's' },
+    { NULL,        no_argument,       NULL, 0   }
+};
+
+static void usage(void)
+{
+    fprintf(
+        stderr,
+        "usage: %s [-%s] [file ...]\n",
+        __progname,
+        optstr
+    );
+    exit(EUSAGE);
+}
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+/**
+ * xorshift64*: deterministic for a given seed
+ */
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * Fragments which open or close constructs in a lot of languages
+ */
+static const char * const dictionary[] = {
+    "\"", "'", "`", "\\", "\n", "\r\n", " ", "\t", "#", "//", "/*", "*/", "<!--", "-->",
+    "<?php", "?>", "<%", "%>", "<<<EOT\n", "EOT;\n", "${", "#{", "{{", "}}", "{%", "%}",
+    "'''", "\"\"\"", "<![CDATA[", "]]>", "<", ">", "(", ")", "[", "]", "{", "}",
+    "$", "@", "=", "0x", "1e", "--", "\\\n", "<script>", "</script>", "<style>", ";",
+};
+
+/**
+ * Apply a random mutation to an input
+ *
+ * @return its new length
+ */
+static size_t mutate(char *input, size_t input_len)
+{
+    size_t offset, len;
+
+    offset = 0 == input_len ? 0 : rng() % input_len;
+    switch (0 == input_len ? 0 : rng() % 4) {
+        case 0: // insert a fragment
+        {
+            const char *fragment;
+
+            fragment = dictionary[rng() % ARRAY_SIZE(dictionary)];
+            len = strlen(fragment);
+            if (input_len + len <= MAX_INPUT_LEN) {
+                memmove(input + offset + len, input + offset, input_len - offset);
+                memcpy(input + offset, fragment, len);
+                input_len += len;
+            }
+            break;
+        }
+        case 1: // duplicate a slice
+            len = 1 + rng() % MIN(input_len - offset, 64U);
+            if (input_len + len <= MAX_INPUT_LEN) {
+                memmove(input + offset + len, input + offset, input_len - offset);
+                input_len += len;
+            }
+            break;
+        case 2: // remove a slice
+            len = 1 + rng() % MIN(input_len - offset, 16U);
+            memmove(input + offset, input + offset + len, input_len - offset - len);
+            input_len -= len;
+            break;
+        case 3: // replace a byte
+            input[offset] = (char) (' ' + rng() % ('~' - ' ' + 1));
+            break;
+    }
+
+    return input_len;
+}
+
+/**
+ * Remove chunks of a flagged input, as long as it stays flagged
+ *
+ * @return the new length of the input
+ */
+static size_t minimize(const LexerImplementation *imp, char *input, size_t input_len, double *exponent)
+{
+    size_t chunk, offset;
+    char candidate[MAX_INPUT_LEN];
+
+    for (chunk = input_len / 2; chunk >= 1; chunk /= 2) {
+        for (offset = 0; offset + chunk <= input_len; ) {
+            double e;
+
+            memcpy(candidate, input, offset);
+            memcpy(candidate + offset, input + offset + chunk, input_len - offset - chunk);
+            if (pathological(imp, candidate, input_len - chunk, &e)) {
+                input_len -= chunk;
+                memcpy(input, candidate, input_len);
+                *exponent = e;
+            } else {
+                offset += chunk;
+            }
+        }
+    }
+
+    return input_len;
+}
+
+static uint32_t fnv1a(const char *input, size_t input_len)
+{
+    size_t i;
+    uint32_t hash;
+
+    for (hash = 2166136261U, i = 0; i < input_len; i++) {
+        hash = (hash ^ (unsigned char) input[i]) * 16777619U;
+    }
+
+    return hash;
+}
+
+/**
+ * Write a flagged input as a test case for shalltest: its source is the
+ * input repeated as for the larger of the measures, so it stays slow until
+ * the lexer is fixed, its expected result the one of the plain formatter
+ * and it requires a minimum speed
+ *
+ * @return false if the input can't be represented in the format of the
+ * test cases or the file can't be written
+ */
+static bool write_case(const char *directory, const LexerImplementation *imp, const char *input, size_t input_len, double exponent)
+{
+    FILE *fp;
+    size_t i;
+    Lexer *lexer;
+    Formatter *plain;
+    String *source;
+    char *result, *p;
+    size_t result_len;
+    char path[4096], name[128];
+
+    // a NUL or a line starting with "--" (which could be taken for a section) can't be written
+    if (NULL != memchr(input, '\0', input_len) || (input_len >= STR_LEN("--") && 0 == memcmp(input, "--", STR_LEN("--")))) {
+        return false;
+    }
+    for (i = 0; i + STR_LEN("\n--") <= input_len; i++) {
+        if (0 == memcmp(input + i, "\n--", STR_LEN("\n--"))) {
+            return false;
+        }
+    }
+    snprintf(name, ARRAY_SIZE(name), "%s", lexer_implementation_name(imp));
+    for (p = name; '\0' != *p; p++) {
+        *p = tolower((unsigned char) *p);
+    }
+    snprintf(path, ARRAY_SIZE(path), "%s/%s_%08" PRIx32 ".ssc", directory, name, fnv1a(input, input_len));
+    source = string_new();
+    for (i = 0; i < SCALE(input_len) * SCALE_RATIO; i++) {
+        string_append_string_len(source, input, input_len);
+    }
+    // shalltest removes the final new line of the sections
+    string_chomp(source);
+    if (source->len > 0 && '\r' == source->ptr[source->len - 1]) {
+        string_destroy(source);
+        return false;
+    }
+    lexer = lexer_create(imp);
+    plain = formatter_create(plainfmt);
+    highlight_string(source->ptr, source->len, &result, &result_len, plain, 1, &lexer);
+    formatter_destroy(plain);
+    lexer_destroy(lexer, NULL);
+    if (NULL != (fp = fopen(path, "w"))) {
+        fprintf(fp, "--TEST--\n%s: linear lexing (found by shallfuzz, work grew as n^%.2f)\n", lexer_implementation_name(imp), exponent);
+        fprintf(fp, "--LEXER--\n%s\n--PERF--\nmin_speed=%g\n--SOURCE--\n", lexer_implementation_name(imp), CASE_MIN_SPEED);
+        fwrite(source->ptr, 1, source->len, fp);
+        fputs("\n--EXPECT--\n", fp);
+        fwrite(result, 1, result_len, fp);
+        fputs("\n", fp);
+        fclose(fp);
+        printf("%s\n", path);
+    }
+    free(result);
+    string_destroy(source);
+
+    return NULL != fp;
+}
+
+typedef struct {
+    char *input;
+    size_t input_len;
+} CorpusEntry;
+
+/**
+ * Handle a flagged input: report, minimize and write it
+ */
+static void flagged(const LexerImplementation *imp, char *input, size_t input_len, double exponent, const char *origin, bool minimization, const char *directory)
+{
+    report(imp, input_len, exponent, origin);
+    if (minimization && isfinite(exponent)) {
+        input_len = minimize(imp, input, input_len, &exponent);
+        report(imp, input_len, exponent, "the minimized input");
+    }
+    if (NULL != directory && !write_case(directory, imp, input, input_len, exponent)) {
+        STWARN("can't write the input as a test case into %s", directory);
+    }
+}
+
+/**
+ * Read a whole file, truncated to MAX_INPUT_LEN
+ *
+ * @return false on failure
+ */
+static bool read_input(const char *filename, char *input, size_t *input_len)
+{
+    FILE *fp;
+
+    if (NULL == (fp = fopen(filename, "rb"))) {
+        return false;
+    }
+    *input_len = fread(input, 1, MAX_INPUT_LEN, fp);
+    fclose(fp);
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int o, ret;
+    size_t i, j;
+    unsigned long runs;
+    const char *directory;
+    bool fFlag, mFlag, *found;
+    const LexerImplementation *forced;
+    CorpusEntry corpus[MAX_CORPUS];
+    size_t corpus_len;
+
+    ret = EXIT_SUCCESS;
+    runs = 0;
+    forced = NULL;
+    directory = NULL;
+    fFlag = mFlag = false;
+    while (-1 != (o = getopt_long(argc, argv, optstr, long_options, NULL))) {
+        switch (o) {
+            case 'e':
+                if ((max_exponent = strtod(optarg, NULL)) <= 1.0) {
+                    usage();
+                }
+                break;
+            case 'F':
+                fFlag = true;
+                break;
+            case 'l':
+                if (NULL == (forced = lexer_implementation_by_name(optarg))) {
+                    STERR("there is no lexer named %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'm':
+                mFlag = true;
+                break;
+            case 'n':
+                runs = strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                directory = optarg;
+                mFlag = true;
+                break;
+            case 's':
+                rng_state = strtoull(optarg, NULL, 10) | 1;
+                break;
+            default:
+                usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    setup();
+    found = mem_new_n0(*found, imps_len);
+    corpus_len = 0;
+    // check the given inputs, with all lexers unless one is forced (or given by the first byte with -F)
+    for (o = 0; o < argc; o++) {
+        size_t input_len;
+        char input[MAX_INPUT_LEN];
+
+        if (!read_input(argv[o], input, &input_len)) {
+            STERR("can't read %s: %s", argv[o], strerror(errno));
+            ret = EXIT_FAILURE;
+            continue;
+        }
+        for (i = 0; i < imps_len; i++) {
+            double exponent;
+            const char *p;
+            size_t p_len;
+
+            p = input;
+            p_len = input_len;
+            if (fFlag) {
+                if (0 == input_len || i != (unsigned char) input[0] % imps_len) {
+                    continue;
+                }
+                ++p;
+                --p_len;
+            } else if (NULL != forced && forced != imps[i]) {
+                continue;
+            }
+            if (pathological(imps[i], p, p_len, &exponent)) {
+                char copy[MAX_INPUT_LEN];
+
+                memcpy(copy, p, p_len);
+                flagged(imps[i], copy, p_len, exponent, argv[o], mFlag, directory);
+                found[i] = true;
+                ret = EXIT_FAILURE;
+            }
+        }
+        if (corpus_len < ARRAY_SIZE(corpus)) {
+            corpus[corpus_len].input = malloc(MAX_INPUT_LEN);
+            memcpy(corpus[corpus_len].input, fFlag && input_len > 0 ? input + 1 : input, corpus[corpus_len].input_len = fFlag && input_len > 0 ? input_len - 1 : input_len);
+            ++corpus_len;
+        }
+    }
+    if (runs > 0 && 0 == corpus_len) {
+        corpus[0].input = malloc(MAX_INPUT_LEN);
+        corpus[0].input_len = 0;
+        corpus_len = 1;
+    }
+    // mutate the corpus at random, an input which makes a lexer work more joins it
+    for (j = 0; j < runs; j++) {
+        double exponent;
+        size_t input_len, mutations;
+        const LexerImplementation *imp;
+        char input[MAX_INPUT_LEN];
+        CorpusEntry *parent;
+
+        i = NULL == forced ? rng() % imps_len : 0;
+        imp = NULL == forced ? imps[i] : forced;
+        if (NULL != forced) {
+            for (i = 0; imps[i] != forced; i++)
+                ;
+        }
+        if (found[i]) {
+            continue;
+        }
+        parent = &corpus[rng() % corpus_len];
+        memcpy(input, parent->input, input_len = parent->input_len);
+        for (mutations = 1 + rng() % 4; mutations > 0; mutations--) {
+            input_len = mutate(input, input_len);
+        }
+        if (pathological(imp, input, input_len, &exponent)) {
+            char origin[64];
+
+            snprintf(origin, ARRAY_SIZE(origin), "run #%zu", j);
+            flagged(imp, input, input_len, exponent, origin, mFlag, directory);
+            found[i] = true;
+            ret = EXIT_FAILURE;
+        } else if (exponent > 1.05 && corpus_len < ARRAY_SIZE(corpus)) {
+            corpus[corpus_len].input = malloc(MAX_INPUT_LEN);
+            memcpy(corpus[corpus_len].input, input, corpus[corpus_len].input_len = input_len);
+            ++corpus_len;
+        }
+    }
+    for (i = 0; i < corpus_len; i++) {
+        free(corpus[i].input);
+    }
+    free(found);
+    free(imps);
+    formatter_destroy(fmt);
+    highlight_stats_destroy(stats);
+    string_destroy(scaled);
+
+    return ret;
+}
+#endif /* WITH_LIBFUZZER */
@@ -0,0 +1,370 @@
+/**
+ * @file cli/bin/shallprof.c
+ * @brief per rule profile of the lexers on given files
+ *
+ * Requires shall to be built with the PROFILING option (cmake -DPROFILING=ON).
+ *
+ * The files are tokenized (and nothing is written), then, for each lexer,
+ * its rules are ranked by the number of times they matched: hits, share of
+ * the hits of the lexer, bytes matched and time spent in the calls to the
+ * lexer which ended on this rule. The most hit states of the generated
+ * code can be reported too.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "cpp.h"
+#include "shall.h"
+#include "formatter.h"
+#include "profile.h"
+#include "xtring.h"
+
+#ifndef EUSAGE
+# define EUSAGE -2
+#endif /* !EUSAGE */
+
+#ifdef _MSC_VER
+extern char __progname[];
+#else
+extern char *__progname;
+#endif /* _MSC_VER */
+
+#define STERR(format, ...) \
+    fprintf(stderr, "[ ERR ] " format "\n", ## __VA_ARGS__)
+
+#define STWARN(format, ...) \
+    fprintf(stderr, "[ WARN ] " format "\n", ## __VA_ARGS__)
+
+#define DEFAULT_LIMIT 20
+
+static char optstr[] = "l:n:r:St";
+
+static struct option long_options[] = {
+    { "lexer",   required_argument, NULL, 'l' },
+    { "limit",   required_argument, NULL, 'n' },
+    { "repeat",  required_argument, NULL, 'r' },
+    { "states",  no_argument,       NULL, 'S' },
+    { "time",    no_argument,       NULL, 't' },
+    { NULL,      no_argument,       NULL, 0   }
+};
+
+static void usage(void)
+{
+    fprintf(
+        stderr,
+        "usage: %s [-%s] file ...\n",
+        __progname,
+        optstr
+    );
+    exit(EUSAGE);
+}
+
+static int null_start_token(int UNUSED(token), String *UNUSED(out), FormatterData *UNUSED(data))
+{
+    return 0;
+}
+
+static int null_end_token(int UNUSED(token), String *UNUSED(out), FormatterData *UNUSED(data))
+{
+    return 0;
+}
+
+static int null_write_token(String *UNUSED(out), const char *UNUSED(token), size_t UNUSED(token_len), FormatterData *UNUSED(data))
+{
+    return 0;
+}
+
+/**
+ * A formatter which writes nothing
+ */
+static const FormatterImplementation nullfmt = {
+    "Null",
+    "Writes nothing",
+    formatter_implementation_default_get_option_ptr,
+    NULL,
+    NULL,
+    null_start_token,
+    null_end_token,
+    null_write_token,
+    NULL,
+    NULL,
+    NULL,
+    0,
+    NULL
+};
+
+typedef struct {
+    // the name of the file of the lexer, without directory nor extension
+    char stem[64];
+    LexerProfileEntry entry;
+} Entry;
+
+#define IS_STATE(e) \
+    (0 == (e)->entry.line)
+
+typedef struct {
+    Entry *entries;
+    size_t entries_len;
+    size_t entries_size;
+} Profile;
+
+static void entry_add_cb(const LexerProfileEntry *entry, void *data)
+{
+    Entry *e;
+    Profile *profile;
+    const char *basename, *dot;
+
+    profile = (Profile *) data;
+    if (profile->entries_len >= profile->entries_size) {
+        profile->entries_size = 0 == profile->entries_size ? 256 : profile->entries_size * 2;
+        profile->entries = realloc(profile->entries, profile->entries_size * sizeof(*profile->entries));
+    }
+    e = &profile->entries[profile->entries_len++];
+    e->entry = *entry;
+    basename = NULL == (basename = strrchr(entry->file, '/')) ? entry->file : basename + 1;
+    dot = strrchr(basename, '.');
+    snprintf(e->stem, ARRAY_SIZE(e->stem), "%.*s", (int) (NULL == dot ? strlen(basename) : (size_t) (dot - basename)), basename);
+}
+
+/**
+ * Sort by lexer then by rule (by line) or state
+ */
+static int entry_by_site_cmp(const void *a, const void *b)
+{
+    int diff;
+    const Entry *ea, *eb;
+
+    ea = (const Entry *) a;
+    eb = (const Entry *) b;
+    if (0 != (diff = strcmp(ea->stem, eb->stem))) {
+        return diff;
+    }
+    if (ea->entry.line != eb->entry.line) {
+        return ea->entry.line - eb->entry.line;
+    }
+
+    return ea->entry.state - eb->entry.state;
+}
+
+static bool tFlag;
+
+/**
+ * Sort by lexer then rules before states then by decreasing hits (or time for rules with -t)
+ */
+static int entry_by_cost_cmp(const void *a, const void *b)
+{
+    int diff;
+    uint64_t ca, cb;
+    const Entry *ea, *eb;
+
+    ea = (const Entry *) a;
+    eb = (const Entry *) b;
+    if (0 != (diff = strcmp(ea->stem, eb->stem))) {
+        return diff;
+    }
+    if (IS_STATE(ea) != IS_STATE(eb)) {
+        return IS_STATE(ea) ? 1 : -1;
+    }
+    if (tFlag && !IS_STATE(ea)) {
+        ca = ea->entry.time_ns;
+        cb = eb->entry.time_ns;
+    } else {
+        ca = ea->entry.hits;
+        cb = eb->entry.hits;
+    }
+
+    return ca > cb ? -1 : ca < cb;
+}
+
+/**
+ * Merge the entries of the same rule or state (a rule may be instrumented
+ * by several macros on the same line, some re2c states appear several times)
+ */
+static void profile_merge(Profile *profile)
+{
+    size_t i, j;
+
+    qsort(profile->entries, profile->entries_len, sizeof(*profile->entries), entry_by_site_cmp);
+    for (i = j = 0; i < profile->entries_len; i++) {
+        if (j > 0 && 0 == entry_by_site_cmp(&profile->entries[j - 1], &profile->entries[i])) {
+            profile->entries[j - 1].entry.hits += profile->entries[i].entry.hits;
+            profile->entries[j - 1].entry.bytes += profile->entries[i].entry.bytes;
+            profile->entries[j - 1].entry.time_ns += profile->entries[i].entry.time_ns;
+        } else {
+            profile->entries[j++] = profile->entries[i];
+        }
+    }
+    profile->entries_len = j;
+    qsort(profile->entries, profile->entries_len, sizeof(*profile->entries), entry_by_cost_cmp);
+}
+
+/**
+ * Print the report of the lexer of the entries [from;to[
+ */
+static void print_lexer(const Entry *from, const Entry *to, unsigned long limit, bool states)
+{
+    const Entry *e;
+    unsigned long n;
+    uint64_t rule_hits, state_hits, bytes, time_ns;
+
+    rule_hits = state_hits = bytes = time_ns = 0;
+    for (e = from; e < to; e++) {
+        if (!IS_STATE(e)) {
+            rule_hits += e->entry.hits;
+            bytes += e->entry.bytes;
+            time_ns += e->entry.time_ns;
+        } else {
+            state_hits += e->entry.hits;
+        }
+    }
+    printf("== %s: %" PRIu64 " hit(s), %" PRIu64 " byte(s), %.3f ms ==\n", from->stem, rule_hits, bytes, time_ns / 1e6);
+    printf("%-28s %12s %7s %12s %11s %8s\n", "rule", "hits", "%", "bytes", "time (ms)", "ns/hit");
+    for (e = from, n = 0; e < to && !IS_STATE(e) && (0 == limit || n < limit); e++, n++) {
+        char rule[64];
+        const char *basename;
+
+        basename = NULL == (basename = strrchr(e->entry.file, '/')) ? e->entry.file : basename + 1;
+        snprintf(rule, ARRAY_SIZE(rule), "%s:%d", basename, e->entry.line);
+        printf("%-28s %12" PRIu64 " %6.2f%% %12" PRIu64 " %11.3f %8.1f\n", rule, e->entry.hits, 100.0 * e->entry.hits / rule_hits, e->entry.bytes, e->entry.time_ns / 1e6, (double) e->entry.time_ns / e->entry.hits);
+    }
+    if (states) {
+        for (e = from; e < to && !IS_STATE(e); e++)
+            ;
+        printf("%-28s %12s %7s\n", "state", "hits", "%");
+        for (n = 0; e < to && (0 == limit || n < limit); e++, n++) {
+            char state[64];
+            const char *basename;
+
+            basename = NULL == (basename = strrchr(e->entry.file, '/')) ? e->entry.file : basename + 1;
+            snprintf(state, ARRAY_SIZE(state), "%s:yy%d", basename, e->entry.state);
+            printf("%-28s %12" PRIu64 " %6.2f%%\n", state, e->entry.hits, 100.0 * e->entry.hits / state_hits);
+        }
+    }
+    putchar('\n');
+}
+
+/**
+ * Read a whole file
+ *
+ * @return NULL on failure else its content
+ */
+static String *read_file(const char *filename)
+{
+    FILE *fp;
+    size_t read;
+    String *buffer;
+    char chunk[8192];
+
+    if (NULL == (fp = fopen(filename, "rb"))) {
+        return NULL;
+    }
+    buffer = string_new();
+    while ((read = fread(chunk, 1, ARRAY_SIZE(chunk), fp)) > 0) {
+        string_append_string_len(buffer, chunk, read);
+    }
+    fclose(fp);
+
+    return buffer;
+}
+
+int main(int argc, char **argv)
+{
+    int o, ret;
+    bool sFlag;
+    size_t i, j;
+    Formatter *fmt;
+    Profile profile;
+    unsigned long limit, repeat;
+    const LexerImplementation *forced;
+
+    ret = EXIT_SUCCESS;
+    forced = NULL;
+    sFlag = tFlag = false;
+    limit = DEFAULT_LIMIT;
+    repeat = 1;
+    while (-1 != (o = getopt_long(argc, argv, optstr, long_options, NULL))) {
+        switch (o) {
+            case 'l':
+                if (NULL == (forced = lexer_implementation_by_name(optarg))) {
+                    STERR("there is no lexer named %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'n':
+                limit = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                if (0 == (repeat = strtoul(optarg, NULL, 10))) {
+                    usage();
+                }
+                break;
+            case 'S':
+                sFlag = true;
+                break;
+            case 't':
+                tFlag = true;
+                break;
+            default:
+                usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1) {
+        usage();
+    }
+    if (!lexer_profile_available()) {
+        STERR("shall was built without profiling, rebuild it with cmake -DPROFILING=ON");
+        return EXIT_FAILURE;
+    }
+    fmt = formatter_create(&nullfmt);
+    for (o = 0; o < argc; o++) {
+        unsigned long r;
+        Lexer *lexer;
+        String *source;
+        const LexerImplementation *imp;
+
+        if (NULL == (source = read_file(argv[o]))) {
+            STERR("can't read %s: %s", argv[o], strerror(errno));
+            ret = EXIT_FAILURE;
+            continue;
+        }
+        if (NULL == (imp = forced) && NULL == (imp = lexer_implementation_for_filename(argv[o])) && NULL == (imp = lexer_implementation_guess(source->ptr, source->len))) {
+            STWARN("no lexer found for %s, skipped", argv[o]);
+            string_destroy(source);
+            continue;
+        }
+        lexer = lexer_create(imp);
+        for (r = 0; r < repeat; r++) {
+            char *dest;
+
+            if (0 != highlight_string(source->ptr, source->len, &dest, NULL, fmt, 1, &lexer)) {
+                STWARN("%s lexer failed on %s", lexer_implementation_name(imp), argv[o]);
+            }
+            free(dest);
+        }
+        lexer_destroy(lexer, NULL);
+        string_destroy(source);
+    }
+    formatter_destroy(fmt);
+
+    bzero(&profile, sizeof(profile));
+    lexer_profile_each(entry_add_cb, &profile);
+    profile_merge(&profile);
+    for (i = 0; i < profile.entries_len; i = j) {
+        for (j = i + 1; j < profile.entries_len && 0 == strcmp(profile.entries[i].stem, profile.entries[j].stem); j++)
+            ;
+        print_lexer(&profile.entries[i], &profile.entries[j], limit, sFlag);
+    }
+    free(profile.entries);
+
+    return ret;
+}
@@ -6,11 +6,16 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/select.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <limits.h>
 #include <assert.h>
 #include <fts.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <time.h>
+#include <stdint.h>
 
 #include "cpp.h"
 #include "types.h"
@@ -18,7 +23,12 @@
 #include "shall.h"
 #include "utils.h"
 #include "xtring.h"
+#include "themes.h"
+#include "formatter.h"
 #include "lexer_group.h"
+#include "cache.h"
+#include "stats.h"
+#include "allocations.h"
 
 #ifndef EUSAGE
 # define EUSAGE -2
@@ -39,12 +49,13 @@ extern char *__progname;
 #define STWARN(format, ...) \
     fprintf(stderr, "[ WARN ] " format "\n", ## __VA_ARGS__)
 
-static char optstr[] = "v";
+static char optstr[] = "j:v";
 
 static struct option long_options[] = {
 //     { "list",             required_argument, NULL, 'L' },
-    { "verbose", no_argument, NULL, 'v' },
-    { NULL,      no_argument, NULL, 0   }
+    { "jobs",    required_argument, NULL, 'j' },
+    { "verbose", no_argument,       NULL, 'v' },
+    { NULL,      no_argument,       NULL, 0   }
 };
 
 static void usage(void)
@@ -58,6 +69,167 @@ static void usage(void)
     exit(EUSAGE);
 }
 
+/**
+ * Limits set by the --PERF-- section of a test
+ */
+typedef struct {
+    /**
+     * Maximum number of allocations (SIZE_MAX for no limit)
+     */
+    size_t max_allocations;
+    /**
+     * Maximum of the bytes allocated at once (SIZE_MAX for no limit)
+     */
+    size_t max_peak_bytes;
+    /**
+     * Minimum throughput, as a fraction of the one of calibration_mbps
+     * (0 for no limit)
+     */
+    double min_speed;
+    /**
+     * Maximum number of wrong guesses of the lexer, at each chunk size, when
+     * highlighted by highlight_string_parallel (UINT64_MAX for no limit)
+     */
+    uint64_t max_resync_misses;
+} PerfLimits;
+
+// time during which the highlighting is repeated to measure its throughput
+#define PERF_MIN_TIME_MS 50.0
+#define PERF_MIN_RUNS 3
+#define CALIBRATION_BUFFER_SIZE (1024 * 1024)
+#define CALIBRATION_RUNS 5
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * Throughput, in MB/s, of a loop which reads each byte of a buffer and
+ * hashes it (FNV-1a). The speed required by a --PERF-- section is relative
+ * to it so a test doesn't depend on the machine which runs it.
+ */
+static double calibration_mbps(void)
+{
+    static double mbps = 0.0;
+
+    if (0.0 == mbps) {
+        size_t i, r;
+        char *buffer;
+        double best;
+        volatile uint32_t sink;
+
+        buffer = mem_new_n(*buffer, CALIBRATION_BUFFER_SIZE);
+        for (i = 0; i < CALIBRATION_BUFFER_SIZE; i++) {
+            buffer[i] = ' ' + i % ('~' - ' ');
+        }
+        best = 0.0;
+        for (r = 0; r < CALIBRATION_RUNS; r++) {
+            double start, elapsed;
+            uint32_t hash;
+
+            start = now_ms();
+            for (hash = 2166136261U, i = 0; i < CALIBRATION_BUFFER_SIZE; i++) {
+                hash = (hash ^ (unsigned char) buffer[i]) * 16777619U;
+            }
+            sink = hash;
+            elapsed = now_ms() - start;
+            if (0 == r || elapsed < best) {
+                best = elapsed;
+            }
+        }
+        (void) sink;
+        free(buffer);
+        mbps = CALIBRATION_BUFFER_SIZE / (MAX(best, 1e-3) * 1000.0);
+    }
+
+    return mbps;
+}
+
+/**
+ * Parse a line "key=value" of a --PERF-- section
+ */
+static void perf_parse(PerfLimits *limits, const char *line, const char *filename)
+{
+    Option opt;
+
+    option_parse(line, &opt);
+    if (0 == strcmp(opt.name, "max_allocations")) {
+        limits->max_allocations = strtoull(opt.value, NULL, 10);
+    } else if (0 == strcmp(opt.name, "max_peak_bytes")) {
+        limits->max_peak_bytes = strtoull(opt.value, NULL, 10);
+    } else if (0 == strcmp(opt.name, "min_speed")) {
+        limits->min_speed = strtod(opt.value, NULL);
+    } else if (0 == strcmp(opt.name, "max_resync_misses")) {
+        limits->max_resync_misses = strtoull(opt.value, NULL, 10);
+    } else {
+        STWARN("unknown limit '%s' in --PERF-- section of %s", opt.name, filename);
+    }
+    free(opt.name);
+}
+
+/**
+ * Check the limits of a --PERF-- section, the throughput is measured by
+ * repeating the highlighting for at least PERF_MIN_TIME_MS
+ *
+ * @return false if one of them is exceeded
+ */
+static bool perf_check(const PerfLimits *limits, const char *filename, const String *source, Formatter *fmt, Lexer *lexer, size_t allocations, size_t peak, int verbosity)
+{
+    bool ok;
+    double speed;
+
+    ok = true;
+#ifdef WITH_ALLOCATION_COUNTING
+    if (limits->max_allocations < allocations) {
+        fprintf(stderr, "[ PERF ] %s: %zu allocations, more than the maximum of %zu\n", filename, allocations, limits->max_allocations);
+        ok = false;
+    }
+    if (limits->max_peak_bytes < peak) {
+        fprintf(stderr, "[ PERF ] %s: peak of %zu bytes allocated, more than the maximum of %zu\n", filename, peak, limits->max_peak_bytes);
+        ok = false;
+    }
+#else
+    if (SIZE_MAX != limits->max_allocations || SIZE_MAX != limits->max_peak_bytes) {
+        STWARN("allocations can't be counted on this system, limits of %s ignored", filename);
+    }
+#endif /* WITH_ALLOCATION_COUNTING */
+    speed = 0.0;
+    if (limits->min_speed > 0.0 && source->len > 0) {
+        int runs;
+        double best, elapsed;
+
+        best = 0.0;
+        for (runs = 0, elapsed = 0.0; runs < PERF_MIN_RUNS || elapsed < PERF_MIN_TIME_MS; runs++) {
+            char *dest;
+            double start, duration;
+
+            start = now_ms();
+            highlight_string(source->ptr, source->len, &dest, NULL, fmt, 1, &lexer);
+            duration = now_ms() - start;
+            free(dest);
+            if (0 == runs || duration < best) {
+                best = duration;
+            }
+            elapsed += duration;
+        }
+        speed = source->len / (MAX(best, 1e-6) * 1000.0) / calibration_mbps();
+        if (speed < limits->min_speed) {
+            fprintf(stderr, "[ PERF ] %s: speed of %.4f (%.1f MB/s), less than the minimum of %.4f\n", filename, speed, speed * calibration_mbps(), limits->min_speed);
+            ok = false;
+        }
+    }
+    if (verbosity) {
+        printf("=== <perf> ===\nallocations=%zu\npeak_bytes=%zu\nspeed=%.4f\n=== </perf> ===\n", allocations, peak, speed);
+    }
+
+    return ok;
+}
+
 static bool string_fgets(String *str, FILE *fp)
 {
     if (feof(fp)) {
@@ -123,6 +295,255 @@ static void ctxt_chomp(st_ctxt_t *ctxt)
     ctxt_apply_cb(ctxt, string_chomp);
 }
 
+/**
+ * Names, in a --BUDGET-- section, of the values returned by highlight_string_with_budget
+ */
+static const char * const statuses[] = {
+    [ HIGHLIGHT_SUCCESS ] = "success",
+    [ HIGHLIGHT_RECURSION ] = "recursion",
+    [ HIGHLIGHT_TIMEOUT ] = "timeout",
+    [ HIGHLIGHT_MAX_TOKENS_EXCEEDED ] = "max_tokens",
+    [ HIGHLIGHT_MAX_OUTPUT_EXCEEDED ] = "max_output",
+    [ HIGHLIGHT_SINK_ERROR ] = "sink_error",
+};
+
+/**
+ * Parse a line of a --BUDGET-- section: the limits of the highlighting
+ * (timeout, max_tokens, max_output and check_interval) and the value it
+ * is expected to return (status)
+ */
+static void budget_parse(HighlightBudget *budget, int *status, const char *line, const char *filename)
+{
+    Option opt;
+
+    option_parse(line, &opt);
+    if (0 == strcmp(opt.name, "timeout")) {
+        budget->timeout = strtoul(opt.value, NULL, 10);
+    } else if (0 == strcmp(opt.name, "max_tokens")) {
+        budget->max_tokens = strtoull(opt.value, NULL, 10);
+    } else if (0 == strcmp(opt.name, "max_output")) {
+        budget->max_output = strtoull(opt.value, NULL, 10);
+    } else if (0 == strcmp(opt.name, "check_interval")) {
+        budget->check_interval = strtoull(opt.value, NULL, 10);
+    } else if (0 == strcmp(opt.name, "status")) {
+        size_t i;
+
+        for (i = 0; i < ARRAY_SIZE(statuses); i++) {
+            if (0 == strcmp(opt.value, statuses[i])) {
+                *status = i;
+                break;
+            }
+        }
+        if (i >= ARRAY_SIZE(statuses)) {
+            STWARN("unknown status '%s' in --BUDGET-- section of %s", opt.value, filename);
+        }
+    } else {
+        STWARN("unknown limit '%s' in --BUDGET-- section of %s", opt.name, filename);
+    }
+    free(opt.name);
+}
+
+/**
+ * Chunk sizes (in bytes) to highlight each source with
+ * highlight_string_parallel: the smallest ones put the borders of the
+ * chunks everywhere, inside tokens and on wrong guesses of the lexer
+ */
+static const size_t parallel_chunk_sizes[] = { 1, 3, 16 };
+
+/**
+ * Checks that highlight_string_parallel gives the same output as
+ * highlight_string_with_budget (result) and that the lexer doesn't guess
+ * its state wrong more often than max_resync_misses
+ */
+static bool parallel_check(const PerfLimits *limits, const char *filename, const String *source, Formatter *fmt, Lexer *lexer, const HighlightBudget *budget, const char *result, size_t result_len)
+{
+    size_t i;
+    bool ok;
+
+    ok = true;
+    for (i = 0; i < ARRAY_SIZE(parallel_chunk_sizes); i++) {
+        char *presult;
+        size_t presult_len;
+        HighlightStatsTotals totals;
+        HighlightStats *stats, *previous;
+
+        presult = NULL;
+        stats = highlight_stats_create();
+        previous = highlight_stats_bind(stats);
+        highlight_string_parallel(source->ptr, source->len, &presult, &presult_len, fmt, 1, &lexer, budget, 4, parallel_chunk_sizes[i]);
+        highlight_stats_bind(previous);
+        highlight_stats_totals(stats, &totals);
+        highlight_stats_destroy(stats);
+        if (presult_len != result_len || 0 != memcmp(presult, result, result_len)) {
+            STERR("%s: output of highlight_string_parallel, by chunks of %zu bytes, differs", filename, parallel_chunk_sizes[i]);
+            ok = false;
+        }
+        if (totals.resync_misses > limits->max_resync_misses) {
+            STERR("%s: %" PRIu64 " wrong guess(es) of the lexer out of %" PRIu64 ", by chunks of %zu bytes, exceed(s) %" PRIu64, filename, totals.resync_misses, totals.resyncs, parallel_chunk_sizes[i], limits->max_resync_misses);
+            ok = false;
+        }
+        free(presult);
+    }
+
+    return ok;
+}
+
+/**
+ * Checks that the counters of highlight_stats match a single highlighting
+ * of source into result_len bytes
+ */
+static bool stats_check(const char *filename, const String *source, Formatter *fmt, Lexer *lexer, const HighlightBudget *budget, size_t result_len)
+{
+    bool ok;
+    char *sresult;
+    HighlightStatsTotals totals;
+    HighlightStats *stats, *previous;
+
+    sresult = NULL;
+    stats = highlight_stats_create();
+    previous = highlight_stats_bind(stats);
+    highlight_string_with_budget(source->ptr, source->len, &sresult, NULL, fmt, 1, &lexer, budget);
+    highlight_stats_bind(previous);
+    highlight_stats_totals(stats, &totals);
+    highlight_stats_destroy(stats);
+    free(sresult);
+    if (!(ok = 1 == totals.documents && source->len == totals.bytes_in && result_len == totals.bytes_out)) {
+        STERR("%s: highlight_stats counted %" PRIu64 " document(s), %" PRIu64 " byte(s) in and %" PRIu64 " out instead of 1, %zu and %zu", filename, totals.documents, totals.bytes_in, totals.bytes_out, source->len, result_len);
+    }
+
+    return ok;
+}
+
+static int string_sink_write(const char *chunk, size_t chunk_len, void *data)
+{
+    string_append_string_len((String *) data, chunk, chunk_len);
+
+    return 0;
+}
+
+/**
+ * Checks that highlight_string_pipelined gives the same output and status
+ * as highlight_string_with_budget (result and status)
+ *
+ * Under a max_output limit, it is checked against the output formatted so
+ * far, which depends on the progress of the formatting thread: there is
+ * nothing to compare.
+ */
+static bool pipelined_check(const char *filename, const String *source, Formatter *fmt, Lexer *lexer, const HighlightBudget *budget, int status, const char *result, size_t result_len)
+{
+    bool ok;
+    int pstatus;
+    String *presult;
+    HighlightSink sink;
+
+    presult = string_new();
+    sink.write = string_sink_write;
+    sink.data = presult;
+    // small chunks and queue to make the two threads wait for each other
+    sink.chunk_size = 16;
+    pstatus = highlight_string_pipelined(source->ptr, source->len, &sink, fmt, 1, &lexer, budget, 2);
+    ok = true;
+    if ((NULL == budget || 0 == budget->max_output) && !(ok = pstatus == status && presult->len == result_len && 0 == memcmp(presult->ptr, result, result_len))) {
+        STERR("%s: output of highlight_string_pipelined differs", filename);
+    }
+    string_destroy(presult);
+
+    return ok;
+}
+
+/**
+ * Create and open a file with a unique name in the temporary directory
+ *
+ * @return its descriptor or -1 on failure
+ */
+static int temporary_file(char *path, size_t path_size)
+{
+    const char *tmpdir;
+
+    if (NULL == (tmpdir = getenv("TMPDIR")) || '\0' == *tmpdir) {
+        tmpdir = "/tmp";
+    }
+    if ((size_t) snprintf(path, path_size, "%s/shalltest.XXXXXX", tmpdir) >= path_size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    return mkstemp(path);
+}
+
+/**
+ * Build the name of the file of the differences of a test: its own name
+ * with the extension .diff instead of .ssc
+ */
+static void diff_filename(const char *filename, char *diffpath, size_t diffpath_size)
+{
+    const char *dot;
+
+    dot = strrchr(filename, '.');
+    assert(NULL != dot);
+    snprintf(diffpath, diffpath_size, "%.*s.diff", (int) (dot - filename), filename);
+}
+
+/**
+ * Write the differences (diff -u) between the expected and the actual
+ * results of a test into its .diff file
+ */
+static void write_diff(const char *filename, const String *expect, const char *result, size_t result_len)
+{
+    enum {
+        PROC_RECV, // NOTE: always reader/receiver first to stick with pipe(2) ([0] = read end, [1] = write end)
+        PROC_SEND,
+        _PROC_COUNT
+    };
+
+    pid_t pid;
+    int status, fdexpect, fd[_PROC_COUNT];
+    char diffpath[PATH_MAX], expectpath[PATH_MAX];
+
+    // the expected result goes into a (unique) temporary file, the actual one to the standard input of diff
+    if (-1 == (fdexpect = temporary_file(expectpath, ARRAY_SIZE(expectpath)))) {
+        STERR("can't create a temporary file: %s", strerror(errno));
+        return;
+    }
+    if (-1 == write(fdexpect, expect->ptr, expect->len)) {
+        STERR("write failed: %s", strerror(errno));
+        goto end;
+    }
+    if (0 != pipe(fd)) {
+        STERR("pipe failed: %s", strerror(errno));
+        goto end;
+    }
+    diff_filename(filename, diffpath, ARRAY_SIZE(diffpath));
+    pid = fork();
+    if (-1 == pid) {
+        STERR("fork failed: %s", strerror(errno));
+        close(fd[PROC_RECV]);
+        close(fd[PROC_SEND]);
+        goto end;
+    } else if (0 == pid) {
+        int fdout;
+
+        close(fd[PROC_SEND]);
+        dup2(fd[PROC_RECV], STDIN_FILENO);
+        close(fd[PROC_RECV]);
+        fdout = open(diffpath, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+        dup2(fdout, STDOUT_FILENO);
+        close(fdout);
+        execlp("diff", "diff", "-u", "-L", "expected", "-L", "result", expectpath, "-", NULL);
+        STERR("execlp failed: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    close(fd[PROC_RECV]);
+    if (-1 == write(fd[PROC_SEND], result, result_len)) {
+        STERR("write failed: %s", strerror(errno));
+    }
+    close(fd[PROC_SEND]);
+    waitpid(pid, &status, 0);
+end:
+    close(fdexpect);
+    unlink(expectpath);
+}
+
 static int procfile(const char *filename, st_ctxt_t *ctxt, int verbosity)
 {
     enum {
@@ -131,7 +552,9 @@ static int procfile(const char *filename, st_ctxt_t *ctxt, int verbosity)
         PART_SOURCE,
         PART_EXPECT,
         PART_LEXER,
-        PART_FORMATTER
+        PART_FORMATTER,
+        PART_BUDGET,
+        PART_PERF
     };
 
     size_t i;
@@ -141,22 +564,35 @@ static int procfile(const char *filename, st_ctxt_t *ctxt, int verbosity)
     LexerGroup *g;
     Formatter *fmt;
     bool guess_limp;
+    bool has_budget;
+    bool status_ok, stats_ok, pipelined_ok;
+    int status, expected_status;
+    HighlightBudget budget;
     int oldpart, part;
     size_t result_len;
-    int ret, status, fdsource;
+    int ret;
+    bool perf_ok, parallel_ok;
+    ssize_t live;
+    PerfLimits limits;
+    size_t allocations, peak;
     OptionsStore options[COUNT];
     const LexerImplementation *limp;
     const FormatterImplementation *fimp;
-    char sourcepath[PATH_MAX] = "/tmp/shallsource"; // TODO: build a unique path to run several shalltest in parallel ("/tmp/shall.<source/expect>.$$")?
 
     ret = 0;
     g = NULL;
     limp = NULL;
     result = NULL;
-    fdsource = -1;
     fimp = plainfmt;
     guess_limp = false;
+    has_budget = false;
+    bzero(&budget, sizeof(budget));
+    expected_status = HIGHLIGHT_SUCCESS;
+    live = allocations = peak = 0;
     oldpart = part = PART_NONE;
+    limits.max_allocations = limits.max_peak_bytes = SIZE_MAX;
+    limits.min_speed = 0.0;
+    limits.max_resync_misses = UINT64_MAX;
     ctxt_flush(ctxt);
     for (i = 0; i < COUNT; i++) {
         options_store_init(&options[i]);
@@ -187,6 +623,12 @@ static int procfile(const char *filename, st_ctxt_t *ctxt, int verbosity)
             } else if (0 == strncmp("EXPECT", p, STR_LEN("EXPECT"))) {
                 part = PART_EXPECT;
                 p += STR_LEN("EXPECT");
+            } else if (0 == strncmp("BUDGET", p, STR_LEN("BUDGET"))) {
+                part = PART_BUDGET;
+                p += STR_LEN("BUDGET");
+            } else if (0 == strncmp("PERF", p, STR_LEN("PERF"))) {
+                part = PART_PERF;
+                p += STR_LEN("PERF");
             }
             while (' ' == *p || '\t' == *p) {
                 ++p;
@@ -203,12 +645,16 @@ static int procfile(const char *filename, st_ctxt_t *ctxt, int verbosity)
             STWARN("line '%s' found out of any section", ctxt->line->ptr);
         }
         if (part == oldpart) {
-            if (PART_LEXER == part || PART_FORMATTER == part) {
+            if (PART_LEXER == part || PART_FORMATTER == part || PART_BUDGET == part || PART_PERF == part) {
                 bool has_equal;
 
                 string_chomp(ctxt->line);
                 has_equal = NULL != memchr(ctxt->line->ptr, '=', ctxt->line->len);
-                if (PART_LEXER == part) {
+                if (PART_PERF == part) {
+                    if (has_equal) {
+                        perf_parse(&limits, ctxt->line->ptr, filename);
+                    }
+                } else if (PART_LEXER == part) {
                     /**
                      * TODO: options before any lexer are common/shared?
                      *
@@ -257,6 +703,11 @@ static int procfile(const char *filename, st_ctxt_t *ctxt, int verbosity)
                     } else {
                         options_store_add(&options[FORMATTER], ctxt->line->ptr);
                     }
+                } else if (PART_BUDGET == part) {
+                    if (has_equal) {
+                        has_budget = true;
+                        budget_parse(&budget, &expected_status, ctxt->line->ptr, filename);
+                    }
                 }
             } else {
                 string_append_string_len(ctxt->buffer[part], ctxt->line->ptr, ctxt->line->len);
@@ -294,7 +745,22 @@ static int procfile(const char *filename, st_ctxt_t *ctxt, int verbosity)
             STWARN("option '%s' rejected by %s formatter", options[FORMATTER].options[i].name, formatter_implementation_name(formatter_implementation(fmt)));
         }
     }
-    highlight_string(ctxt->source->ptr, ctxt->source->len, &result, &result_len, fmt, 1, &lexer);
+#ifdef WITH_ALLOCATION_COUNTING
+    allocations = allocations_count();
+    live = allocations_peak_reset();
+#endif /* WITH_ALLOCATION_COUNTING */
+    status = highlight_string_with_budget(ctxt->source->ptr, ctxt->source->len, &result, &result_len, fmt, 1, &lexer, has_budget ? &budget : NULL);
+#ifdef WITH_ALLOCATION_COUNTING
+    allocations = allocations_count() - allocations;
+    peak = allocations_peak() - live;
+#endif /* WITH_ALLOCATION_COUNTING */
+    perf_ok = perf_check(&limits, filename, ctxt->source, fmt, lexer, allocations, peak, verbosity);
+    parallel_ok = parallel_check(&limits, filename, ctxt->source, fmt, lexer, has_budget ? &budget : NULL, result, result_len);
+    stats_ok = stats_check(filename, ctxt->source, fmt, lexer, has_budget ? &budget : NULL, result_len);
+    pipelined_ok = pipelined_check(filename, ctxt->source, fmt, lexer, has_budget ? &budget : NULL, status, result, result_len);
+    if (!(status_ok = !has_budget || status == expected_status)) {
+        fprintf(stderr, "[ BUDGET ] %s: %s returned instead of %s\n", filename, statuses[status], statuses[expected_status]);
+    }
     if (verbosity) {
         printf("=== <source> ===\n%s\n=== </source> ===\n", ctxt->source->ptr);
         printf("=== <get> ===\n%s\n=== </get> ===\n", result);
@@ -305,73 +771,15 @@ static int procfile(const char *filename, st_ctxt_t *ctxt, int verbosity)
     for (i = 0; i < COUNT; i++) {
         options_store_free(&options[i]);
     }
-    {
-        enum {
-            PROC_RECV, // NOTE: always reader/receiver first to stick with pipe(2) ([0] = read end, [1] = write end)
-            PROC_SEND,
-            _PROC_COUNT
-        };
-
-        pid_t pid;
-        int fd[_PROC_COUNT];
+    if (result_len == ctxt->expect->len && 0 == memcmp(result, ctxt->expect->ptr, result_len)) {
+        char diffpath[PATH_MAX];
 
-        //snprintf(sourcepath, "/tmp/shall.source.%d", pid);
-        unlink(sourcepath);
-        if (0 != mkfifo(sourcepath, 0640)) {
-            STERR("mkfifo %s failed: %s", sourcepath, strerror(errno));
-            return 0;
-        }
-        if (0 != pipe(fd)) {
-            STERR("pipe failed: %s", strerror(errno));
-            return 0;
-        }
-        pid = fork();
-        if (-1 == pid) {
-            return 0;
-        } else if (0 == pid) {
-            int fdout;
-            char *dot, dpath[PATH_MAX];
-
-            strcpy(dpath, filename);
-            dot = strrchr(dpath, '.');
-            assert(NULL != dot);
-//             strcat(dot + 1, "diff");
-            *++dot = 'd';
-            *++dot = 'i';
-            *++dot = 'f';
-            *++dot = 'f';
-            *++dot = '\0';
-            close(fd[PROC_SEND]);
-            dup2(fd[PROC_RECV], STDIN_FILENO);
-            close(fd[PROC_RECV]);
-            fdout = open(dpath, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
-            dup2(fdout, STDOUT_FILENO);
-            close(fdout);
-            execlp("diff", "diff", "-u", sourcepath, "-", NULL);
-            STERR("execlp failed: %s", strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-        if (-1 == (fdsource = open(sourcepath, O_WRONLY))) {
-            STERR("open %s failed: %s", sourcepath, strerror(errno));
-            goto end;
-        }
-        close(fd[PROC_RECV]);
-        if (-1 == write(fd[PROC_SEND], result, result_len)) {
-            STERR("write failed: %s", strerror(errno));
-            goto end;
-        }
-        close(fd[PROC_SEND]);
-        if (-1 == write(fdsource, ctxt->expect->ptr, ctxt->expect->len)) {
-            STERR("write failed: %s", strerror(errno));
-            goto end;
-        }
-end:
-        if (-1 != fdsource) {
-            close(fdsource);
-        }
-        waitpid(pid, &status, 0);
-        ret = WIFEXITED(status) ? EXIT_SUCCESS == WEXITSTATUS(status) : 0;
-        unlink(sourcepath);
+        ret = perf_ok && parallel_ok && status_ok && stats_ok && pipelined_ok;
+        // remove the differences left by a previous failure
+        diff_filename(filename, diffpath, ARRAY_SIZE(diffpath));
+        unlink(diffpath);
+    } else {
+        write_diff(filename, ctxt->expect, result, result_len);
     }
     if (NULL != result) {
         free(result);
@@ -391,16 +799,29 @@ static int strendswith(const char *string, size_t string_len, const char *suffix
     return 0 == strcmp(string + string_len - suffix_len, suffix);
 }
 
-static int procdir(char **argv, st_ctxt_t *ctxt, int verbosity)
+static int fts_name_cmp(const FTSENT **a, const FTSENT **b)
+{
+    return strcmp((*a)->fts_name, (*b)->fts_name);
+}
+
+/**
+ * Find the tests (.ssc files) in the given files and directories, in the
+ * order of their names for the results to be reported in the same order
+ * from a run to another
+ *
+ * @return false on failure
+ */
+static bool collect(char **argv, char ***files, size_t *files_len)
 {
-    int ret;
     FTS *fts;
     FTSENT *p;
+    size_t files_size;
 
-    ret = 1;
-    if (NULL == (fts = fts_open(argv, FTS_NOSTAT | FTS_NOCHDIR, NULL))) {
+    *files = NULL;
+    *files_len = files_size = 0;
+    if (NULL == (fts = fts_open(argv, FTS_NOSTAT | FTS_NOCHDIR, fts_name_cmp))) {
         STERR("can't fts_open: %s", strerror(errno));
-        return 0;
+        return false;
     }
     while (NULL != (p = fts_read(fts))) {
         switch (p->fts_info) {
@@ -416,26 +837,922 @@ static int procdir(char **argv, st_ctxt_t *ctxt, int verbosity)
                 break;
             default:
                 if (strendswith(p->fts_path, p->fts_pathlen, ".ssc", STR_LEN(".ssc"))) {
-                    ret &= procfile(p->fts_path, ctxt, verbosity);
+                    if (*files_len >= files_size) {
+                        files_size = 0 == files_size ? 64 : files_size * 2;
+                        *files = mem_renew(*files, **files, files_size);
+                    }
+                    (*files)[(*files_len)++] = strdup(p->fts_path);
                 }
                 break;
         }
     }
     fts_close(fts);
 
+    return true;
+}
+
+/**
+ * What a worker reports, through a pipe, after each of its tests
+ */
+typedef struct {
+    // index of the test
+    size_t index;
+    // result of procfile
+    int ret;
+    // position of the output of the test in the files of the worker (stdout and stderr)
+    off_t start, end;
+    off_t err_start, err_end;
+} WorkerReport;
+
+/**
+ * Copy the part [start;end[ of the file fd to fp
+ */
+static void copy_output(int fd, off_t start, off_t end, FILE *fp)
+{
+    off_t offset;
+    char buffer[8192];
+
+    for (offset = start; offset < end; ) {
+        ssize_t len;
+
+        if ((len = pread(fd, buffer, MIN((off_t) ARRAY_SIZE(buffer), end - offset), offset)) <= 0) {
+            break;
+        }
+        fwrite(buffer, 1, len, fp);
+        offset += len;
+    }
+}
+
+/**
+ * Copy the errors of a test to stderr then its output to stdout, as a
+ * test reports its failures before its result
+ */
+static void report_output(int output, int error, const WorkerReport *report)
+{
+    fflush(stdout);
+    copy_output(error, report->err_start, report->err_end, stderr);
+    copy_output(output, report->start, report->end, stdout);
+    fflush(stdout);
+}
+
+/**
+ * Create a temporary file, already unlinked: it is only reachable through
+ * the returned descriptor (shared with the workers)
+ *
+ * @return -1 on failure
+ */
+static int anonymous_file(void)
+{
+    int fd;
+    char path[PATH_MAX];
+
+    if (-1 == (fd = temporary_file(path, ARRAY_SIZE(path)))) {
+        STERR("can't create a temporary file: %s", strerror(errno));
+    } else {
+        unlink(path);
+    }
+
+    return fd;
+}
+
+/**
+ * Run the tests on *jobs* processes: worker w runs the tests w, w + jobs,
+ * w + 2 * jobs, ... with its outputs redirected into temporary files.
+ * The output of each test is then copied to stdout, and its errors to
+ * stderr, in the order of the tests, as soon as the ones before it are
+ * done.
+ *
+ * @return 1 if all tests passed
+ */
+static int procfiles_parallel(char **files, size_t files_len, st_ctxt_t *ctxt, int verbosity, unsigned long jobs)
+{
+    int ret;
+    size_t i, next;
+    unsigned long w, running;
+    WorkerReport *reports;
+    bool *done;
+    pid_t *pids;
+    int *outputs, *errors, *pipes;
+
+    ret = 1;
+    pids = mem_new_n(*pids, jobs);
+    pipes = mem_new_n(*pipes, jobs);
+    outputs = mem_new_n(*outputs, jobs);
+    errors = mem_new_n(*errors, jobs);
+    reports = mem_new_n(*reports, files_len);
+    done = mem_new_n0(*done, files_len);
+    fflush(stdout);
+    fflush(stderr);
+    for (running = w = 0; w < jobs; w++) {
+        int fd[2];
+
+        pids[w] = -1;
+        pipes[w] = -1;
+        errors[w] = -1;
+        if (-1 == (outputs[w] = anonymous_file()) || -1 == (errors[w] = anonymous_file())) {
+            continue;
+        }
+        if (0 != pipe(fd)) {
+            STERR("pipe failed: %s", strerror(errno));
+            continue;
+        }
+        if (-1 == (pids[w] = fork())) {
+            STERR("fork failed: %s", strerror(errno));
+            close(fd[0]);
+            close(fd[1]);
+            continue;
+        } else if (0 == pids[w]) {
+            unsigned long v;
+
+            close(fd[0]);
+            for (v = 0; v < w; v++) {
+                if (-1 != pipes[v]) {
+                    close(pipes[v]);
+                }
+            }
+            dup2(outputs[w], STDOUT_FILENO);
+            dup2(errors[w], STDERR_FILENO);
+            for (i = w; i < files_len; i += jobs) {
+                WorkerReport report;
+
+                report.index = i;
+                report.start = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+                report.err_start = lseek(STDERR_FILENO, 0, SEEK_CUR);
+                report.ret = procfile(files[i], ctxt, verbosity);
+                fflush(stdout);
+                fflush(stderr);
+                report.end = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+                report.err_end = lseek(STDERR_FILENO, 0, SEEK_CUR);
+                if (sizeof(report) != write(fd[1], &report, sizeof(report))) {
+                    _exit(EXIT_FAILURE);
+                }
+            }
+            _exit(EXIT_SUCCESS);
+        }
+        close(fd[1]);
+        pipes[w] = fd[0];
+        ++running;
+    }
+    next = 0;
+    while (running > 0) {
+        fd_set fds;
+        int maxfd;
+
+        FD_ZERO(&fds);
+        for (maxfd = -1, w = 0; w < jobs; w++) {
+            if (-1 != pipes[w]) {
+                FD_SET(pipes[w], &fds);
+                maxfd = MAX(maxfd, pipes[w]);
+            }
+        }
+        if (-1 == select(maxfd + 1, &fds, NULL, NULL, NULL)) {
+            if (EINTR == errno) {
+                continue;
+            }
+            STERR("select failed: %s", strerror(errno));
+            break;
+        }
+        for (w = 0; w < jobs; w++) {
+            WorkerReport report;
+
+            if (-1 == pipes[w] || !FD_ISSET(pipes[w], &fds)) {
+                continue;
+            }
+            // reports are smaller than PIPE_BUF so they are never split
+            if (sizeof(report) != read(pipes[w], &report, sizeof(report))) {
+                close(pipes[w]);
+                pipes[w] = -1;
+                --running;
+            } else if (report.index < files_len) {
+                reports[report.index] = report;
+                done[report.index] = true;
+            }
+        }
+        for (; next < files_len && done[next]; next++) {
+            report_output(outputs[next % jobs], errors[next % jobs], &reports[next]);
+            ret &= reports[next].ret;
+        }
+    }
+    for (w = 0; w < jobs; w++) {
+        if (-1 != pids[w]) {
+            waitpid(pids[w], NULL, 0);
+        }
+    }
+    // the tests of a worker which died (or couldn't be started) were not run
+    for (; next < files_len; next++) {
+        if (!done[next]) {
+            STERR("%s was not run to completion", files[next]);
+            ret = 0;
+        } else {
+            report_output(outputs[next % jobs], errors[next % jobs], &reports[next]);
+            ret &= reports[next].ret;
+        }
+    }
+    for (w = 0; w < jobs; w++) {
+        if (-1 != outputs[w]) {
+            close(outputs[w]);
+        }
+        if (-1 != errors[w]) {
+            close(errors[w]);
+        }
+    }
+    free(done);
+    free(reports);
+    free(outputs);
+    free(errors);
+    free(pipes);
+    free(pids);
+
+    return ret;
+}
+
+static int procdir(char **argv, st_ctxt_t *ctxt, int verbosity, unsigned long jobs)
+{
+    int ret;
+    size_t i, files_len;
+    char **files;
+
+    if (!collect(argv, &files, &files_len)) {
+        return 0;
+    }
+    ret = 1;
+    if (jobs > 1 && files_len > 1) {
+        ret = procfiles_parallel(files, files_len, ctxt, verbosity, MIN(jobs, (unsigned long) files_len));
+    } else {
+        for (i = 0; i < files_len; i++) {
+            ret &= procfile(files[i], ctxt, verbosity);
+        }
+    }
+    for (i = 0; i < files_len; i++) {
+        free(files[i]);
+    }
+    free(files);
+
+    return ret;
+}
+
+#ifndef POOL_TEST_THREADS
+# define POOL_TEST_THREADS 8
+#endif /* !POOL_TEST_THREADS */
+
+/**
+ * The threads which highlighted a document with pool_formatter
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_t threads[POOL_TEST_THREADS];
+    size_t threads_len;
+} pool_seen = { PTHREAD_MUTEX_INITIALIZER, { 0 }, 0 };
+
+/**
+ * Records the thread which highlights the document
+ */
+static int pool_start_document(String *UNUSED(out), FormatterData *UNUSED(data))
+{
+    size_t i;
+
+    // let the other workers take their share
+    usleep(1000);
+    pthread_mutex_lock(&pool_seen.lock);
+    for (i = 0; i < pool_seen.threads_len && !pthread_equal(pool_seen.threads[i], pthread_self()); i++)
+        ;
+    if (i == pool_seen.threads_len && i < ARRAY_SIZE(pool_seen.threads)) {
+        pool_seen.threads[pool_seen.threads_len++] = pthread_self();
+    }
+    pthread_mutex_unlock(&pool_seen.lock);
+
+    return 0;
+}
+
+static int pool_token(int UNUSED(token), String *UNUSED(out), FormatterData *UNUSED(data))
+{
+    return 0;
+}
+
+static int pool_write_token(String *UNUSED(out), const char *UNUSED(token), size_t UNUSED(token_len), FormatterData *UNUSED(data))
+{
+    return 0;
+}
+
+/**
+ * A formatter which writes nothing but records the threads it is run by
+ */
+static const FormatterImplementation pool_formatter = {
+    .name = "Pool",
+    .docstr = "Records the threads of highlight_batch",
+    .start_document = pool_start_document,
+    .start_token = pool_token,
+    .end_token = pool_token,
+    .write_token = pool_write_token,
+    .data_size = 0,
+    .options = NULL
+};
+
+/**
+ * Highlight *jobs_len* documents by highlight_batch on *threads* threads
+ *
+ * @return the number of different threads which highlighted them
+ */
+static size_t pool_run(size_t jobs_len, unsigned threads)
+{
+    size_t i;
+    Lexer *lexer;
+    Formatter *fmt;
+    HighlightJob jobs[64];
+    HighlightResult results[ARRAY_SIZE(jobs)];
+
+    assert(jobs_len <= ARRAY_SIZE(jobs));
+    lexer = lexer_create(lexer_implementation_by_name("text"));
+    fmt = formatter_create(&pool_formatter);
+    for (i = 0; i < jobs_len; i++) {
+        jobs[i].src = "x";
+        jobs[i].src_len = STR_LEN("x");
+        jobs[i].fmt = fmt;
+        jobs[i].lexerc = 1;
+        jobs[i].lexerv = &lexer;
+        jobs[i].budget = NULL;
+    }
+    pool_seen.threads_len = 0;
+    highlight_batch(jobs, jobs_len, results, threads);
+    for (i = 0; i < jobs_len; i++) {
+        free(results[i].dst);
+    }
+    formatter_destroy(fmt);
+    lexer_destroy(lexer, NULL);
+
+    return pool_seen.threads_len;
+}
+
+/**
+ * Once the pool was grown by a large call, a smaller one still only get
+ * the number of threads it asked for
+ */
+static bool test_pool_size(void)
+{
+    pool_run(64, 8);
+
+    return pool_run(64, 2) <= 2;
+}
+
+/* path of the shall binary, built next to shalltest */
+static char shall_path[PATH_MAX] = "shall";
+
+static bool write_file(const char *path, const char *content)
+{
+    FILE *fp;
+    bool ok;
+
+    if (NULL == (fp = fopen(path, "w"))) {
+        return false;
+    }
+    ok = EOF != fputs(content, fp);
+    ok &= 0 == fclose(fp);
+
+    return ok;
+}
+
+static bool file_equals(const char *path, const char *content)
+{
+    FILE *fp;
+    size_t read;
+    char buffer[1024];
+
+    if (NULL == (fp = fopen(path, "r"))) {
+        return false;
+    }
+    read = fread(buffer, sizeof(buffer[0]), ARRAY_SIZE(buffer), fp);
+    fclose(fp);
+
+    return strlen(content) == read && 0 == memcmp(buffer, content, read);
+}
+
+static void remove_tree(const char *path)
+{
+    FTS *fts;
+    FTSENT *p;
+    char *paths[] = { (char *) path, NULL };
+
+    if (NULL == (fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, NULL))) {
+        return;
+    }
+    while (NULL != (p = fts_read(fts))) {
+        switch (p->fts_info) {
+            case FTS_D:
+                break;
+            case FTS_DP:
+                rmdir(p->fts_accpath);
+                break;
+            default:
+                unlink(p->fts_accpath);
+                break;
+        }
+    }
+    fts_close(fts);
+}
+
+/**
+ * Run shall in recursive mode (shall -f html -r *srcdir* -d *outdir*)
+ */
+static bool run_shall_tree(const char *srcdir, const char *outdir)
+{
+    pid_t pid;
+    int fd, status;
+
+    if (-1 == (pid = fork())) {
+        return false;
+    }
+    if (0 == pid) {
+        if (-1 != (fd = open("/dev/null", O_WRONLY))) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        execlp(shall_path, "shall", "-f", "html", "-r", srcdir, "-d", outdir, (char *) NULL);
+        _exit(EXIT_FAILURE);
+    }
+
+    return pid == waitpid(pid, &status, 0) && WIFEXITED(status) && EXIT_SUCCESS == WEXITSTATUS(status);
+}
+
+/**
+ * A second run of shall -r only highlights again the files which were
+ * modified, including the ones which names contain the separators of the
+ * manifest
+ */
+static bool test_tree_incremental(void)
+{
+    bool ok;
+    size_t i;
+    char dir[] = "/tmp/shalltest.XXXXXX", srcdir[sizeof(dir) + 4], outdir[sizeof(dir) + 4], path[PATH_MAX];
+    static const char * const names[] = { "a.txt", "b\tc.txt", "new\nline.txt" };
+    static const char * const mark = "not highlighted again";
+
+    if (NULL == mkdtemp(dir)) {
+        return false;
+    }
+    snprintf(srcdir, sizeof(srcdir), "%s/src", dir);
+    snprintf(outdir, sizeof(outdir), "%s/out", dir);
+    ok = 0 == mkdir(srcdir, 0755);
+    for (i = 0; ok && i < ARRAY_SIZE(names); i++) {
+        snprintf(path, sizeof(path), "%s/%s", srcdir, names[i]);
+        ok = write_file(path, names[i]);
+    }
+    ok = ok && run_shall_tree(srcdir, outdir);
+    // overwrite the outputs to detect which files are highlighted by the second run
+    for (i = 0; ok && i < ARRAY_SIZE(names); i++) {
+        snprintf(path, sizeof(path), "%s/%s.html", outdir, names[i]);
+        ok = write_file(path, mark);
+    }
+    // a different size is enough, whatever the resolution of mtime is
+    snprintf(path, sizeof(path), "%s/%s", srcdir, names[0]);
+    ok = ok && write_file(path, "modified") && run_shall_tree(srcdir, outdir);
+    for (i = 0; ok && i < ARRAY_SIZE(names); i++) {
+        snprintf(path, sizeof(path), "%s/%s.html", outdir, names[i]);
+        ok = (0 == i) != file_equals(path, mark);
+    }
+    remove_tree(dir);
+
+    return ok;
+}
+
+/**
+ * Highlight *string* through *cache* and compare the result to the one
+ * of highlight_string
+ */
+static bool cached_equals(HighlightCache *cache, Formatter *fmt, Lexer *lexer, const char *string)
+{
+    bool ok;
+    char *expected, *result;
+    size_t expected_len, result_len;
+
+    result = NULL;
+    highlight_string(string, strlen(string), &expected, &expected_len, fmt, 1, &lexer);
+    ok = 0 == highlight_string_cached(cache, string, strlen(string), &result, &result_len, fmt, 1, &lexer, NULL);
+    ok = ok && expected_len == result_len && 0 == memcmp(expected, result, result_len);
+    free(expected);
+    free(result);
+
+    return ok;
+}
+
+/**
+ * The second request of a string is served from memory
+ */
+static bool test_cache_memory_hit(void)
+{
+    bool ok;
+    Lexer *lexer;
+    Formatter *fmt;
+    HighlightCache *cache;
+    HighlightCacheStats stats;
+
+    lexer = lexer_create(lexer_implementation_by_name("text"));
+    fmt = formatter_create(formatter_implementation_by_name("html"));
+    cache = highlight_cache_create(1024 * 1024, NULL);
+    ok = cached_equals(cache, fmt, lexer, "foo") && cached_equals(cache, fmt, lexer, "foo");
+    highlight_cache_stats(cache, &stats);
+    ok = ok && 1 == stats.misses && 1 == stats.hits && 1 == stats.entries;
+    highlight_cache_destroy(cache);
+    formatter_destroy(fmt);
+    lexer_destroy(lexer, NULL);
+
+    return ok;
+}
+
+/**
+ * A result stored on disk by a cache is found by another one on the same
+ * directory, and the file is readable by everyone
+ */
+static bool test_cache_disk_hit(void)
+{
+    FTS *fts;
+    FTSENT *p;
+    bool ok;
+    size_t files;
+    Lexer *lexer;
+    Formatter *fmt;
+    HighlightCache *cache;
+    HighlightCacheStats stats;
+    char dir[] = "/tmp/shalltest.XXXXXX";
+    char *paths[] = { dir, NULL };
+
+    if (NULL == mkdtemp(dir)) {
+        return false;
+    }
+    lexer = lexer_create(lexer_implementation_by_name("text"));
+    fmt = formatter_create(formatter_implementation_by_name("html"));
+    cache = highlight_cache_create(1024 * 1024, dir);
+    ok = cached_equals(cache, fmt, lexer, "foo");
+    highlight_cache_destroy(cache);
+    files = 0;
+    if (ok && NULL != (fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, NULL))) {
+        while (NULL != (p = fts_read(fts))) {
+            if (FTS_F == p->fts_info) {
+                ++files;
+                ok &= 0644 == (p->fts_statp->st_mode & 0777);
+            }
+        }
+        fts_close(fts);
+    }
+    ok = ok && 1 == files;
+    cache = highlight_cache_create(1024 * 1024, dir);
+    ok = ok && cached_equals(cache, fmt, lexer, "foo");
+    highlight_cache_stats(cache, &stats);
+    ok = ok && 0 == stats.misses && 1 == stats.disk_hits;
+    highlight_cache_destroy(cache);
+    formatter_destroy(fmt);
+    lexer_destroy(lexer, NULL);
+    remove_tree(dir);
+
+    return ok;
+}
+
+/**
+ * When the memory is full, the least recently used result is dropped
+ */
+static bool test_cache_eviction(void)
+{
+    bool ok;
+    Lexer *lexer;
+    char *result;
+    size_t result_len;
+    Formatter *fmt;
+    HighlightCache *cache;
+    HighlightCacheStats stats;
+
+    lexer = lexer_create(lexer_implementation_by_name("text"));
+    fmt = formatter_create(formatter_implementation_by_name("html"));
+    // room for 2 results (of strings of the same length)
+    highlight_string("a", STR_LEN("a"), &result, &result_len, fmt, 1, &lexer);
+    free(result);
+    cache = highlight_cache_create(2 * result_len, NULL);
+    ok = cached_equals(cache, fmt, lexer, "a") && cached_equals(cache, fmt, lexer, "b");
+    // a becomes the most recently used so b is the one dropped for c
+    ok = ok && cached_equals(cache, fmt, lexer, "a") && cached_equals(cache, fmt, lexer, "c");
+    highlight_cache_stats(cache, &stats);
+    ok = ok && 1 == stats.evictions && 1 == stats.hits && 3 == stats.misses && 2 == stats.entries;
+    ok = ok && cached_equals(cache, fmt, lexer, "a") && cached_equals(cache, fmt, lexer, "b");
+    highlight_cache_stats(cache, &stats);
+    ok = ok && 2 == stats.evictions && 2 == stats.hits && 4 == stats.misses && 2 == stats.entries;
+    highlight_cache_destroy(cache);
+    formatter_destroy(fmt);
+    lexer_destroy(lexer, NULL);
+
+    return ok;
+}
+
+/**
+ * The graphic rendition of a character, as a terminal would display it
+ * (colors are kept as their SGR parameters, empty for the default one)
+ */
+typedef struct {
+    bool bold;
+    bool italic;
+    bool underline;
+    char fg[STR_SIZE("38;2;RRR;GGG;BBB")];
+    char bg[STR_SIZE("48;2;RRR;GGG;BBB")];
+} Rendition;
+
+#ifndef SGR_MAX_PARAMETERS
+# define SGR_MAX_PARAMETERS 16
+#endif /* !SGR_MAX_PARAMETERS */
+
+/**
+ * Apply to *r* the parameters of the escape sequence (after its "\e[")
+ * at *p*
+ *
+ * @return the end of the sequence or NULL if it is not one the terminal
+ * formatter is expected to write
+ */
+static const char *sgr_apply(Rendition *r, const char *p, const char *end)
+{
+    char *q;
+    size_t i, params_len;
+    unsigned long params[SGR_MAX_PARAMETERS];
+
+    for (params_len = 0; p < end && 'm' != *p; p = q) {
+        if (params_len > 0) {
+            if (';' != *p) {
+                return NULL;
+            }
+            ++p;
+        }
+        if (params_len >= ARRAY_SIZE(params) || p >= end || *p < '0' || *p > '9') {
+            return NULL;
+        }
+        params[params_len++] = strtoul(p, &q, 10);
+    }
+    if (p >= end || 0 == params_len) {
+        return NULL;
+    }
+    for (i = 0; i < params_len; i++) {
+        char *color;
+
+        switch (params[i]) {
+            case 0:
+                bzero(r, sizeof(*r));
+                break;
+            case 1:
+            case 22:
+                r->bold = 1 == params[i];
+                break;
+            case 3:
+            case 23:
+                r->italic = 3 == params[i];
+                break;
+            case 4:
+            case 24:
+                r->underline = 4 == params[i];
+                break;
+            case 39:
+            case 49:
+                *(39 == params[i] ? r->fg : r->bg) = '\0';
+                break;
+            case 38:
+            case 48:
+                color = 38 == params[i] ? r->fg : r->bg;
+                if (i + 2 < params_len && 5 == params[i + 1]) {
+                    snprintf(color, sizeof(r->fg), "%lu;5;%lu", params[i], params[i + 2]);
+                    i += 2;
+                } else if (i + 4 < params_len && 2 == params[i + 1]) {
+                    snprintf(color, sizeof(r->fg), "%lu;2;%lu;%lu;%lu", params[i], params[i + 2], params[i + 3], params[i + 4]);
+                    i += 4;
+                } else {
+                    return NULL;
+                }
+                break;
+            default:
+                if ((params[i] >= 30 && params[i] <= 37) || (params[i] >= 90 && params[i] <= 97)) {
+                    snprintf(r->fg, sizeof(r->fg), "%lu", params[i]);
+                } else if ((params[i] >= 40 && params[i] <= 47) || (params[i] >= 100 && params[i] <= 107)) {
+                    snprintf(r->bg, sizeof(r->bg), "%lu", params[i]);
+                } else {
+                    return NULL;
+                }
+                break;
+        }
+    }
+
+    return p + 1;
+}
+
+/**
+ * On a blank character, only the underline and the background are visible
+ */
+static bool rendition_equals(const Rendition *a, const Rendition *b, char c)
+{
+    if (a->underline != b->underline || 0 != strcmp(a->bg, b->bg)) {
+        return false;
+    }
+    if (' ' == c || '\t' == c || '\n' == c || '\r' == c) {
+        return true;
+    }
+
+    return a->bold == b->bold && a->italic == b->italic && 0 == strcmp(a->fg, b->fg);
+}
+
+/**
+ * Play the output of the terminal formatter as a terminal would: set, in
+ * *renditions*, the one of each character written
+ *
+ * @return false if the output contains an unexpected escape sequence, more
+ * than renditions_size characters or doesn't leave the terminal in its
+ * default state
+ */
+static bool sgr_play(const String *out, Rendition *renditions, size_t renditions_size, size_t *renditions_len)
+{
+    Rendition r;
+    const char *p, *end;
+    static const Rendition reset = { 0 };
+
+    *renditions_len = 0;
+    bzero(&r, sizeof(r));
+    for (p = out->ptr, end = out->ptr + out->len; p < end; ) {
+        if ('\e' == *p) {
+            if (p + 1 >= end || '[' != p[1] || NULL == (p = sgr_apply(&r, p + STR_LEN("\e["), end))) {
+                return false;
+            }
+        } else {
+            if (*renditions_len >= renditions_size) {
+                return false;
+            }
+            renditions[(*renditions_len)++] = r;
+            ++p;
+        }
+    }
+
+    return rendition_equals(&r, &reset, 'x');
+}
+
+
+#ifndef TERMINAL_STREAM_TOKENS
+# define TERMINAL_STREAM_TOKENS 512
+#endif /* !TERMINAL_STREAM_TOKENS */
+
+/**
+ * Render the same random stream of tokens with the terminal formatter
+ * twice: each token on its own (so with the full sequence of its
+ * attributes) and in a row (where only the attributes which change are
+ * written) and compare what a terminal displays for each character
+ */
+static void terminal_stream_check(const Theme *theme, void *data)
+{
+    bool *ok;
+    size_t i, j;
+    Formatter *fmt;
+    uint64_t state;
+    String *out, *text;
+    const char *mode;
+    const char * const modes[] = { NULL, "mode256", "mode16" };
+    static const char * const texts[] = { "x", "ab", "a b", " ", "\t", "\n", "  \n", "\n\t" };
+    Rendition renditions[TERMINAL_STREAM_TOKENS * 2 * STR_LEN("  \n")], full[_TOKEN_COUNT], *r;
+    int types[ARRAY_SIZE(renditions)];
+    size_t renditions_len, types_len;
+
+    ok = (bool *) data;
+    out = string_new();
+    text = string_new();
+    fmt = formatter_create(termfmt);
+    formatter_set_option_as_string(fmt, "theme", theme_name(theme), strlen(theme_name(theme)));
+    for (i = 0; *ok && i < ARRAY_SIZE(modes); i++) {
+        if (NULL != (mode = modes[i])) {
+            formatter_set_option_as_string(fmt, mode, "1", STR_LEN("1"));
+        }
+        for (j = 0; *ok && j < _TOKEN_COUNT; j++) {
+            string_truncate(out);
+            fmt->imp->start_document(out, &fmt->optvals);
+            fmt->imp->start_token(j, out, &fmt->optvals);
+            fmt->imp->write_token(out, "x", STR_LEN("x"), &fmt->optvals);
+            fmt->imp->end_token(j, out, &fmt->optvals);
+            fmt->imp->end_document(out, &fmt->optvals);
+            if (!sgr_play(out, &full[j], 1, &renditions_len) || 1 != renditions_len) {
+                STERR("terminal formatter, theme %s, %s: unexpected output for the token type %zu", theme_name(theme), NULL == mode ? "true color" : mode, j);
+                *ok = false;
+            }
+        }
+        // deterministic, for a failure to be reproducible
+        state = 0x9E3779B97F4A7C15ULL;
+        string_truncate(out);
+        string_truncate(text);
+        types_len = 0;
+        fmt->imp->start_document(out, &fmt->optvals);
+        for (j = 0; *ok && j < TERMINAL_STREAM_TOKENS; j++) {
+            int token;
+            size_t k, writes;
+
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            token = (int) (((state * 0x2545F4914F6CDD1DULL) >> 32) % _TOKEN_COUNT);
+            fmt->imp->start_token(token, out, &fmt->optvals);
+            // a token may be written in several pieces
+            for (writes = 1 + (state & 1), k = 0; k < writes; k++) {
+                const char *t;
+
+                t = texts[(state >> (8 + 4 * k)) % ARRAY_SIZE(texts)];
+                fmt->imp->write_token(out, t, strlen(t), &fmt->optvals);
+                string_append_string(text, t);
+                for (; types_len < text->len; types_len++) {
+                    types[types_len] = token;
+                }
+            }
+            fmt->imp->end_token(token, out, &fmt->optvals);
+        }
+        fmt->imp->end_document(out, &fmt->optvals);
+        if (*ok && (!sgr_play(out, renditions, ARRAY_SIZE(renditions), &renditions_len) || renditions_len != text->len)) {
+            STERR("terminal formatter, theme %s, %s: unexpected output for a stream of tokens", theme_name(theme), NULL == mode ? "true color" : mode);
+            *ok = false;
+        }
+        for (j = 0, r = renditions; *ok && j < renditions_len; j++, r++) {
+            if (!rendition_equals(r, &full[types[j]], text->ptr[j])) {
+                STERR("terminal formatter, theme %s, %s: character %zu (token type %d) is not displayed as the token on its own", theme_name(theme), NULL == mode ? "true color" : mode, j, types[j]);
+                *ok = false;
+            }
+        }
+    }
+    formatter_destroy(fmt);
+    string_destroy(text);
+    string_destroy(out);
+}
+
+/**
+ * The attributes which are kept from one token to the next display as
+ * a full sequence for each token
+ */
+static bool test_terminal_delta(void)
+{
+    bool ok;
+
+    ok = true;
+    theme_each(terminal_stream_check, &ok);
+
+    return ok;
+}
+
+/**
+ * Checks which can't be expressed by a .ssc file
+ */
+static const struct {
+    const char *description;
+    bool (*run)(void);
+} internal_tests[] = {
+    { "threads used by a call on the pool once it was grown", test_pool_size },
+    { "incremental highlighting of a tree by shall", test_tree_incremental },
+    { "cache hit in memory", test_cache_memory_hit },
+    { "cache hit on disk", test_cache_disk_hit },
+    { "cache eviction of the least recently used result", test_cache_eviction },
+    { "terminal formatter, attributes written as the difference with the previous token", test_terminal_delta },
+};
+
+static int procinternals(void)
+{
+    int ret;
+    size_t i;
+
+    ret = 1;
+    for (i = 0; i < ARRAY_SIZE(internal_tests); i++) {
+        bool ok;
+
+        ok = internal_tests[i].run();
+        printf("Test: %s (internal) [ %s ]\n", internal_tests[i].description, ok ? GREEN("PASS") : RED("FAIL"));
+        ret &= ok;
+    }
+    // the threads of the pool would not survive the fork of the workers of -j
+    highlight_batch_pool_destroy();
+
     return ret;
 }
 
 int main(int argc, char **argv)
 {
+    const char *p;
     st_ctxt_t ctxt;
+    unsigned long jobs;
     int o, res, verbosity;
 
     res = 1;
+    jobs = 1;
     verbosity = 0;
     ctxt_init(&ctxt);
+    if (NULL != (p = strrchr(argv[0], '/'))) {
+        snprintf(shall_path, sizeof(shall_path), "%.*s/shall", (int) (p - argv[0]), argv[0]);
+    }
     while (-1 != (o = getopt_long(argc, argv, optstr, long_options, NULL))) {
         switch (o) {
+            case 'j':
+            {
+                char *endptr;
+
+                jobs = strtoul(optarg, &endptr, 10);
+                if ('\0' != *endptr) {
+                    fprintf(stderr, "invalid number of jobs '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                if (0 == jobs) {
+                    jobs = (unsigned long) MAX(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+                }
+                break;
+            }
             case 'v':
                 ++verbosity;
                 break;
@@ -454,7 +1771,8 @@ int main(int argc, char **argv)
             res &= procfile(*argv, &ctxt, verbosity);
         }
 #else
-        res = procdir(argv, &ctxt, verbosity);
+        res = procinternals();
+        res &= procdir(argv, &ctxt, verbosity, jobs);
 #endif
     }
     ctxt_destroy(&ctxt);
@@ -0,0 +1,310 @@
+/**
+ * @file cli/bin/shalltrace.c
+ * @brief dump of a trace written by shall --trace
+ *
+ * By default, the records are printed from the oldest to the most recent,
+ * one per line: document, offset, length, type of the token then the lexer
+ * and the line of the rule which produced it. With -H, the rules are
+ * instead ranked by the number of tokens they produced, to find out which
+ * one fires in a loop.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "cpp.h"
+#include "shall.h"
+#include "tokens.h"
+#include "trace.h"
+#include "xtring.h"
+
+#ifndef EUSAGE
+# define EUSAGE -2
+#endif /* !EUSAGE */
+
+#ifdef _MSC_VER
+extern char __progname[];
+#else
+extern char *__progname;
+#endif /* _MSC_VER */
+
+#define STERR(format, ...) \
+    fprintf(stderr, "[ ERR ] " format "\n", ## __VA_ARGS__)
+
+#define MAX_EXCERPT_LEN 40U
+
+static char optstr[] = "Hn:s:";
+
+static struct option long_options[] = {
+    { "hotspots", no_argument,       NULL, 'H' },
+    { "limit",    required_argument, NULL, 'n' },
+    { "source",   required_argument, NULL, 's' },
+    { NULL,       no_argument,       NULL, 0   }
+};
+
+static void usage(void)
+{
+    fprintf(
+        stderr,
+        "usage: %s [-%s] trace\n",
+        __progname,
+        optstr
+    );
+    exit(EUSAGE);
+}
+
+typedef struct {
+    const HighlightTrace *trace;
+    // the content of the document (NULL if not given)
+    const String *source;
+    // the records left to skip before printing
+    uint64_t skip;
+    // the records kept for -H
+    HighlightTraceRecord *records;
+    size_t records_len;
+} DumpContext;
+
+static const char *lexer_name(const HighlightTrace *trace, uint8_t id)
+{
+    const char *name;
+
+    return NULL == (name = highlight_trace_lexer_name(trace, id)) ? "?" : name;
+}
+
+static const char *token_name(uint8_t type)
+{
+    return type < _TOKEN_COUNT ? tokens[type].name : "?";
+}
+
+/**
+ * Print the text of a token, escaped and shortened if needed
+ */
+static void print_excerpt(const String *source, const HighlightTraceRecord *record)
+{
+    size_t i, len;
+
+    if (NULL == source || record->offset > source->len || record->length > source->len - record->offset) {
+        return;
+    }
+    len = MIN(record->length, MAX_EXCERPT_LEN);
+    fputs(" \"", stdout);
+    for (i = 0; i < len; i++) {
+        unsigned char c;
+
+        c = (unsigned char) source->ptr[record->offset + i];
+        if ('\n' == c) {
+            fputs("\\n", stdout);
+        } else if ('\t' == c) {
+            fputs("\\t", stdout);
+        } else if ('"' == c || '\\' == c) {
+            printf("\\%c", c);
+        } else if (c < 0x20 || 0x7F == c) {
+            printf("\\x%02X", c);
+        } else {
+            putchar(c);
+        }
+    }
+    fputs(len < record->length ? "\"..." : "\"", stdout);
+}
+
+static void print_record_cb(const HighlightTraceRecord *record, void *data)
+{
+    DumpContext *ctxt;
+
+    ctxt = (DumpContext *) data;
+    if (ctxt->skip > 0) {
+        --ctxt->skip;
+        return;
+    }
+    printf("%5" PRIu16 " %10" PRIu32 " %6" PRIu32 " %-24s %s:%" PRIu32, record->document, record->offset, record->length, token_name(record->type), lexer_name(ctxt->trace, record->lexer), record->line);
+    // offsets are only meaningful against the source for a single document
+    if (0 == record->document) {
+        print_excerpt(ctxt->source, record);
+    }
+    putchar('\n');
+}
+
+static void count_record_cb(const HighlightTraceRecord *UNUSED(record), void *data)
+{
+    ++*((uint64_t *) data);
+}
+
+static void collect_record_cb(const HighlightTraceRecord *record, void *data)
+{
+    DumpContext *ctxt;
+
+    ctxt = (DumpContext *) data;
+    ctxt->records[ctxt->records_len++] = *record;
+}
+
+static int record_by_rule_cmp(const void *a, const void *b)
+{
+    const HighlightTraceRecord *ra, *rb;
+
+    ra = (const HighlightTraceRecord *) a;
+    rb = (const HighlightTraceRecord *) b;
+    if (ra->lexer != rb->lexer) {
+        return ra->lexer - rb->lexer;
+    }
+
+    return ra->line < rb->line ? -1 : ra->line > rb->line;
+}
+
+typedef struct {
+    uint8_t lexer;
+    uint32_t line;
+    uint64_t hits;
+    uint64_t bytes;
+} Hotspot;
+
+static int hotspot_cmp(const void *a, const void *b)
+{
+    const Hotspot *ha, *hb;
+
+    ha = (const Hotspot *) a;
+    hb = (const Hotspot *) b;
+    if (ha->hits != hb->hits) {
+        return ha->hits > hb->hits ? -1 : 1;
+    }
+
+    return ha->bytes > hb->bytes ? -1 : ha->bytes < hb->bytes;
+}
+
+/**
+ * Rank the rules by the number of tokens they produced
+ */
+static void print_hotspots(DumpContext *ctxt, uint64_t records, uint64_t limit)
+{
+    size_t i, hotspots_len;
+    Hotspot *hotspots;
+
+    ctxt->records = mem_new_n(*ctxt->records, records);
+    ctxt->records_len = 0;
+    highlight_trace_each(ctxt->trace, collect_record_cb, ctxt);
+    qsort(ctxt->records, ctxt->records_len, sizeof(*ctxt->records), record_by_rule_cmp);
+    hotspots = mem_new_n(*hotspots, MAX(ctxt->records_len, 1U));
+    hotspots_len = 0;
+    for (i = 0; i < ctxt->records_len; i++) {
+        if (0 == hotspots_len || ctxt->records[i].lexer != hotspots[hotspots_len - 1].lexer || ctxt->records[i].line != hotspots[hotspots_len - 1].line) {
+            hotspots[hotspots_len].lexer = ctxt->records[i].lexer;
+            hotspots[hotspots_len].line = ctxt->records[i].line;
+            hotspots[hotspots_len].hits = hotspots[hotspots_len].bytes = 0;
+            ++hotspots_len;
+        }
+        ++hotspots[hotspots_len - 1].hits;
+        hotspots[hotspots_len - 1].bytes += ctxt->records[i].length;
+    }
+    qsort(hotspots, hotspots_len, sizeof(*hotspots), hotspot_cmp);
+    printf("%-24s %10s %7s %12s\n", "rule", "tokens", "%", "bytes");
+    for (i = 0; i < hotspots_len && (0 == limit || i < limit); i++) {
+        char rule[64];
+
+        snprintf(rule, ARRAY_SIZE(rule), "%s:%" PRIu32, lexer_name(ctxt->trace, hotspots[i].lexer), hotspots[i].line);
+        printf("%-24s %10" PRIu64 " %6.2f%% %12" PRIu64 "\n", rule, hotspots[i].hits, 100.0 * hotspots[i].hits / ctxt->records_len, hotspots[i].bytes);
+    }
+    free(hotspots);
+    free(ctxt->records);
+}
+
+/**
+ * Read a whole file
+ *
+ * @return NULL on failure else its content
+ */
+static String *read_file(const char *filename)
+{
+    FILE *fp;
+    size_t read;
+    String *buffer;
+    char chunk[8192];
+
+    if (NULL == (fp = fopen(filename, "rb"))) {
+        return NULL;
+    }
+    buffer = string_new();
+    while ((read = fread(chunk, 1, ARRAY_SIZE(chunk), fp)) > 0) {
+        string_append_string_len(buffer, chunk, read);
+    }
+    fclose(fp);
+
+    return buffer;
+}
+
+int main(int argc, char **argv)
+{
+    int o, ret;
+    FILE *fp;
+    bool hFlag;
+    String *source;
+    DumpContext ctxt;
+    HighlightTrace *trace;
+    uint64_t limit, count, records;
+
+    limit = 0;
+    hFlag = false;
+    source = NULL;
+    ret = EXIT_SUCCESS;
+    while (-1 != (o = getopt_long(argc, argv, optstr, long_options, NULL))) {
+        switch (o) {
+            case 'H':
+                hFlag = true;
+                break;
+            case 'n':
+                limit = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                if (NULL == source && NULL == (source = read_file(optarg))) {
+                    STERR("can't read %s: %s", optarg, strerror(errno));
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (1 != argc) {
+        usage();
+    }
+    if (NULL == (fp = fopen(argv[0], "rb"))) {
+        STERR("can't open %s: %s", argv[0], strerror(errno));
+        return EXIT_FAILURE;
+    }
+    trace = highlight_trace_read(fp);
+    fclose(fp);
+    if (NULL == trace) {
+        STERR("%s is not a valid trace", argv[0]);
+        ret = EXIT_FAILURE;
+    } else {
+        records = 0;
+        highlight_trace_each(trace, count_record_cb, &records);
+        count = highlight_trace_count(trace);
+        if (count > records) {
+            printf("# %" PRIu64 " token(s) traced, only the last %" PRIu64 " were kept\n", count, records);
+        }
+        bzero(&ctxt, sizeof(ctxt));
+        ctxt.trace = trace;
+        ctxt.source = source;
+        if (hFlag) {
+            print_hotspots(&ctxt, records, limit);
+        } else {
+            // with -n, the most recent records
+            ctxt.skip = 0 != limit && records > limit ? records - limit : 0;
+            highlight_trace_each(trace, print_record_cb, &ctxt);
+        }
+        highlight_trace_destroy(trace);
+    }
+    if (NULL != source) {
+        string_destroy(source);
+    }
+
+    return ret;
+}
@@ -0,0 +1,111 @@
+/**
+ * @file cli/shared/allocations.c
+ * @brief count the allocations of the process, libshall included
+ *
+ * Only linked to the tools which measure them (shalltest, shallbench): it
+ * replaces malloc & co for the whole executable. The counters are updated
+ * atomically, the threads of the batch pool allocate too.
+ */
+
+#include <stdbool.h>
+
+#include "allocations.h"
+
+#ifdef WITH_ALLOCATION_COUNTING
+# include <malloc.h>
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+static struct {
+    // number of (re)allocations
+    size_t allocations;
+    // bytes currently allocated
+    ssize_t live;
+    // the highest value of live since it was last reset
+    ssize_t peak;
+} memory;
+
+static void *memory_add(void *ptr)
+{
+    if (NULL != ptr) {
+        ssize_t live, peak;
+
+        __atomic_add_fetch(&memory.allocations, 1, __ATOMIC_RELAXED);
+        live = __atomic_add_fetch(&memory.live, (ssize_t) malloc_usable_size(ptr), __ATOMIC_RELAXED);
+        peak = __atomic_load_n(&memory.peak, __ATOMIC_RELAXED);
+        // on failure, peak is set to the current value
+        while (live > peak && !__atomic_compare_exchange_n(&memory.peak, &peak, live, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+    }
+
+    return ptr;
+}
+
+void *malloc(size_t size)
+{
+    return memory_add(__libc_malloc(size));
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    return memory_add(__libc_calloc(nmemb, size));
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *new;
+    size_t old_size;
+
+    old_size = NULL == ptr ? 0 : malloc_usable_size(ptr);
+    if (NULL == (new = __libc_realloc(ptr, size)) && 0 != size) {
+        // ptr is left untouched
+        return NULL;
+    }
+    __atomic_sub_fetch(&memory.live, (ssize_t) old_size, __ATOMIC_RELAXED);
+
+    return memory_add(new);
+}
+
+void free(void *ptr)
+{
+    if (NULL != ptr) {
+        __atomic_sub_fetch(&memory.live, (ssize_t) malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    }
+    __libc_free(ptr);
+}
+
+/**
+ * @return the number of (re)allocations made since the start of the process
+ */
+size_t allocations_count(void)
+{
+    return __atomic_load_n(&memory.allocations, __ATOMIC_RELAXED);
+}
+
+/**
+ * @return the highest number of bytes allocated at the same time since the
+ * last call to allocations_peak_reset
+ */
+ssize_t allocations_peak(void)
+{
+    return __atomic_load_n(&memory.peak, __ATOMIC_RELAXED);
+}
+
+/**
+ * Start a new measure of the peak from the bytes currently allocated
+ *
+ * @return these bytes
+ */
+ssize_t allocations_peak_reset(void)
+{
+    ssize_t live;
+
+    live = __atomic_load_n(&memory.live, __ATOMIC_RELAXED);
+    __atomic_store_n(&memory.peak, live, __ATOMIC_RELAXED);
+
+    return live;
+}
+#endif /* WITH_ALLOCATION_COUNTING */
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Allocation counting: with the GNU libc, the allocator can be replaced by
+ * the executable itself (the library is then served by the functions of
+ * allocations.c too) and the original one is still reachable by its
+ * __libc_ names. Elsewhere, nothing is counted.
+ */
+#ifdef __GLIBC__
+# define WITH_ALLOCATION_COUNTING 1
+
+size_t allocations_count(void);
+ssize_t allocations_peak(void);
+ssize_t allocations_peak_reset(void);
+#endif /* __GLIBC__ */
@@ -0,0 +1,256 @@
+/**
+ * @file cli/shared/manifest.c
+ * @brief record of the files highlighted by a previous run (for incremental rebuilds)
+ *
+ * The manifest is a text file, one entry per line, fields separated by tabulations:
+ * size, mtime, content hash, lexer name, configuration hash and, last, the path
+ * (relative to the source directory). As a file name can contain any byte but
+ * '\0' and '/', backslashes, tabulations and new lines of the path are escaped
+ * (\\, \t and \n).
+ * The first line is a header used to reject incompatible versions.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "cpp.h"
+#include "manifest.h"
+
+#define MANIFEST_HEADER "# shall manifest v2\n"
+
+static void manifest_entry_destroy(void *data)
+{
+    ManifestEntry *e;
+
+    e = (ManifestEntry *) data;
+    free(e->path);
+    free(e->lexer);
+    free(e->config);
+    free(e);
+}
+
+/**
+ * Initialize an empty manifest
+ *
+ * @param m the manifest
+ */
+void manifest_init(Manifest *m)
+{
+    // the key is owned by the entry (e->path), so no key_dtor
+    hashtable_ascii_cs_init(&m->entries, NULL, NULL, manifest_entry_destroy);
+}
+
+/**
+ * Dispose of a manifest
+ *
+ * @param m the manifest
+ */
+void manifest_destroy(Manifest *m)
+{
+    hashtable_destroy(&m->entries);
+}
+
+/**
+ * Get the entry of a file
+ *
+ * @param m the manifest
+ * @param path the relative path of the file
+ *
+ * @return NULL if the file is unknown
+ */
+ManifestEntry *manifest_get(Manifest *m, const char *path)
+{
+    ManifestEntry *e;
+
+    if (hashtable_get(&m->entries, path, &e)) {
+        return e;
+    }
+
+    return NULL;
+}
+
+/**
+ * Add or replace the entry of a file
+ *
+ * @param m the manifest
+ * @param path the relative path of the file
+ * @param size its size
+ * @param mtime its modification time
+ * @param hash the hash of its content
+ * @param lexer the name of the lexer used to highlight it
+ * @param config a hash of the options (formatter, formatter and lexer options) used to highlight it
+ */
+void manifest_put(Manifest *m, const char *path, off_t size, time_t mtime, const Hash128 *hash, const char *lexer, const char *config)
+{
+    ManifestEntry *e;
+
+    e = malloc(sizeof(*e));
+    e->path = strdup(path);
+    e->size = size;
+    e->mtime = mtime;
+    e->hash = *hash;
+    e->lexer = strdup(lexer);
+    e->config = strdup(config);
+    hashtable_put(&m->entries, 0, e->path, e, NULL);
+}
+
+/**
+ * Write *path* to *fp*, escaping the characters used as separators
+ */
+static void manifest_write_path(FILE *fp, const char *path)
+{
+    const char *p;
+
+    for (p = path; '\0' != *p; p++) {
+        switch (*p) {
+            case '\\':
+                fputs("\\\\", fp);
+                break;
+            case '\t':
+                fputs("\\t", fp);
+                break;
+            case '\n':
+                fputs("\\n", fp);
+                break;
+            default:
+                fputc(*p, fp);
+                break;
+        }
+    }
+}
+
+/**
+ * Unescape, in place, a path written by manifest_write_path
+ *
+ * @return false if the path is not correctly escaped
+ */
+static bool manifest_unescape_path(char *path)
+{
+    char *r, *w;
+
+    for (r = w = path; '\0' != *r; r++) {
+        if ('\\' == *r) {
+            switch (*++r) {
+                case '\\':
+                    *w++ = '\\';
+                    break;
+                case 't':
+                    *w++ = '\t';
+                    break;
+                case 'n':
+                    *w++ = '\n';
+                    break;
+                default:
+                    return false;
+            }
+        } else {
+            *w++ = *r;
+        }
+    }
+    *w = '\0';
+
+    return true;
+}
+
+/**
+ * Load a manifest previously written by manifest_save
+ *
+ * @param m the manifest (have to be initialized)
+ * @param filename the file to read
+ *
+ * @return false if the file does not exist or is not a valid manifest
+ * (m is left empty in this case)
+ */
+bool manifest_load(Manifest *m, const char *filename)
+{
+    FILE *fp;
+    bool ok;
+    char *line;
+    size_t line_size;
+    ssize_t line_len;
+
+    if (NULL == (fp = fopen(filename, "r"))) {
+        return false;
+    }
+    line = NULL;
+    line_size = 0;
+    ok = -1 != getline(&line, &line_size, fp) && 0 == strcmp(line, MANIFEST_HEADER);
+    while (ok && -1 != (line_len = getline(&line, &line_size, fp))) {
+        char *p, *fields[6];
+        size_t i;
+        Hash128 hash;
+
+        if ('\n' != line[line_len - 1]) {
+            ok = false;
+            break;
+        }
+        line[line_len - 1] = '\0';
+        p = line;
+        for (i = 0; i < ARRAY_SIZE(fields) - 1; i++) {
+            fields[i] = p;
+            if (NULL == (p = strchr(p, '\t'))) {
+                break;
+            }
+            *p++ = '\0';
+        }
+        fields[ARRAY_SIZE(fields) - 1] = p;
+        if (NULL == p || 0 != hash128_from_hex(fields[2], &hash) || !manifest_unescape_path(p)) {
+            ok = false;
+            break;
+        }
+        manifest_put(m, fields[5], (off_t) strtoll(fields[0], NULL, 10), (time_t) strtoll(fields[1], NULL, 10), &hash, fields[3], fields[4]);
+    }
+    free(line);
+    fclose(fp);
+    if (!ok) {
+        hashtable_clear(&m->entries);
+    }
+
+    return ok;
+}
+
+/**
+ * Write a manifest, atomically: the previous one, if any, is only replaced
+ * once the new one is fully written
+ *
+ * @param m the manifest
+ * @param filename the file to (over)write
+ *
+ * @return false on failure
+ */
+bool manifest_save(Manifest *m, const char *filename)
+{
+    FILE *fp;
+    bool ok;
+    Iterator it;
+    ManifestEntry *e;
+    char tmp[8192], hex[HASH128_HEX_SIZE];
+
+    if ((size_t) snprintf(tmp, sizeof(tmp), "%s.%ld", filename, (long) getpid()) >= sizeof(tmp)) {
+        return false;
+    }
+    if (NULL == (fp = fopen(tmp, "w"))) {
+        return false;
+    }
+    fputs(MANIFEST_HEADER, fp);
+    hashtable_to_iterator(&it, &m->entries);
+    for (iterator_first(&it); iterator_is_valid(&it, NULL, &e); iterator_next(&it)) {
+        fprintf(fp, "%" PRIdMAX "\t%" PRIdMAX "\t%s\t%s\t%s\t", (intmax_t) e->size, (intmax_t) e->mtime, hash128_to_hex(&e->hash, hex), e->lexer, e->config);
+        manifest_write_path(fp, e->path);
+        fputc('\n', fp);
+    }
+    iterator_close(&it);
+    ok = 0 == ferror(fp);
+    ok &= 0 == fclose(fp);
+    if (ok) {
+        ok = 0 == rename(tmp, filename);
+    }
+    if (!ok) {
+        unlink(tmp);
+    }
+
+    return ok;
+}
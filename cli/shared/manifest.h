@@ -0,0 +1,30 @@
+#pragma once
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+#include "hash.h"
+#include "hashtable.h"
+
+#define MANIFEST_FILENAME ".shall-manifest"
+
+typedef struct {
+    char *path;
+    off_t size;
+    time_t mtime;
+    Hash128 hash;
+    char *lexer;
+    char *config;
+} ManifestEntry;
+
+typedef struct {
+    HashTable entries;
+} Manifest;
+
+void manifest_init(Manifest *);
+bool manifest_load(Manifest *, const char *);
+bool manifest_save(Manifest *, const char *);
+void manifest_destroy(Manifest *);
+
+ManifestEntry *manifest_get(Manifest *, const char *);
+void manifest_put(Manifest *, const char *, off_t, time_t, const Hash128 *, const char *, const char *);
@@ -0,0 +1,388 @@
+/**
+ * @file cli/shared/protocol.c
+ * @brief framing of the requests/responses exchanged by shall --serve and shall --client
+ *
+ * Each message is a frame: its length, as a 32 bits big endian integer,
+ * followed by its body.
+ *
+ * The body of a request is made of header lines ("<name> <value>\n"),
+ * an empty line then the document to highlight (UTF-8). Recognized headers:
+ * - formatter: the name of the formatter
+ * - filename: a filename used to find out the lexer
+ * - lexer: the name of a lexer (repeat it to chain lexers)
+ * - lexer-option: an option (name=value) for the top lexer
+ * - formatter-option: an option (name=value) for the formatter
+ * - timeout: the maximum time, in milliseconds, to process the request
+ *   (the server may lower it)
+ *
+ * A header can't contain a new line.
+ *
+ * The body of a response starts with a status line: "ok", "timeout" or
+ * "error <message>". For "ok", the result follows. The status line is
+ * "ok <limit>" instead if the end of the document is not highlighted
+ * because a limit (timeout, max-output, max-tokens) was reached.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpp.h"
+#include "protocol.h"
+
+/**
+ * @return the current time, in milliseconds, on which deadlines are based
+ */
+uint64_t protocol_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Wait for fd to be ready for events
+ *
+ * @return false if the deadline (0 for none) is passed or on error
+ */
+static bool wait_ready(int fd, short events, uint64_t deadline)
+{
+    int ret, timeout;
+    uint64_t now;
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    do {
+        timeout = -1;
+        if (0 != deadline) {
+            if ((now = protocol_now_ms()) >= deadline) {
+                return false;
+            }
+            timeout = (int) MIN(deadline - now, (uint64_t) INT_MAX);
+        }
+        pfd.revents = 0;
+    } while (-1 == (ret = poll(&pfd, 1, timeout)) && EINTR == errno);
+
+    return ret > 0;
+}
+
+static bool read_all(int fd, char *buffer, size_t buffer_len, uint64_t deadline)
+{
+    ssize_t r;
+    size_t total;
+
+    for (total = 0; total < buffer_len; total += r) {
+        if (!wait_ready(fd, POLLIN, deadline)) {
+            return false;
+        }
+        if ((r = read(fd, buffer + total, buffer_len - total)) <= 0) {
+            if (-1 == r && (EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno)) {
+                r = 0;
+                continue;
+            }
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool write_all(int fd, const char *buffer, size_t buffer_len, uint64_t deadline)
+{
+    ssize_t w;
+    size_t total;
+
+    for (total = 0; total < buffer_len; total += w) {
+        if (!wait_ready(fd, POLLOUT, deadline)) {
+            return false;
+        }
+        if ((w = write(fd, buffer + total, buffer_len - total)) <= 0) {
+            if (-1 == w && (EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno)) {
+                w = 0;
+                continue;
+            }
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Read a frame
+ *
+ * @param fd the socket
+ * @param body its body (NUL terminated), to free
+ * @param body_len the length of body
+ * @param deadline the time (see protocol_now_ms) by which the whole frame
+ * has to be received, 0 for none
+ *
+ * @return false on end of stream, error, deadline passed or a frame bigger
+ * than PROTOCOL_MAX_FRAME_SIZE
+ */
+bool frame_read(int fd, char **body, size_t *body_len, uint64_t deadline)
+{
+    uint8_t header[4];
+    uint32_t len;
+
+    if (!read_all(fd, (char *) header, sizeof(header), deadline)) {
+        return false;
+    }
+    len = (uint32_t) header[0] << 24 | (uint32_t) header[1] << 16 | (uint32_t) header[2] << 8 | header[3];
+    if (len > PROTOCOL_MAX_FRAME_SIZE || NULL == (*body = malloc(len + 1))) {
+        return false;
+    }
+    if (!read_all(fd, *body, len, deadline)) {
+        free(*body);
+        return false;
+    }
+    (*body)[len] = '\0';
+    *body_len = len;
+
+    return true;
+}
+
+/**
+ * Write a frame made of two parts (to avoid a copy of the payload)
+ *
+ * @param fd the socket
+ * @param head the first part of the body
+ * @param head_len its length
+ * @param payload the second part (may be NULL if payload_len is 0)
+ * @param payload_len its length
+ * @param deadline the time (see protocol_now_ms) by which the whole frame
+ * has to be sent, 0 for none
+ *
+ * @return false on error or deadline passed
+ */
+bool frame_write(int fd, const char *head, size_t head_len, const char *payload, size_t payload_len, uint64_t deadline)
+{
+    uint8_t header[4];
+    size_t len;
+
+    len = head_len + payload_len;
+    if (len > PROTOCOL_MAX_FRAME_SIZE) {
+        return false;
+    }
+    header[0] = (len >> 24) & 0xFF;
+    header[1] = (len >> 16) & 0xFF;
+    header[2] = (len >> 8) & 0xFF;
+    header[3] = len & 0xFF;
+
+    return write_all(fd, (const char *) header, sizeof(header), deadline) && write_all(fd, head, head_len, deadline) && write_all(fd, payload, payload_len, deadline);
+}
+
+/**
+ * Add a header to a request being built
+ *
+ * @param buffer the headers
+ * @param name the name of the header
+ * @param value its value
+ *
+ * @return false (nothing is added) if value contains a new line
+ */
+bool request_header_append(String *buffer, const char *name, const char *value)
+{
+    if (NULL != strchr(value, '\n')) {
+        return false;
+    }
+    string_append_string(buffer, name);
+    string_append_char(buffer, ' ');
+    string_append_string(buffer, value);
+    string_append_char(buffer, '\n');
+
+    return true;
+}
+
+/**
+ * Add an option header (lexer-option or formatter-option) to a request
+ * being built
+ *
+ * @param buffer the headers
+ * @param name the name of the header
+ * @param option the name of the option
+ * @param value its value
+ * @param value_len the length of value
+ *
+ * @return false (nothing is added) if the option contains a new line
+ */
+bool request_option_append(String *buffer, const char *name, const char *option, const char *value, size_t value_len)
+{
+    if (NULL != strchr(option, '\n') || NULL != memchr(value, '\n', value_len)) {
+        return false;
+    }
+    string_append_string(buffer, name);
+    string_append_char(buffer, ' ');
+    string_append_string(buffer, option);
+    string_append_char(buffer, '=');
+    string_append_string_len(buffer, value, value_len);
+    string_append_char(buffer, '\n');
+
+    return true;
+}
+
+/**
+ * Parse the body of a request. The body is modified in place and has to
+ * be kept until the request is freed.
+ *
+ * @param body the body of the frame
+ * @param body_len its length
+ * @param r the request to fill
+ *
+ * @return false if the request is malformed
+ */
+bool request_parse(char *body, size_t body_len, Request *r)
+{
+    int o;
+    char *p, *end;
+
+    bzero(r, sizeof(*r));
+    for (o = 0; o < COUNT; o++) {
+        options_store_init(&r->options[o]);
+    }
+    p = body;
+    end = body + body_len;
+    while (p < end && '\n' != *p) {
+        char *eol, *value;
+
+        if (NULL == (eol = memchr(p, '\n', end - p))) {
+            return false;
+        }
+        *eol = '\0';
+        if (NULL == (value = strchr(p, ' '))) {
+            return false;
+        }
+        *value++ = '\0';
+        if (0 == strcmp(p, "formatter")) {
+            r->formatter = value;
+        } else if (0 == strcmp(p, "filename")) {
+            r->filename = value;
+        } else if (0 == strcmp(p, "lexer")) {
+            if (r->lexers_len >= ARRAY_SIZE(r->lexers)) {
+                return false;
+            }
+            r->lexers[r->lexers_len++] = value;
+        } else if (0 == strcmp(p, "lexer-option")) {
+            options_store_add(&r->options[LEXER], value);
+        } else if (0 == strcmp(p, "formatter-option")) {
+            options_store_add(&r->options[FORMATTER], value);
+        } else if (0 == strcmp(p, "timeout")) {
+            r->timeout = strtoul(value, NULL, 10);
+        }
+        // unknown headers are ignored for forward compatibility
+        p = eol + 1;
+    }
+    if (p >= end) {
+        return false;
+    }
+    r->payload = p + 1;
+    r->payload_len = end - r->payload;
+
+    return true;
+}
+
+/**
+ * Free the memory allocated by request_parse (not the body)
+ *
+ * @param r the request
+ */
+void request_free(Request *r)
+{
+    int o;
+
+    for (o = 0; o < COUNT; o++) {
+        options_store_free(&r->options[o]);
+    }
+}
+
+/**
+ * Send a response
+ *
+ * @param fd the socket
+ * @param status the status
+ * @param message an error message for RESPONSE_ERROR (on one line),
+ * the limit reached (if any, else NULL) for RESPONSE_OK
+ * @param payload the result for RESPONSE_OK
+ * @param payload_len its length
+ * @param deadline the time (see protocol_now_ms) by which the whole
+ * response has to be sent, 0 for none
+ *
+ * @return false on error or deadline passed
+ */
+bool response_write(int fd, ResponseStatus status, const char *message, const char *payload, size_t payload_len, uint64_t deadline)
+{
+    bool ok;
+    String *head;
+
+    head = string_new();
+    switch (status) {
+        case RESPONSE_OK:
+            STRING_APPEND_STRING(head, "ok");
+            if (NULL != message) {
+                string_append_char(head, ' ');
+                string_append_string(head, message);
+            }
+            string_append_char(head, '\n');
+            break;
+        case RESPONSE_TIMEOUT:
+            STRING_APPEND_STRING(head, "timeout\n");
+            payload_len = 0;
+            break;
+        default:
+            STRING_APPEND_STRING(head, "error ");
+            string_append_string(head, message);
+            string_append_char(head, '\n');
+            payload_len = 0;
+            break;
+    }
+    ok = frame_write(fd, head->ptr, head->len, payload, payload_len, deadline);
+    string_destroy(head);
+
+    return ok;
+}
+
+/**
+ * Parse the body of a response (in place)
+ *
+ * @param body the body of the frame
+ * @param body_len its length
+ * @param message set to the error message for RESPONSE_ERROR, for RESPONSE_OK
+ * to the limit reached (NULL if the whole document was highlighted)
+ * @param payload set to the result for RESPONSE_OK
+ * @param payload_len its length
+ *
+ * @return the status of the response (RESPONSE_ERROR if malformed)
+ */
+ResponseStatus response_parse(char *body, size_t body_len, const char **message, const char **payload, size_t *payload_len)
+{
+    char *eol;
+
+    *message = "malformed response";
+    *payload = NULL;
+    *payload_len = 0;
+    if (NULL == (eol = memchr(body, '\n', body_len))) {
+        return RESPONSE_ERROR;
+    }
+    *eol = '\0';
+    if (0 == strcmp(body, "ok") || 0 == strncmp(body, "ok ", STR_LEN("ok "))) {
+        *message = '\0' == body[STR_LEN("ok")] ? NULL : body + STR_LEN("ok ");
+        *payload = eol + 1;
+        *payload_len = body + body_len - *payload;
+        return RESPONSE_OK;
+    } else if (0 == strcmp(body, "timeout")) {
+        *message = "timeout";
+        return RESPONSE_TIMEOUT;
+    } else if (0 == strncmp(body, "error ", STR_LEN("error "))) {
+        *message = body + STR_LEN("error ");
+    }
+
+    return RESPONSE_ERROR;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "optparse.h"
+#include "xtring.h"
+
+#define PROTOCOL_MAX_FRAME_SIZE (64 * 1024 * 1024)
+#define PROTOCOL_MAX_LEXERS 8
+
+/**
+ * A request, as received by the server (--serve).
+ * Strings point into the frame they were parsed from.
+ */
+typedef struct {
+    const char *formatter;
+    const char *filename;
+    size_t lexers_len;
+    const char *lexers[PROTOCOL_MAX_LEXERS];
+    OptionsStore options[COUNT];
+    unsigned long timeout;
+    const char *payload;
+    size_t payload_len;
+} Request;
+
+typedef enum {
+    RESPONSE_OK,
+    RESPONSE_ERROR,
+    RESPONSE_TIMEOUT
+} ResponseStatus;
+
+uint64_t protocol_now_ms(void);
+
+bool frame_read(int, char **, size_t *, uint64_t);
+bool frame_write(int, const char *, size_t, const char *, size_t, uint64_t);
+
+bool request_header_append(String *, const char *, const char *);
+bool request_option_append(String *, const char *, const char *, const char *, size_t);
+bool request_parse(char *, size_t, Request *);
+void request_free(Request *);
+
+bool response_write(int, ResponseStatus, const char *, const char *, size_t, uint64_t);
+ResponseStatus response_parse(char *, size_t, const char **, const char **, size_t *);
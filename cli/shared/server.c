@@ -0,0 +1,633 @@
+/**
+ * @file cli/shared/server.c
+ * @brief a long-lived highlighting server listening on a Unix domain socket (shall --serve)
+ *
+ * Requests are dispatched to a pool of workers. Each worker keeps the
+ * lexers and formatters it has created (by name and options) so the
+ * following requests for the same settings don't pay their initialization.
+ * A client may send any number of requests (see protocol.c) over the same
+ * connection, they are processed in order. Between two requests, the
+ * connection goes back to the accepting thread which waits for the next one
+ * (poll) so an idle client doesn't hold a worker.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "cpp.h"
+#include "xtring.h"
+#include "hashtable.h"
+#include "lexer_group.h"
+#include "protocol.h"
+#include "server.h"
+
+#ifndef SERVER_WORKER_STACK_SIZE
+/* highlight_string keeps its token buffer on the stack */
+# define SERVER_WORKER_STACK_SIZE (8 * 1024 * 1024)
+#endif /* !SERVER_WORKER_STACK_SIZE */
+
+/* maximum number of workers */
+#define SERVER_MAX_WORKERS 256
+/* maximum number of accepted connections waiting for a worker */
+#define SERVER_QUEUE_SIZE 128
+/* maximum number of lexer groups and formatters kept by each worker */
+#define SERVER_WORKER_CACHE_SIZE 64
+/* default time (in milliseconds) to process a request */
+#define SERVER_DEFAULT_TIMEOUT 10000
+/* a longer time requested by a client is lowered to this one (in milliseconds) */
+#define SERVER_MAX_TIMEOUT 60000UL
+/* the output is no more highlighted beyond this size (in bytes) */
+#define SERVER_MAX_OUTPUT (PROTOCOL_MAX_FRAME_SIZE / 4)
+/* once a request started to arrive, time (in seconds) to receive the rest of it, then to send its response */
+#define SERVER_IO_TIMEOUT 5
+/* a connection without any request for this time (in seconds) is closed */
+#define SERVER_IDLE_TIMEOUT 30
+
+typedef struct {
+    int fd;
+    uint64_t ready; // when a request started to arrive, to count the time spent in the queue
+} PendingConnection;
+
+typedef struct {
+    int fd;
+    uint64_t since; // end of its last request (or its acceptation)
+} IdleConnection;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    PendingConnection pending[SERVER_QUEUE_SIZE];
+    size_t head;
+    size_t len;
+    bool closing;
+    // connections given back by the workers after a request, not yet watched by the accepting thread
+    int *released;
+    size_t released_len, released_size;
+    // a worker writes to wakeup[1] to tell the accepting thread there are some
+    int wakeup[2];
+    const FormatterImplementation *default_fimp;
+    HighlightCache *cache;
+} Server;
+
+typedef struct {
+    Server *server;
+    HashTable formatters;
+    HashTable groups;
+} Worker;
+
+static volatile sig_atomic_t stop;
+
+static void on_stop_signal(int UNUSED(signo))
+{
+    stop = 1;
+}
+
+static void formatter_destroy_cb(void *data)
+{
+    formatter_destroy((Formatter *) data);
+}
+
+static void options_to_key(String *key, const OptionsStore *store)
+{
+    size_t i;
+
+    for (i = 0; i < store->options_len; i++) {
+        string_append_char(key, '\n');
+        string_append_string(key, store->options[i].name);
+        string_append_char(key, '=');
+        string_append_string_len(key, store->options[i].value, store->options[i].value_len);
+    }
+}
+
+/**
+ * Get (or create) a formatter for the given request
+ *
+ * @return NULL (and set *error*) if the formatter is unknown or an option is rejected
+ */
+static Formatter *worker_formatter(Worker *w, const Request *r, const char **error)
+{
+    size_t i;
+    String *key;
+    Formatter *fmt;
+    const FormatterImplementation *fimp;
+
+    if (NULL == r->formatter) {
+        fimp = w->server->default_fimp;
+    } else if (NULL == (fimp = formatter_implementation_by_name(r->formatter))) {
+        *error = "unknown formatter";
+        return NULL;
+    }
+    key = string_new();
+    string_append_string(key, formatter_implementation_name(fimp));
+    options_to_key(key, &r->options[FORMATTER]);
+    if (!hashtable_get(&w->formatters, key->ptr, &fmt)) {
+        fmt = formatter_create(fimp);
+        for (i = 0; i < r->options[FORMATTER].options_len; i++) {
+            if (0 != formatter_set_option_as_string(fmt, r->options[FORMATTER].options[i].name, r->options[FORMATTER].options[i].value, r->options[FORMATTER].options[i].value_len)) {
+                *error = "formatter option rejected";
+                formatter_destroy(fmt);
+                string_destroy(key);
+                return NULL;
+            }
+        }
+        if (hashtable_size(&w->formatters) >= SERVER_WORKER_CACHE_SIZE) {
+            hashtable_clear(&w->formatters);
+        }
+        hashtable_put(&w->formatters, 0, string_orphan(key), fmt, NULL);
+    } else {
+        string_destroy(key);
+    }
+
+    return fmt;
+}
+
+/**
+ * Get (or create) the lexers for the given request: the ones it names
+ * else from its filename else by guessing from its content else text
+ *
+ * @return NULL (and set *error*) if a lexer is unknown or an option is rejected
+ */
+static LexerGroup *worker_lexers(Worker *w, const Request *r, const char **error)
+{
+    size_t i;
+    String *key;
+    LexerGroup *g;
+    const LexerImplementation *limps[PROTOCOL_MAX_LEXERS];
+    size_t limps_len;
+
+    if (r->lexers_len > 0) {
+        for (i = 0; i < r->lexers_len; i++) {
+            if (NULL == (limps[i] = lexer_implementation_by_name(r->lexers[i]))) {
+                *error = "unknown lexer";
+                return NULL;
+            }
+        }
+        limps_len = r->lexers_len;
+    } else {
+        limps[0] = NULL;
+        if (NULL != r->filename) {
+            limps[0] = lexer_implementation_for_filename(r->filename);
+        }
+        if (NULL == limps[0]) {
+            limps[0] = lexer_implementation_guess(r->payload, r->payload_len);
+        }
+        if (NULL == limps[0]) {
+            limps[0] = lexer_implementation_by_name("text");
+        }
+        limps_len = 1;
+    }
+    key = string_new();
+    for (i = 0; i < limps_len; i++) {
+        string_append_string(key, lexer_implementation_name(limps[i]));
+        string_append_char(key, '\t');
+    }
+    options_to_key(key, &r->options[LEXER]);
+    if (!hashtable_get(&w->groups, key->ptr, &g)) {
+        g = NULL;
+        for (i = 0; i < limps_len; i++) {
+            group_append(&g, lexer_create(limps[i]));
+        }
+        for (i = 0; i < r->options[LEXER].options_len; i++) {
+            if (0 != lexer_set_option_as_string(g->lexers[0], r->options[LEXER].options[i].name, r->options[LEXER].options[i].value, r->options[LEXER].options[i].value_len)) {
+                *error = "lexer option rejected";
+                group_destroy(g);
+                string_destroy(key);
+                return NULL;
+            }
+        }
+        if (hashtable_size(&w->groups) >= SERVER_WORKER_CACHE_SIZE) {
+            hashtable_clear(&w->groups);
+        }
+        hashtable_put(&w->groups, 0, string_orphan(key), g, NULL);
+    } else {
+        string_destroy(key);
+    }
+
+    return g;
+}
+
+/**
+ * Send a response within SERVER_IO_TIMEOUT (see response_write)
+ */
+static bool worker_respond(int fd, ResponseStatus status, const char *message, const char *payload, size_t payload_len)
+{
+    return response_write(fd, status, message, payload, payload_len, protocol_now_ms() + SERVER_IO_TIMEOUT * 1000);
+}
+
+/**
+ * Process a request and send its response
+ *
+ * @param since when the request was received (or its connection accepted
+ * for the first one), in milliseconds
+ *
+ * @return false if the response can't be sent (connection is lost)
+ */
+static bool worker_handle_request(Worker *w, int fd, char *body, size_t body_len, uint64_t since)
+{
+    bool ok;
+    Request r;
+    LexerGroup *g;
+    Formatter *fmt;
+    const char *error;
+    uint64_t deadline, now;
+
+    error = NULL;
+    deadline = since;
+    if (!request_parse(body, body_len, &r)) {
+        request_free(&r);
+        return worker_respond(fd, RESPONSE_ERROR, "malformed request", NULL, 0);
+    }
+    deadline += 0 == r.timeout ? SERVER_DEFAULT_TIMEOUT : MIN(r.timeout, SERVER_MAX_TIMEOUT);
+    if (NULL == (fmt = worker_formatter(w, &r, &error)) || NULL == (g = worker_lexers(w, &r, &error))) {
+        ok = worker_respond(fd, RESPONSE_ERROR, error, NULL, 0);
+    } else if ((now = protocol_now_ms()) >= deadline) {
+        ok = worker_respond(fd, RESPONSE_TIMEOUT, NULL, NULL, 0);
+    } else {
+        int ret;
+        char *result;
+        size_t result_len;
+        HighlightBudget budget;
+
+        bzero(&budget, sizeof(budget));
+        budget.timeout = deadline - now;
+        budget.max_output = SERVER_MAX_OUTPUT;
+        if (NULL == w->server->cache) {
+            ret = highlight_string_with_budget(r.payload, r.payload_len, &result, &result_len, fmt, g->count, g->lexers, &budget);
+        } else {
+            ret = highlight_string_cached(w->server->cache, r.payload, r.payload_len, &result, &result_len, fmt, g->count, g->lexers, &budget);
+        }
+        if (result_len > PROTOCOL_MAX_FRAME_SIZE - STR_LEN("ok max-output\n")) {
+            ok = worker_respond(fd, RESPONSE_ERROR, "result too large", NULL, 0);
+        } else {
+            switch (ret) {
+                case HIGHLIGHT_SUCCESS:
+                    ok = worker_respond(fd, RESPONSE_OK, NULL, result, result_len);
+                    break;
+                // budget exhausted: the end of the document was not highlighted
+                case HIGHLIGHT_TIMEOUT:
+                    ok = worker_respond(fd, RESPONSE_OK, "timeout", result, result_len);
+                    break;
+                case HIGHLIGHT_MAX_OUTPUT_EXCEEDED:
+                    ok = worker_respond(fd, RESPONSE_OK, "max-output", result, result_len);
+                    break;
+                case HIGHLIGHT_MAX_TOKENS_EXCEEDED:
+                    ok = worker_respond(fd, RESPONSE_OK, "max-tokens", result, result_len);
+                    break;
+                default:
+                    ok = worker_respond(fd, RESPONSE_ERROR, "highlighting failed", NULL, 0);
+                    break;
+            }
+        }
+        free(result);
+    }
+    request_free(&r);
+
+    return ok;
+}
+
+/**
+ * Give a connection back to the accepting thread, to wait for its next
+ * request (the connection is closed if the server is stopping)
+ */
+static void server_release(Server *server, int fd)
+{
+    pthread_mutex_lock(&server->lock);
+    if (server->closing) {
+        close(fd);
+    } else {
+        if (server->released_len >= server->released_size) {
+            server->released_size = 0 == server->released_size ? 16 : server->released_size * 2;
+            server->released = realloc(server->released, server->released_size * sizeof(*server->released));
+        }
+        server->released[server->released_len++] = fd;
+        // the pipe is not blocking: if it is full, the accepting thread will be woken up anyway
+        if (-1 == write(server->wakeup[1], "", 1)) {
+            // NOP
+        }
+    }
+    pthread_mutex_unlock(&server->lock);
+}
+
+/**
+ * Process the request which started to arrive on a connection then give it
+ * back to the accepting thread (or close it if it is lost)
+ */
+static void worker_handle_connection(Worker *w, int fd, uint64_t ready)
+{
+    bool ok;
+    char *body;
+    size_t body_len;
+
+    if ((ok = frame_read(fd, &body, &body_len, protocol_now_ms() + SERVER_IO_TIMEOUT * 1000))) {
+        // the request may have waited in the queue
+        ok = worker_handle_request(w, fd, body, body_len, ready);
+        free(body);
+    }
+    if (ok && !stop) {
+        server_release(w->server, fd);
+    } else {
+        close(fd);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    Worker w;
+    Server *server;
+
+    server = (Server *) arg;
+    w.server = server;
+    hashtable_ascii_cs_init(&w.formatters, NULL, free, formatter_destroy_cb);
+    hashtable_ascii_cs_init(&w.groups, NULL, free, group_destroy);
+    while (1) {
+        PendingConnection pc;
+
+        pthread_mutex_lock(&server->lock);
+        while (0 == server->len && !server->closing) {
+            pthread_cond_wait(&server->not_empty, &server->lock);
+        }
+        if (0 == server->len) {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+        pc = server->pending[server->head];
+        server->head = (server->head + 1) % SERVER_QUEUE_SIZE;
+        --server->len;
+        pthread_cond_signal(&server->not_full);
+        pthread_mutex_unlock(&server->lock);
+        worker_handle_connection(&w, pc.fd, pc.ready);
+    }
+    hashtable_destroy(&w.formatters);
+    hashtable_destroy(&w.groups);
+
+    return NULL;
+}
+
+static bool fill_address(struct sockaddr_un *sun, const char *path)
+{
+    bzero(sun, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun->sun_path)) {
+        fprintf(stderr, "socket path '%s' is too long\n", path);
+        return false;
+    }
+    strcpy(sun->sun_path, path);
+
+    return true;
+}
+
+/**
+ * Connect to a server
+ *
+ * @param path the path of its socket
+ *
+ * @return the connected socket or -1 on failure
+ */
+int client_connect(const char *path)
+{
+    int fd;
+    struct sockaddr_un sun;
+
+    if (!fill_address(&sun, path)) {
+        return -1;
+    }
+    if (-1 == (fd = socket(AF_UNIX, SOCK_STREAM, 0))) {
+        return -1;
+    }
+    if (0 != connect(fd, (struct sockaddr *) &sun, sizeof(sun))) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Queue a connection on which a request started to arrive for a worker
+ */
+static void server_enqueue(Server *server, int fd, uint64_t ready)
+{
+    pthread_mutex_lock(&server->lock);
+    while (SERVER_QUEUE_SIZE == server->len && !stop) {
+        pthread_cond_wait(&server->not_full, &server->lock);
+    }
+    if (SERVER_QUEUE_SIZE == server->len) {
+        close(fd);
+    } else {
+        server->pending[(server->head + server->len) % SERVER_QUEUE_SIZE].fd = fd;
+        server->pending[(server->head + server->len) % SERVER_QUEUE_SIZE].ready = ready;
+        ++server->len;
+        pthread_cond_signal(&server->not_empty);
+    }
+    pthread_mutex_unlock(&server->lock);
+}
+
+/**
+ * Run the server until SIGINT or SIGTERM is received
+ *
+ * @param path the path of the socket to create. A stale socket (nobody listening
+ * on it) is replaced.
+ * @param default_fimp the formatter to use when a request doesn't name one
+ * @param threads the number of workers
+ * @param cache a cache for the results (NULL for none)
+ *
+ * @return false if the server can't be started
+ */
+bool server_run(const char *path, const FormatterImplementation *default_fimp, unsigned long threads, HighlightCache *cache)
+{
+    int lfd;
+    Server server;
+    IdleConnection *idle;
+    struct pollfd *pfds;
+    size_t j, idle_len, idle_size;
+    unsigned long i, started;
+    struct stat st;
+    struct sockaddr_un sun;
+    struct sigaction sa;
+    pthread_t *tids;
+    pthread_attr_t attr;
+    sigset_t set, oldset;
+
+    if (!fill_address(&sun, path)) {
+        return false;
+    }
+    if (0 == stat(path, &st) && S_ISSOCK(st.st_mode)) {
+        int fd;
+
+        if (-1 != (fd = client_connect(path))) {
+            close(fd);
+            fprintf(stderr, "a server is already listening on %s\n", path);
+            return false;
+        }
+        unlink(path);
+    }
+    if (-1 == (lfd = socket(AF_UNIX, SOCK_STREAM, 0))) {
+        perror("socket");
+        return false;
+    }
+    if (0 != bind(lfd, (struct sockaddr *) &sun, sizeof(sun)) || 0 != listen(lfd, SOMAXCONN)) {
+        fprintf(stderr, "can't listen on %s: %s\n", path, strerror(errno));
+        close(lfd);
+        return false;
+    }
+
+    if (threads > SERVER_MAX_WORKERS) {
+        threads = SERVER_MAX_WORKERS;
+    }
+    if (NULL == (tids = mem_new_n(*tids, threads))) {
+        perror("malloc");
+        close(lfd);
+        unlink(path);
+        return false;
+    }
+    bzero(&server, sizeof(server));
+    if (0 != pipe(server.wakeup)) {
+        perror("pipe");
+        free(tids);
+        close(lfd);
+        unlink(path);
+        return false;
+    }
+    fcntl(server.wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(server.wakeup[1], F_SETFL, O_NONBLOCK);
+    server.default_fimp = default_fimp;
+    server.cache = cache;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.not_empty, NULL);
+    pthread_cond_init(&server.not_full, NULL);
+
+    // workers don't handle signals: let them interrupt accept in this thread
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, SERVER_WORKER_STACK_SIZE);
+    for (started = i = 0; i < threads; i++) {
+        if (0 == pthread_create(&tids[started], &attr, worker_main, &server)) {
+            ++started;
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    bzero(&sa, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    idle = NULL;
+    pfds = NULL;
+    idle_len = idle_size = 0;
+    while (!stop && started > 0) {
+        int fd;
+        uint64_t now;
+
+        // +2: the listening socket and the pipe of the workers
+        pfds = realloc(pfds, (idle_len + 2) * sizeof(*pfds));
+        pfds[0].fd = lfd;
+        pfds[1].fd = server.wakeup[0];
+        for (j = 0; j < idle_len; j++) {
+            pfds[j + 2].fd = idle[j].fd;
+        }
+        for (j = 0; j < idle_len + 2; j++) {
+            pfds[j].events = POLLIN;
+            pfds[j].revents = 0;
+        }
+        if (-1 == poll(pfds, idle_len + 2, 1000)) {
+            if (EINTR != errno) {
+                perror("poll");
+            }
+            continue;
+        }
+        now = protocol_now_ms();
+        // a request (or the end of the connection, the worker will see it) arrived, else it may be expired
+        for (i = j = 0; j < idle_len; j++) {
+            if (0 != pfds[j + 2].revents) {
+                server_enqueue(&server, idle[j].fd, now);
+            } else if (now - idle[j].since >= SERVER_IDLE_TIMEOUT * 1000) {
+                close(idle[j].fd);
+            } else {
+                idle[i++] = idle[j];
+            }
+        }
+        idle_len = i;
+        if (0 != (pfds[1].revents & POLLIN)) {
+            char buffer[64];
+
+            while (read(server.wakeup[0], buffer, sizeof(buffer)) > 0)
+                ;
+            pthread_mutex_lock(&server.lock);
+            if (idle_len + server.released_len > idle_size) {
+                idle_size = idle_len + server.released_len;
+                idle = realloc(idle, idle_size * sizeof(*idle));
+            }
+            for (j = 0; j < server.released_len; j++) {
+                idle[idle_len].fd = server.released[j];
+                idle[idle_len++].since = now;
+            }
+            server.released_len = 0;
+            pthread_mutex_unlock(&server.lock);
+        }
+        if (0 != (pfds[0].revents & POLLIN)) {
+            if (-1 == (fd = accept(lfd, NULL, NULL))) {
+                if (EINTR != errno && ECONNABORTED != errno) {
+                    perror("accept");
+                }
+                continue;
+            }
+            // frames are read and written against a deadline (poll): never block on the socket itself
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            // wait for its first request as for the following ones
+            if (idle_len >= idle_size) {
+                idle_size = 0 == idle_size ? 16 : idle_size * 2;
+                idle = realloc(idle, idle_size * sizeof(*idle));
+            }
+            idle[idle_len].fd = fd;
+            idle[idle_len++].since = now;
+        }
+    }
+
+    close(lfd);
+    unlink(path);
+    pthread_mutex_lock(&server.lock);
+    server.closing = true;
+    pthread_cond_broadcast(&server.not_empty);
+    pthread_mutex_unlock(&server.lock);
+    for (i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+    // the workers are gone: nobody else uses these connections
+    for (j = 0; j < idle_len; j++) {
+        close(idle[j].fd);
+    }
+    for (j = 0; j < server.released_len; j++) {
+        close(server.released[j]);
+    }
+    free(server.released);
+    free(idle);
+    free(pfds);
+    close(server.wakeup[0]);
+    close(server.wakeup[1]);
+    pthread_cond_destroy(&server.not_full);
+    pthread_cond_destroy(&server.not_empty);
+    pthread_mutex_destroy(&server.lock);
+
+    return started > 0;
+}
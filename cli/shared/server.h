@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "shall.h"
+#include "cache.h"
+
+bool server_run(const char *, const FormatterImplementation *, unsigned long, HighlightCache *);
+int client_connect(const char *);
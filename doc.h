@@ -14,9 +14,13 @@
  *  <li>\ref lib/darray.c</li>
  *  <li>\ref lib/options.c</li>
  *  <li>\ref lib/themes.c</li>
+ *  <li>\ref lib/palette.c</li>
  *  <li>\ref lib/encoding.c</li>
  *  <li>\ref lib/dlist.c</li>
  *  <li>\ref lib/version.c</li>
+ *  <li>\ref lib/stats.c</li>
+ *  <li>\ref lib/trace.c</li>
+ *  <li>\ref lib/profile.c</li>
  * </ul>
  *
  * Shared by library and binaries:
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "machine.h"
+#include "types.h"
+#include "shall.h"
+
+typedef struct HighlightCache HighlightCache;
+
+/**
+ * Counters of a HighlightCache
+ */
+typedef struct {
+    /**
+     * Number of results found in memory
+     */
+    uint64_t hits;
+    /**
+     * Number of results found on disk (but not in memory)
+     */
+    uint64_t disk_hits;
+    /**
+     * Number of results which had to be computed
+     */
+    uint64_t misses;
+    /**
+     * Number of results dropped from memory to respect its size limit
+     */
+    uint64_t evictions;
+    /**
+     * Number of results currently held in memory
+     */
+    size_t entries;
+    /**
+     * Total size, in bytes, of the results currently held in memory
+     */
+    size_t size;
+} HighlightCacheStats;
+
+SHALL_API HighlightCache *highlight_cache_create(size_t, const char *);
+SHALL_API void highlight_cache_destroy(HighlightCache *);
+SHALL_API void highlight_cache_stats(HighlightCache *, HighlightCacheStats *);
+SHALL_API int highlight_string_cached(HighlightCache *, const char *, size_t, char **, size_t *, Formatter *, size_t, Lexer **, const HighlightBudget *);
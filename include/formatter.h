@@ -35,7 +35,9 @@ struct FormatterImplementation {
      */
     int (*start_document)(String *, FormatterData *);
     /**
-     * Optionnal (may be NULL) callback called (once) at the end of the tokenisation process
+     * Optionnal (may be NULL) callback called (once) at the end of the tokenisation process.
+     * It can only append to the output: what was written before may already
+     * have been sent to a sink (highlight_string_to)
      */
     int (*end_document)(String *, FormatterData *);
     /**
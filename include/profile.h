@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "machine.h"
+#include "types.h"
+#include "shall.h"
+
+/**
+ * Counters of a rule or a state of a re2c lexer (with PROFILING=ON)
+ */
+typedef struct {
+    /**
+     * The source of the lexer: its .re file for a rule, the generated
+     * .c file for a state
+     */
+    const char *file;
+    /**
+     * The line of the rule in file (0 for a state)
+     */
+    int line;
+    /**
+     * For a state, its number in the generated code (-1 for the start of the lexer)
+     */
+    int state;
+    /**
+     * Number of times the rule matched or the state was entered
+     */
+    uint64_t hits;
+    /**
+     * For a rule, total size, in bytes, of the input it matched
+     */
+    uint64_t bytes;
+    /**
+     * For a rule, total time, in nanoseconds, of the calls to the lexer
+     * which ended on it
+     */
+    uint64_t time_ns;
+} LexerProfileEntry;
+
+SHALL_API bool lexer_profile_available(void);
+SHALL_API void lexer_profile_reset(void);
+SHALL_API void lexer_profile_each(void (*)(const LexerProfileEntry *, void *), void *);
@@ -73,10 +73,109 @@ SHALL_API bool formatter_implementation_options_to_iterator(Iterator *, const Fo
 
 SHALL_API void formatter_destroy(Formatter *);
 SHALL_API Formatter *formatter_create(const FormatterImplementation *);
+SHALL_API Formatter *formatter_copy(Formatter *);
 
 SHALL_API int formatter_get_option(Formatter *, const char *, OptionValue **);
 SHALL_API int formatter_set_option(Formatter *, const char *, OptionType, OptionValue);
 SHALL_API int formatter_set_option_as_string(Formatter *, const char *, const char *, size_t);
 
+/**
+ * Limits on the work done by highlight_string_with_budget (0 for no limit)
+ */
+typedef struct {
+    /**
+     * Maximum time, in milliseconds
+     */
+    unsigned long timeout;
+    /**
+     * Maximum number of tokens
+     */
+    size_t max_tokens;
+    /**
+     * Maximum size, in bytes, of the output (before the remaining input is added as text)
+     */
+    size_t max_output;
+    /**
+     * Time and output size are checked every *check_interval* tokens (default: 1024)
+     */
+    size_t check_interval;
+} HighlightBudget;
+
+enum {
+    HIGHLIGHT_SUCCESS,
+    HIGHLIGHT_RECURSION,
+    HIGHLIGHT_TIMEOUT,
+    HIGHLIGHT_MAX_TOKENS_EXCEEDED,
+    HIGHLIGHT_MAX_OUTPUT_EXCEEDED,
+    HIGHLIGHT_SINK_ERROR
+};
+
+/**
+ * A receiver for the output of highlight_string_to
+ */
+typedef struct {
+    /**
+     * Called with each chunk of output, in order, and user data; a non-zero
+     * return value stops highlighting (HIGHLIGHT_SINK_ERROR)
+     */
+    int (*write)(const char *, size_t, void *);
+    /**
+     * Passed as is to write
+     */
+    void *data;
+    /**
+     * Output is accumulated until it reaches this size, in bytes, before
+     * being written (default: 8192)
+     */
+    size_t chunk_size;
+} HighlightSink;
+
 SHALL_API void highlight_sample(char **, size_t *, Formatter *);
 SHALL_API int highlight_string(const char *, size_t, char **, size_t *, Formatter *, size_t, Lexer **);
+SHALL_API int highlight_string_with_budget(const char *, size_t, char **, size_t *, Formatter *, size_t, Lexer **, const HighlightBudget *);
+SHALL_API int highlight_string_to(const char *, size_t, const HighlightSink *, Formatter *, size_t, Lexer **, const HighlightBudget *);
+SHALL_API int highlight_string_pipelined(const char *, size_t, const HighlightSink *, Formatter *, size_t, Lexer **, const HighlightBudget *, size_t);
+SHALL_API int highlight_string_parallel(const char *, size_t, char **, size_t *, Formatter *, size_t, Lexer **, const HighlightBudget *, unsigned, size_t);
+
+/**
+ * A document to highlight with highlight_batch
+ */
+typedef struct {
+    /**
+     * The input string and its length
+     */
+    const char *src;
+    size_t src_len;
+    /**
+     * The formatter (several jobs can share the same one: each thread
+     * works on its own copy of it)
+     */
+    Formatter *fmt;
+    /**
+     * The lexers, as for highlight_string (they are shared, not copied)
+     */
+    size_t lexerc;
+    Lexer **lexerv;
+    /**
+     * The limits (NULL for none)
+     */
+    const HighlightBudget *budget;
+} HighlightJob;
+
+/**
+ * The outcome of a HighlightJob
+ */
+typedef struct {
+    /**
+     * The output, to free, and its length
+     */
+    char *dst;
+    size_t dst_len;
+    /**
+     * One of the HIGHLIGHT_* constants
+     */
+    int status;
+} HighlightResult;
+
+SHALL_API size_t highlight_batch(const HighlightJob *, size_t, HighlightResult *, unsigned);
+SHALL_API void highlight_batch_pool_destroy(void);
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "machine.h"
+#include "types.h"
+#include "shall.h"
+
+typedef struct HighlightStats HighlightStats;
+
+/**
+ * Counters of the highlightings done with a HighlightStats
+ */
+typedef struct {
+    /**
+     * Number of documents highlighted
+     */
+    uint64_t documents;
+    /**
+     * Total size, in bytes, of the inputs
+     */
+    uint64_t bytes_in;
+    /**
+     * Total size, in bytes, of the outputs
+     */
+    uint64_t bytes_out;
+    /**
+     * Number of tokens produced by all lexers
+     */
+    uint64_t tokens;
+    /**
+     * Number of times a lexer delegated a part of the input to another one
+     */
+    uint64_t delegations;
+    /**
+     * Number of times buffered tokens were handed over to the formatter
+     */
+    uint64_t flushes;
+    /**
+     * Number of times a parser (bison) failed and the lexer was used alone for the rest of the document
+     */
+    uint64_t parser_fallbacks;
+    /**
+     * Number of times the cursor was moved backward, by a lexer (yyless)
+     * or for a delegation, to scan again a part of the input
+     */
+    uint64_t cursor_resets;
+    /**
+     * Total size, in bytes, of the input scanned again because of these moves
+     */
+    uint64_t bytes_rescanned;
+    /**
+     * The highest number of tokens held at once in the token buffer
+     */
+    uint64_t peak_buffer;
+    /**
+     * Number of chunks highlight_string_parallel lexed from a guessed state
+     * (at a resynchronization point of the lexer)
+     */
+    uint64_t resyncs;
+    /**
+     * Part of them for which the guess was wrong: the lexing of the previous
+     * chunk went on over them
+     */
+    uint64_t resync_misses;
+    /**
+     * Total time, in nanoseconds
+     */
+    uint64_t time_ns;
+    /**
+     * Part of time_ns spent in the formatter
+     */
+    uint64_t format_ns;
+} HighlightStatsTotals;
+
+/**
+ * Counters of a lexer implementation
+ */
+typedef struct {
+    /**
+     * Number of tokens it produced
+     */
+    uint64_t tokens;
+    /**
+     * Total size, in bytes, of these tokens
+     */
+    uint64_t bytes;
+    /**
+     * Number of times another lexer delegated a part of the input to it
+     */
+    uint64_t delegations;
+    /**
+     * Time, in nanoseconds, spent in it (formatting excluded)
+     */
+    uint64_t time_ns;
+} HighlightLexerStats;
+
+SHALL_API HighlightStats *highlight_stats_create(void);
+SHALL_API void highlight_stats_destroy(HighlightStats *);
+SHALL_API void highlight_stats_reset(HighlightStats *);
+SHALL_API void highlight_stats_merge(HighlightStats *, const HighlightStats *);
+SHALL_API HighlightStats *highlight_stats_bind(HighlightStats *);
+SHALL_API void highlight_stats_totals(const HighlightStats *, HighlightStatsTotals *);
+SHALL_API void highlight_stats_lexer(const HighlightStats *, const LexerImplementation *, HighlightLexerStats *);
+SHALL_API void highlight_stats_each_lexer(const HighlightStats *, void (*)(const LexerImplementation *, const HighlightLexerStats *, void *), void *);
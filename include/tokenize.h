@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "machine.h"
+#include "types.h"
+#include "shall.h"
+
+typedef struct HighlightTokens HighlightTokens;
+
+/**
+ * A token, as found by highlight_tokens
+ */
+typedef struct {
+    /**
+     * Its type (one of the constants of tokens.h)
+     */
+    int type;
+    /**
+     * Position, in bytes, of its first byte in the source
+     */
+    size_t start;
+    /**
+     * Position, in bytes, after its last byte in the source
+     */
+    size_t end;
+} HighlightToken;
+
+SHALL_API int highlight_tokens(const char *, size_t, HighlightTokens **, size_t, Lexer **);
+SHALL_API void highlight_tokens_destroy(HighlightTokens *);
+SHALL_API size_t highlight_tokens_count(const HighlightTokens *);
+SHALL_API const HighlightToken *highlight_tokens_chunk(const HighlightTokens *, size_t, size_t *);
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "machine.h"
+#include "types.h"
+#include "shall.h"
+
+typedef struct HighlightTrace HighlightTrace;
+
+/**
+ * A token, as traced by a HighlightTrace
+ */
+typedef struct {
+    /**
+     * Position of the token in its document, in bytes
+     */
+    uint32_t offset;
+    /**
+     * Length of the token, in bytes
+     */
+    uint32_t length;
+    /**
+     * Line, in the source (.re) of its lexer, of the rule which produced it
+     */
+    uint32_t line;
+    /**
+     * Number, modulo 65536, of the document the token belongs to (the first
+     * one traced is 0)
+     */
+    uint16_t document;
+    /**
+     * Its type (one of the constants of tokens.h)
+     */
+    uint8_t type;
+    /**
+     * Identifier, in the trace, of the lexer which produced it (see highlight_trace_lexer_name)
+     */
+    uint8_t lexer;
+} HighlightTraceRecord;
+
+SHALL_API HighlightTrace *highlight_trace_create(size_t);
+SHALL_API void highlight_trace_destroy(HighlightTrace *);
+SHALL_API void highlight_trace_reset(HighlightTrace *);
+SHALL_API void highlight_trace_merge(HighlightTrace *, const HighlightTrace *);
+SHALL_API HighlightTrace *highlight_trace_bind(HighlightTrace *);
+SHALL_API uint64_t highlight_trace_count(const HighlightTrace *);
+SHALL_API const char *highlight_trace_lexer_name(const HighlightTrace *, uint8_t);
+SHALL_API void highlight_trace_each(const HighlightTrace *, void (*)(const HighlightTraceRecord *, void *), void *);
+SHALL_API bool highlight_trace_write(const HighlightTrace *, FILE *);
+SHALL_API HighlightTrace *highlight_trace_read(FILE *);
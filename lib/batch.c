@@ -0,0 +1,540 @@
+/**
+ * @file lib/batch.c
+ * @brief highlighting of independent documents on a pool of threads
+ *
+ * The pool is owned by the library: its threads are created on demand, the
+ * first time a batch needs them, then sleep between two batches until
+ * highlight_batch_pool_destroy. Batches are run one at a time, the calling
+ * thread being one of the workers.
+ *
+ * Jobs are sorted by decreasing size of input then dealt, round robin, to
+ * a deque per worker. A worker takes the jobs of its own deque from its
+ * front (largest first) and, once it is empty, steals from the back of the
+ * deques of the others. Starting with the largest documents avoids the
+ * batch to end on a big one started late by a single thread.
+ *
+ * A formatter keeps some state while it is used, a worker so has its own
+ * copy of each formatter of the batch (a "session", reused by all the jobs
+ * it runs; if one can't be made, the job is run by the calling thread, with
+ * the original, once the batch is over). Only builtin formatters can be
+ * copied this way: formatters implemented by bindings call back into their
+ * runtime and have to be run with threads = 1 (in which case the formatter
+ * of the job is used as is).
+ *
+ * Statistics and traces bound by the calling thread (highlight_stats_bind,
+ * highlight_trace_bind) are not collected by the other threads.
+ *
+ * The pool is also used internally, for other work than whole documents,
+ * through highlight_pool_run.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "cpp.h"
+#include "formatter.h"
+#include "shall.h"
+#include "batch_internal.h"
+
+#ifndef DOXYGEN
+# define BATCH_MAX_THREADS 256
+#endif /* !DOXYGEN */
+
+#ifndef POOL_THREAD_STACK_SIZE
+/* highlight_string keeps its token buffer on the stack */
+# define POOL_THREAD_STACK_SIZE (8 * 1024 * 1024)
+#endif /* !POOL_THREAD_STACK_SIZE */
+
+// status of a job which couldn't be run by a worker (no copy of its formatter)
+#define JOB_DEFERRED -1
+
+typedef struct {
+    pthread_mutex_t lock;
+    // indexes of jobs, by decreasing size, those in [head;tail[ are pending
+    size_t *slots;
+    size_t head, tail;
+} BatchDeque;
+
+typedef struct {
+    Formatter *original;
+    Formatter *copy;
+} SessionFormatter;
+
+/**
+ * What a worker keeps from a job to the next one
+ */
+typedef struct {
+    SessionFormatter *formatters;
+    size_t formatters_len;
+    size_t formatters_size;
+} BatchSession;
+
+typedef struct {
+    PoolTask task;
+    void *arg;
+    // number of threads working on the batch (the caller included)
+    unsigned workers;
+    BatchDeque *deques;
+    // number of pool threads which are done with the batch
+    unsigned left;
+} Batch;
+
+static struct {
+    // protects all fields but sessions
+    pthread_mutex_t lock;
+    // a new batch (generation was incremented) or shutdown
+    pthread_cond_t work;
+    // a pool thread left the current batch
+    pthread_cond_t done;
+    // batches are run one at a time
+    pthread_mutex_t batch_lock;
+    pthread_t *threads;
+    unsigned threads_len;
+    // last generation handled by each pool thread
+    unsigned long seen[BATCH_MAX_THREADS];
+    Batch *batch;
+    unsigned long generation;
+    bool shutdown;
+    // one per worker (0 is the caller of highlight_batch), under batch_lock
+    BatchSession sessions[BATCH_MAX_THREADS];
+} pool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER,
+    NULL,
+    0,
+    { 0 },
+    NULL,
+    0,
+    false,
+    { { NULL, 0, 0 } }
+};
+
+/**
+ * Gets the copy of fmt of the session, makes it on first use
+ *
+ * @return NULL if it can't be made (out of memory)
+ */
+static Formatter *session_formatter(BatchSession *session, Formatter *fmt)
+{
+    size_t i;
+    Formatter *copy;
+
+    for (i = 0; i < session->formatters_len; i++) {
+        if (fmt == session->formatters[i].original) {
+            return session->formatters[i].copy;
+        }
+    }
+    if (session->formatters_len >= session->formatters_size) {
+        size_t formatters_size;
+        SessionFormatter *formatters;
+
+        formatters_size = 0 == session->formatters_size ? 4 : session->formatters_size * 2;
+        if (NULL == (formatters = mem_renew(session->formatters, *formatters, formatters_size))) {
+            return NULL;
+        }
+        session->formatters = formatters;
+        session->formatters_size = formatters_size;
+    }
+    if (NULL == (copy = formatter_copy(fmt))) {
+        return NULL;
+    }
+    session->formatters[session->formatters_len].original = fmt;
+    session->formatters[session->formatters_len].copy = copy;
+
+    return session->formatters[session->formatters_len++].copy;
+}
+
+/**
+ * Drops the copies of the formatters: options of the originals may have
+ * changed before the next batch (the storage is kept)
+ */
+static void session_reset(BatchSession *session)
+{
+    size_t i;
+
+    for (i = 0; i < session->formatters_len; i++) {
+        formatter_destroy(session->formatters[i].copy);
+    }
+    session->formatters_len = 0;
+}
+
+static bool deque_pop_front(BatchDeque *deque, size_t *job)
+{
+    bool found;
+
+    pthread_mutex_lock(&deque->lock);
+    if ((found = deque->head < deque->tail)) {
+        *job = deque->slots[deque->head++];
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return found;
+}
+
+static bool deque_pop_back(BatchDeque *deque, size_t *job)
+{
+    bool found;
+
+    pthread_mutex_lock(&deque->lock);
+    if ((found = deque->head < deque->tail)) {
+        *job = deque->slots[--deque->tail];
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return found;
+}
+
+/**
+ * Gets the next job of a worker: from its own deque first, else stolen
+ * from an other one
+ *
+ * @return false if there is no job left (none is ever added to a deque)
+ */
+static bool batch_next(Batch *batch, unsigned id, size_t *job)
+{
+    unsigned i;
+
+    if (deque_pop_front(&batch->deques[id], job)) {
+        return true;
+    }
+    for (i = 1; i < batch->workers; i++) {
+        if (deque_pop_back(&batch->deques[(id + i) % batch->workers], job)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Runs the jobs of a batch until there is none left
+ */
+static void batch_work(Batch *batch, unsigned id)
+{
+    size_t job;
+
+    while (batch_next(batch, id, &job)) {
+        batch->task(batch->arg, job, id);
+    }
+}
+
+static void deques_free(BatchDeque *deques, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        pthread_mutex_destroy(&deques[i].lock);
+        free(deques[i].slots);
+    }
+    free(deques);
+}
+
+static void *pool_thread(void *arg)
+{
+    unsigned id;
+
+    id = (unsigned) (uintptr_t) arg;
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        Batch *batch;
+
+        while (!pool.shutdown && pool.seen[id] == pool.generation) {
+            pthread_cond_wait(&pool.work, &pool.lock);
+        }
+        if (pool.shutdown) {
+            break;
+        }
+        pool.seen[id] = pool.generation;
+        batch = pool.batch;
+        // the batch may already be over (woken too late)
+        if (NULL != batch && id < batch->workers) {
+            pthread_mutex_unlock(&pool.lock);
+            batch_work(batch, id);
+            pthread_mutex_lock(&pool.lock);
+            ++batch->left;
+            pthread_cond_signal(&pool.done);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    return NULL;
+}
+
+/**
+ * Grows the pool up to count threads (the caller of highlight_batch not
+ * included), under pool.lock
+ *
+ * @return the number of threads of the pool
+ */
+static unsigned pool_grow(unsigned count)
+{
+    if (count > pool.threads_len) {
+        pthread_t *threads;
+        pthread_attr_t attr;
+
+        if (NULL == (threads = mem_renew(pool.threads, *threads, count))) {
+            return pool.threads_len;
+        }
+        pool.threads = threads;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, POOL_THREAD_STACK_SIZE);
+        while (pool.threads_len < count) {
+            // workers are numbered from 1, 0 is the caller
+            pool.seen[pool.threads_len + 1] = pool.generation;
+            if (0 != pthread_create(&pool.threads[pool.threads_len], &attr, pool_thread, (void *) (uintptr_t) (pool.threads_len + 1))) {
+                break;
+            }
+            ++pool.threads_len;
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    return pool.threads_len;
+}
+
+/**
+ * @return the number of threads to use for n tasks when threads are
+ * requested (0 for the number of CPUs)
+ */
+unsigned highlight_pool_threads(unsigned threads, size_t n)
+{
+    if (0 == threads) {
+        threads = (unsigned) MAX(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+    }
+    if (threads > BATCH_MAX_THREADS) {
+        threads = BATCH_MAX_THREADS;
+    }
+    if (threads > n) {
+        threads = (unsigned) n;
+    }
+
+    return threads;
+}
+
+/**
+ * Runs task(arg, i, worker) for each i in [0;n[ on the pool, worker being
+ * the number of the thread which runs it (0 for the calling one)
+ *
+ * @param n the number of tasks
+ * @param order if not NULL, the order in which to start the tasks (n
+ * indexes), else they are started from 0 to n - 1
+ * @param threads the number of threads to use, the calling one included
+ * (0 for the number of CPUs). It is limited to n.
+ * @param task the function to call
+ * @param arg its first argument
+ *
+ * @return the number of threads which were used (workers are numbered
+ * from 0 to this value - 1)
+ */
+unsigned highlight_pool_run(size_t n, const size_t *order, unsigned threads, PoolTask task, void *arg)
+{
+    size_t i;
+    Batch batch;
+
+    if (0 == n) {
+        return 0;
+    }
+    threads = highlight_pool_threads(threads, n);
+    pthread_mutex_lock(&pool.batch_lock);
+    pthread_mutex_lock(&pool.lock);
+    if (threads > 1) {
+        // we may get less threads than requested but the pool may also be larger, from a previous call
+        threads = 1 + MIN(pool_grow(threads - 1), threads - 1);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    batch.task = task;
+    batch.arg = arg;
+    batch.workers = threads;
+    batch.left = 0;
+    batch.deques = mem_new_n(*batch.deques, threads);
+    for (i = 0; NULL != batch.deques && i < threads; i++) {
+        if (NULL == (batch.deques[i].slots = mem_new_n(*batch.deques[i].slots, n / threads + 1))) {
+            deques_free(batch.deques, i);
+            batch.deques = NULL;
+        } else {
+            batch.deques[i].head = batch.deques[i].tail = 0;
+            pthread_mutex_init(&batch.deques[i].lock, NULL);
+        }
+    }
+    if (NULL == batch.deques) {
+        // out of memory: the caller runs all the tasks, in order
+        for (i = 0; i < n; i++) {
+            task(arg, NULL == order ? i : order[i], 0);
+        }
+        pthread_mutex_unlock(&pool.batch_lock);
+
+        return 1;
+    }
+    // deal the tasks: each deque keeps their order
+    for (i = 0; i < n; i++) {
+        BatchDeque *deque;
+
+        deque = &batch.deques[i % threads];
+        deque->slots[deque->tail++] = NULL == order ? i : order[i];
+    }
+
+    if (threads > 1) {
+        pthread_mutex_lock(&pool.lock);
+        pool.batch = &batch;
+        ++pool.generation;
+        pthread_cond_broadcast(&pool.work);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    batch_work(&batch, 0);
+    if (threads > 1) {
+        pthread_mutex_lock(&pool.lock);
+        while (batch.left < threads - 1) {
+            pthread_cond_wait(&pool.done, &pool.lock);
+        }
+        pool.batch = NULL;
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    deques_free(batch.deques, threads);
+    pthread_mutex_unlock(&pool.batch_lock);
+
+    return threads;
+}
+
+typedef struct {
+    size_t len;
+    size_t index;
+} JobSize;
+
+typedef struct {
+    const HighlightJob *jobs;
+    HighlightResult *out;
+    // there is a single worker: no need to copy the formatters
+    bool serial;
+} Jobs;
+
+static int job_size_cmp(const void *a, const void *b)
+{
+    const JobSize *ja, *jb;
+
+    ja = (const JobSize *) a;
+    jb = (const JobSize *) b;
+    if (ja->len != jb->len) {
+        return ja->len > jb->len ? -1 : 1;
+    }
+    // keep the order of the batch between jobs of the same size
+    return ja->index < jb->index ? -1 : ja->index > jb->index;
+}
+
+static void job_run(void *arg, size_t job, unsigned worker)
+{
+    Jobs *jobs;
+    Formatter *fmt;
+    const HighlightJob *j;
+
+    jobs = (Jobs *) arg;
+    j = &jobs->jobs[job];
+    if (jobs->serial) {
+        fmt = j->fmt;
+    } else if (NULL == (fmt = session_formatter(&pool.sessions[worker], j->fmt))) {
+        // highlight_batch runs it afterwards, with the original formatter
+        jobs->out[job].status = JOB_DEFERRED;
+        return;
+    }
+    jobs->out[job].status = highlight_string_with_budget(j->src, j->src_len, &jobs->out[job].dst, &jobs->out[job].dst_len, fmt, j->lexerc, j->lexerv, j->budget);
+}
+
+/**
+ * Highlights several independent documents, in parallel, on a pool of
+ * threads owned by the library
+ *
+ * @param jobs the documents to highlight
+ * @param n the number of jobs
+ * @param out an array of n results, the one of jobs[i] is set in out[i]
+ * @param threads the number of threads to use, the calling one included
+ * (0 for the number of CPUs). It is limited to n.
+ *
+ * @return the number of jobs which didn't end on HIGHLIGHT_SUCCESS (their
+ * output is still set, see highlight_string_with_budget)
+ */
+SHALL_API size_t highlight_batch(const HighlightJob *jobs, size_t n, HighlightResult *out, unsigned threads)
+{
+    Jobs arg;
+    JobSize *sizes;
+    size_t i, failures, *order;
+    unsigned workers;
+
+    if (0 == n) {
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        out[i].dst = NULL;
+        out[i].dst_len = 0;
+    }
+    // start with the largest documents (else, out of memory, in the order of the batch)
+    order = NULL;
+    if (NULL != (sizes = mem_new_n(*sizes, n))) {
+        for (i = 0; i < n; i++) {
+            sizes[i].len = jobs[i].src_len;
+            sizes[i].index = i;
+        }
+        qsort(sizes, n, sizeof(*sizes), job_size_cmp);
+        if (NULL != (order = mem_new_n(*order, n))) {
+            for (i = 0; i < n; i++) {
+                order[i] = sizes[i].index;
+            }
+        }
+        free(sizes);
+    }
+    arg.jobs = jobs;
+    arg.out = out;
+    arg.serial = 1 == highlight_pool_threads(threads, n);
+    workers = highlight_pool_run(n, order, threads, job_run, &arg);
+    free(order);
+    // the sessions are only used by the batches of highlight_batch, one at a time
+    pthread_mutex_lock(&pool.batch_lock);
+    for (i = 0; i < workers; i++) {
+        session_reset(&pool.sessions[i]);
+    }
+    pthread_mutex_unlock(&pool.batch_lock);
+
+    for (failures = i = 0; i < n; i++) {
+        if (JOB_DEFERRED == out[i].status) {
+            out[i].status = highlight_string_with_budget(jobs[i].src, jobs[i].src_len, &out[i].dst, &out[i].dst_len, jobs[i].fmt, jobs[i].lexerc, jobs[i].lexerv, jobs[i].budget);
+        }
+        if (HIGHLIGHT_SUCCESS != out[i].status) {
+            ++failures;
+        }
+    }
+
+    return failures;
+}
+
+/**
+ * Stops the threads of the pool used by highlight_batch and frees its
+ * memory (a later call to highlight_batch creates a new one)
+ */
+SHALL_API void highlight_batch_pool_destroy(void)
+{
+    unsigned i;
+
+    pthread_mutex_lock(&pool.batch_lock);
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = true;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < pool.threads_len; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.threads_len = 0;
+    pool.shutdown = false;
+    for (i = 0; i < ARRAY_SIZE(pool.sessions); i++) {
+        free(pool.sessions[i].formatters);
+        pool.sessions[i].formatters = NULL;
+        pool.sessions[i].formatters_size = 0;
+    }
+    pthread_mutex_unlock(&pool.batch_lock);
+}
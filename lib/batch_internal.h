@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stddef.h>
+
+typedef void (*PoolTask)(void *, size_t, unsigned);
+
+unsigned highlight_pool_threads(unsigned, size_t);
+unsigned highlight_pool_run(size_t, const size_t *, unsigned, PoolTask, void *);
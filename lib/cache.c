@@ -0,0 +1,453 @@
+/**
+ * @file lib/cache.c
+ * @brief content addressed cache of highlighting results
+ *
+ * A result is identified by a 128-bit hash of everything which has an effect
+ * on it: the input string, the lexers (with their options, sublexers included)
+ * and the formatter (with its options). Formatters are expected to produce
+ * an output which only depends on their implementation and options.
+ *
+ * Results are kept in memory, up to a given size, and the least recently used
+ * are dropped first. If a directory is given, results are also stored in it
+ * (as dir/xx/yyyy... where xxyyyy... is the hexadecimal hash) so they survive
+ * to the process. Files are written to a temporary file then renamed, so a
+ * reader never sees a partial result, even if several processes share the
+ * same directory.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "cpp.h"
+#include "hash.h"
+#include "hashtable.h"
+#include "lexer.h"
+#include "formatter.h"
+#undef TOKEN // conflict between lexer.h and tokens.h (included by themes.h)
+#include "themes.h"
+#include "version.h"
+#include "cache.h"
+
+#ifndef DOXYGEN
+# define CACHE_LEXER_DEPTH_LIMIT 8
+#endif /* !DOXYGEN */
+
+typedef struct CacheEntry CacheEntry;
+
+struct CacheEntry {
+    Hash128 key;
+    char *result;
+    size_t result_len;
+    CacheEntry *prev; // more recently used
+    CacheEntry *next; // less recently used
+};
+
+struct HighlightCache {
+    pthread_mutex_t lock;
+    HashTable entries;
+    CacheEntry *head, *tail;
+    size_t max_size;
+    char *directory;
+    HighlightCacheStats stats;
+};
+
+static ht_hash_t cache_key_hash(ht_key_t k)
+{
+    return (ht_hash_t) ((const Hash128 *) k)->h1;
+}
+
+static bool cache_key_equal(ht_key_t a, ht_key_t b)
+{
+    return 0 == hash128_cmp((const Hash128 *) a, (const Hash128 *) b);
+}
+
+static void cache_entry_destroy(void *data)
+{
+    CacheEntry *e;
+
+    e = (CacheEntry *) data;
+    free(e->result);
+    free(e);
+}
+
+/**
+ * Creates a new cache
+ *
+ * @param max_size the maximum size, in bytes, of the results kept in memory
+ * (0 to only rely on the directory)
+ * @param directory the directory where to store results, NULL for a memory
+ * only cache. It is created if it does not exist.
+ *
+ * @return NULL on failure (directory can't be created)
+ */
+SHALL_API HighlightCache *highlight_cache_create(size_t max_size, const char *directory)
+{
+    HighlightCache *cache;
+
+    if (NULL != directory && 0 != mkdir(directory, 0755) && EEXIST != errno) {
+        return NULL;
+    }
+    cache = malloc(sizeof(*cache));
+    pthread_mutex_init(&cache->lock, NULL);
+    hashtable_init(&cache->entries, 0, cache_key_hash, cache_key_equal, NULL, NULL, cache_entry_destroy);
+    cache->head = cache->tail = NULL;
+    cache->max_size = max_size;
+    cache->directory = NULL == directory ? NULL : strdup(directory);
+    bzero(&cache->stats, sizeof(cache->stats));
+
+    return cache;
+}
+
+/**
+ * Destroys a cache (results stored on disk are kept)
+ *
+ * @param cache the cache to free
+ */
+SHALL_API void highlight_cache_destroy(HighlightCache *cache)
+{
+    hashtable_destroy(&cache->entries);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->directory);
+    free(cache);
+}
+
+/**
+ * Gets the counters of a cache
+ *
+ * @param cache the cache
+ * @param stats the structure to fill
+ */
+SHALL_API void highlight_cache_stats(HighlightCache *cache, HighlightCacheStats *stats)
+{
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* ========== key computation ========== */
+
+static void hash_string(Hash128Context *ctxt, const char *string, size_t string_len)
+{
+    hash128_update(ctxt, &string_len, sizeof(string_len));
+    if (string_len > 0) {
+        hash128_update(ctxt, string, string_len);
+    }
+}
+
+static void hash_lexer(Hash128Context *, const Lexer *, int);
+
+static void hash_option(Hash128Context *ctxt, const OptionDeclaration *od, const OptionValue *optval, int depth)
+{
+    hash_string(ctxt, od->name, od->name_len);
+    switch (od->type) {
+        case OPT_TYPE_BOOL:
+        case OPT_TYPE_INT:
+            hash128_update(ctxt, &OPT_GET_INT(*optval), sizeof(OPT_GET_INT(*optval)));
+            break;
+        case OPT_TYPE_STRING:
+            if (NULL == OPT_STRVAL(*optval)) {
+                hash_string(ctxt, NULL, 0);
+            } else {
+                hash_string(ctxt, OPT_STRVAL(*optval), OPT_STRLEN(*optval));
+            }
+            break;
+        case OPT_TYPE_THEME:
+            if (NULL == OPT_THEMPTR(*optval)) {
+                hash_string(ctxt, NULL, 0);
+            } else {
+                hash_string(ctxt, OPT_THEMPTR(*optval)->name, strlen(OPT_THEMPTR(*optval)->name));
+                hash128_update(ctxt, OPT_THEMPTR(*optval)->styles, sizeof(OPT_THEMPTR(*optval)->styles));
+            }
+            break;
+        case OPT_TYPE_LEXER:
+            if (NULL == OPT_LEXPTR(*optval)) {
+                hash_string(ctxt, NULL, 0);
+            } else {
+                hash_lexer(ctxt, LEXER_UNWRAP(*optval), depth + 1);
+            }
+            break;
+        default:
+            hash128_update(ctxt, &OPT_PTR(*optval), sizeof(OPT_PTR(*optval)));
+            break;
+    }
+}
+
+static void hash_lexer(Hash128Context *ctxt, const Lexer *lexer, int depth)
+{
+    const LexerOption *lo;
+
+    hash_string(ctxt, lexer->imp->name, strlen(lexer->imp->name));
+    // a lexer can't be its own sublexer but stay on the safe side
+    if (depth < CACHE_LEXER_DEPTH_LIMIT && NULL != lexer->imp->options) {
+        for (lo = lexer->imp->options; NULL != lo->name; lo++) {
+            hash_option(ctxt, lo, &lexer->optvals[lo->offset / sizeof(OptionValue)], depth);
+        }
+    }
+}
+
+static void hash_formatter(Hash128Context *ctxt, Formatter *fmt)
+{
+    const FormatterOption *fo;
+
+    hash_string(ctxt, fmt->imp->name, strlen(fmt->imp->name));
+    if (NULL != fmt->imp->options) {
+        for (fo = fmt->imp->options; NULL != fo->name; fo++) {
+            OptionValue *optvalptr;
+
+            if (NULL != (optvalptr = fmt->imp->get_option_ptr(fmt, 0, fo->offset, fo->name, fo->name_len))) {
+                hash_option(ctxt, fo, optvalptr, 0);
+            }
+        }
+    }
+}
+
+static void cache_key(Hash128 *key, const char *src, size_t src_len, Formatter *fmt, size_t lexerc, Lexer **lexerv)
+{
+    size_t i;
+    Version version;
+    Hash128Context ctxt;
+
+    version_get(version);
+    // results of an other version of the library may differ
+    hash128_init(&ctxt, (uint64_t) version[0] << 16 | (uint64_t) version[1] << 8 | version[2]);
+    hash_formatter(&ctxt, fmt);
+    hash128_update(&ctxt, &lexerc, sizeof(lexerc));
+    for (i = 0; i < lexerc; i++) {
+        hash_lexer(&ctxt, lexerv[i], 0);
+    }
+    hash_string(&ctxt, src, src_len);
+    hash128_final(&ctxt, key);
+}
+
+/* ========== memory (LRU) ========== */
+
+static void lru_unlink(HighlightCache *cache, CacheEntry *e)
+{
+    if (NULL == e->prev) {
+        cache->head = e->next;
+    } else {
+        e->prev->next = e->next;
+    }
+    if (NULL == e->next) {
+        cache->tail = e->prev;
+    } else {
+        e->next->prev = e->prev;
+    }
+}
+
+static void lru_push_head(HighlightCache *cache, CacheEntry *e)
+{
+    e->prev = NULL;
+    e->next = cache->head;
+    if (NULL == cache->head) {
+        cache->tail = e;
+    } else {
+        cache->head->prev = e;
+    }
+    cache->head = e;
+}
+
+// caller have to hold the lock
+static bool memory_get(HighlightCache *cache, const Hash128 *key, char **dst, size_t *dst_len)
+{
+    CacheEntry *e;
+
+    if (!hashtable_get(&cache->entries, key, &e)) {
+        return false;
+    }
+    if (e != cache->head) {
+        lru_unlink(cache, e);
+        lru_push_head(cache, e);
+    }
+    *dst = malloc(e->result_len + 1);
+    memcpy(*dst, e->result, e->result_len + 1);
+    *dst_len = e->result_len;
+
+    return true;
+}
+
+// caller have to hold the lock
+static void memory_put(HighlightCache *cache, const Hash128 *key, const char *result, size_t result_len)
+{
+    CacheEntry *e;
+
+    if (result_len > cache->max_size || hashtable_contains(&cache->entries, key)) {
+        return;
+    }
+    while (NULL != cache->tail && cache->stats.size + result_len > cache->max_size) {
+        e = cache->tail;
+        lru_unlink(cache, e);
+        cache->stats.size -= e->result_len;
+        --cache->stats.entries;
+        ++cache->stats.evictions;
+        hashtable_delete(&cache->entries, &e->key, true);
+    }
+    e = malloc(sizeof(*e));
+    e->key = *key;
+    e->result = malloc(result_len + 1);
+    memcpy(e->result, result, result_len + 1);
+    e->result_len = result_len;
+    lru_push_head(cache, e);
+    hashtable_put(&cache->entries, 0, &e->key, e, NULL);
+    cache->stats.size += result_len;
+    ++cache->stats.entries;
+}
+
+/* ========== disk ========== */
+
+static bool disk_path(HighlightCache *cache, const Hash128 *key, char *path, size_t path_size, bool create_parent)
+{
+    char hex[HASH128_HEX_SIZE];
+
+    hash128_to_hex(key, hex);
+    if ((size_t) snprintf(path, path_size, "%s/%.2s", cache->directory, hex) >= path_size) {
+        return false;
+    }
+    if (create_parent && 0 != mkdir(path, 0755) && EEXIST != errno) {
+        return false;
+    }
+
+    return (size_t) snprintf(path, path_size, "%s/%.2s/%s", cache->directory, hex, hex + 2) < path_size;
+}
+
+static bool disk_get(HighlightCache *cache, const Hash128 *key, char **dst, size_t *dst_len)
+{
+    int fd;
+    char *buffer;
+    struct stat st;
+    char path[4096];
+    size_t total;
+    ssize_t r;
+
+    if (!disk_path(cache, key, path, sizeof(path), false)) {
+        return false;
+    }
+    if (-1 == (fd = open(path, O_RDONLY))) {
+        return false;
+    }
+    if (0 != fstat(fd, &st) || NULL == (buffer = malloc(st.st_size + 1))) {
+        close(fd);
+        return false;
+    }
+    for (total = 0; total < (size_t) st.st_size; total += r) {
+        if ((r = read(fd, buffer + total, st.st_size - total)) <= 0) {
+            if (-1 == r && EINTR == errno) {
+                r = 0;
+                continue;
+            }
+            break;
+        }
+    }
+    close(fd);
+    if (total != (size_t) st.st_size) {
+        free(buffer);
+        return false;
+    }
+    buffer[total] = '\0';
+    *dst = buffer;
+    *dst_len = total;
+
+    return true;
+}
+
+static void disk_put(HighlightCache *cache, const Hash128 *key, const char *result, size_t result_len)
+{
+    int fd;
+    size_t total;
+    ssize_t w;
+    char path[4096], tmp[4096];
+
+    if (!disk_path(cache, key, path, sizeof(path), true)) {
+        return;
+    }
+    if ((size_t) snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= sizeof(tmp)) {
+        return;
+    }
+    if (-1 == (fd = mkstemp(tmp))) {
+        return;
+    }
+    // mkstemp creates the file 0600, which would hide the result to the other users of the directory
+    if (0 != fchmod(fd, 0644)) {
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    for (total = 0; total < result_len; total += w) {
+        if ((w = write(fd, result + total, result_len - total)) <= 0) {
+            if (-1 == w && EINTR == errno) {
+                w = 0;
+                continue;
+            }
+            break;
+        }
+    }
+    if (0 != close(fd) || total != result_len || 0 != rename(tmp, path)) {
+        unlink(tmp);
+    }
+}
+
+/**
+ * Same as highlight_string_with_budget but first look for a previous result
+ * in the given cache. On a miss, the result is computed then stored in the
+ * cache.
+ *
+ * @param cache the cache
+ * @param src the input string
+ * @param src_len its length
+ * @param dst the output string
+ * @param dst_len its length if not null
+ * @param fmt the formatter to generate output from tokens
+ * @param lexerc the number of lexers in lexerv (have to >= 1)
+ * @param lexerv an array of lexers to tokenize the input string
+ * (the top lexer have to be at index 0)
+ * @param budget the limits to highlight the string on a miss (NULL for none)
+ *
+ * @return zero if successfull (only successful results are cached), else
+ * see highlight_string_with_budget
+ */
+SHALL_API int highlight_string_cached(HighlightCache *cache, const char *src, size_t src_len, char **dst, size_t *dst_len, Formatter *fmt, size_t lexerc, Lexer **lexerv, const HighlightBudget *budget)
+{
+    int ret;
+    Hash128 key;
+    size_t result_len;
+
+    cache_key(&key, src, src_len, fmt, lexerc, lexerv);
+    pthread_mutex_lock(&cache->lock);
+    if (memory_get(cache, &key, dst, &result_len)) {
+        ++cache->stats.hits;
+        pthread_mutex_unlock(&cache->lock);
+        ret = 0;
+    } else {
+        pthread_mutex_unlock(&cache->lock);
+        if (NULL != cache->directory && disk_get(cache, &key, dst, &result_len)) {
+            pthread_mutex_lock(&cache->lock);
+            ++cache->stats.disk_hits;
+            memory_put(cache, &key, *dst, result_len);
+            pthread_mutex_unlock(&cache->lock);
+            ret = 0;
+        } else {
+            if (0 == (ret = highlight_string_with_budget(src, src_len, dst, &result_len, fmt, lexerc, lexerv, budget))) {
+                if (NULL != cache->directory) {
+                    disk_put(cache, &key, *dst, result_len);
+                }
+            }
+            pthread_mutex_lock(&cache->lock);
+            ++cache->stats.misses;
+            if (0 == ret) {
+                memory_put(cache, &key, *dst, result_len);
+            }
+            pthread_mutex_unlock(&cache->lock);
+        }
+    }
+    if (NULL != dst_len) {
+        *dst_len = result_len;
+    }
+
+    return ret;
+}
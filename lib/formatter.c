@@ -299,6 +299,37 @@ SHALL_API Formatter *formatter_create(const FormatterImplementation *imp)
 #endif
 }
 
+/**
+ * Creates a new formatter of the same implementation and with the same
+ * option values as an other one. A formatter holds the state of the
+ * document it writes, it can't be used by several threads at the same
+ * time: give its own copy to each of them.
+ *
+ * @param fmt the formatter to copy
+ *
+ * @return a new formatter
+ */
+SHALL_API Formatter *formatter_copy(Formatter *fmt)
+{
+    Formatter *copy;
+
+    if (NULL != (copy = formatter_create(fmt->imp)) && NULL != fmt->imp->options) {
+        FormatterOption *fo;
+
+        for (fo = fmt->imp->options; NULL != fo->name; fo++) {
+            OptionValue *src, *dest;
+
+            src = fmt->imp->get_option_ptr(fmt, 0, fo->offset, fo->name, fo->name_len);
+            dest = copy->imp->get_option_ptr(copy, 0, fo->offset, fo->name, fo->name_len);
+            if (NULL != src && NULL != dest) {
+                option_copy(fo->type, dest, *src, fo->defval);
+            }
+        }
+    }
+
+    return copy;
+}
+
 /**
  * Disposes of a formatter (frees memory). This function should be called
  * once per "object" returned by formatter_create().
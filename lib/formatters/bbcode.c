@@ -19,6 +19,8 @@ typedef struct {
         size_t suffix_len;
         const char *suffix;
     } sequences[_TOKEN_COUNT];
+    // theme from which sequences were built (NULL if not yet built)
+    const Theme *prepared_theme;
 } BBCodeFormatterData;
 
 #define LONGEST_OPENING_TAG \
@@ -26,18 +28,36 @@ typedef struct {
 
 STRING_BUILDER_DECL(STR_SIZE(LONGEST_OPENING_TAG));
 
-static int bbcode_start_document(String *out, FormatterData *data)
+static void free_prepared(BBCodeFormatterData *mydata)
+{
+    size_t i;
+
+    for (i = 0; i < _TOKEN_COUNT; i++) {
+        if (mydata->sequences[i].prefix_len > 0) {
+            free((void *) mydata->sequences[i].prefix);
+            free((void *) mydata->sequences[i].suffix);
+        }
+    }
+}
+
+/**
+ * Build the tags of each token type. They are kept from one document to
+ * the next and only rebuilt when the theme has changed since.
+ */
+static void prepare(BBCodeFormatterData *mydata)
 {
     size_t i;
     const Theme *theme;
-    BBCodeFormatterData *mydata;
 
-    mydata = (BBCodeFormatterData *) data;
     // TODO: define a default theme in shall itself
     if (NULL == (theme = mydata->theme)) {
         theme = theme_by_name("molokai");
     }
-    // TODO: build "cache" only the first time and rebuild it only if theme has changed between 2 start_document calls
+    if (theme == mydata->prepared_theme) {
+        return;
+    }
+    free_prepared(mydata);
+    mydata->prepared_theme = theme;
     for (i = 0; i < _TOKEN_COUNT; i++) {
         mydata->sequences[i].prefix_len = mydata->sequences[i].suffix_len = 0;
         mydata->sequences[i].prefix = mydata->sequences[i].suffix = NULL;
@@ -75,6 +95,14 @@ static int bbcode_start_document(String *out, FormatterData *data)
             STRING_BUILDER_DUP_INTO(sb[CLOSING_TAG], mydata->sequences[i].suffix);
         }
     }
+}
+
+static int bbcode_start_document(String *out, FormatterData *data)
+{
+    BBCodeFormatterData *mydata;
+
+    mydata = (BBCodeFormatterData *) data;
+    prepare(mydata);
     if (mydata->codetag) {
         STRING_APPEND_STRING(out, "[code]");
     }
@@ -133,16 +161,7 @@ static int bbcode_write_token(String *out, const char *token, size_t token_len,
 
 static void bbcode_finalize(FormatterData *data)
 {
-    size_t i;
-    BBCodeFormatterData *mydata;
-
-    mydata = (BBCodeFormatterData *) data;
-    for (i = 0; i < _TOKEN_COUNT; i++) {
-        if (mydata->sequences[i].prefix_len > 0) {
-            free((void *) mydata->sequences[i].prefix);
-            free((void *) mydata->sequences[i].suffix);
-        }
-    }
+    free_prepared((BBCodeFormatterData *) data);
 }
 
 const FormatterImplementation _bbcodefmt = {
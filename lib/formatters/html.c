@@ -1,11 +1,14 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <stdbool.h>
 
 #include "cpp.h"
 #include "tokens.h"
 #include "themes.h"
 #include "formatter.h"
+#include "themes_builtin.h"
 
 typedef struct {
     OptionValue title;
@@ -14,26 +17,139 @@ typedef struct {
     int full ALIGNED(sizeof(OptionValue));
     int nowrap ALIGNED(sizeof(OptionValue));
     int noclasses ALIGNED(sizeof(OptionValue));
+    int usedclasses ALIGNED(sizeof(OptionValue));
     const Theme *theme ALIGNED(sizeof(OptionValue));
     struct {
         size_t len;
         const char *val;
     } open_span_tag[_TOKEN_COUNT];
+    // the style sheet of a theme which is not a builtin one, for full documents (NULL until needed)
+    char *css;
+    // usedclasses mode: the token types written in the current document
+    bool used[_TOKEN_COUNT];
+    // usedclasses mode: the document from its style sheet, which is only known at its end, is held
+    // there (what was written to out may already have been sent to a sink)
+    String *held;
+    bool holding;
+    // theme and options from which open_span_tag and css were built (theme is NULL if not yet built)
+    struct {
+        const Theme *theme;
+        int noclasses;
+    } prepared;
 } HTMLFormatterData;
 
 #define NL "\n"
 #define INDENT "  "
 
-static int html_start_document(String *out, FormatterData *data)
+/**
+ * @return where to write: out, or the held part of the document in usedclasses mode
+ */
+static String *html_output(String *out, FormatterData *data)
 {
     HTMLFormatterData *mydata;
-    const Theme *theme;
 
     mydata = (HTMLFormatterData *) data;
+
+    return mydata->holding ? mydata->held : out;
+}
+
+static void free_prepared(HTMLFormatterData *mydata)
+{
+    size_t i;
+
+    for (i = 0; i < _TOKEN_COUNT; i++) {
+        if (mydata->open_span_tag[i].len > 0) {
+            free((void *) mydata->open_span_tag[i].val);
+        }
+        mydata->open_span_tag[i].len = 0;
+        mydata->open_span_tag[i].val = NULL;
+    }
+    free(mydata->css);
+    mydata->css = NULL;
+}
+
+/**
+ * Build the inline styles of each token type (noclasses mode). They are
+ * kept, as the style sheet, from one document to the next and only rebuilt
+ * when the theme or the noclasses option have changed since.
+ *
+ * @return the theme in use
+ */
+static const Theme *prepare(HTMLFormatterData *mydata)
+{
+    const Theme *theme;
+
     // TODO: define a default theme in shall itself
     if (NULL == (theme = mydata->theme)) {
         theme = theme_by_name("molokai");
     }
+    if (theme == mydata->prepared.theme && mydata->noclasses == mydata->prepared.noclasses) {
+        return theme;
+    }
+    free_prepared(mydata);
+    mydata->prepared.theme = theme;
+    mydata->prepared.noclasses = mydata->noclasses;
+    if (mydata->noclasses) {
+        size_t i;
+        String *buffer;
+
+        buffer = string_new();
+        for (i = 0; i < _TOKEN_COUNT; i++) {
+            if (theme->styles[i].flags) {
+                string_truncate(buffer);
+                STRING_APPEND_STRING(buffer, "<span style=\"");
+                if (theme->styles[i].bold) {
+                    STRING_APPEND_STRING(buffer, "font-weight: bold;");
+                }
+                if (theme->styles[i].italic) {
+                    STRING_APPEND_STRING(buffer, "font-style: italic;");
+                }
+                if (theme->styles[i].underline) {
+                    STRING_APPEND_STRING(buffer, "text-decoration: underline;");
+                }
+                if (theme->styles[i].fg_set) {
+                    STRING_APPEND_COLOR(buffer, "color: ", theme->styles[i].fg, ";");
+                }
+                if (theme->styles[i].bg_set) {
+                    STRING_APPEND_COLOR(buffer, "background-color: ", theme->styles[i].bg, ";");
+                }
+                STRING_APPEND_STRING(buffer, "\">");
+
+                mydata->open_span_tag[i].val = strndup(buffer->ptr, buffer->len);
+                mydata->open_span_tag[i].len = buffer->len;
+            }
+        }
+        string_destroy(buffer);
+    }
+
+    return theme;
+}
+
+/**
+ * @return the style sheet of the whole theme
+ */
+static const char *style_sheet(HTMLFormatterData *mydata, const Theme *theme)
+{
+    const char *css;
+
+    if (NULL == (css = theme_builtin_css(theme))) {
+        if (NULL == mydata->css) {
+            mydata->css = theme_export_as_css(theme, NULL, true);
+        }
+        css = mydata->css;
+    }
+
+    return css;
+}
+
+static int html_start_document(String *out, FormatterData *data)
+{
+    HTMLFormatterData *mydata;
+    const Theme *theme;
+
+    mydata = (HTMLFormatterData *) data;
+    theme = prepare(mydata);
+    mydata->holding = false;
     if (0 != mydata->full) {
         if (5 == mydata->full) {
             STRING_APPEND_STRING(out, "<!DOCTYPE html>")
@@ -55,11 +171,18 @@ static int html_start_document(String *out, FormatterData *data)
         }
         STRING_APPEND_STRING(out, NL INDENT INDENT "<style type=\"text/css\">");
         if (!mydata->noclasses) {
-            char *css;
-
-            css = theme_export_as_css(theme, NULL, true);
-            string_append_string(out, css);
-            free(css);
+            if (mydata->usedclasses) {
+                // the rules are only known at the end of the document
+                bzero(mydata->used, sizeof(mydata->used));
+                if (NULL == mydata->held) {
+                    mydata->held = string_new();
+                }
+                string_truncate(mydata->held);
+                mydata->holding = true;
+                out = mydata->held;
+            } else {
+                string_append_string(out, style_sheet(mydata, theme));
+            }
         }
         STRING_APPEND_STRING(out, NL INDENT INDENT "</style>"
             NL INDENT "</head>"
@@ -75,55 +198,32 @@ static int html_start_document(String *out, FormatterData *data)
             STRING_APPEND_STRING(out, "\">");
         }
     }
-    // TODO: build "cache" only the first time and rebuild it only if theme has changed between 2 start_document calls
-    if (mydata->noclasses) {
-        size_t i;
-        String *buffer;
-
-        buffer = string_new();
-        for (i = 0; i < _TOKEN_COUNT; i++) {
-            mydata->open_span_tag[i].len = 0;
-            mydata->open_span_tag[i].val = NULL;
-            if (theme->styles[i].flags) {
-                string_truncate(buffer);
-                STRING_APPEND_STRING(buffer, "<span style=\"");
-                if (theme->styles[i].bold) {
-                    STRING_APPEND_STRING(buffer, "font-weight: bold;");
-                }
-                if (theme->styles[i].italic) {
-                    STRING_APPEND_STRING(buffer, "font-style: italic;");
-                }
-                if (theme->styles[i].underline) {
-                    STRING_APPEND_STRING(buffer, "text-decoration: underline;");
-                }
-                if (theme->styles[i].fg_set) {
-                    STRING_APPEND_COLOR(buffer, "color: ", theme->styles[i].fg, ";");
-                }
-                if (theme->styles[i].bg_set) {
-                    STRING_APPEND_COLOR(buffer, "background-color: ", theme->styles[i].bg, ";");
-                }
-                STRING_APPEND_STRING(buffer, "\">");
-
-                mydata->open_span_tag[i].val = strndup(buffer->ptr, buffer->len);
-                mydata->open_span_tag[i].len = buffer->len;
-            }
-        }
-        string_destroy(buffer);
-    }
 
     return 0;
 }
 
 static int html_end_document(String *out, FormatterData *data)
 {
+    String *body;
     HTMLFormatterData *mydata;
 
     mydata = (HTMLFormatterData *) data;
+    body = html_output(out, data);
     if (!mydata->nowrap) {
-        STRING_APPEND_STRING(out, "</pre>");
+        STRING_APPEND_STRING(body, "</pre>");
     }
     if (0 != mydata->full) {
-        STRING_APPEND_STRING(out, NL INDENT "</body>" NL "</html>");
+        STRING_APPEND_STRING(body, NL INDENT "</body>" NL "</html>");
+    }
+    if (mydata->holding) {
+        char *css;
+
+        css = theme_export_as_css_for_tokens(mydata->prepared.theme, NULL, true, mydata->used);
+        string_append_string(out, css);
+        free(css);
+        string_append_string_len(out, body->ptr, body->len);
+        string_truncate(body);
+        mydata->holding = false;
     }
 
     return 0;
@@ -135,11 +235,13 @@ static int html_start_token(int token, String *out, FormatterData *data)
         HTMLFormatterData *mydata;
 
         mydata = (HTMLFormatterData *) data;
+        out = html_output(out, data);
         if (mydata->noclasses) {
             if (mydata->open_span_tag[token].len > 0) {
                 string_append_string_len(out, mydata->open_span_tag[token].val, mydata->open_span_tag[token].len);
             }
         } else {
+            mydata->used[token] = true;
             if ('\0' == tokens[token].cssclass[1]) {
                 char buffer[] = "<span class=\"X\">";
 
@@ -158,25 +260,26 @@ static int html_start_token(int token, String *out, FormatterData *data)
     return 0;
 }
 
-static int html_end_token(int token, String *out, FormatterData *UNUSED(data))
+static int html_end_token(int token, String *out, FormatterData *data)
 {
     if (IGNORABLE != token) {
-        STRING_APPEND_STRING(out, "</span>");
+        STRING_APPEND_STRING(html_output(out, data), "</span>");
     }
 
     return 0;
 }
 
-static int html_write_token(String *out, const char *token, size_t token_len, FormatterData *UNUSED(data))
+static int html_write_token(String *out, const char *token, size_t token_len, FormatterData *data)
 {
-    string_append_xml_len(out, token, token_len);
+    string_append_xml_len(html_output(out, data), token, token_len);
 
     return 0;
 }
 
 // NOTE: for debugging and testing, span tag is voluntarily in uppercase to be easier to identify
-static int html_start_lexing(const char *lexname, String *out, FormatterData *UNUSED(data))
+static int html_start_lexing(const char *lexname, String *out, FormatterData *data)
 {
+    out = html_output(out, data);
     STRING_APPEND_STRING(out, "<SPAN class=\"");
     string_append_string(out, lexname);
     STRING_APPEND_STRING(out, "\">");
@@ -184,9 +287,9 @@ static int html_start_lexing(const char *lexname, String *out, FormatterData *UN
     return 0;
 }
 
-static int html_end_lexing(const char *UNUSED(lexname), String *out, FormatterData *UNUSED(data))
+static int html_end_lexing(const char *UNUSED(lexname), String *out, FormatterData *data)
 {
-    STRING_APPEND_STRING(out, "</SPAN>");
+    STRING_APPEND_STRING(html_output(out, data), "</SPAN>");
 
     return 0;
 }
@@ -196,14 +299,9 @@ static void html_finalize(FormatterData *data)
     HTMLFormatterData *mydata;
 
     mydata = (HTMLFormatterData *) data;
-    if (mydata->noclasses) {
-        size_t i;
-
-        for (i = 0; i < _TOKEN_COUNT; i++) {
-            if (mydata->open_span_tag[i].len > 0) {
-                free((void *) mydata->open_span_tag[i].val);
-            }
-        }
+    free_prepared(mydata);
+    if (NULL != mydata->held) {
+        string_destroy(mydata->held);
     }
 }
 
@@ -221,13 +319,14 @@ const FormatterImplementation _htmlfmt = {
     html_finalize,
     sizeof(HTMLFormatterData),
     (/*const*/ FormatterOption /*const*/ []) {
-        { S("full"),      OPT_TYPE_INT,    offsetof(HTMLFormatterData, full),      OPT_DEF_INT(0),     "if not 0, embeds generated output in a whole HTML 4 page (use 5 for a HTML 5 document)" },
-        { S("title"),     OPT_TYPE_STRING, offsetof(HTMLFormatterData, title),     OPT_DEF_STRING(""), "when *full* is not 0, this is the content to use as `<title>` for the full HTML output document (its content is escaped)" },
-        { S("nowrap"),    OPT_TYPE_BOOL,   offsetof(HTMLFormatterData, nowrap),    OPT_DEF_BOOL(0),    "when set to true, don't wrap output within a `<pre>` tag" },
-        { S("noclasses"), OPT_TYPE_BOOL,   offsetof(HTMLFormatterData, noclasses), OPT_DEF_BOOL(0),    "when set to true (not recommanded), output `<span>` tags will not use CSS classes, but inline styles" },
-        { S("theme"),     OPT_TYPE_THEME,  offsetof(HTMLFormatterData, theme),     OPT_DEF_THEME,      "the theme to use" },
-        { S("cssclass"),  OPT_TYPE_STRING, offsetof(HTMLFormatterData, cssclass),  OPT_DEF_STRING(""), "if valued to `foo`, ` class=\"foo\"` is added to `<pre>` tag" },
-        { S("linestart"), OPT_TYPE_INT,    offsetof(HTMLFormatterData, linestart), OPT_DEF_INT(1),     "the line number for the first line" },
+        { S("full"),        OPT_TYPE_INT,    offsetof(HTMLFormatterData, full),        OPT_DEF_INT(0),     "if not 0, embeds generated output in a whole HTML 4 page (use 5 for a HTML 5 document)" },
+        { S("title"),       OPT_TYPE_STRING, offsetof(HTMLFormatterData, title),       OPT_DEF_STRING(""), "when *full* is not 0, this is the content to use as `<title>` for the full HTML output document (its content is escaped)" },
+        { S("nowrap"),      OPT_TYPE_BOOL,   offsetof(HTMLFormatterData, nowrap),      OPT_DEF_BOOL(0),    "when set to true, don't wrap output within a `<pre>` tag" },
+        { S("noclasses"),   OPT_TYPE_BOOL,   offsetof(HTMLFormatterData, noclasses),   OPT_DEF_BOOL(0),    "when set to true (not recommanded), output `<span>` tags will not use CSS classes, but inline styles" },
+        { S("usedclasses"), OPT_TYPE_BOOL,   offsetof(HTMLFormatterData, usedclasses), OPT_DEF_BOOL(0),    "when *full* is not 0 and set to true, the style sheet only contains the rules of the classes used by the document" },
+        { S("theme"),       OPT_TYPE_THEME,  offsetof(HTMLFormatterData, theme),       OPT_DEF_THEME,      "the theme to use" },
+        { S("cssclass"),    OPT_TYPE_STRING, offsetof(HTMLFormatterData, cssclass),    OPT_DEF_STRING(""), "if valued to `foo`, ` class=\"foo\"` is added to `<pre>` tag" },
+        { S("linestart"),   OPT_TYPE_INT,    offsetof(HTMLFormatterData, linestart),   OPT_DEF_INT(1),     "the line number for the first line" },
         END_OF_OPTIONS
     }
 };
@@ -1,4 +1,5 @@
 #include <stddef.h>
+#include <stdbool.h>
 
 #include "cpp.h"
 #include "tokens.h"
@@ -6,36 +7,47 @@
 
 typedef struct {
     int nolexing ALIGNED(sizeof(OptionValue));
+    // the newline which ends the last line, only written if something follows
+    // (the output may have been sent to a sink, it can't be removed by end_document)
+    bool newline;
 } PlainFormatterData;
 
-#if 0
-static int start_document(String *out, FormatterData *data)
+static void end_line(String *out, PlainFormatterData *mydata)
 {
-    STRING_APPEND_STRING(out, "--BOS--");
+    if (mydata->newline) {
+        STRING_APPEND_STRING(out, "\n");
+        mydata->newline = false;
+    }
+}
+
+static int start_document(String *UNUSED(out), FormatterData *data)
+{
+//     STRING_APPEND_STRING(out, "--BOS--");
+    ((PlainFormatterData *) data)->newline = false;
 
     return 0;
 }
-#endif
 
-static int end_document(String *out, FormatterData *UNUSED(data))
+static int end_document(String *UNUSED(out), FormatterData *data)
 {
 //     STRING_APPEND_STRING(out, "--EOS--");
-    string_chomp(out);
+    ((PlainFormatterData *) data)->newline = false;
 
     return 0;
 }
 
-static int start_token(int token, String *out, FormatterData *UNUSED(data))
+static int start_token(int token, String *out, FormatterData *data)
 {
+    end_line(out, (PlainFormatterData *) data);
     string_append_string_len(out, tokens[token].name, tokens[token].name_len);
     STRING_APPEND_STRING(out, ": ");
 
     return 0;
 }
 
-static int end_token(int UNUSED(token), String *out, FormatterData *UNUSED(data))
+static int end_token(int UNUSED(token), String *UNUSED(out), FormatterData *data)
 {
-    STRING_APPEND_STRING(out, "\n");
+    ((PlainFormatterData *) data)->newline = true;
 
     return 0;
 }
@@ -53,9 +65,11 @@ static int start_lexing(const char *lexer, String *out, FormatterData *data)
 
     mydata = (PlainFormatterData *) data;
     if (!mydata->nolexing) {
+        end_line(out, mydata);
         STRING_APPEND_STRING(out, "===== ");
         string_append_string(out, lexer);
-        STRING_APPEND_STRING(out, " =====\n");
+        STRING_APPEND_STRING(out, " =====");
+        mydata->newline = true;
     }
 
     return 0;
@@ -67,9 +81,11 @@ static int end_lexing(const char *lexer, String *out, FormatterData *data)
 
     mydata = (PlainFormatterData *) data;
     if (!mydata->nolexing) {
+        end_line(out, mydata);
         STRING_APPEND_STRING(out, "===== /");
         string_append_string(out, lexer);
-        STRING_APPEND_STRING(out, " =====\n");
+        STRING_APPEND_STRING(out, " =====");
+        mydata->newline = true;
     }
 
     return 0;
@@ -81,7 +97,7 @@ static const FormatterImplementation _plainfmt = {
 #ifndef WITHOUT_FORMATTER_OPTIONS
     formatter_implementation_default_get_option_ptr,
 #endif
-    NULL,
+    start_document,
     end_document,
     start_token,
     end_token,
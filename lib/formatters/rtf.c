@@ -17,6 +17,11 @@ typedef struct {
         size_t prefix_len;
         const char *prefix;
     } sequences[_TOKEN_COUNT];
+    // the font and color tables
+    size_t header_len;
+    char *header;
+    // theme from which header and sequences were built (NULL if not yet built)
+    const Theme *prepared_theme;
 } RTFFormatterData;
 
 #define STRINGIFY_HELPER(x) #x
@@ -41,19 +46,41 @@ static ht_hash_t hash_color(const Color *color)
     return h.h;    
 }
 
-static int rtf_start_document(String *out, FormatterData *data)
+static void free_prepared(RTFFormatterData *mydata)
 {
     size_t i;
+
+    for (i = 0; i < _TOKEN_COUNT; i++) {
+        if (mydata->sequences[i].prefix_len > 0) {
+            free((void *) mydata->sequences[i].prefix);
+        }
+    }
+    free(mydata->header);
+}
+
+/**
+ * Build the header (font and color tables) and the prefix of each token
+ * type. They are kept from one document to the next and only rebuilt when
+ * the theme has changed since.
+ */
+static void prepare(RTFFormatterData *mydata)
+{
+    size_t i;
+    String *out;
     const Theme *theme;
     enum { FG, BG, COUNT };
-    RTFFormatterData *mydata;
     int map[COUNT][_TOKEN_COUNT];
 
-    mydata = (RTFFormatterData *) data;
     // TODO: define a default theme in shall itself
     if (NULL == (theme = mydata->theme)) {
         theme = theme_by_name("molokai");
     }
+    if (theme == mydata->prepared_theme) {
+        return;
+    }
+    free_prepared(mydata);
+    mydata->prepared_theme = theme;
+    out = string_new();
     STRING_APPEND_STRING(out, "{\\rtf1\\ansi\\uc0\\deff0{\\fonttbl{\\f0\\fmodern\\fprq1\\fcharset0");
     // TODO: append fontface here?
     STRING_APPEND_STRING(out, ";}}{\\colortbl;");
@@ -112,6 +139,17 @@ static int rtf_start_document(String *out, FormatterData *data)
             STRING_BUILDER_DUP_INTO(sb, mydata->sequences[i].prefix);
         }
     }
+    mydata->header_len = out->len;
+    mydata->header = string_orphan(out);
+}
+
+static int rtf_start_document(String *out, FormatterData *data)
+{
+    RTFFormatterData *mydata;
+
+    mydata = (RTFFormatterData *) data;
+    prepare(mydata);
+    string_append_string_len(out, mydata->header, mydata->header_len);
 
     return 0;
 }
@@ -165,15 +203,7 @@ static int rtf_write_token(String *out, const char *token, size_t token_len, For
 
 static void rtf_finalize(FormatterData *data)
 {
-    size_t i;
-    RTFFormatterData *mydata;
-
-    mydata = (RTFFormatterData *) data;
-    for (i = 0; i < _TOKEN_COUNT; i++) {
-        if (mydata->sequences[i].prefix_len > 0) {
-            free((void *) mydata->sequences[i].prefix);
-        }
-    }
+    free_prepared((RTFFormatterData *) data);
 }
 
 const FormatterImplementation _rtffmt = {
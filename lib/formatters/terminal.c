@@ -2,11 +2,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <strings.h>
 
 #include "cpp.h"
 #include "tokens.h"
 #include "themes.h"
 #include "formatter.h"
+#include "palette.h"
 #include "string_builder.h"
 
 #define BOLD      "01"
@@ -16,432 +19,287 @@
 #define BLINK     "05"
 #define OVERLINE  "06"
 
+/**
+ * The graphic rendition (SGR) state of the terminal: the attributes and the
+ * colors (as SGR parameters, empty for the default color)
+ */
 typedef struct {
+    bool bold;
+    bool italic;
+    bool underline;
+    char fg[STR_SIZE("38;2;RRR;GGG;BBB")];
+    char bg[STR_SIZE("48;2;RRR;GGG;BBB")];
+} SGRState;
+
+// no palette: colors are written as is (24 bits)
+#define TRUE_COLOR -1
+
+typedef struct {
+    int mode16 ALIGNED(sizeof(OptionValue));
     int mode256 ALIGNED(sizeof(OptionValue));
     const Theme *theme ALIGNED(sizeof(OptionValue));
+    // the distinct states used by the theme
+    SGRState styles[_TOKEN_COUNT];
+    // the state for each token type (token types with the same style share it)
+    const SGRState *token_styles[_TOKEN_COUNT];
+    // the entry of styles for the default attributes (NULL if the theme doesn't use it)
+    const SGRState *default_style;
+    // the state of the terminal at this point of the output
+    SGRState current;
+    // the state of the current token, if not yet applied (NULL if applied)
+    const SGRState *pending;
+    // the entry of styles which current is equal to (NULL if none)
+    const SGRState *applied;
+    // the palettes of a theme which is not a builtin one
+    ThemePalette palette;
+    // theme and palette (a Palette or TRUE_COLOR) from which styles were built (theme is NULL if not yet built)
     struct {
-        size_t value_len;
-        const char *value;
-    } sequences[_TOKEN_COUNT];
+        const Theme *theme;
+        int palette;
+    } prepared;
 } TerminalFormatterData;
 
-// bold (1) + italic (3) + underline (4) + fg (38;2;R;G;B) + bg (48;2;R;G;B) (with R/G/B in [0;255])
+// a reset (0) + bold (1) + italic (3) + underline (4) + fg (38;2;R;G;B) + bg (48;2;R;G;B) (with R/G/B in [0;255])
+// or, for a transition, their opposite: bold and italic and underline off (22;23;24) + fg and bg
 #define LONGEST_ANSI_ESCAPE_SEQUENCE \
-    "\e[1;3;4;38;2;RRR;GGG;BBB;48;2;RRR;GGG;BBBm"
-
-static const Color mode256[] = {
-    // [0x00-0x07]: standard colors (as in ESC [ 30–37 m) (based on xterm)
-    { 0x00, 0x00, 0x00 }, // 0: black
-    { 0xCD, 0x00, 0x00 }, // 1: red
-    { 0x00, 0xCD, 0x00 }, // 2: green
-    { 0xCD, 0xCD, 0x00 }, // 3: brown/yellow
-    { 0x00, 0x00, 0xEE }, // 4: blue
-    { 0xCD, 0x00, 0xCD }, // 5: magenta
-    { 0x00, 0xCD, 0xCD }, // 6: cyan
-    { 0xE5, 0xE5, 0xE5 }, // 7: gray
-    // [0x08-0x0F]: high intensity colors (as in ESC [ 90–97 m) (based on xterm)
-    { 0x7F, 0x7F, 0x7F }, // 0: darkgray
-    { 0xFF, 0x00, 0x00 }, // 1: red
-    { 0x00, 0xFF, 0x00 }, // 2: green
-    { 0xFF, 0xFF, 0x00 }, // 3: yellow
-    { 0x5C, 0x5C, 0xFF }, // 4: blue
-    { 0xFF, 0x00, 0xFF }, // 5: magenta
-    { 0x00, 0xFF, 0xFF }, // 6: cyan
-    { 0xFF, 0xFF, 0xFF }, // 7: white
-    // [0x10-0xE7]: 6 × 6 × 6 = 216 colors: 16 + 36 × r + 6 × g + b (0 ≤ r, g, b ≤ 5)
-#if 0
-<?php
-$valuerange = [ 0x00, 0x5F, 0x87, 0xAF, 0xD7, 0xFF ];
-for ($i = 0; $i < 216; $i++) {
-    printf('{ 0x%02X, 0x%02X, 0x%02X },' . PHP_EOL, $valuerange[($i / count($valuerange) ** 2) % count($valuerange)], $valuerange[($i / count($valuerange)) % count($valuerange)], $valuerange[$i % count($valuerange)]);
-}
-#endif
-    { 0x00, 0x00, 0x00 },
-    { 0x00, 0x00, 0x5F },
-    { 0x00, 0x00, 0x87 },
-    { 0x00, 0x00, 0xAF },
-    { 0x00, 0x00, 0xD7 },
-    { 0x00, 0x00, 0xFF },
-    { 0x00, 0x5F, 0x00 },
-    { 0x00, 0x5F, 0x5F },
-    { 0x00, 0x5F, 0x87 },
-    { 0x00, 0x5F, 0xAF },
-    { 0x00, 0x5F, 0xD7 },
-    { 0x00, 0x5F, 0xFF },
-    { 0x00, 0x87, 0x00 },
-    { 0x00, 0x87, 0x5F },
-    { 0x00, 0x87, 0x87 },
-    { 0x00, 0x87, 0xAF },
-    { 0x00, 0x87, 0xD7 },
-    { 0x00, 0x87, 0xFF },
-    { 0x00, 0xAF, 0x00 },
-    { 0x00, 0xAF, 0x5F },
-    { 0x00, 0xAF, 0x87 },
-    { 0x00, 0xAF, 0xAF },
-    { 0x00, 0xAF, 0xD7 },
-    { 0x00, 0xAF, 0xFF },
-    { 0x00, 0xD7, 0x00 },
-    { 0x00, 0xD7, 0x5F },
-    { 0x00, 0xD7, 0x87 },
-    { 0x00, 0xD7, 0xAF },
-    { 0x00, 0xD7, 0xD7 },
-    { 0x00, 0xD7, 0xFF },
-    { 0x00, 0xFF, 0x00 },
-    { 0x00, 0xFF, 0x5F },
-    { 0x00, 0xFF, 0x87 },
-    { 0x00, 0xFF, 0xAF },
-    { 0x00, 0xFF, 0xD7 },
-    { 0x00, 0xFF, 0xFF },
-    { 0x5F, 0x00, 0x00 },
-    { 0x5F, 0x00, 0x5F },
-    { 0x5F, 0x00, 0x87 },
-    { 0x5F, 0x00, 0xAF },
-    { 0x5F, 0x00, 0xD7 },
-    { 0x5F, 0x00, 0xFF },
-    { 0x5F, 0x5F, 0x00 },
-    { 0x5F, 0x5F, 0x5F },
-    { 0x5F, 0x5F, 0x87 },
-    { 0x5F, 0x5F, 0xAF },
-    { 0x5F, 0x5F, 0xD7 },
-    { 0x5F, 0x5F, 0xFF },
-    { 0x5F, 0x87, 0x00 },
-    { 0x5F, 0x87, 0x5F },
-    { 0x5F, 0x87, 0x87 },
-    { 0x5F, 0x87, 0xAF },
-    { 0x5F, 0x87, 0xD7 },
-    { 0x5F, 0x87, 0xFF },
-    { 0x5F, 0xAF, 0x00 },
-    { 0x5F, 0xAF, 0x5F },
-    { 0x5F, 0xAF, 0x87 },
-    { 0x5F, 0xAF, 0xAF },
-    { 0x5F, 0xAF, 0xD7 },
-    { 0x5F, 0xAF, 0xFF },
-    { 0x5F, 0xD7, 0x00 },
-    { 0x5F, 0xD7, 0x5F },
-    { 0x5F, 0xD7, 0x87 },
-    { 0x5F, 0xD7, 0xAF },
-    { 0x5F, 0xD7, 0xD7 },
-    { 0x5F, 0xD7, 0xFF },
-    { 0x5F, 0xFF, 0x00 },
-    { 0x5F, 0xFF, 0x5F },
-    { 0x5F, 0xFF, 0x87 },
-    { 0x5F, 0xFF, 0xAF },
-    { 0x5F, 0xFF, 0xD7 },
-    { 0x5F, 0xFF, 0xFF },
-    { 0x87, 0x00, 0x00 },
-    { 0x87, 0x00, 0x5F },
-    { 0x87, 0x00, 0x87 },
-    { 0x87, 0x00, 0xAF },
-    { 0x87, 0x00, 0xD7 },
-    { 0x87, 0x00, 0xFF },
-    { 0x87, 0x5F, 0x00 },
-    { 0x87, 0x5F, 0x5F },
-    { 0x87, 0x5F, 0x87 },
-    { 0x87, 0x5F, 0xAF },
-    { 0x87, 0x5F, 0xD7 },
-    { 0x87, 0x5F, 0xFF },
-    { 0x87, 0x87, 0x00 },
-    { 0x87, 0x87, 0x5F },
-    { 0x87, 0x87, 0x87 },
-    { 0x87, 0x87, 0xAF },
-    { 0x87, 0x87, 0xD7 },
-    { 0x87, 0x87, 0xFF },
-    { 0x87, 0xAF, 0x00 },
-    { 0x87, 0xAF, 0x5F },
-    { 0x87, 0xAF, 0x87 },
-    { 0x87, 0xAF, 0xAF },
-    { 0x87, 0xAF, 0xD7 },
-    { 0x87, 0xAF, 0xFF },
-    { 0x87, 0xD7, 0x00 },
-    { 0x87, 0xD7, 0x5F },
-    { 0x87, 0xD7, 0x87 },
-    { 0x87, 0xD7, 0xAF },
-    { 0x87, 0xD7, 0xD7 },
-    { 0x87, 0xD7, 0xFF },
-    { 0x87, 0xFF, 0x00 },
-    { 0x87, 0xFF, 0x5F },
-    { 0x87, 0xFF, 0x87 },
-    { 0x87, 0xFF, 0xAF },
-    { 0x87, 0xFF, 0xD7 },
-    { 0x87, 0xFF, 0xFF },
-    { 0xAF, 0x00, 0x00 },
-    { 0xAF, 0x00, 0x5F },
-    { 0xAF, 0x00, 0x87 },
-    { 0xAF, 0x00, 0xAF },
-    { 0xAF, 0x00, 0xD7 },
-    { 0xAF, 0x00, 0xFF },
-    { 0xAF, 0x5F, 0x00 },
-    { 0xAF, 0x5F, 0x5F },
-    { 0xAF, 0x5F, 0x87 },
-    { 0xAF, 0x5F, 0xAF },
-    { 0xAF, 0x5F, 0xD7 },
-    { 0xAF, 0x5F, 0xFF },
-    { 0xAF, 0x87, 0x00 },
-    { 0xAF, 0x87, 0x5F },
-    { 0xAF, 0x87, 0x87 },
-    { 0xAF, 0x87, 0xAF },
-    { 0xAF, 0x87, 0xD7 },
-    { 0xAF, 0x87, 0xFF },
-    { 0xAF, 0xAF, 0x00 },
-    { 0xAF, 0xAF, 0x5F },
-    { 0xAF, 0xAF, 0x87 },
-    { 0xAF, 0xAF, 0xAF },
-    { 0xAF, 0xAF, 0xD7 },
-    { 0xAF, 0xAF, 0xFF },
-    { 0xAF, 0xD7, 0x00 },
-    { 0xAF, 0xD7, 0x5F },
-    { 0xAF, 0xD7, 0x87 },
-    { 0xAF, 0xD7, 0xAF },
-    { 0xAF, 0xD7, 0xD7 },
-    { 0xAF, 0xD7, 0xFF },
-    { 0xAF, 0xFF, 0x00 },
-    { 0xAF, 0xFF, 0x5F },
-    { 0xAF, 0xFF, 0x87 },
-    { 0xAF, 0xFF, 0xAF },
-    { 0xAF, 0xFF, 0xD7 },
-    { 0xAF, 0xFF, 0xFF },
-    { 0xD7, 0x00, 0x00 },
-    { 0xD7, 0x00, 0x5F },
-    { 0xD7, 0x00, 0x87 },
-    { 0xD7, 0x00, 0xAF },
-    { 0xD7, 0x00, 0xD7 },
-    { 0xD7, 0x00, 0xFF },
-    { 0xD7, 0x5F, 0x00 },
-    { 0xD7, 0x5F, 0x5F },
-    { 0xD7, 0x5F, 0x87 },
-    { 0xD7, 0x5F, 0xAF },
-    { 0xD7, 0x5F, 0xD7 },
-    { 0xD7, 0x5F, 0xFF },
-    { 0xD7, 0x87, 0x00 },
-    { 0xD7, 0x87, 0x5F },
-    { 0xD7, 0x87, 0x87 },
-    { 0xD7, 0x87, 0xAF },
-    { 0xD7, 0x87, 0xD7 },
-    { 0xD7, 0x87, 0xFF },
-    { 0xD7, 0xAF, 0x00 },
-    { 0xD7, 0xAF, 0x5F },
-    { 0xD7, 0xAF, 0x87 },
-    { 0xD7, 0xAF, 0xAF },
-    { 0xD7, 0xAF, 0xD7 },
-    { 0xD7, 0xAF, 0xFF },
-    { 0xD7, 0xD7, 0x00 },
-    { 0xD7, 0xD7, 0x5F },
-    { 0xD7, 0xD7, 0x87 },
-    { 0xD7, 0xD7, 0xAF },
-    { 0xD7, 0xD7, 0xD7 },
-    { 0xD7, 0xD7, 0xFF },
-    { 0xD7, 0xFF, 0x00 },
-    { 0xD7, 0xFF, 0x5F },
-    { 0xD7, 0xFF, 0x87 },
-    { 0xD7, 0xFF, 0xAF },
-    { 0xD7, 0xFF, 0xD7 },
-    { 0xD7, 0xFF, 0xFF },
-    { 0xFF, 0x00, 0x00 },
-    { 0xFF, 0x00, 0x5F },
-    { 0xFF, 0x00, 0x87 },
-    { 0xFF, 0x00, 0xAF },
-    { 0xFF, 0x00, 0xD7 },
-    { 0xFF, 0x00, 0xFF },
-    { 0xFF, 0x5F, 0x00 },
-    { 0xFF, 0x5F, 0x5F },
-    { 0xFF, 0x5F, 0x87 },
-    { 0xFF, 0x5F, 0xAF },
-    { 0xFF, 0x5F, 0xD7 },
-    { 0xFF, 0x5F, 0xFF },
-    { 0xFF, 0x87, 0x00 },
-    { 0xFF, 0x87, 0x5F },
-    { 0xFF, 0x87, 0x87 },
-    { 0xFF, 0x87, 0xAF },
-    { 0xFF, 0x87, 0xD7 },
-    { 0xFF, 0x87, 0xFF },
-    { 0xFF, 0xAF, 0x00 },
-    { 0xFF, 0xAF, 0x5F },
-    { 0xFF, 0xAF, 0x87 },
-    { 0xFF, 0xAF, 0xAF },
-    { 0xFF, 0xAF, 0xD7 },
-    { 0xFF, 0xAF, 0xFF },
-    { 0xFF, 0xD7, 0x00 },
-    { 0xFF, 0xD7, 0x5F },
-    { 0xFF, 0xD7, 0x87 },
-    { 0xFF, 0xD7, 0xAF },
-    { 0xFF, 0xD7, 0xD7 },
-    { 0xFF, 0xD7, 0xFF },
-    { 0xFF, 0xFF, 0x00 },
-    { 0xFF, 0xFF, 0x5F },
-    { 0xFF, 0xFF, 0x87 },
-    { 0xFF, 0xFF, 0xAF },
-    { 0xFF, 0xFF, 0xD7 },
-    { 0xFF, 0xFF, 0xFF },
-    // [0xE8-0xFF]: grayscale from black to white in 24 steps
-#if 0
-for ($i = 0; $i < 24; $i++) {
-    printf('{ 0x%1$02X, 0x%1$02X, 0x%1$02X },' . PHP_EOL, 8 + 10 * $i);
-}
-#endif
-    { 0x08, 0x08, 0x08 },
-    { 0x12, 0x12, 0x12 },
-    { 0x1C, 0x1C, 0x1C },
-    { 0x26, 0x26, 0x26 },
-    { 0x30, 0x30, 0x30 },
-    { 0x3A, 0x3A, 0x3A },
-    { 0x44, 0x44, 0x44 },
-    { 0x4E, 0x4E, 0x4E },
-    { 0x58, 0x58, 0x58 },
-    { 0x62, 0x62, 0x62 },
-    { 0x6C, 0x6C, 0x6C },
-    { 0x76, 0x76, 0x76 },
-    { 0x80, 0x80, 0x80 },
-    { 0x8A, 0x8A, 0x8A },
-    { 0x94, 0x94, 0x94 },
-    { 0x9E, 0x9E, 0x9E },
-    { 0xA8, 0xA8, 0xA8 },
-    { 0xB2, 0xB2, 0xB2 },
-    { 0xBC, 0xBC, 0xBC },
-    { 0xC6, 0xC6, 0xC6 },
-    { 0xD0, 0xD0, 0xD0 },
-    { 0xDA, 0xDA, 0xDA },
-    { 0xE4, 0xE4, 0xE4 },
-    { 0xEE, 0xEE, 0xEE },
-};
+    "\e[0;22;23;24;38;2;RRR;GGG;BBB;48;2;RRR;GGG;BBBm"
 
-static uint8_t closest_color_for_256_mode(const Color *original)
+STRING_BUILDER_DECL(STR_SIZE(LONGEST_ANSI_ESCAPE_SEQUENCE));
+
+/**
+ * Write the SGR parameters to set a color
+ *
+ * @param index the entry of the palette which is the closest to color (unused for TRUE_COLOR)
+ */
+static void sgr_color(char *buffer, size_t buffer_size, bool background, const Color *color, int palette, uint8_t index)
 {
-    size_t i;
-    uint8_t match;
-    int min_distance;
-
-    match = 0;
-    min_distance = 257 * 257 * 3;
-    for (i = 0; i < ARRAY_SIZE(mode256); i++) {
-        int rd, gd, bd, current_distance;
-
-        rd = original->r - mode256[i].r;
-        gd = original->g - mode256[i].g;
-        bd = original->b - mode256[i].b;
-        current_distance = rd * rd + gd * gd + bd * bd;
-        if (current_distance < min_distance) {
-            match = i;
-            min_distance = current_distance;
-        }
+    switch (palette) {
+        case PALETTE_16:
+            // 30-37 (40-47) for the standard colors, 90-97 (100-107) for the high intensity ones
+            snprintf(buffer, buffer_size, "%d", (background ? 40 : 30) + (index < 8 ? index : 60 + index - 8));
+            break;
+        case PALETTE_256:
+            snprintf(buffer, buffer_size, "%d;5;%" PRIu8, background ? 48 : 38, index);
+            break;
+        default:
+            snprintf(buffer, buffer_size, "%d;2;%" PRIu8 ";%" PRIu8 ";%" PRIu8, background ? 48 : 38, color->r, color->g, color->b);
+            break;
     }
-
-    return match;
 }
 
-STRING_BUILDER_DECL(STR_SIZE(LONGEST_ANSI_ESCAPE_SEQUENCE));
-
-// TODO: build "cache" only the first time and rebuild it only if theme has changed between 2 start_document calls
-static void rebuild_cache(TerminalFormatterData *data)
+/**
+ * Build the SGR state of each token type. They are kept from one document
+ * to the next and only rebuilt when the theme or the mode16/mode256 options
+ * have changed since. The closest colors of the palettes are computed at build
+ * time for the builtin themes, the first time they are used for the others.
+ */
+static void prepare(TerminalFormatterData *mydata)
 {
-    size_t i;
+    int palette;
     const Theme *theme;
-    TerminalFormatterData *mydata;
+    const ThemePalette *tp;
+    size_t i, j, styles_len;
+    static const SGRState reset = { 0 };
 
-    mydata = (TerminalFormatterData *) data;
     // TODO: define a default theme in shall itself
     if (NULL == (theme = mydata->theme)) {
         theme = theme_by_name("molokai");
     }
-    for (i = 0; i < _TOKEN_COUNT; i++) {
-        mydata->sequences[i].value_len = 0;
-        mydata->sequences[i].value = NULL;
-        if (theme->styles[i].flags) {
-            string_builder_t sb;
+    palette = mydata->mode16 ? PALETTE_16 : mydata->mode256 ? PALETTE_256 : TRUE_COLOR;
+    if (theme == mydata->prepared.theme && palette == mydata->prepared.palette) {
+        return;
+    }
+    mydata->prepared.theme = theme;
+    mydata->prepared.palette = palette;
+    tp = NULL;
+    if (TRUE_COLOR != palette && NULL == (tp = theme_palette_builtin(theme))) {
+        if (theme != mydata->palette.theme) {
+            theme_palette_build(theme, &mydata->palette);
+        }
+        tp = &mydata->palette;
+    }
+    mydata->default_style = NULL;
+    bzero(mydata->styles, sizeof(mydata->styles));
+    for (i = styles_len = 0; i < _TOKEN_COUNT; i++) {
+        SGRState *state;
 
-            STRING_BUILDER_INIT(sb);
-            STRING_BUILDER_APPEND(sb, "\e[");
-            if (theme->styles[i].bold) {
-                STRING_BUILDER_APPEND(sb, "1;");
-            }
-            if (theme->styles[i].italic) {
-                STRING_BUILDER_APPEND(sb, "3;");
-            }
-            if (theme->styles[i].underline) {
-                STRING_BUILDER_APPEND(sb, "4;");
-            }
+        state = &mydata->styles[styles_len];
+        if (theme->styles[i].flags) {
+            state->bold = theme->styles[i].bold;
+            state->italic = theme->styles[i].italic;
+            state->underline = theme->styles[i].underline;
             if (theme->styles[i].fg_set) {
-                if (mydata->mode256) {
-                    STRING_BUILDER_APPEND_FORMATTED(sb, "38;5;%" PRIu8 ";", closest_color_for_256_mode(&theme->styles[i].fg));
-                } else {
-                    STRING_BUILDER_APPEND_FORMATTED(sb, "38;2;%" PRIu8 ";%" PRIu8 ";%" PRIu8 ";", theme->styles[i].fg.r, theme->styles[i].fg.g, theme->styles[i].fg.b);
-                }
+                sgr_color(state->fg, ARRAY_SIZE(state->fg), false, &theme->styles[i].fg, palette, NULL == tp ? 0 : tp->styles[palette][i].fg);
             }
             if (theme->styles[i].bg_set) {
-                if (mydata->mode256) {
-                    STRING_BUILDER_APPEND_FORMATTED(sb, "48;5;%" PRIu8 ";", closest_color_for_256_mode(&theme->styles[i].bg));
-                } else {
-                    STRING_BUILDER_APPEND_FORMATTED(sb, "48;2;%" PRIu8 ";%" PRIu8 ";%" PRIu8 ";", theme->styles[i].bg.r, theme->styles[i].bg.g, theme->styles[i].bg.b);
-                }
+                sgr_color(state->bg, ARRAY_SIZE(state->bg), true, &theme->styles[i].bg, palette, NULL == tp ? 0 : tp->styles[palette][i].bg);
             }
-            sb.w[-1] = 'm'; // overwrite last ';'
-            STRING_BUILDER_DUP_INTO(sb, mydata->sequences[i].value);
+        }
+        // share the states so that the transition between two token types of the same style is free
+        for (j = 0; j < styles_len && 0 != memcmp(&mydata->styles[j], state, sizeof(*state)); j++)
+            ;
+        if (j == styles_len) {
+            ++styles_len;
+        } else {
+            bzero(state, sizeof(*state));
+        }
+        mydata->token_styles[i] = &mydata->styles[j];
+        if (0 == memcmp(&mydata->styles[j], &reset, sizeof(reset))) {
+            mydata->default_style = &mydata->styles[j];
         }
     }
 }
 
-static int terminal_start_document(String *UNUSED(out), FormatterData *data)
-{
-    TerminalFormatterData *mydata;
+#define SGR_APPEND(sb, parameters) \
+    do { \
+        if ((sb).w > (sb).buffer + STR_LEN("\e[")) { \
+            STRING_BUILDER_APPEND_1(sb, ';'); \
+        } \
+        STRING_BUILDER_APPEND(sb, parameters); \
+    } while (0);
 
-    mydata = (TerminalFormatterData *) data;
-    rebuild_cache(mydata);
+/**
+ * Write the escape sequence to switch the terminal from its current state to
+ * the given one. It is the shortest of the attributes which differ between
+ * these two states and of a reset followed by the attributes of the new one.
+ */
+static void sgr_transition(String *out, SGRState *current, const SGRState *target)
+{
+    string_builder_t delta, reset;
 
-    return 0;
+    STRING_BUILDER_INIT(delta);
+    STRING_BUILDER_APPEND(delta, "\e[");
+    if (current->bold != target->bold) {
+        SGR_APPEND(delta, target->bold ? "1" : "22");
+    }
+    if (current->italic != target->italic) {
+        SGR_APPEND(delta, target->italic ? "3" : "23");
+    }
+    if (current->underline != target->underline) {
+        SGR_APPEND(delta, target->underline ? "4" : "24");
+    }
+    if (0 != strcmp(current->fg, target->fg)) {
+        SGR_APPEND(delta, '\0' == *target->fg ? "39" : target->fg);
+    }
+    if (0 != strcmp(current->bg, target->bg)) {
+        SGR_APPEND(delta, '\0' == *target->bg ? "49" : target->bg);
+    }
+    if (delta.w == delta.buffer + STR_LEN("\e[")) {
+        return; // nothing changes
+    }
+    STRING_BUILDER_INIT(reset);
+    STRING_BUILDER_APPEND(reset, "\e[0");
+    if (target->bold) {
+        STRING_BUILDER_APPEND(reset, ";1");
+    }
+    if (target->italic) {
+        STRING_BUILDER_APPEND(reset, ";3");
+    }
+    if (target->underline) {
+        STRING_BUILDER_APPEND(reset, ";4");
+    }
+    if ('\0' != *target->fg) {
+        STRING_BUILDER_APPEND_1(reset, ';');
+        STRING_BUILDER_APPEND(reset, target->fg);
+    }
+    if ('\0' != *target->bg) {
+        STRING_BUILDER_APPEND_1(reset, ';');
+        STRING_BUILDER_APPEND(reset, target->bg);
+    }
+    if (reset.w - reset.buffer < delta.w - delta.buffer) {
+        STRING_BUILDER_APPEND_1(reset, 'm');
+        string_append_string_len(out, reset.buffer, reset.w - reset.buffer);
+    } else {
+        STRING_BUILDER_APPEND_1(delta, 'm');
+        string_append_string_len(out, delta.buffer, delta.w - delta.buffer);
+    }
+    memcpy(current, target, sizeof(*current));
 }
 
-#if 0
-static int terminal_end_document(String *UNUSED(out), FormatterData *data)
+static int terminal_start_document(String *UNUSED(out), FormatterData *data)
 {
     TerminalFormatterData *mydata;
 
     mydata = (TerminalFormatterData *) data;
+    prepare(mydata);
+    mydata->pending = NULL;
+    mydata->applied = mydata->default_style;
+    bzero(&mydata->current, sizeof(mydata->current));
 
     return 0;
 }
-#endif
 
-static int terminal_start_token(int token, String *out, FormatterData *data)
+static int terminal_end_document(String *out, FormatterData *data)
 {
     TerminalFormatterData *mydata;
+    static const SGRState reset = { 0 };
 
     mydata = (TerminalFormatterData *) data;
-    if (mydata->sequences[token].value_len > 0) {
-        string_append_string_len(out, mydata->sequences[token].value, mydata->sequences[token].value_len);
+    mydata->pending = NULL;
+    mydata->applied = mydata->default_style;
+    if (0 != memcmp(&mydata->current, &reset, sizeof(reset))) {
+        STRING_APPEND_STRING(out, "\e[0m");
+        bzero(&mydata->current, sizeof(mydata->current));
     }
 
     return 0;
 }
 
-static int terminal_end_token(int token, String *out, FormatterData *data)
+/**
+ * The attributes of a token are kept after it: only what differs for the
+ * next one is written, the terminal is only reset at the end of the document.
+ * Their change is delayed to the first write of the token, which may not
+ * need it.
+ */
+static int terminal_start_token(int token, String *UNUSED(out), FormatterData *data)
 {
     TerminalFormatterData *mydata;
 
     mydata = (TerminalFormatterData *) data;
-    if (mydata->sequences[token].value_len > 0) {
-        STRING_APPEND_STRING(out, "\e[39;49;00m");
-    }
+    mydata->pending = mydata->token_styles[token];
 
     return 0;
 }
 
-static int terminal_write_token(String *out, const char *token, size_t token_len, FormatterData *UNUSED(data))
+static int terminal_end_token(int UNUSED(token), String *UNUSED(out), FormatterData *UNUSED(data))
 {
-    string_append_string_len(out, token, token_len);
-
     return 0;
 }
 
-static void terminal_finalize(FormatterData *data)
+/**
+ * @return true if the text is only made of spaces, tabulations and new lines,
+ * on which the color of the foreground, bold and italic are not visible
+ */
+static bool is_blank(const char *token, size_t token_len)
+{
+    const char *end;
+
+    for (end = token + token_len; token < end; token++) {
+        if (' ' != *token && '\t' != *token && '\n' != *token && '\r' != *token) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int terminal_write_token(String *out, const char *token, size_t token_len, FormatterData *data)
 {
-    size_t i;
     TerminalFormatterData *mydata;
 
     mydata = (TerminalFormatterData *) data;
-    for (i = 0; i < _TOKEN_COUNT; i++) {
-        if (mydata->sequences[i].value_len > 0) {
-            free((void *) mydata->sequences[i].value);
+    if (mydata->pending == mydata->applied) {
+        mydata->pending = NULL; // same token type as the previous one
+    } else if (NULL != mydata->pending) {
+        if (!is_blank(token, token_len) || mydata->current.underline != mydata->pending->underline || 0 != strcmp(mydata->current.bg, mydata->pending->bg)) {
+            sgr_transition(out, &mydata->current, mydata->pending);
+            mydata->applied = mydata->pending;
+            mydata->pending = NULL;
         }
     }
+    string_append_string_len(out, token, token_len);
+
+    return 0;
 }
 
 const FormatterImplementation _termfmt = {
@@ -451,17 +309,18 @@ const FormatterImplementation _termfmt = {
     formatter_implementation_default_get_option_ptr,
 #endif
     terminal_start_document,
-    NULL/*terminal_end_document*/,
+    terminal_end_document,
     terminal_start_token,
     terminal_end_token,
     terminal_write_token,
     NULL,
     NULL,
-    terminal_finalize,
+    NULL,
     sizeof(TerminalFormatterData),
     (/*const*/ FormatterOption /*const*/ []) {
         { S("theme"),   OPT_TYPE_THEME, offsetof(TerminalFormatterData, theme),   OPT_DEF_THEME,   "the theme to use" },
         { S("mode256"), OPT_TYPE_BOOL,  offsetof(TerminalFormatterData, mode256), OPT_DEF_BOOL(0), "if true, restrict color scheme to 256 colors" },
+        { S("mode16"),  OPT_TYPE_BOOL,  offsetof(TerminalFormatterData, mode16),  OPT_DEF_BOOL(0), "if true, restrict color scheme to the 16 standard colors (prevails over mode256)" },
         END_OF_OPTIONS
     }
 };
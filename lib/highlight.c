@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
 
 #include "lexer.h"
 #include "formatter.h"
@@ -15,8 +16,14 @@
 #include "tokens.h"
 #include "dlist.h"
 #include "hashtable.h"
+#include "stats_internal.h"
+#include "trace_internal.h"
+#include "pipeline_internal.h"
+#include "batch_internal.h"
 
 #define RECURSION_LIMIT 8
+#define DEFAULT_BUDGET_CHECK_INTERVAL 1024
+#define DEFAULT_SINK_CHUNK_SIZE 8192
 
 #define T_IGNORE 258
 
@@ -105,11 +112,36 @@ typedef struct {
     DelegationStackElement elements[16];
 } ProcessingContext;
 
+/**
+ * A parser keeps pointers on the tokens it is given (to retype them
+ * later), so, while one is involved, the buffer can't be flushed (nor
+ * moved) when it becomes full: the next tokens go to these blocks instead.
+ */
+typedef struct TokenBlock {
+    struct TokenBlock *next;
+    LexerReturnValue tokens[4096];
+} TokenBlock;
+
 typedef struct {
     String *output;
     Formatter *fmt;
     int previous_token_type;
     LexerReturnValue buffer[10000], *cursor;
+    // end of the current block (buffer or block->tokens)
+    LexerReturnValue *limit;
+    // extra blocks (allocated on demand, reused after a flush) and the one in use (NULL if none)
+    TokenBlock *blocks, *block;
+    // statistics (NULL if they are not collected)
+    HighlightStatsTotals *stats;
+    // time spent to format since the current lexer took over (if stats)
+    uint64_t format_ns;
+    // where output is sent as it is produced (NULL to keep it in output)
+    const HighlightSink *sink;
+    size_t sink_chunk_size;
+    // bytes already sent to sink
+    size_t sent;
+    // sink->write returned non-zero, the rest of the output is discarded
+    bool sink_failed;
 } OutputBufferContext;
 
 static bool lexer_data_init(LexerData *data, size_t data_size)
@@ -306,84 +338,557 @@ static LexerListElement *delegation_pop(ProcessingContext *pc, LexerInput *yy/*,
     return lle_after_pop;
 }
 
-static void buffer_init(OutputBufferContext *obc, Formatter *fmt)
+#ifndef DOXYGEN
+# define DEFAULT_PARALLEL_CHUNK_SIZE (256 * 1024)
+#endif /* !DOXYGEN */
+
+/**
+ * A call to the yylex callback of a lexer, as recorded by a lexing ahead
+ * of the formatting
+ */
+typedef struct {
+    int what;
+    LexerReturnValue rv;
+    // YYTEXT and YYCURSOR when yylex returned
+    const YYCTYPE *yytext, *yycursor;
+} LexerCall;
+
+/**
+ * The lexing of a part of the input, by a single lexer
+ */
+typedef struct {
+    ProcessingContext pc;
+    LexerListElement *lle;
+    LexerInput yy;
+    // where the lexing started
+    const YYCTYPE *start;
+    // the lexing stops on the first token which ends at or after it (or at DONE if it is YYLIMIT)
+    const YYCTYPE *stop;
+    LexerCall *calls;
+    size_t calls_len, calls_size;
+    // same as in highlight_real
+    const YYCTYPE *prev_yycursor;
+    size_t yycursor_unchanged;
+    // the lexer is DONE or stopped to progress: nothing follows
+    bool over;
+} LexerRun;
+
+/**
+ * The state of highlight_string_parallel: the input is lexed by windows
+ * of (up to) threads chunks. The first one goes on with the lexing of the
+ * previous window, the others start, speculatively, at a resynchronization
+ * point of the lexer. Then highlight_real replays the recorded calls.
+ */
+typedef struct {
+    Lexer *lexer;
+    const YYCTYPE *src, *limit;
+    unsigned threads;
+    size_t chunk_size;
+    // the state of the lexer at a resynchronization point
+    ProcessingContext ref;
+    LexerListElement *ref_lle;
+    // runs[0] to runs[runs_len - 1] are the validated lexing of the current window, in order
+    LexerRun *runs;
+    size_t runs_len;
+    // the next call to replay: runs[run].calls[call]
+    size_t run, call;
+} ParallelLexing;
+
+static LexerListElement *lexer_run_start(LexerRun *run, ParallelLexing *pl, const YYCTYPE *start, bool resync)
+{
+    run->lle = processing_context_init(&run->pc, pl->lexer);
+    if (resync && NULL != pl->lexer->imp->resync_state) {
+        pl->lexer->imp->resync_state(run->lle->data);
+    }
+    run->yy.src = pl->src;
+    run->yy.limit = pl->limit;
+    run->yy.cursor = run->yy.yytext = run->yy.marker = run->prev_yycursor = run->start = start;
+    run->yycursor_unchanged = 0;
+    run->calls_len = 0;
+    run->over = false;
+
+    return run->lle;
+}
+
+/**
+ * Lexes the next token of a run into call
+ */
+static void lexer_run_next(LexerRun *run, LexerCall *call)
+{
+    int what;
+    LexerInput *yy;
+
+    yy = &run->yy;
+    YYTEXT = YYCURSOR;
+#ifdef WITH_PROFILING
+    call->rv.profile_site = NULL;
+#endif /* WITH_PROFILING */
+    call->what = what = run->lle->lexer->imp->yylex(yy, run->lle->data, run->lle->lexer->optvals, &call->rv, (void *) &run->pc);
+    call->yytext = YYTEXT;
+    call->yycursor = YYCURSOR;
+    // from here, do as highlight_real
+    if (YYCURSOR == run->prev_yycursor) {
+        if (++run->yycursor_unchanged >= RECURSION_LIMIT) {
+            run->over = true;
+        }
+    } else {
+        run->yycursor_unchanged = 0;
+        run->prev_yycursor = YYCURSOR;
+    }
+    switch ((what & ~TOKEN)) {
+        case DONE:
+            run->over = true;
+            break;
+        case DELEGATE_FULL:
+        case DELEGATE_UNTIL:
+            // there is no other lexer in the stack
+            YYCURSOR = call->rv.child_limit;
+            break;
+    }
+}
+
+static void lexer_run(LexerRun *run)
+{
+    while (!run->over && (run->yy.cursor < run->stop || run->stop >= run->yy.limit)) {
+        if (run->calls_len >= run->calls_size) {
+            size_t calls_size;
+            LexerCall *calls;
+
+            calls_size = 0 == run->calls_size ? 4096 : run->calls_size * 2;
+            if (NULL == (calls = mem_renew(run->calls, *calls, calls_size))) {
+                // out of memory: the run stops here, as if the chunk ended here (the next one is a wrong guess)
+                break;
+            }
+            run->calls = calls;
+            run->calls_size = calls_size;
+        }
+        lexer_run_next(run, &run->calls[run->calls_len++]);
+    }
+}
+
+static bool lexer_data_equal(const LexerData *a, const LexerData *b, size_t data_size)
+{
+    return a->state == b->state
+        && a->next_label == b->next_label
+        && darray_length(a->state_stack) == darray_length(b->state_stack)
+        && 0 == memcmp(a->state_stack->data, b->state_stack->data, darray_length(a->state_stack) * a->state_stack->element_size)
+        && 0 == memcmp(a + 1, b + 1, data_size - sizeof(*a))
+    ;
+}
+
+static void parallel_lex(void *arg, size_t i, unsigned UNUSED(worker))
+{
+    lexer_run(&((ParallelLexing *) arg)->runs[i]);
+}
+
+static void lexer_run_swap(LexerRun *a, LexerRun *b)
+{
+    LexerRun tmp;
+
+    tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+/**
+ * Lexes the next window of the input
+ */
+static void parallel_window(ParallelLexing *pl)
+{
+    size_t i, n, from;
+    const YYCTYPE *start, *end;
+
+    // the last validated lexing goes on
+    lexer_run_swap(&pl->runs[0], &pl->runs[pl->runs_len - 1]);
+    pl->runs[0].calls_len = 0;
+    pl->run = pl->call = 0;
+    start = pl->runs[0].yy.cursor;
+    if (SIZE_T(pl->limit - start) > pl->threads * pl->chunk_size) {
+        end = start + pl->threads * pl->chunk_size;
+    } else {
+        end = pl->limit;
+    }
+    for (n = i = 1; i < pl->threads; i++) {
+        const YYCTYPE *border;
+
+        from = SIZE_T(start - pl->src) + i * pl->chunk_size;
+        if (from >= SIZE_T(end - pl->src)) {
+            break;
+        }
+        border = pl->src + pl->lexer->imp->resync_find((const char *) pl->src, pl->limit - pl->src, from);
+        if (border >= end) {
+            break;
+        }
+        if (border > pl->runs[n - 1].start) {
+            pl->runs[n - 1].stop = border;
+            lexer_run_start(&pl->runs[n++], pl, border, true);
+        }
+    }
+    pl->runs[n - 1].stop = end;
+    if (1 == n) {
+        lexer_run(&pl->runs[0]);
+    } else {
+        highlight_pool_run(n, NULL, pl->threads, parallel_lex, pl);
+    }
+    // check each guess against the state in which the lexing of the previous chunk really ends
+    for (pl->runs_len = 1, i = 1; i < n; i++) {
+        LexerRun *prev;
+
+        prev = &pl->runs[pl->runs_len - 1];
+        if (!prev->over && 0 == prev->yycursor_unchanged && prev->yy.cursor == pl->runs[i].start && lexer_data_equal(prev->lle->data, pl->ref_lle->data, pl->lexer->imp->data_size)) {
+            highlight_stats_resync(true);
+            processing_context_destroy(&prev->pc);
+            lexer_run_swap(&pl->runs[pl->runs_len++], &pl->runs[i]);
+        } else {
+            // wrong guess: the previous lexing goes on over this chunk
+            highlight_stats_resync(false);
+            processing_context_destroy(&pl->runs[i].pc);
+            prev->stop = pl->runs[i].stop;
+            lexer_run(prev);
+        }
+    }
+}
+
+/**
+ * Serves the calls recorded by parallel_window to highlight_real (in
+ * place of the yylex callback of the lexer)
+ */
+static int parallel_replay(ParallelLexing *pl, LexerInput *yy, LexerReturnValue *rv)
+{
+    LexerCall *call, direct;
+
+    call = NULL;
+    while (NULL == call && pl->call >= pl->runs[pl->run].calls_len) {
+        if (pl->run + 1 < pl->runs_len) {
+            ++pl->run;
+            pl->call = 0;
+        } else if (pl->runs[pl->run].over) {
+            return DONE;
+        } else {
+            parallel_window(pl);
+            // no call could be recorded (out of memory): the token is lexed right away
+            if (1 == pl->runs_len && 0 == pl->runs[0].calls_len && !pl->runs[0].over) {
+                lexer_run_next(&pl->runs[0], call = &direct);
+            }
+        }
+    }
+    if (NULL == call) {
+        call = &pl->runs[pl->run].calls[pl->call++];
+    }
+    *rv = call->rv;
+    YYTEXT = call->yytext;
+    YYCURSOR = call->yycursor;
+
+    return call->what;
+}
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void buffer_init(OutputBufferContext *obc, Formatter *fmt, HighlightStats *stats, const HighlightSink *sink)
 {
     obc->fmt = fmt;
     obc->cursor = obc->buffer;
+    obc->limit = obc->buffer + ARRAY_SIZE(obc->buffer);
+    obc->blocks = obc->block = NULL;
     obc->output = string_new();
     obc->previous_token_type = -1;
+    obc->stats = NULL == stats ? NULL : highlight_stats_totals_ptr(stats);
+    obc->format_ns = 0;
+    obc->sink = sink;
+    obc->sink_chunk_size = NULL == sink || 0 == sink->chunk_size ? DEFAULT_SINK_CHUNK_SIZE : sink->chunk_size;
+    obc->sent = 0;
+    obc->sink_failed = false;
 }
 
-static void buffer_flush(OutputBufferContext *obc, bool hard_flush)
+/**
+ * Send the output to the sink, if any, once there is at least a chunk
+ * of it (or whatever its size if force is true)
+ */
+static void buffer_drain(OutputBufferContext *obc, bool force)
+{
+    if (NULL != obc->sink && obc->output->len > 0 && (force || obc->output->len >= obc->sink_chunk_size)) {
+        if (!obc->sink_failed && 0 != obc->sink->write(obc->output->ptr, obc->output->len, obc->sink->data)) {
+            obc->sink_failed = true;
+        }
+        obc->sent += obc->output->len;
+        string_truncate(obc->output);
+    }
+}
+
+/**
+ * @return the last token of the buffer (NULL if it is empty)
+ */
+static LexerReturnValue *buffer_last(OutputBufferContext *obc)
+{
+    TokenBlock *b;
+
+    if (NULL == obc->block) {
+        return obc->cursor == obc->buffer ? NULL : obc->cursor - 1;
+    }
+    if (obc->cursor != obc->block->tokens) {
+        return obc->cursor - 1;
+    }
+    // the cursor is at the start of its block, so the previous one is full
+    if (obc->block == obc->blocks) {
+        return obc->buffer + ARRAY_SIZE(obc->buffer) - 1;
+    }
+    for (b = obc->blocks; b->next != obc->block; b = b->next)
+        ;
+
+    return b->tokens + ARRAY_SIZE(b->tokens) - 1;
+}
+
+/**
+ * Make room for the next tokens without flushing the ones already
+ * buffered: continue in the next block
+ */
+static void buffer_grow(OutputBufferContext *obc)
+{
+    TokenBlock *next;
+
+    next = NULL == obc->block ? obc->blocks : obc->block->next;
+    if (NULL == next) {
+        next = malloc(sizeof(*next));
+        next->next = NULL;
+        if (NULL == obc->block) {
+            obc->blocks = next;
+        } else {
+            obc->block->next = next;
+        }
+    }
+    obc->block = next;
+    obc->cursor = next->tokens;
+    obc->limit = next->tokens + ARRAY_SIZE(next->tokens);
+}
+
+static void buffer_free_blocks(OutputBufferContext *obc)
+{
+    TokenBlock *b, *next;
+
+    for (b = obc->blocks; NULL != b; b = next) {
+        next = b->next;
+        free(b);
+    }
+    obc->blocks = obc->block = NULL;
+}
+
+static void buffer_flush_tokens(OutputBufferContext *obc, LexerReturnValue *from, LexerReturnValue *to)
 {
     LexerReturnValue *rvp;
 
-    if (obc->cursor != obc->buffer) {
-        for (rvp = obc->buffer; rvp < obc->cursor; rvp++) {
-//             debug("[TOKEN] >%.*s< (%d) (%s <= %s)", (int) (rvp->yyend - rvp->yystart), rvp->yystart, rvp->token_value, tokens[rvp->token_default_type].name, -1 == obc->previous_token_type ? "\xe2\x88\x85" /* U+2205 */ : tokens[obc->previous_token_type].name);
-            if (obc->previous_token_type != rvp->token_default_type) {
-                if (-1 != obc->previous_token_type/* && IGNORABLE != obc->previous_token_type*/) {
-                    obc->fmt->imp->end_token(obc->previous_token_type, obc->output, &obc->fmt->optvals);
-                }
-//                 if (IGNORABLE != rvp->token_default_type) {
-                    obc->fmt->imp->start_token(rvp->token_default_type, obc->output, &obc->fmt->optvals);
-//                 }
+    for (rvp = from; rvp < to; rvp++) {
+//         debug("[TOKEN] >%.*s< (%d) (%s <= %s)", (int) (rvp->yyend - rvp->yystart), rvp->yystart, rvp->token_value, tokens[rvp->token_default_type].name, -1 == obc->previous_token_type ? "\xe2\x88\x85" /* U+2205 */ : tokens[obc->previous_token_type].name);
+        if (obc->previous_token_type != rvp->token_default_type) {
+            if (-1 != obc->previous_token_type/* && IGNORABLE != obc->previous_token_type*/) {
+                obc->fmt->imp->end_token(obc->previous_token_type, obc->output, &obc->fmt->optvals);
+            }
+//             if (IGNORABLE != rvp->token_default_type) {
+                obc->fmt->imp->start_token(rvp->token_default_type, obc->output, &obc->fmt->optvals);
+//             }
+        }
+        obc->fmt->imp->write_token(obc->output, (const char *) rvp->yystart, rvp->yyend - rvp->yystart, &obc->fmt->optvals);
+        obc->previous_token_type = rvp->token_default_type;
+    }
+}
+
+static void buffer_flush(OutputBufferContext *obc, bool hard_flush)
+{
+    if (NULL != buffer_last(obc)) {
+        size_t count;
+        uint64_t started_at;
+
+        started_at = 0;
+        if (NULL != obc->stats) {
+            started_at = monotonic_ns();
+            ++obc->stats->flushes;
+        }
+        if (NULL == obc->block) {
+            count = obc->cursor - obc->buffer;
+            buffer_flush_tokens(obc, obc->buffer, obc->cursor);
+        } else {
+            TokenBlock *b;
+
+            count = ARRAY_SIZE(obc->buffer);
+            buffer_flush_tokens(obc, obc->buffer, obc->buffer + ARRAY_SIZE(obc->buffer));
+            for (b = obc->blocks; b != obc->block; b = b->next) {
+                count += ARRAY_SIZE(b->tokens);
+                buffer_flush_tokens(obc, b->tokens, b->tokens + ARRAY_SIZE(b->tokens));
             }
-            obc->fmt->imp->write_token(obc->output, (const char *) rvp->yystart, rvp->yyend - rvp->yystart, &obc->fmt->optvals);
-            obc->previous_token_type = rvp->token_default_type;
+            count += obc->cursor - b->tokens;
+            buffer_flush_tokens(obc, b->tokens, obc->cursor);
+        }
+        // the buffer only grows between two flushes
+        if (NULL != obc->stats && count > obc->stats->peak_buffer) {
+            obc->stats->peak_buffer = count;
         }
         if (hard_flush) {
             obc->fmt->imp->end_token(obc->previous_token_type, obc->output, &obc->fmt->optvals);
         }
         obc->cursor = obc->buffer;
+        obc->limit = obc->buffer + ARRAY_SIZE(obc->buffer);
+        obc->block = NULL;
+        if (NULL != obc->stats) {
+            obc->format_ns += monotonic_ns() - started_at;
+        }
 //         STRING_APPEND_STRING(obc->output, "\n==== FLUSHED =====\n");
     }
+    buffer_drain(obc, false);
 }
 
 /**
- * Highlight a string according to given lexer(s) and formatter
- *
- * @param src the input string
- * @param src_len its length
- * @param dst the output string
- * @param dst_len its length if not null
- * @param fmt the formatter to generate output from tokens
- * @param lexerc the number of lexers in lexerv (have to >= 1)
- * @param lexerv an array of lexers to tokenize the input string
- * (the top lexer have to be at index 0)
- *
- * @return zero if successfull
+ * Charge the time elapsed since the previous switch (formatting excluded) to
+ * the lexer which was running, then count (and trace) for the one of lle
  */
-SHALL_API int highlight_string(const char *src, size_t src_len, char **dst, size_t *dst_len, Formatter *fmt, size_t lexerc, Lexer **lexerv/*, uint32_t flags*/)
+#define INSTRUMENT_SWITCH_LEXER() \
+    do { \
+        if (NULL != trace) { \
+            trace_lexer = highlight_trace_lexer_id(trace, lle->lexer->imp); \
+        } \
+        if (NULL != stats) { \
+            uint64_t now; \
+ \
+            now = monotonic_ns(); \
+            lexer_stats->time_ns += now - lexer_started_at - obc.format_ns; \
+            obc.stats->format_ns += obc.format_ns; \
+            obc.format_ns = 0; \
+            lexer_started_at = now; \
+            lexer_stats = highlight_stats_lexer_ptr(stats, lle->lexer->imp); \
+        } \
+    } while (0)
+
+/**
+ * Count and trace the token at obc.cursor, which is kept in the buffer
+ */
+#define INSTRUMENT_TOKEN() \
+    do { \
+        if (NULL != stats) { \
+            ++obc.stats->tokens; \
+            ++lexer_stats->tokens; \
+            lexer_stats->bytes += obc.cursor->yyend - obc.cursor->yystart; \
+        } \
+        if (NULL != trace) { \
+            highlight_trace_record(trace, trace_lexer, (const char *) obc.cursor->yystart - src_start, obc.cursor->yyend - obc.cursor->yystart, obc.cursor->token_default_type, obc.cursor->return_line); \
+        } \
+    } while (0)
+
+/**
+ * @return the length of the UTF-8 BOM which starts src (0 if none)
+ */
+static size_t bom_length(const char *src, size_t src_len)
+{
+    if (src_len >= STR_LEN(UTF8_BOM) && 0 == memcmp(src, UTF8_BOM, STR_LEN(UTF8_BOM))) {
+        return STR_LEN(UTF8_BOM);
+    }
+
+    return 0;
+}
+
+/**
+ * @return the length of the shebang line, its newline included, which
+ * starts src (0 if none)
+ */
+static size_t shebang_length(const char *src, size_t src_len)
+{
+    if (src_len > STR_LEN(SHELLMAGIC) && 0 == memcmp(src, SHELLMAGIC, STR_LEN(SHELLMAGIC))) {
+        const char *lf;
+
+        for (lf = src; lf < src + src_len && ('\n' != *lf && '\r' != *lf); ++lf)
+            ;
+        if (lf < src + src_len) {
+            return ++lf - src;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * The work behind highlight_string_with_budget, highlight_string_to,
+ * highlight_string_pipelined and highlight_string_parallel: output goes to
+ * sink if not NULL, else to dst/dst_len if not NULL. If pipe is not NULL,
+ * fmt is its recorder and the output is produced by the thread of the pipe.
+ * If ahead is not NULL, the calls to the yylex callback are replayed from
+ * its lexing.
+ */
+static int highlight_real(const char *src, size_t src_len, char **dst, size_t *dst_len, const HighlightSink *sink, Formatter *fmt, size_t lexerc, Lexer **lexerv, const HighlightBudget *budget, HighlightPipe *pipe, ParallelLexing *ahead)
 {
     String *buffer;
-    bool skip_parser;
     LexerInput xx, *yy;
+    LexerReturnValue *last;
+    bool skip_parser, parsing;
     ProcessingContext pc;
     int status, ret, what;
     LexerListElement *lle;
+    HighlightStats *stats;
+    HighlightTrace *trace;
     OutputBufferContext obc;
     const YYCTYPE *prev_yycursor;
-    size_t l, buffer_len, yycursor_unchanged;
+    HighlightLexerStats *lexer_stats;
+    uint64_t deadline, started_at, lexer_started_at;
+    uint8_t trace_lexer;
+#ifdef WITH_PROFILING
+    uint64_t yylex_started_at;
+#endif /* WITH_PROFILING */
+    size_t l, buffer_len, yycursor_unchanged, tokens, check_interval, next_check;
+    const char * const src_start = src;
     const char * const src_end = src + src_len;
 
     assert(lexerc > 0); // nothing to do, returns ""?
     assert(NULL != lexerv);
 
-    ret = 0;
+    ret = HIGHLIGHT_SUCCESS;
     yy = &xx;
-    skip_parser = false;
+    tokens = 0;
+    deadline = 0;
+    check_interval = next_check = DEFAULT_BUDGET_CHECK_INTERVAL;
+    if (NULL != budget) {
+        if (0 != budget->check_interval) {
+            check_interval = next_check = budget->check_interval;
+        }
+        if (0 != budget->timeout) {
+            deadline = monotonic_ms() + budget->timeout;
+        }
+    }
+    skip_parser = parsing = false;
     status = YYPUSH_MORE;
     yycursor_unchanged = 0;
     lle = processing_context_init(&pc, lexerv[0]);
+    lexer_stats = NULL;
+    started_at = lexer_started_at = 0;
+    if (NULL != (stats = highlight_stats_bound())) {
+        started_at = lexer_started_at = monotonic_ns();
+        lexer_stats = highlight_stats_lexer_ptr(stats, lle->lexer->imp);
+        ++highlight_stats_totals_ptr(stats)->documents;
+        highlight_stats_totals_ptr(stats)->bytes_in += src_len;
+    }
+    trace_lexer = 0;
+    if (NULL != (trace = highlight_trace_bound())) {
+        highlight_trace_start_document(trace);
+        trace_lexer = highlight_trace_lexer_id(trace, lle->lexer->imp);
+    }
 
     // skip UTF-8 BOM
-    if (src_len >= STR_LEN(UTF8_BOM) && 0 == memcmp(src, UTF8_BOM, STR_LEN(UTF8_BOM))) {
-        src += STR_LEN(UTF8_BOM);
-        src_len -= STR_LEN(UTF8_BOM);
-    }
+    l = bom_length(src, src_len);
+    src += l;
+    src_len -= l;
 # define previous_token_type obc.previous_token_type
-    buffer_init(&obc, fmt);
+    buffer_init(&obc, fmt, stats, sink);
     buffer = obc.output;
 //     yy.bol = 1;
 //     yy.lineno = 0;
@@ -391,20 +896,14 @@ SHALL_API int highlight_string(const char *src, size_t src_len, char **dst, size
         fmt->imp->start_document(buffer, &fmt->optvals);
     }
     // skip shebang
-    if (src_len > STR_LEN(SHELLMAGIC) && 0 == memcmp(src, SHELLMAGIC, STR_LEN(SHELLMAGIC))) {
-        const char *lf;
-
-        for (lf = src; lf < src_end && ('\n' != *lf && '\r' != *lf); ++lf)
-            ;
-        if (lf < src_end) {
-            // TODO: highlight it?
+    if (0 != (l = shebang_length(src, src_len))) {
+        // TODO: highlight it?
 #if 1
-            fmt->imp->start_token(previous_token_type = IGNORABLE, buffer, &fmt->optvals);
-            fmt->imp->write_token(buffer, src, ++lf - src, &fmt->optvals);
+        fmt->imp->start_token(previous_token_type = IGNORABLE, buffer, &fmt->optvals);
+        fmt->imp->write_token(buffer, src, l, &fmt->optvals);
 #endif
-            src_len -= lf - src;
-            src = lf;
-        }
+        src_len -= l;
+        src += l;
     }
     YYSRC = (const YYCTYPE *) src;
     YYLIMIT = (const YYCTYPE *) src + src_len;
@@ -416,13 +915,60 @@ SHALL_API int highlight_string(const char *src, size_t src_len, char **dst, size
         append_lexer(&pc, lexerv[l]);
     }
     do {
+        if (obc.sink_failed || (NULL != pipe && highlight_pipe_failed(pipe))) {
+            ret = HIGHLIGHT_SINK_ERROR;
+            goto abandon_or_done;
+        }
+        if (NULL != budget) {
+            if (0 != budget->max_tokens && tokens >= budget->max_tokens) {
+                ret = HIGHLIGHT_MAX_TOKENS_EXCEEDED;
+                goto out_of_budget;
+            }
+            if (tokens >= next_check) {
+                next_check = tokens + check_interval;
+                if (0 != deadline && monotonic_ms() >= deadline) {
+                    ret = HIGHLIGHT_TIMEOUT;
+                    goto out_of_budget;
+                }
+                // pending tokens are not yet formatted, count them as is
+                if (0 != budget->max_output && (NULL == pipe ? obc.sent + buffer->len : highlight_pipe_output_len(pipe)) + (NULL == (last = buffer_last(&obc)) ? 0 : SIZE_T(last->yyend - obc.buffer->yystart)) >= budget->max_output) {
+                    ret = HIGHLIGHT_MAX_OUTPUT_EXCEEDED;
+                    goto out_of_budget;
+                }
+            }
+        }
+        /**
+         * The buffer is full: format the tokens it holds to make room for the
+         * next ones unless a parser was given some of them (it may retype
+         * them later)
+         */
+        if (obc.cursor >= obc.limit) {
+            if (parsing && !skip_parser) {
+                buffer_grow(&obc);
+            } else {
+                buffer_flush(&obc, false);
+            }
+        }
+        ++tokens;
         YYTEXT = YYCURSOR;
-        what = lle->lexer->imp->yylex(yy, lle->data, lle->lexer->optvals, obc.cursor, (void *) &pc);
+#ifdef WITH_PROFILING
+        obc.cursor->profile_site = NULL;
+        yylex_started_at = monotonic_ns();
+#endif /* WITH_PROFILING */
+        if (NULL == ahead) {
+            what = lle->lexer->imp->yylex(yy, lle->data, lle->lexer->optvals, obc.cursor, (void *) &pc);
+        } else {
+            what = parallel_replay(ahead, yy, obc.cursor);
+        }
+#ifdef WITH_PROFILING
+        if (NULL != obc.cursor->profile_site) {
+            obc.cursor->profile_site->entry.time_ns += monotonic_ns() - yylex_started_at;
+        }
+#endif /* WITH_PROFILING */
         // trivial safety against infinite loop
         if (YYCURSOR == prev_yycursor) {
             if (++yycursor_unchanged >= RECURSION_LIMIT) {
-                // TODO: return a real error code
-                ret = 1;
+                ret = HIGHLIGHT_RECURSION;
                 debug("[ ERR ] recursion found with lexer %s on %.*s at offset %zu", lle->lexer->imp->name, (int) (obc.cursor->yyend - obc.cursor->yystart), obc.cursor->yystart, SIZE_T(obc.cursor->yyend - obc.cursor->yystart));
                 goto abandon_or_done;
             }
@@ -440,6 +986,7 @@ retry_as_token:
 
             yyleng = obc.cursor->yyend - obc.cursor->yystart;
             if (!skip_parser && T_IGNORE != obc.cursor->token_value && NULL != lle->lexer->imp->yypush_parse) {
+                parsing = true;
                 status = lle->lexer->imp->yypush_parse(lle->ps, obc.cursor->token_value, &obc.cursor);
             } else {
                 // TODO: merge current token with previous one to limit memory consumption? (if they have the same token_default_type)
@@ -452,6 +999,9 @@ retry_as_token:
                 debug("parse error on >%.*s< (%d) (%s)", (int) (obc.cursor->yyend - obc.cursor->yystart), obc.cursor->yystart, obc.cursor->token_value, tokens[obc.cursor->token_default_type].name);
                 skip_parser = true;
                 status = YYPUSH_MORE;
+                if (NULL != stats) {
+                    ++obc.stats->parser_fallbacks;
+                }
 #ifdef DEBUG
                 goto abandon_or_done; // WARNING: temporary
 #endif
@@ -462,7 +1012,7 @@ retry_as_token:
             {
                 bool something_to_flush;
 
-                something_to_flush = obc.cursor != obc.buffer;
+                something_to_flush = NULL != buffer_last(&obc);
                 debug("[DONE] %s", lle->lexer->imp->name);
                 buffer_flush(&obc, true);
 #if 1
@@ -476,6 +1026,7 @@ retry_as_token:
 #endif
                 if (NULL != pc.current_lexer_offset->prev) {
                     lle = delegation_pop(&pc, yy);
+                    INSTRUMENT_SWITCH_LEXER();
 #if 1
                     debug("something_to_flush for %s = %s", lle->lexer->imp->name, something_to_flush ? "true" : "false");
                     if (something_to_flush && NULL != fmt->imp->start_lexing) {
@@ -505,7 +1056,15 @@ retry_as_token:
                 if (NULL != pc.current_lexer_offset->next) {
                     // TODO: offset are now wrong with buffering?
                     debug("PUSH YYLIMIT (%zu => %zu)", SIZE_T(YYLIMIT - YYSRC), SIZE_T(copy.child_limit - YYSRC));
+                    if (HAS_FLAG(what, TOKEN)) {
+                        INSTRUMENT_TOKEN();
+                    }
                     lle = delegation_push(&pc, yy, what & ~TOKEN, -1);
+                    INSTRUMENT_SWITCH_LEXER();
+                    if (NULL != stats) {
+                        ++obc.stats->delegations;
+                        ++lexer_stats->delegations;
+                    }
 #if 1
                     if (NULL != fmt->imp->start_lexing) {
                         fmt->imp->start_lexing(lle->lexer->imp->name, buffer, &fmt->optvals);
@@ -521,6 +1080,10 @@ retry_as_token:
 #endif
                     if (DELEGATE_UNTIL == (what & ~TOKEN)) {
                         if (!HAS_FLAG(what, TOKEN)) {
+                            if (NULL != stats) {
+                                ++obc.stats->cursor_resets;
+                                obc.stats->bytes_rescanned += YYCURSOR - YYTEXT;
+                            }
                             YYCURSOR = YYTEXT; // come back before we read this token if delegation is active right now
                         }
                         YYLIMIT = copy.child_limit;
@@ -546,6 +1109,7 @@ retry_as_token:
                 break;
             }
             case 0: // TOKEN &= ~TOKEN == 0
+                INSTRUMENT_TOKEN();
                 ++obc.cursor;
                 // alreay handled
                 break;
@@ -554,24 +1118,269 @@ retry_as_token:
                 break;
         }
     } while (YYPUSH_MORE == status/* || NULL == lle->lexer->imp->yypush_parse*/);
+    goto abandon_or_done;
+out_of_budget:
+    {
+        DListElement *e;
+
+        debug("[ ERR ] budget exhausted (%d) at offset %zu", ret, SIZE_T(YYCURSOR - YYSRC));
+        buffer_flush(&obc, true);
+        // everything before YYCURSOR was tokenized, write the rest as is
+        if ((const char *) YYCURSOR < src_end) {
+            fmt->imp->start_token(TEXT, buffer, &fmt->optvals);
+            fmt->imp->write_token(buffer, (const char *) YYCURSOR, src_end - (const char *) YYCURSOR, &fmt->optvals);
+            fmt->imp->end_token(TEXT, buffer, &fmt->optvals);
+        }
+        previous_token_type = -1;
+        if (NULL != fmt->imp->end_lexing) {
+            for (e = pc.current_lexer_offset; NULL != e; e = e->prev) {
+                fmt->imp->end_lexing(((LexerListElement *) e->data)->lexer->imp->name, buffer, &fmt->optvals);
+            }
+        }
+    }
 abandon_or_done:
     buffer_flush(&obc, true);
+    buffer_free_blocks(&obc);
     // TODO: while (lle->current_lexer_offset-- > 0): end_lexing?
     if (NULL != fmt->imp->end_document) {
         fmt->imp->end_document(buffer, &fmt->optvals);
     }
+    buffer_drain(&obc, true);
+    if (NULL != stats) {
+        INSTRUMENT_SWITCH_LEXER();
+        obc.stats->bytes_out += obc.sent + buffer->len;
+        obc.stats->time_ns += monotonic_ns() - started_at;
+    }
     processing_context_destroy(&pc);
 
-    // set result string
-    buffer_len = buffer->len;
-    *dst = string_orphan(buffer);
-    if (NULL != dst_len) {
-        *dst_len = buffer_len;
+    if (NULL != dst) {
+        // set result string
+        buffer_len = buffer->len;
+        *dst = string_orphan(buffer);
+        if (NULL != dst_len) {
+            *dst_len = buffer_len;
+        }
+    } else {
+        string_destroy(buffer);
+        if (obc.sink_failed) {
+            ret = HIGHLIGHT_SINK_ERROR;
+        }
     }
 
     return ret;
 }
 
+/**
+ * Highlight a string according to given lexer(s) and formatter but
+ * within some limits. Once one of them is reached, the rest of the input
+ * is written as is, as TEXT tokens.
+ *
+ * @param src the input string
+ * @param src_len its length
+ * @param dst the output string
+ * @param dst_len its length if not null
+ * @param fmt the formatter to generate output from tokens
+ * @param lexerc the number of lexers in lexerv (have to >= 1)
+ * @param lexerv an array of lexers to tokenize the input string
+ * (the top lexer have to be at index 0)
+ * @param budget the limits (NULL for none)
+ *
+ * Statistics are collected if the calling thread bound a HighlightStats
+ * (see highlight_stats_bind), tokens are traced if it bound a HighlightTrace
+ * (see highlight_trace_bind).
+ *
+ * @return one of the HIGHLIGHT_* constants:
+ *  + HIGHLIGHT_SUCCESS (0) if successfull
+ *  + HIGHLIGHT_RECURSION if a lexer stopped to progress
+ *  + HIGHLIGHT_TIMEOUT, HIGHLIGHT_MAX_TOKENS_EXCEEDED or HIGHLIGHT_MAX_OUTPUT_EXCEEDED
+ *    if the budget ran out on time, count of tokens or output size
+ */
+SHALL_API int highlight_string_with_budget(const char *src, size_t src_len, char **dst, size_t *dst_len, Formatter *fmt, size_t lexerc, Lexer **lexerv, const HighlightBudget *budget)
+{
+    return highlight_real(src, src_len, dst, dst_len, NULL, fmt, lexerc, lexerv, budget, NULL, NULL);
+}
+
+/**
+ * Highlight a string according to given lexer(s) and formatter, as
+ * highlight_string_with_budget, but instead of building the whole output,
+ * send it to a sink as it is produced (by chunks of about sink->chunk_size
+ * bytes).
+ *
+ * @param src the input string
+ * @param src_len its length
+ * @param sink the receiver of the output
+ * @param fmt the formatter to generate output from tokens
+ * @param lexerc the number of lexers in lexerv (have to >= 1)
+ * @param lexerv an array of lexers to tokenize the input string
+ * (the top lexer have to be at index 0)
+ * @param budget the limits (NULL for none)
+ *
+ * @return same as highlight_string_with_budget plus HIGHLIGHT_SINK_ERROR
+ * if sink->write failed (highlighting stops as soon as possible)
+ */
+SHALL_API int highlight_string_to(const char *src, size_t src_len, const HighlightSink *sink, Formatter *fmt, size_t lexerc, Lexer **lexerv, const HighlightBudget *budget)
+{
+    assert(NULL != sink);
+    assert(NULL != sink->write);
+
+    return highlight_real(src, src_len, NULL, NULL, sink, fmt, lexerc, lexerv, budget, NULL, NULL);
+}
+
+/**
+ * Highlight a string as highlight_string_to but on two threads: the
+ * calling one runs the lexers while a second one, started for the
+ * document, runs the formatter and writes to the sink. Tokens go from the
+ * first to the second through a queue of a fixed size: when the formatter
+ * is late, the lexers wait for it.
+ *
+ * The output is the same as the one of highlight_string_to, sink->write is
+ * called by the formatting thread. The formatter has to be a builtin one
+ * (those of the bindings call back into their runtime) and statistics
+ * (see highlight_stats_bind) charge the time to fill the queue, not to
+ * format, to formatting. The max_output limit of the budget is checked
+ * against the output formatted so far, which can be behind the lexers by
+ * up to queue_size tokens.
+ *
+ * @param src the input string
+ * @param src_len its length
+ * @param sink the receiver of the output
+ * @param fmt the formatter to generate output from tokens
+ * @param lexerc the number of lexers in lexerv (have to >= 1)
+ * @param lexerv an array of lexers to tokenize the input string
+ * (the top lexer have to be at index 0)
+ * @param budget the limits (NULL for none)
+ * @param queue_size the capacity of the queue, in formatter calls (0 for
+ * the default: 16384)
+ *
+ * @return same as highlight_string_to
+ */
+SHALL_API int highlight_string_pipelined(const char *src, size_t src_len, const HighlightSink *sink, Formatter *fmt, size_t lexerc, Lexer **lexerv, const HighlightBudget *budget, size_t queue_size)
+{
+    int ret;
+    size_t output_len;
+    HighlightPipe *pipe;
+    HighlightStats *stats;
+
+    assert(NULL != sink);
+    assert(NULL != sink->write);
+
+    if (NULL == (pipe = highlight_pipe_start(sink, fmt, queue_size))) {
+        // no thread: do it all by ourselves
+        return highlight_string_to(src, src_len, sink, fmt, lexerc, lexerv, budget);
+    }
+    ret = highlight_real(src, src_len, NULL, NULL, NULL, highlight_pipe_formatter(pipe), lexerc, lexerv, budget, pipe, NULL);
+    if (!highlight_pipe_finish(pipe, &output_len)) {
+        ret = HIGHLIGHT_SINK_ERROR;
+    }
+    if (NULL != (stats = highlight_stats_bound())) {
+        highlight_stats_totals_ptr(stats)->bytes_out += output_len;
+    }
+
+    return ret;
+}
+
+/**
+ * Highlight a string as highlight_string_with_budget but, for a large
+ * input and a lexer which knows where its state can be recovered (the
+ * resync_find callback of its implementation), lex it on several threads
+ * of the pool of highlight_batch.
+ *
+ * The input is cut in chunks at resynchronization points: each one is
+ * lexed from the state the lexer is expected to be in at this point while
+ * formatting stays on the calling thread, in order. When the lexing of a
+ * chunk does not end exactly on the next point, in this very same state,
+ * the guess was wrong and the next chunk is lexed again, as a continuation
+ * of the previous one. So the output is identical to the one of
+ * highlight_string_with_budget.
+ *
+ * Otherwise (several lexers, a lexer with a parser, a lexer which stacks
+ * an other one, a single thread or an input too small to be split) this
+ * is just highlight_string_with_budget.
+ *
+ * @param src the input string
+ * @param src_len its length
+ * @param dst the output string
+ * @param dst_len its length if not null
+ * @param fmt the formatter to generate output from tokens
+ * @param lexerc the number of lexers in lexerv (have to >= 1)
+ * @param lexerv an array of lexers to tokenize the input string
+ * (the top lexer have to be at index 0)
+ * @param budget the limits (NULL for none)
+ * @param threads the number of threads to use, the calling one included
+ * (0 for the number of CPUs)
+ * @param chunk_size the size, in bytes, of the chunks the input is cut in
+ * (0 for the default: 256 KB)
+ *
+ * Statistics and traces are collected as by highlight_string_with_budget
+ * except for the rescans of the lexers on the other threads.
+ *
+ * @return same as highlight_string_with_budget
+ */
+SHALL_API int highlight_string_parallel(const char *src, size_t src_len, char **dst, size_t *dst_len, Formatter *fmt, size_t lexerc, Lexer **lexerv, const HighlightBudget *budget, unsigned threads, size_t chunk_size)
+{
+    int ret;
+    size_t i, skip;
+    ParallelLexing pl;
+
+    assert(lexerc > 0);
+    assert(NULL != lexerv);
+
+    pl.chunk_size = 0 == chunk_size ? DEFAULT_PARALLEL_CHUNK_SIZE : chunk_size;
+    skip = bom_length(src, src_len);
+    skip += shebang_length(src + skip, src_len - skip);
+    pl.threads = highlight_pool_threads(threads, (src_len - skip) / pl.chunk_size);
+    if (1 != lexerc || NULL == lexerv[0]->imp->resync_find || NULL != lexerv[0]->imp->yypush_parse || pl.threads < 2) {
+        return highlight_string_with_budget(src, src_len, dst, dst_len, fmt, lexerc, lexerv, budget);
+    }
+    pl.lexer = lexerv[0];
+    pl.src = (const YYCTYPE *) src + skip;
+    pl.limit = (const YYCTYPE *) src + src_len;
+    if (NULL == (pl.runs = mem_new_n0(*pl.runs, pl.threads))) {
+        return highlight_string_with_budget(src, src_len, dst, dst_len, fmt, lexerc, lexerv, budget);
+    }
+    lexer_run_start(&pl.runs[0], &pl, pl.src, false);
+    // the lexer stacked an other one
+    if (pl.runs[0].pc.lexer_stack.head != pl.runs[0].pc.lexer_stack.tail) {
+        processing_context_destroy(&pl.runs[0].pc);
+        free(pl.runs);
+        return highlight_string_with_budget(src, src_len, dst, dst_len, fmt, lexerc, lexerv, budget);
+    }
+    pl.ref_lle = processing_context_init(&pl.ref, pl.lexer);
+    if (NULL != pl.lexer->imp->resync_state) {
+        pl.lexer->imp->resync_state(pl.ref_lle->data);
+    }
+    pl.runs_len = 1;
+    pl.run = pl.call = 0;
+    ret = highlight_real(src, src_len, dst, dst_len, NULL, fmt, lexerc, lexerv, budget, NULL, &pl);
+    processing_context_destroy(&pl.runs[pl.runs_len - 1].pc);
+    processing_context_destroy(&pl.ref);
+    for (i = 0; i < pl.threads; i++) {
+        free(pl.runs[i].calls);
+    }
+    free(pl.runs);
+
+    return ret;
+}
+
+/**
+ * Highlight a string according to given lexer(s) and formatter
+ *
+ * @param src the input string
+ * @param src_len its length
+ * @param dst the output string
+ * @param dst_len its length if not null
+ * @param fmt the formatter to generate output from tokens
+ * @param lexerc the number of lexers in lexerv (have to >= 1)
+ * @param lexerv an array of lexers to tokenize the input string
+ * (the top lexer have to be at index 0)
+ *
+ * @return zero if successfull
+ */
+SHALL_API int highlight_string(const char *src, size_t src_len, char **dst, size_t *dst_len, Formatter *fmt, size_t lexerc, Lexer **lexerv/*, uint32_t flags*/)
+{
+    return highlight_string_with_budget(src, src_len, dst, dst_len, fmt, lexerc, lexerv, NULL);
+}
+
 /**
  * Generate a sample of highlighting for the given formatter
  *
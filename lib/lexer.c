@@ -31,6 +31,7 @@ extern const LexerImplementation js_lexer;
 extern const LexerImplementation json_lexer;
 extern const LexerImplementation lua_lexer;
 extern const LexerImplementation mysql_lexer;
+extern const LexerImplementation ndjson_lexer; // provided by json lexer
 extern const LexerImplementation nginx_lexer;
 extern const LexerImplementation php_lexer;
 extern const LexerImplementation postgresql_lexer;
@@ -60,6 +61,7 @@ static const LexerImplementation *available_lexers[] = {
     &json_lexer,
     &lua_lexer,
     &mysql_lexer,
+    &ndjson_lexer,
     &nginx_lexer,
     &php_lexer,
     &postgresql_lexer,
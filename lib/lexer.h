@@ -4,6 +4,10 @@
 #include "types.h"
 #include "options.h"
 #include "darray.h"
+#include "stats_internal.h"
+#ifdef WITH_PROFILING
+# include "profile_internal.h"
+#endif /* WITH_PROFILING */
 
 #ifndef DOXYGEN
 # define SHELLMAGIC "#!"
@@ -28,6 +32,7 @@
 
 #define yyless(x) \
     do { \
+        highlight_stats_rescan(YYCURSOR - (YYTEXT + x)); \
         YYCURSOR = YYTEXT + x; \
     } while (0);
 
@@ -37,8 +42,42 @@
 
 #define YYGETCONDITION()  data->state
 #define YYSETCONDITION(s) data->state = s
+#ifdef WITH_PROFILING
+/**
+ * Count the entries in a state (re2c is run with -d)
+ */
+# define PROFILE_STATE(s) \
+    do { \
+        static LexerProfileSite site = { { __FILE__, 0, 0, 0, 0, 0 }, NULL, false }; \
+ \
+        if (!site.registered) { \
+            site.entry.state = s; \
+            lexer_profile_register(&site); \
+        } \
+        ++site.entry.hits; \
+    } while (0);
+/**
+ * Count the hits of the rule which is returning and what it matched
+ */
+# define PROFILE_RULE \
+    do { \
+        static LexerProfileSite site = { { __FILE__, __LINE__, 0, 0, 0, 0 }, NULL, false }; \
+ \
+        if (!site.registered) { \
+            lexer_profile_register(&site); \
+        } \
+        ++site.entry.hits; \
+        site.entry.bytes += YYCURSOR - YYTEXT; \
+        rv->profile_site = &site; \
+    } while (0);
+#else
+# define PROFILE_RULE
+#endif /* WITH_PROFILING */
+
 #if 0
 # define YYDEBUG(s, c) fprintf(stderr, "state: %d char: %c\n", s, c)
+#elif defined(WITH_PROFILING)
+# define YYDEBUG(s, c) PROFILE_STATE(s)
 #else
 # define YYDEBUG(s, c)
 #endif
@@ -99,15 +138,23 @@ enum {
 //     DELEGATE_UNTIL_AFTER_TOKEN = 13,
 };
 
+/**
+ * The line of the rule is always recorded, for tracing (lib/trace.c)
+ */
 #ifdef DEBUG
 # define TRACK_ORIGIN \
     do { \
+        PROFILE_RULE; \
         rv->return_line = __LINE__; \
         rv->return_file = __FILE__; \
         rv->return_func = __func__; \
     } while (0);
 #else
-# define TRACK_ORIGIN
+# define TRACK_ORIGIN \
+    do { \
+        PROFILE_RULE; \
+        rv->return_line = __LINE__; \
+    } while (0);
 #endif
 
 #define DONE() \
@@ -383,6 +430,27 @@ struct LexerImplementation {
     int (*yypush_parse)(yypstate *, int, LexerReturnValue/*YYSTYPE*/ const *);
     void *(*yypstate_new)(void);
     void (*yypstate_delete)(void *);
+    /**
+     * Optionnal (may be NULL) callback to find a resynchronization point: the
+     * first position, at or after the given offset, where a token is expected
+     * to start with the lexer in the state set by resync_state. Returns the
+     * length of the input if there is none.
+     *
+     * It allows highlight_string_parallel to lex a large input by chunks,
+     * in parallel. A guess is never trusted: the state in which the lexing
+     * of the previous chunk really ends is checked against it, extra data
+     * (past LexerData) included, bytewise: a lexer has to reset them when it
+     * returns to the resynchronization state. A lexer which implements it
+     * must not stack other lexers while lexing (delegations are only allowed
+     * to fall back to a token).
+     */
+    size_t (*resync_find)(const char *, size_t, size_t);
+    /**
+     * Optionnal callback to set the state of the lexer (data initialized as
+     * for a new document) at a resynchronization point. If NULL, the lexer
+     * resumes in its initial state.
+     */
+    void (*resync_state)(LexerData *);
 };
 
 /**
@@ -408,11 +476,14 @@ struct LexerReturnValue {
     int token_default_type; // TOKEN, the default token value set by the lexer and used to highlight
     const YYCTYPE *child_limit; // DELEGATE_*
     int delegation_fallback; // DELEGATE_*
+    int return_line; // the line of the rule which returned it
 #ifdef DEBUG
-    int return_line;
     const char *return_file;
     const char *return_func;
 #endif
+#ifdef WITH_PROFILING
+    LexerProfileSite *profile_site; // the rule which returned it
+#endif /* WITH_PROFILING */
 };
 
 #define YYSTRNCMP(x) \
@@ -450,6 +521,7 @@ typedef struct {
 int named_elements_cmp(const void *, const void *);
 int named_elements_casecmp(const void *, const void *);
 bool check_codepoint(const YYCTYPE *, const YYCTYPE * const, const YYCTYPE **, const char *, size_t, const char *, size_t, size_t, size_t, uint8_t);
+size_t resync_find_line(const char *, size_t, size_t, const char *, size_t, bool);
 
 void append_lexer(void *, Lexer *);
 void prepend_lexer(void *, Lexer *);
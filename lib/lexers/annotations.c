@@ -67,4 +67,6 @@ LexerImplementation annotations_lexer = {
     NULL, // yypush_parse
     NULL, // yypstate_new
     NULL, // yypstate_delete
+    NULL, // resync_find
+    NULL, // resync_state
 };
@@ -65,4 +65,6 @@ LexerImplementation cpp_lexer = {
     NULL, // yypush_parse
     NULL, // yypstate_new
     NULL, // yypstate_delete
+    NULL, // resync_find
+    NULL, // resync_state
 };
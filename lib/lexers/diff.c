@@ -79,6 +79,11 @@ static int difflex(YYLEX_ARGS)
     DONE();
 }
 
+static size_t diffresync(const char *src, size_t src_len, size_t from)
+{
+    return resync_find_line(src, src_len, from, NULL, 0, false);
+}
+
 LexerImplementation diff_lexer = {
     "Diff",
     "Lexer for unified or context-style diffs or patches",
@@ -99,4 +104,6 @@ LexerImplementation diff_lexer = {
     NULL, // yypush_parse
     NULL, // yypstate_new
     NULL, // yypstate_delete
+    diffresync,
+    NULL, // resync_state (initial)
 };
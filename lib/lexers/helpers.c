@@ -118,3 +118,41 @@ bool check_codepoint(const YYCTYPE *start, const YYCTYPE * const limit, const YY
 
     return ok;
 }
+
+/**
+ * Helper to implement the resync_find callback of a line oriented lexer:
+ * finds the first line, starting at or after a given offset, which follows
+ * a line ending with a given suffix.
+ *
+ * @param src the input string
+ * @param src_len its length
+ * @param from the offset where to start the search
+ * @param suffix the end of the previous line (without its newline), NULL for any line
+ * @param suffix_len its length (0 if unused)
+ * @param skip_spaces true to skip white spaces and empty lines after the newline,
+ * for lexers which make a single token of successive white spaces
+ *
+ * @return the offset found or src_len if there is none
+ */
+size_t resync_find_line(const char *src, size_t src_len, size_t from, const char *suffix, size_t suffix_len, bool skip_spaces)
+{
+    const char *p, *nl, *eol, * const end = src + src_len;
+
+    // a newline at from - 1 makes from itself a candidate
+    for (p = src + (from > 0 ? from - 1 : 0); p < end && NULL != (nl = memchr(p, '\n', end - p)); p = nl + 1) {
+        eol = nl;
+        if (eol > src && '\r' == eol[-1]) {
+            --eol;
+        }
+        if (NULL == suffix || (SIZE_T(eol - src) >= suffix_len && 0 == memcmp(eol - suffix_len, suffix, suffix_len))) {
+            for (p = nl + 1; skip_spaces && p < end && (' ' == *p || '\t' == *p || '\r' == *p || '\n' == *p); ++p)
+                ;
+            if (p < end) {
+                return p - src;
+            }
+            break;
+        }
+    }
+
+    return src_len;
+}
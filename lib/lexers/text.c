@@ -35,4 +35,6 @@ LexerImplementation text_lexer = {
     NULL, // yypush_parse
     NULL, // yypstate_new
     NULL, // yypstate_delete
+    NULL, // resync_find
+    NULL, // resync_state
 };
@@ -0,0 +1,413 @@
+/**
+ * @file lib/palette.c
+ * @brief mapping of colors to the palettes of terminals with 16 or 256 colors
+ *
+ * The closest color is the one of the palette with the smallest CIE76
+ * distance, which is the euclidean distance in the CIE L*a*b* color space.
+ * Unlike the one between RGB components, it is close to the difference
+ * perceived by the eye (especially for greys).
+ *
+ * The mapping of the styles of the builtin themes is computed at build time
+ * (by themegen), the one of other themes on demand.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "cpp.h"
+#include "palette.h"
+
+typedef struct {
+    double l, a, b;
+} Lab;
+
+// xterm 256 colors: the first 16 are the ones of PALETTE_16
+static const Color palette[] = {
+    // [0x00-0x07]: standard colors (as in ESC [ 30–37 m) (based on xterm)
+    { 0x00, 0x00, 0x00 }, // 0: black
+    { 0xCD, 0x00, 0x00 }, // 1: red
+    { 0x00, 0xCD, 0x00 }, // 2: green
+    { 0xCD, 0xCD, 0x00 }, // 3: brown/yellow
+    { 0x00, 0x00, 0xEE }, // 4: blue
+    { 0xCD, 0x00, 0xCD }, // 5: magenta
+    { 0x00, 0xCD, 0xCD }, // 6: cyan
+    { 0xE5, 0xE5, 0xE5 }, // 7: gray
+    // [0x08-0x0F]: high intensity colors (as in ESC [ 90–97 m) (based on xterm)
+    { 0x7F, 0x7F, 0x7F }, // 0: darkgray
+    { 0xFF, 0x00, 0x00 }, // 1: red
+    { 0x00, 0xFF, 0x00 }, // 2: green
+    { 0xFF, 0xFF, 0x00 }, // 3: yellow
+    { 0x5C, 0x5C, 0xFF }, // 4: blue
+    { 0xFF, 0x00, 0xFF }, // 5: magenta
+    { 0x00, 0xFF, 0xFF }, // 6: cyan
+    { 0xFF, 0xFF, 0xFF }, // 7: white
+    // [0x10-0xE7]: 6 × 6 × 6 = 216 colors: 16 + 36 × r + 6 × g + b (0 ≤ r, g, b ≤ 5)
+#if 0
+<?php
+$valuerange = [ 0x00, 0x5F, 0x87, 0xAF, 0xD7, 0xFF ];
+for ($i = 0; $i < 216; $i++) {
+    printf('{ 0x%02X, 0x%02X, 0x%02X },' . PHP_EOL, $valuerange[($i / count($valuerange) ** 2) % count($valuerange)], $valuerange[($i / count($valuerange)) % count($valuerange)], $valuerange[$i % count($valuerange)]);
+}
+#endif
+    { 0x00, 0x00, 0x00 },
+    { 0x00, 0x00, 0x5F },
+    { 0x00, 0x00, 0x87 },
+    { 0x00, 0x00, 0xAF },
+    { 0x00, 0x00, 0xD7 },
+    { 0x00, 0x00, 0xFF },
+    { 0x00, 0x5F, 0x00 },
+    { 0x00, 0x5F, 0x5F },
+    { 0x00, 0x5F, 0x87 },
+    { 0x00, 0x5F, 0xAF },
+    { 0x00, 0x5F, 0xD7 },
+    { 0x00, 0x5F, 0xFF },
+    { 0x00, 0x87, 0x00 },
+    { 0x00, 0x87, 0x5F },
+    { 0x00, 0x87, 0x87 },
+    { 0x00, 0x87, 0xAF },
+    { 0x00, 0x87, 0xD7 },
+    { 0x00, 0x87, 0xFF },
+    { 0x00, 0xAF, 0x00 },
+    { 0x00, 0xAF, 0x5F },
+    { 0x00, 0xAF, 0x87 },
+    { 0x00, 0xAF, 0xAF },
+    { 0x00, 0xAF, 0xD7 },
+    { 0x00, 0xAF, 0xFF },
+    { 0x00, 0xD7, 0x00 },
+    { 0x00, 0xD7, 0x5F },
+    { 0x00, 0xD7, 0x87 },
+    { 0x00, 0xD7, 0xAF },
+    { 0x00, 0xD7, 0xD7 },
+    { 0x00, 0xD7, 0xFF },
+    { 0x00, 0xFF, 0x00 },
+    { 0x00, 0xFF, 0x5F },
+    { 0x00, 0xFF, 0x87 },
+    { 0x00, 0xFF, 0xAF },
+    { 0x00, 0xFF, 0xD7 },
+    { 0x00, 0xFF, 0xFF },
+    { 0x5F, 0x00, 0x00 },
+    { 0x5F, 0x00, 0x5F },
+    { 0x5F, 0x00, 0x87 },
+    { 0x5F, 0x00, 0xAF },
+    { 0x5F, 0x00, 0xD7 },
+    { 0x5F, 0x00, 0xFF },
+    { 0x5F, 0x5F, 0x00 },
+    { 0x5F, 0x5F, 0x5F },
+    { 0x5F, 0x5F, 0x87 },
+    { 0x5F, 0x5F, 0xAF },
+    { 0x5F, 0x5F, 0xD7 },
+    { 0x5F, 0x5F, 0xFF },
+    { 0x5F, 0x87, 0x00 },
+    { 0x5F, 0x87, 0x5F },
+    { 0x5F, 0x87, 0x87 },
+    { 0x5F, 0x87, 0xAF },
+    { 0x5F, 0x87, 0xD7 },
+    { 0x5F, 0x87, 0xFF },
+    { 0x5F, 0xAF, 0x00 },
+    { 0x5F, 0xAF, 0x5F },
+    { 0x5F, 0xAF, 0x87 },
+    { 0x5F, 0xAF, 0xAF },
+    { 0x5F, 0xAF, 0xD7 },
+    { 0x5F, 0xAF, 0xFF },
+    { 0x5F, 0xD7, 0x00 },
+    { 0x5F, 0xD7, 0x5F },
+    { 0x5F, 0xD7, 0x87 },
+    { 0x5F, 0xD7, 0xAF },
+    { 0x5F, 0xD7, 0xD7 },
+    { 0x5F, 0xD7, 0xFF },
+    { 0x5F, 0xFF, 0x00 },
+    { 0x5F, 0xFF, 0x5F },
+    { 0x5F, 0xFF, 0x87 },
+    { 0x5F, 0xFF, 0xAF },
+    { 0x5F, 0xFF, 0xD7 },
+    { 0x5F, 0xFF, 0xFF },
+    { 0x87, 0x00, 0x00 },
+    { 0x87, 0x00, 0x5F },
+    { 0x87, 0x00, 0x87 },
+    { 0x87, 0x00, 0xAF },
+    { 0x87, 0x00, 0xD7 },
+    { 0x87, 0x00, 0xFF },
+    { 0x87, 0x5F, 0x00 },
+    { 0x87, 0x5F, 0x5F },
+    { 0x87, 0x5F, 0x87 },
+    { 0x87, 0x5F, 0xAF },
+    { 0x87, 0x5F, 0xD7 },
+    { 0x87, 0x5F, 0xFF },
+    { 0x87, 0x87, 0x00 },
+    { 0x87, 0x87, 0x5F },
+    { 0x87, 0x87, 0x87 },
+    { 0x87, 0x87, 0xAF },
+    { 0x87, 0x87, 0xD7 },
+    { 0x87, 0x87, 0xFF },
+    { 0x87, 0xAF, 0x00 },
+    { 0x87, 0xAF, 0x5F },
+    { 0x87, 0xAF, 0x87 },
+    { 0x87, 0xAF, 0xAF },
+    { 0x87, 0xAF, 0xD7 },
+    { 0x87, 0xAF, 0xFF },
+    { 0x87, 0xD7, 0x00 },
+    { 0x87, 0xD7, 0x5F },
+    { 0x87, 0xD7, 0x87 },
+    { 0x87, 0xD7, 0xAF },
+    { 0x87, 0xD7, 0xD7 },
+    { 0x87, 0xD7, 0xFF },
+    { 0x87, 0xFF, 0x00 },
+    { 0x87, 0xFF, 0x5F },
+    { 0x87, 0xFF, 0x87 },
+    { 0x87, 0xFF, 0xAF },
+    { 0x87, 0xFF, 0xD7 },
+    { 0x87, 0xFF, 0xFF },
+    { 0xAF, 0x00, 0x00 },
+    { 0xAF, 0x00, 0x5F },
+    { 0xAF, 0x00, 0x87 },
+    { 0xAF, 0x00, 0xAF },
+    { 0xAF, 0x00, 0xD7 },
+    { 0xAF, 0x00, 0xFF },
+    { 0xAF, 0x5F, 0x00 },
+    { 0xAF, 0x5F, 0x5F },
+    { 0xAF, 0x5F, 0x87 },
+    { 0xAF, 0x5F, 0xAF },
+    { 0xAF, 0x5F, 0xD7 },
+    { 0xAF, 0x5F, 0xFF },
+    { 0xAF, 0x87, 0x00 },
+    { 0xAF, 0x87, 0x5F },
+    { 0xAF, 0x87, 0x87 },
+    { 0xAF, 0x87, 0xAF },
+    { 0xAF, 0x87, 0xD7 },
+    { 0xAF, 0x87, 0xFF },
+    { 0xAF, 0xAF, 0x00 },
+    { 0xAF, 0xAF, 0x5F },
+    { 0xAF, 0xAF, 0x87 },
+    { 0xAF, 0xAF, 0xAF },
+    { 0xAF, 0xAF, 0xD7 },
+    { 0xAF, 0xAF, 0xFF },
+    { 0xAF, 0xD7, 0x00 },
+    { 0xAF, 0xD7, 0x5F },
+    { 0xAF, 0xD7, 0x87 },
+    { 0xAF, 0xD7, 0xAF },
+    { 0xAF, 0xD7, 0xD7 },
+    { 0xAF, 0xD7, 0xFF },
+    { 0xAF, 0xFF, 0x00 },
+    { 0xAF, 0xFF, 0x5F },
+    { 0xAF, 0xFF, 0x87 },
+    { 0xAF, 0xFF, 0xAF },
+    { 0xAF, 0xFF, 0xD7 },
+    { 0xAF, 0xFF, 0xFF },
+    { 0xD7, 0x00, 0x00 },
+    { 0xD7, 0x00, 0x5F },
+    { 0xD7, 0x00, 0x87 },
+    { 0xD7, 0x00, 0xAF },
+    { 0xD7, 0x00, 0xD7 },
+    { 0xD7, 0x00, 0xFF },
+    { 0xD7, 0x5F, 0x00 },
+    { 0xD7, 0x5F, 0x5F },
+    { 0xD7, 0x5F, 0x87 },
+    { 0xD7, 0x5F, 0xAF },
+    { 0xD7, 0x5F, 0xD7 },
+    { 0xD7, 0x5F, 0xFF },
+    { 0xD7, 0x87, 0x00 },
+    { 0xD7, 0x87, 0x5F },
+    { 0xD7, 0x87, 0x87 },
+    { 0xD7, 0x87, 0xAF },
+    { 0xD7, 0x87, 0xD7 },
+    { 0xD7, 0x87, 0xFF },
+    { 0xD7, 0xAF, 0x00 },
+    { 0xD7, 0xAF, 0x5F },
+    { 0xD7, 0xAF, 0x87 },
+    { 0xD7, 0xAF, 0xAF },
+    { 0xD7, 0xAF, 0xD7 },
+    { 0xD7, 0xAF, 0xFF },
+    { 0xD7, 0xD7, 0x00 },
+    { 0xD7, 0xD7, 0x5F },
+    { 0xD7, 0xD7, 0x87 },
+    { 0xD7, 0xD7, 0xAF },
+    { 0xD7, 0xD7, 0xD7 },
+    { 0xD7, 0xD7, 0xFF },
+    { 0xD7, 0xFF, 0x00 },
+    { 0xD7, 0xFF, 0x5F },
+    { 0xD7, 0xFF, 0x87 },
+    { 0xD7, 0xFF, 0xAF },
+    { 0xD7, 0xFF, 0xD7 },
+    { 0xD7, 0xFF, 0xFF },
+    { 0xFF, 0x00, 0x00 },
+    { 0xFF, 0x00, 0x5F },
+    { 0xFF, 0x00, 0x87 },
+    { 0xFF, 0x00, 0xAF },
+    { 0xFF, 0x00, 0xD7 },
+    { 0xFF, 0x00, 0xFF },
+    { 0xFF, 0x5F, 0x00 },
+    { 0xFF, 0x5F, 0x5F },
+    { 0xFF, 0x5F, 0x87 },
+    { 0xFF, 0x5F, 0xAF },
+    { 0xFF, 0x5F, 0xD7 },
+    { 0xFF, 0x5F, 0xFF },
+    { 0xFF, 0x87, 0x00 },
+    { 0xFF, 0x87, 0x5F },
+    { 0xFF, 0x87, 0x87 },
+    { 0xFF, 0x87, 0xAF },
+    { 0xFF, 0x87, 0xD7 },
+    { 0xFF, 0x87, 0xFF },
+    { 0xFF, 0xAF, 0x00 },
+    { 0xFF, 0xAF, 0x5F },
+    { 0xFF, 0xAF, 0x87 },
+    { 0xFF, 0xAF, 0xAF },
+    { 0xFF, 0xAF, 0xD7 },
+    { 0xFF, 0xAF, 0xFF },
+    { 0xFF, 0xD7, 0x00 },
+    { 0xFF, 0xD7, 0x5F },
+    { 0xFF, 0xD7, 0x87 },
+    { 0xFF, 0xD7, 0xAF },
+    { 0xFF, 0xD7, 0xD7 },
+    { 0xFF, 0xD7, 0xFF },
+    { 0xFF, 0xFF, 0x00 },
+    { 0xFF, 0xFF, 0x5F },
+    { 0xFF, 0xFF, 0x87 },
+    { 0xFF, 0xFF, 0xAF },
+    { 0xFF, 0xFF, 0xD7 },
+    { 0xFF, 0xFF, 0xFF },
+    // [0xE8-0xFF]: grayscale from black to white in 24 steps
+#if 0
+for ($i = 0; $i < 24; $i++) {
+    printf('{ 0x%1$02X, 0x%1$02X, 0x%1$02X },' . PHP_EOL, 8 + 10 * $i);
+}
+#endif
+    { 0x08, 0x08, 0x08 },
+    { 0x12, 0x12, 0x12 },
+    { 0x1C, 0x1C, 0x1C },
+    { 0x26, 0x26, 0x26 },
+    { 0x30, 0x30, 0x30 },
+    { 0x3A, 0x3A, 0x3A },
+    { 0x44, 0x44, 0x44 },
+    { 0x4E, 0x4E, 0x4E },
+    { 0x58, 0x58, 0x58 },
+    { 0x62, 0x62, 0x62 },
+    { 0x6C, 0x6C, 0x6C },
+    { 0x76, 0x76, 0x76 },
+    { 0x80, 0x80, 0x80 },
+    { 0x8A, 0x8A, 0x8A },
+    { 0x94, 0x94, 0x94 },
+    { 0x9E, 0x9E, 0x9E },
+    { 0xA8, 0xA8, 0xA8 },
+    { 0xB2, 0xB2, 0xB2 },
+    { 0xBC, 0xBC, 0xBC },
+    { 0xC6, 0xC6, 0xC6 },
+    { 0xD0, 0xD0, 0xD0 },
+    { 0xDA, 0xDA, 0xDA },
+    { 0xE4, 0xE4, 0xE4 },
+    { 0xEE, 0xEE, 0xEE },
+};
+
+static double srgb_to_linear(uint8_t component)
+{
+    double c;
+
+    c = component / 255.0;
+
+    return c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+}
+
+static double lab_f(double t)
+{
+    return t > 216.0 / 24389.0 ? cbrt(t) : (24389.0 / 27.0 * t + 16.0) / 116.0;
+}
+
+/**
+ * Convert a sRGB color to CIE L*a*b* (D65 white point)
+ */
+static void color_to_lab(const Color *color, Lab *lab)
+{
+    double r, g, b, fx, fy, fz;
+
+    r = srgb_to_linear(color->r);
+    g = srgb_to_linear(color->g);
+    b = srgb_to_linear(color->b);
+    fx = lab_f((0.4124564 * r + 0.3575761 * g + 0.1804375 * b) / 0.95047);
+    fy = lab_f(0.2126729 * r + 0.7151522 * g + 0.0721750 * b);
+    fz = lab_f((0.0193339 * r + 0.1191920 * g + 0.9503041 * b) / 1.08883);
+    lab->l = 116.0 * fy - 16.0;
+    lab->a = 500.0 * (fx - fy);
+    lab->b = 200.0 * (fy - fz);
+}
+
+/**
+ * Find the color of a palette which is the closest (by the CIE76 distance)
+ * to the given one
+ *
+ * @param p the palette
+ * @param color the color to approximate
+ *
+ * @return the index of this color in the palette
+ */
+uint8_t palette_closest_color(Palette p, const Color *color)
+{
+    Lab lab;
+    uint8_t match;
+    double min_distance;
+    size_t i, palette_len;
+
+    match = 0;
+    min_distance = HUGE_VAL;
+    color_to_lab(color, &lab);
+    palette_len = PALETTE_16 == p ? 16 : ARRAY_SIZE(palette);
+    for (i = 0; i < palette_len; i++) {
+        Lab entry;
+        double dl, da, db, distance;
+
+        color_to_lab(&palette[i], &entry);
+        dl = lab.l - entry.l;
+        da = lab.a - entry.a;
+        db = lab.b - entry.b;
+        distance = dl * dl + da * da + db * db;
+        if (distance < min_distance) {
+            match = i;
+            min_distance = distance;
+        }
+    }
+
+    return match;
+}
+
+/**
+ * Compute the closest colors, in each palette, to the ones of the styles of a theme
+ *
+ * @param theme the theme
+ * @param tp the result
+ */
+void theme_palette_build(const Theme *theme, ThemePalette *tp)
+{
+    int p;
+    size_t i;
+
+    bzero(tp, sizeof(*tp));
+    tp->theme = theme;
+    for (p = 0; p < _PALETTE_COUNT; p++) {
+        for (i = 0; i < _TOKEN_COUNT; i++) {
+            if (theme->styles[i].fg_set) {
+                tp->styles[p][i].fg = palette_closest_color(p, &theme->styles[i].fg);
+            }
+            if (theme->styles[i].bg_set) {
+                tp->styles[p][i].bg = palette_closest_color(p, &theme->styles[i].bg);
+            }
+        }
+    }
+}
+
+/**
+ * Get the precomputed palettes of a builtin theme
+ *
+ * @param theme the theme
+ *
+ * @return NULL if theme is not a builtin one
+ */
+const ThemePalette *theme_palette_builtin(const Theme *theme)
+{
+    const ThemePalette *tp;
+
+    for (tp = builtin_palettes; NULL != tp->theme; tp++) {
+        if (theme == tp->theme) {
+            return tp;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "themes.h"
+#include "tokens.h"
+
+/**
+ * The color palettes of limited terminals
+ */
+typedef enum {
+    // the 16 standard colors (SGR 30-37, 90-97 and 40-47, 100-107)
+    PALETTE_16,
+    // the 256 colors of xterm (SGR 38;5;N and 48;5;N)
+    PALETTE_256,
+    _PALETTE_COUNT
+} Palette;
+
+/**
+ * The closest entries of the palettes to the colors of each style of a theme
+ */
+typedef struct {
+    const Theme *theme;
+    struct {
+        uint8_t fg, bg;
+    } styles[_PALETTE_COUNT][_TOKEN_COUNT];
+} ThemePalette;
+
+// the palettes of the builtin themes, computed at build time (terminated by an entry where theme is NULL)
+extern const ThemePalette builtin_palettes[];
+
+uint8_t palette_closest_color(Palette, const Color *);
+void theme_palette_build(const Theme *, ThemePalette *);
+const ThemePalette *theme_palette_builtin(const Theme *);
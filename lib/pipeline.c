@@ -0,0 +1,437 @@
+/**
+ * @file lib/pipeline.c
+ * @brief lexing and formatting of a document on two threads
+ *
+ * The lexing thread (the caller of highlight_string_pipelined) runs the
+ * usual loop of highlight.c but with a "recorder" formatter: instead of
+ * writing anything, its callbacks push the calls they receive, as small
+ * events, into a ring. A second thread, started for the document, replays
+ * them on the real formatter and sends the output to the sink.
+ *
+ * The ring has a single producer and a single consumer and is lock free:
+ * each side owns its index and only reads the one of the other side. To
+ * limit the traffic between the cores, an index is only published every
+ * PIPE_PUBLISH_INTERVAL events or when its owner runs out of events (the
+ * consumer) or of room (the producer). A side which can't progress yields
+ * a few times then sleeps until the other one publishes its index: a slow
+ * formatter so holds back the lexer (backpressure) and the memory used is
+ * bounded by the size of the ring.
+ *
+ * Events point into the source (tokens) or to the names of the lexers, they
+ * are not copied.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "cpp.h"
+#include "formatter.h"
+#include "pipeline_internal.h"
+
+#define DEFAULT_PIPE_CAPACITY 16384
+#define DEFAULT_PIPE_CHUNK_SIZE 8192
+#define PIPE_PUBLISH_INTERVAL 256
+#define PIPE_SPINS 64
+#define CACHE_LINE_SIZE 64
+
+enum {
+    PIPE_START_DOCUMENT,
+    PIPE_END_DOCUMENT,
+    PIPE_START_TOKEN,
+    PIPE_END_TOKEN,
+    PIPE_WRITE_TOKEN,
+    PIPE_START_LEXING,
+    PIPE_END_LEXING,
+    PIPE_EOF,
+};
+
+/**
+ * A call to a formatter callback
+ */
+typedef struct {
+    // the token (PIPE_WRITE_TOKEN) or the name of the lexer (PIPE_*_LEXING)
+    const char *ptr;
+    size_t len;
+    // type of token for PIPE_START_TOKEN and PIPE_END_TOKEN
+    int token;
+    int op;
+} PipeEvent;
+
+struct HighlightPipe {
+    PipeEvent *events;
+    // capacity - 1, the capacity being a power of 2
+    size_t mask;
+    // published by the producer: events before it are readable
+    size_t tail;
+    // published by the consumer: slots before it can be reused
+    size_t head;
+    // a side sleeps (seq_cst, see pipe_wake)
+    bool producer_waiting;
+    bool consumer_waiting;
+    // the sink failed, the rest of the output is discarded
+    bool failed;
+    // bytes of output produced so far (sent or pending)
+    size_t output_len;
+    char padding1[CACHE_LINE_SIZE];
+    // producer's side
+    size_t producer_tail;
+    size_t producer_head; // last head read
+    Formatter *recorder;
+    FormatterImplementation recorder_imp;
+    char padding2[CACHE_LINE_SIZE];
+    // consumer's side
+    size_t consumer_head;
+    size_t consumer_tail; // last tail read
+    Formatter *fmt;
+    const HighlightSink *sink;
+    size_t chunk_size;
+    String *output;
+    size_t sent;
+    // to sleep
+    pthread_mutex_t lock;
+    pthread_cond_t moved;
+    pthread_t thread;
+};
+
+typedef struct {
+    HighlightPipe *pipe;
+} RecorderFormatterData;
+
+/**
+ * Wakes the other side if it sleeps, after an index was published
+ *
+ * Both the index and the flag are seq_cst: either the sleeper sees the new
+ * index before going to sleep or we see its flag.
+ */
+static void pipe_wake(HighlightPipe *pipe, bool *waiting)
+{
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&pipe->lock);
+        pthread_cond_signal(&pipe->moved);
+        pthread_mutex_unlock(&pipe->lock);
+    }
+}
+
+static void pipe_publish_tail(HighlightPipe *pipe)
+{
+    __atomic_store_n(&pipe->tail, pipe->producer_tail, __ATOMIC_SEQ_CST);
+    pipe_wake(pipe, &pipe->consumer_waiting);
+}
+
+static void pipe_publish_head(HighlightPipe *pipe)
+{
+    __atomic_store_n(&pipe->head, pipe->consumer_head, __ATOMIC_SEQ_CST);
+    pipe_wake(pipe, &pipe->producer_waiting);
+}
+
+/**
+ * Waits for the consumer to free a slot (the ring is full)
+ */
+static void pipe_wait_room(HighlightPipe *pipe)
+{
+    int i;
+
+    pipe_publish_tail(pipe);
+    for (i = 0; i < PIPE_SPINS; i++) {
+        pipe->producer_head = __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE);
+        if (pipe->producer_tail - pipe->producer_head <= pipe->mask) {
+            return;
+        }
+        sched_yield();
+    }
+    pthread_mutex_lock(&pipe->lock);
+    __atomic_store_n(&pipe->producer_waiting, true, __ATOMIC_SEQ_CST);
+    while (pipe->producer_tail - (pipe->producer_head = __atomic_load_n(&pipe->head, __ATOMIC_SEQ_CST)) > pipe->mask) {
+        pthread_cond_wait(&pipe->moved, &pipe->lock);
+    }
+    __atomic_store_n(&pipe->producer_waiting, false, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+/**
+ * Waits for the producer to publish new events (the ring is empty)
+ */
+static void pipe_wait_events(HighlightPipe *pipe)
+{
+    int i;
+
+    pipe_publish_head(pipe);
+    for (i = 0; i < PIPE_SPINS; i++) {
+        pipe->consumer_tail = __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE);
+        if (pipe->consumer_tail != pipe->consumer_head) {
+            return;
+        }
+        sched_yield();
+    }
+    pthread_mutex_lock(&pipe->lock);
+    __atomic_store_n(&pipe->consumer_waiting, true, __ATOMIC_SEQ_CST);
+    while ((pipe->consumer_tail = __atomic_load_n(&pipe->tail, __ATOMIC_SEQ_CST)) == pipe->consumer_head) {
+        pthread_cond_wait(&pipe->moved, &pipe->lock);
+    }
+    __atomic_store_n(&pipe->consumer_waiting, false, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+static void pipe_push(HighlightPipe *pipe, int op, int token, const char *ptr, size_t len)
+{
+    PipeEvent *event;
+
+    if (pipe->producer_tail - pipe->producer_head > pipe->mask) {
+        pipe_wait_room(pipe);
+    }
+    event = &pipe->events[pipe->producer_tail & pipe->mask];
+    event->op = op;
+    event->token = token;
+    event->ptr = ptr;
+    event->len = len;
+    if (0 == (++pipe->producer_tail % PIPE_PUBLISH_INTERVAL)) {
+        pipe_publish_tail(pipe);
+    }
+}
+
+/* ========== recorder (lexing thread) ========== */
+
+#define RECORDER_PIPE(data) (((RecorderFormatterData *) (data))->pipe)
+
+static int recorder_start_document(String *UNUSED(out), FormatterData *data)
+{
+    pipe_push(RECORDER_PIPE(data), PIPE_START_DOCUMENT, 0, NULL, 0);
+
+    return 0;
+}
+
+static int recorder_end_document(String *UNUSED(out), FormatterData *data)
+{
+    pipe_push(RECORDER_PIPE(data), PIPE_END_DOCUMENT, 0, NULL, 0);
+
+    return 0;
+}
+
+static int recorder_start_token(int token, String *UNUSED(out), FormatterData *data)
+{
+    pipe_push(RECORDER_PIPE(data), PIPE_START_TOKEN, token, NULL, 0);
+
+    return 0;
+}
+
+static int recorder_end_token(int token, String *UNUSED(out), FormatterData *data)
+{
+    pipe_push(RECORDER_PIPE(data), PIPE_END_TOKEN, token, NULL, 0);
+
+    return 0;
+}
+
+static int recorder_write_token(String *UNUSED(out), const char *token, size_t token_len, FormatterData *data)
+{
+    pipe_push(RECORDER_PIPE(data), PIPE_WRITE_TOKEN, 0, token, token_len);
+
+    return 0;
+}
+
+static int recorder_start_lexing(const char *lexname, String *UNUSED(out), FormatterData *data)
+{
+    pipe_push(RECORDER_PIPE(data), PIPE_START_LEXING, 0, lexname, 0);
+
+    return 0;
+}
+
+static int recorder_end_lexing(const char *lexname, String *UNUSED(out), FormatterData *data)
+{
+    pipe_push(RECORDER_PIPE(data), PIPE_END_LEXING, 0, lexname, 0);
+
+    return 0;
+}
+
+/* ========== replay (formatting thread) ========== */
+
+static void pipe_drain(HighlightPipe *pipe, bool force)
+{
+    if (pipe->output->len > 0 && (force || pipe->output->len >= pipe->chunk_size)) {
+        if (!pipe->failed && 0 != pipe->sink->write(pipe->output->ptr, pipe->output->len, pipe->sink->data)) {
+            __atomic_store_n(&pipe->failed, true, __ATOMIC_RELAXED);
+        }
+        pipe->sent += pipe->output->len;
+        string_truncate(pipe->output);
+    }
+    __atomic_store_n(&pipe->output_len, pipe->sent + pipe->output->len, __ATOMIC_RELAXED);
+}
+
+/**
+ * Calls the callback of the real formatter recorded by event
+ */
+static void pipe_replay(HighlightPipe *pipe, const PipeEvent *event)
+{
+    Formatter *fmt;
+
+    fmt = pipe->fmt;
+    switch (event->op) {
+        case PIPE_START_DOCUMENT:
+            fmt->imp->start_document(pipe->output, &fmt->optvals);
+            break;
+        case PIPE_END_DOCUMENT:
+            fmt->imp->end_document(pipe->output, &fmt->optvals);
+            break;
+        case PIPE_START_TOKEN:
+            fmt->imp->start_token(event->token, pipe->output, &fmt->optvals);
+            break;
+        case PIPE_END_TOKEN:
+            fmt->imp->end_token(event->token, pipe->output, &fmt->optvals);
+            break;
+        case PIPE_WRITE_TOKEN:
+            fmt->imp->write_token(pipe->output, event->ptr, event->len, &fmt->optvals);
+            break;
+        case PIPE_START_LEXING:
+            fmt->imp->start_lexing(event->ptr, pipe->output, &fmt->optvals);
+            break;
+        case PIPE_END_LEXING:
+            fmt->imp->end_lexing(event->ptr, pipe->output, &fmt->optvals);
+            break;
+    }
+}
+
+static void *pipe_thread(void *arg)
+{
+    bool eof;
+    HighlightPipe *pipe;
+
+    eof = false;
+    pipe = (HighlightPipe *) arg;
+    while (!eof) {
+        if (pipe->consumer_head == pipe->consumer_tail) {
+            pipe_drain(pipe, false);
+            pipe_wait_events(pipe);
+        }
+        do {
+            const PipeEvent *event;
+
+            event = &pipe->events[pipe->consumer_head & pipe->mask];
+            if (PIPE_EOF == event->op) {
+                eof = true;
+            } else if (!pipe->failed) {
+                pipe_replay(pipe, event);
+            }
+            if (0 == (++pipe->consumer_head % PIPE_PUBLISH_INTERVAL)) {
+                pipe_publish_head(pipe);
+                pipe_drain(pipe, false);
+            }
+        } while (!eof && pipe->consumer_head != pipe->consumer_tail);
+    }
+    pipe_drain(pipe, true);
+
+    return NULL;
+}
+
+/* ========== lexing thread's interface ========== */
+
+/**
+ * Starts the formatting thread of a document
+ *
+ * @param sink where the output goes
+ * @param fmt the formatter which makes this output
+ * @param capacity the size of the ring, in events (0 for the default)
+ *
+ * @return NULL if the thread can't be created
+ */
+HighlightPipe *highlight_pipe_start(const HighlightSink *sink, Formatter *fmt, size_t capacity)
+{
+    HighlightPipe *pipe;
+    const FormatterImplementation *imp;
+
+    if (0 == capacity) {
+        capacity = DEFAULT_PIPE_CAPACITY;
+    }
+    pipe = malloc(sizeof(*pipe));
+    bzero(pipe, sizeof(*pipe));
+    for (pipe->mask = 1; pipe->mask < capacity; pipe->mask <<= 1)
+        ;
+    pipe->events = malloc(pipe->mask * sizeof(*pipe->events));
+    --pipe->mask;
+    pipe->fmt = fmt;
+    pipe->sink = sink;
+    pipe->chunk_size = 0 == sink->chunk_size ? DEFAULT_PIPE_CHUNK_SIZE : sink->chunk_size;
+    pipe->output = string_new();
+    // the optional callbacks of the recorder are the ones of fmt: highlight.c checks their presence
+    imp = fmt->imp;
+    pipe->recorder_imp.name = imp->name;
+    pipe->recorder_imp.docstr = imp->docstr;
+    pipe->recorder_imp.get_option_ptr = formatter_implementation_default_get_option_ptr;
+    pipe->recorder_imp.start_document = NULL == imp->start_document ? NULL : recorder_start_document;
+    pipe->recorder_imp.end_document = NULL == imp->end_document ? NULL : recorder_end_document;
+    pipe->recorder_imp.start_token = recorder_start_token;
+    pipe->recorder_imp.end_token = recorder_end_token;
+    pipe->recorder_imp.write_token = recorder_write_token;
+    pipe->recorder_imp.start_lexing = NULL == imp->start_lexing ? NULL : recorder_start_lexing;
+    pipe->recorder_imp.end_lexing = NULL == imp->end_lexing ? NULL : recorder_end_lexing;
+    pipe->recorder_imp.data_size = sizeof(RecorderFormatterData);
+    pipe->recorder = formatter_create(&pipe->recorder_imp);
+    RECORDER_PIPE(&pipe->recorder->optvals) = pipe;
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->moved, NULL);
+    if (0 != pthread_create(&pipe->thread, NULL, pipe_thread, pipe)) {
+        pthread_cond_destroy(&pipe->moved);
+        pthread_mutex_destroy(&pipe->lock);
+        formatter_destroy(pipe->recorder);
+        string_destroy(pipe->output);
+        free(pipe->events);
+        free(pipe);
+        pipe = NULL;
+    }
+
+    return pipe;
+}
+
+/**
+ * @return the formatter to give to the lexing loop
+ */
+Formatter *highlight_pipe_formatter(HighlightPipe *pipe)
+{
+    return pipe->recorder;
+}
+
+/**
+ * @return true if the sink failed (lexing should stop)
+ */
+bool highlight_pipe_failed(HighlightPipe *pipe)
+{
+    return __atomic_load_n(&pipe->failed, __ATOMIC_RELAXED);
+}
+
+/**
+ * @return the size of the output produced so far by the formatting thread
+ * (which is behind the lexing one by up to the size of the ring)
+ */
+size_t highlight_pipe_output_len(HighlightPipe *pipe)
+{
+    return __atomic_load_n(&pipe->output_len, __ATOMIC_RELAXED);
+}
+
+/**
+ * Waits for the formatting thread to process all the events then frees
+ * the pipe
+ *
+ * @param output_len if not NULL, set to the size of the whole output
+ *
+ * @return false if the sink failed
+ */
+bool highlight_pipe_finish(HighlightPipe *pipe, size_t *output_len)
+{
+    bool ok;
+
+    pipe_push(pipe, PIPE_EOF, 0, NULL, 0);
+    pipe_publish_tail(pipe);
+    pthread_join(pipe->thread, NULL);
+    ok = !pipe->failed;
+    if (NULL != output_len) {
+        *output_len = pipe->sent;
+    }
+    pthread_cond_destroy(&pipe->moved);
+    pthread_mutex_destroy(&pipe->lock);
+    formatter_destroy(pipe->recorder);
+    string_destroy(pipe->output);
+    free(pipe->events);
+    free(pipe);
+
+    return ok;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "shall.h"
+
+typedef struct HighlightPipe HighlightPipe;
+
+HighlightPipe *highlight_pipe_start(const HighlightSink *, Formatter *, size_t);
+Formatter *highlight_pipe_formatter(HighlightPipe *);
+bool highlight_pipe_failed(HighlightPipe *);
+size_t highlight_pipe_output_len(HighlightPipe *);
+bool highlight_pipe_finish(HighlightPipe *, size_t *);
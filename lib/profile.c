@@ -0,0 +1,77 @@
+/**
+ * @file lib/profile.c
+ * @brief per rule and per state counters of the re2c lexers
+ *
+ * When shall is built with the PROFILING option (the WITH_PROFILING macro),
+ * the actions of the rules (the TOKEN, VALUED_TOKEN, DELEGATE_* and DONE
+ * macros of lexer.h) and the states (YYDEBUG) of the re2c lexers count
+ * how many times they are hit. Each of them owns a static LexerProfileSite
+ * which registers itself the first time it is hit: the cost, per hit, is
+ * an increment and no lookup. Time is measured for the whole call to the
+ * yylex function of the lexer and charged to the rule it returned from.
+ *
+ * Counters are global and not protected: only profile single threaded
+ * programs, such as shallprof.
+ *
+ * Without the PROFILING option, nothing is instrumented and these functions
+ * have nothing to report.
+ */
+
+#include <stddef.h>
+
+#include "cpp.h"
+#include "profile_internal.h"
+
+// the rules and states hit at least once since the beginning
+static LexerProfileSite *sites;
+
+/**
+ * @return true if shall was built with the PROFILING option
+ */
+SHALL_API bool lexer_profile_available(void)
+{
+#ifdef WITH_PROFILING
+    return true;
+#else
+    return false;
+#endif /* WITH_PROFILING */
+}
+
+/**
+ * Resets all counters to 0
+ */
+SHALL_API void lexer_profile_reset(void)
+{
+    LexerProfileSite *site;
+
+    for (site = sites; NULL != site; site = site->next) {
+        site->entry.hits = site->entry.bytes = site->entry.time_ns = 0;
+    }
+}
+
+/**
+ * Executes the given callback for each rule and state which was hit
+ *
+ * @param cb the callback
+ * @param data an additionnal user data to pass on callback invocation
+ */
+SHALL_API void lexer_profile_each(void (*cb)(const LexerProfileEntry *, void *), void *data)
+{
+    LexerProfileSite *site;
+
+    for (site = sites; NULL != site; site = site->next) {
+        if (0 != site->entry.hits) {
+            cb(&site->entry, data);
+        }
+    }
+}
+
+/**
+ * Adds a rule or a state to the ones to report, on its first hit
+ */
+void lexer_profile_register(LexerProfileSite *site)
+{
+    site->registered = true;
+    site->next = sites;
+    sites = site;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "profile.h"
+
+typedef struct LexerProfileSite LexerProfileSite;
+
+/**
+ * A rule or a state of a lexer, statically allocated where it is
+ * instrumented (see PROFILE_RULE and PROFILE_STATE in lexer.h)
+ */
+struct LexerProfileSite {
+    LexerProfileEntry entry;
+    LexerProfileSite *next;
+    bool registered;
+};
+
+void lexer_profile_register(LexerProfileSite *);
@@ -0,0 +1,259 @@
+/**
+ * @file lib/stats.c
+ * @brief counters of what happens inside highlight_string and friends
+ *
+ * Statistics are only collected for the threads which bind a HighlightStats
+ * (highlight_stats_bind). Otherwise, highlight_string only pays for a test
+ * of a NULL pointer per token. A HighlightStats is not meant to be used by
+ * several threads at the same time: give each thread its own one then
+ * merge them (highlight_stats_merge).
+ *
+ * Example:
+ * \code
+ *   HighlightStats *stats;
+ *   HighlightStatsTotals totals;
+ *
+ *   stats = highlight_stats_create();
+ *   highlight_stats_bind(stats);
+ *   highlight_string(...);
+ *   highlight_stats_bind(NULL);
+ *   highlight_stats_totals(stats, &totals);
+ *   printf("%" PRIu64 " tokens\n", totals.tokens);
+ *   highlight_stats_destroy(stats);
+ * \endcode
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpp.h"
+#include "stats_internal.h"
+
+#ifdef _MSC_VER
+# define THREAD_LOCAL __declspec(thread)
+#else
+# define THREAD_LOCAL __thread
+#endif /* _MSC_VER */
+
+typedef struct {
+    const LexerImplementation *imp;
+    HighlightLexerStats stats;
+} LexerStatsEntry;
+
+struct HighlightStats {
+    HighlightStatsTotals totals;
+    // one entry for each lexer implementation which was used
+    LexerStatsEntry *lexers;
+    size_t lexers_len;
+    size_t lexers_size;
+};
+
+static THREAD_LOCAL HighlightStats *bound;
+
+/**
+ * Creates a new set of counters
+ *
+ * @return the counters, all at 0
+ */
+SHALL_API HighlightStats *highlight_stats_create(void)
+{
+    HighlightStats *stats;
+
+    stats = malloc(sizeof(*stats));
+    bzero(stats, sizeof(*stats));
+
+    return stats;
+}
+
+/**
+ * Destroys a set of counters (it is unbound first if bound to the
+ * current thread)
+ *
+ * @param stats the counters to free
+ */
+SHALL_API void highlight_stats_destroy(HighlightStats *stats)
+{
+    if (stats == bound) {
+        bound = NULL;
+    }
+    free(stats->lexers);
+    free(stats);
+}
+
+/**
+ * Resets all counters to 0
+ *
+ * @param stats the counters
+ */
+SHALL_API void highlight_stats_reset(HighlightStats *stats)
+{
+    bzero(&stats->totals, sizeof(stats->totals));
+    stats->lexers_len = 0;
+}
+
+/**
+ * Adds the counters of *src* to the ones of *dst*
+ *
+ * @param dst the counters to increment
+ * @param src the counters to add
+ */
+SHALL_API void highlight_stats_merge(HighlightStats *dst, const HighlightStats *src)
+{
+    size_t i;
+
+    dst->totals.documents += src->totals.documents;
+    dst->totals.bytes_in += src->totals.bytes_in;
+    dst->totals.bytes_out += src->totals.bytes_out;
+    dst->totals.tokens += src->totals.tokens;
+    dst->totals.delegations += src->totals.delegations;
+    dst->totals.flushes += src->totals.flushes;
+    dst->totals.parser_fallbacks += src->totals.parser_fallbacks;
+    dst->totals.cursor_resets += src->totals.cursor_resets;
+    dst->totals.bytes_rescanned += src->totals.bytes_rescanned;
+    dst->totals.peak_buffer = MAX(dst->totals.peak_buffer, src->totals.peak_buffer);
+    dst->totals.resyncs += src->totals.resyncs;
+    dst->totals.resync_misses += src->totals.resync_misses;
+    dst->totals.time_ns += src->totals.time_ns;
+    dst->totals.format_ns += src->totals.format_ns;
+    for (i = 0; i < src->lexers_len; i++) {
+        HighlightLexerStats *ls;
+
+        ls = highlight_stats_lexer_ptr(dst, src->lexers[i].imp);
+        ls->tokens += src->lexers[i].stats.tokens;
+        ls->bytes += src->lexers[i].stats.bytes;
+        ls->delegations += src->lexers[i].stats.delegations;
+        ls->time_ns += src->lexers[i].stats.time_ns;
+    }
+}
+
+/**
+ * Sets the counters which the next highlightings done by the calling thread
+ * will increment
+ *
+ * @param stats the counters, NULL to stop collecting statistics
+ *
+ * @return the counters previously bound to the current thread (NULL if none)
+ */
+SHALL_API HighlightStats *highlight_stats_bind(HighlightStats *stats)
+{
+    HighlightStats *previous;
+
+    previous = bound;
+    bound = stats;
+
+    return previous;
+}
+
+/**
+ * Gets the global counters
+ *
+ * @param stats the counters
+ * @param totals the structure to fill
+ */
+SHALL_API void highlight_stats_totals(const HighlightStats *stats, HighlightStatsTotals *totals)
+{
+    *totals = stats->totals;
+}
+
+/**
+ * Gets the counters of a lexer implementation
+ *
+ * @param stats the counters
+ * @param imp the lexer implementation
+ * @param ls the structure to fill (all 0 if this lexer was not used)
+ */
+SHALL_API void highlight_stats_lexer(const HighlightStats *stats, const LexerImplementation *imp, HighlightLexerStats *ls)
+{
+    size_t i;
+
+    bzero(ls, sizeof(*ls));
+    for (i = 0; i < stats->lexers_len; i++) {
+        if (imp == stats->lexers[i].imp) {
+            *ls = stats->lexers[i].stats;
+            break;
+        }
+    }
+}
+
+/**
+ * Executes the given callback for each lexer implementation which was used
+ *
+ * @param stats the counters
+ * @param cb the callback
+ * @param data an additionnal user data to pass on callback invocation
+ */
+SHALL_API void highlight_stats_each_lexer(const HighlightStats *stats, void (*cb)(const LexerImplementation *, const HighlightLexerStats *, void *), void *data)
+{
+    size_t i;
+
+    for (i = 0; i < stats->lexers_len; i++) {
+        cb(stats->lexers[i].imp, &stats->lexers[i].stats, data);
+    }
+}
+
+/**
+ * @return the counters bound to the current thread (NULL if none)
+ */
+HighlightStats *highlight_stats_bound(void)
+{
+    return bound;
+}
+
+/**
+ * Counts a move backward of the cursor (a no-op if no statistics are collected)
+ *
+ * @param bytes the distance, in bytes, of the move
+ */
+void highlight_stats_rescan(size_t bytes)
+{
+    if (NULL != bound && 0 != bytes) {
+        ++bound->totals.cursor_resets;
+        bound->totals.bytes_rescanned += bytes;
+    }
+}
+
+/**
+ * Counts a chunk lexed from a guessed state (a no-op if no statistics are collected)
+ *
+ * @param hit false if the guess was wrong
+ */
+void highlight_stats_resync(bool hit)
+{
+    if (NULL != bound) {
+        ++bound->totals.resyncs;
+        if (!hit) {
+            ++bound->totals.resync_misses;
+        }
+    }
+}
+
+/**
+ * @return the global counters, to increment
+ */
+HighlightStatsTotals *highlight_stats_totals_ptr(HighlightStats *stats)
+{
+    return &stats->totals;
+}
+
+/**
+ * @return the counters of a lexer implementation, to increment (added if
+ * it was not yet used)
+ */
+HighlightLexerStats *highlight_stats_lexer_ptr(HighlightStats *stats, const LexerImplementation *imp)
+{
+    size_t i;
+
+    for (i = 0; i < stats->lexers_len; i++) {
+        if (imp == stats->lexers[i].imp) {
+            return &stats->lexers[i].stats;
+        }
+    }
+    if (stats->lexers_len >= stats->lexers_size) {
+        stats->lexers_size = 0 == stats->lexers_size ? 8 : stats->lexers_size * 2;
+        stats->lexers = realloc(stats->lexers, stats->lexers_size * sizeof(*stats->lexers));
+    }
+    stats->lexers[stats->lexers_len].imp = imp;
+    bzero(&stats->lexers[stats->lexers_len].stats, sizeof(stats->lexers[stats->lexers_len].stats));
+
+    return &stats->lexers[stats->lexers_len++].stats;
+}
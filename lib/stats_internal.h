@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "stats.h"
+
+HighlightStats *highlight_stats_bound(void);
+void highlight_stats_rescan(size_t);
+void highlight_stats_resync(bool);
+HighlightStatsTotals *highlight_stats_totals_ptr(HighlightStats *);
+HighlightLexerStats *highlight_stats_lexer_ptr(HighlightStats *, const LexerImplementation *);
@@ -0,0 +1,118 @@
+/**
+ * @file lib/themegen.c
+ * @brief build tool which writes the data precomputed for the builtin themes:
+ * their palettes (builtin_palettes) and their style sheets (builtin_css)
+ *
+ * Usage: themegen <output file>
+ *
+ * The C symbol of each builtin theme has to be its name in lowercase.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <inttypes.h>
+
+#include "cpp.h"
+#include "palette.h"
+#include "themes_builtin.h"
+
+// the ones we are about to compute
+const ThemePalette builtin_palettes[] = {
+    { NULL, { { { 0 } } } }
+};
+
+const ThemeCSS builtin_css[] = {
+    { NULL, NULL }
+};
+
+static void print_theme_symbol(const Theme *theme, FILE *fp)
+{
+    const char *p;
+
+    for (p = theme_name(theme); '\0' != *p; p++) {
+        fputc(tolower((unsigned char) *p), fp);
+    }
+}
+
+static void print_theme_extern(const Theme *theme, void *data)
+{
+    FILE *fp;
+
+    fp = (FILE *) data;
+    fputs("extern const Theme ", fp);
+    print_theme_symbol(theme, fp);
+    fputs(";\n", fp);
+}
+
+static void print_theme_palette(const Theme *theme, void *data)
+{
+    int p;
+    size_t i;
+    FILE *fp;
+    ThemePalette tp;
+
+    fp = (FILE *) data;
+    theme_palette_build(theme, &tp);
+    fputs("    {\n        &", fp);
+    print_theme_symbol(theme, fp);
+    fputs(",\n        {\n", fp);
+    for (p = 0; p < _PALETTE_COUNT; p++) {
+        fputs("            {\n", fp);
+        for (i = 0; i < _TOKEN_COUNT; i++) {
+            if (theme->styles[i].fg_set || theme->styles[i].bg_set) {
+                fprintf(fp, "                [ %s ] = { %" PRIu8 ", %" PRIu8 " },\n", tokens[i].name, tp.styles[p][i].fg, tp.styles[p][i].bg);
+            }
+        }
+        fputs("            },\n", fp);
+    }
+    fputs("        }\n    },\n", fp);
+}
+
+static void print_theme_css(const Theme *theme, void *data)
+{
+    FILE *fp;
+    char *css, *p;
+
+    fp = (FILE *) data;
+    css = theme_export_as_css(theme, NULL, true);
+    fputs("    {\n        &", fp);
+    print_theme_symbol(theme, fp);
+    fputs(",\n        \"", fp);
+    for (p = css; '\0' != *p; p++) {
+        if ('\n' == *p) {
+            fputs(p[1] ? "\\n\"\n        \"" : "\\n", fp);
+        } else {
+            if ('"' == *p || '\\' == *p) {
+                fputc('\\', fp);
+            }
+            fputc(*p, fp);
+        }
+    }
+    fputs("\"\n    },\n", fp);
+    free(css);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *fp;
+
+    if (2 != argc) {
+        fprintf(stderr, "usage: %s <output file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (NULL == (fp = fopen(argv[1], "w"))) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    fputs("/* generated by themegen, do not edit */\n\n#include \"palette.h\"\n#include \"themes_builtin.h\"\n\n", fp);
+    theme_each(print_theme_extern, fp);
+    fputs("\nconst ThemePalette builtin_palettes[] = {\n", fp);
+    theme_each(print_theme_palette, fp);
+    fputs("    { NULL, { { { 0 } } } }\n};\n", fp);
+    fputs("\nconst ThemeCSS builtin_css[] = {\n", fp);
+    theme_each(print_theme_css, fp);
+    fputs("    { NULL, NULL }\n};\n", fp);
+
+    return 0 == fclose(fp) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
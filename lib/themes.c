@@ -10,6 +10,7 @@
 #include "themes.h"
 #include "xtring.h"
 #include "hashtable.h"
+#include "themes_builtin.h"
 
 extern SHALL_API const Theme monokai;
 extern SHALL_API const Theme molokai;
@@ -167,15 +168,38 @@ static ht_hash_t hash_style(const Style *style)
 }
 
 /**
- * Generates CSS for a theme
+ * Get the precomputed style sheet of a builtin theme
+ *
+ * @param theme the theme
+ *
+ * @return NULL if theme is not a builtin one or the result of
+ * theme_export_as_css(theme, NULL, true) (not to free)
+ */
+const char *theme_builtin_css(const Theme *theme)
+{
+    const ThemeCSS *tc;
+
+    for (tc = builtin_css; NULL != tc->theme; tc++) {
+        if (theme == tc->theme) {
+            return tc->css;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Generates CSS for the styles of a theme used by some token types
  *
  * @param theme
  * @param scope
- * 
+ * @param pretty_print
+ * @param used an array of _TOKEN_COUNT elements, true for the token types
+ * to include (NULL for all of them)
+ *
  * @return a string describing the theme in CSS format
- * @todo boolean option to skip background colors
  */
-SHALL_API char *theme_export_as_css(const Theme *theme, const char *scope, bool pretty_print)
+SHALL_API char *theme_export_as_css_for_tokens(const Theme *theme, const char *scope, bool pretty_print, const bool *used)
 {
     size_t i, j;
     String *buffer;
@@ -189,7 +213,7 @@ SHALL_API char *theme_export_as_css(const Theme *theme, const char *scope, bool
         for (j = 0; j < _TOKEN_COUNT; j++) {
             grouped[i][j] = -1;
         }
-        if (' ' != *tokens[i].cssclass && 0 != theme->styles[i].flags) {
+        if (' ' != *tokens[i].cssclass && 0 != theme->styles[i].flags && (NULL == used || used[i])) {
             int **ptr;
 
             ptr = NULL;
@@ -243,3 +267,24 @@ SHALL_API char *theme_export_as_css(const Theme *theme, const char *scope, bool
 
     return string_orphan(buffer);
 }
+
+/**
+ * Generates CSS for a theme
+ *
+ * @param theme
+ * @param scope
+ * 
+ * @return a string describing the theme in CSS format
+ * @todo boolean option to skip background colors
+ */
+SHALL_API char *theme_export_as_css(const Theme *theme, const char *scope, bool pretty_print)
+{
+    const char *css;
+
+    // the one of builtin themes is generated at build time
+    if (NULL == scope && pretty_print && NULL != (css = theme_builtin_css(theme))) {
+        return strdup(css);
+    }
+
+    return theme_export_as_css_for_tokens(theme, scope, pretty_print, NULL);
+}
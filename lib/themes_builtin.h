@@ -0,0 +1,17 @@
+#pragma once
+
+#include "themes.h"
+
+/**
+ * The style sheet of a builtin theme
+ */
+typedef struct {
+    const Theme *theme;
+    // the result of theme_export_as_css(theme, NULL, true)
+    const char *css;
+} ThemeCSS;
+
+// the style sheets of the builtin themes, generated at build time (terminated by an entry where theme is NULL)
+extern const ThemeCSS builtin_css[];
+
+const char *theme_builtin_css(const Theme *);
@@ -0,0 +1,194 @@
+/**
+ * @file lib/tokenize.c
+ * @brief tokens of a string, without formatting
+ *
+ * highlight_tokens runs the lexers as highlight_string does but, instead of
+ * generating an output, keeps the type and the position in the source of
+ * each token. Tokens are stored by chunks of TOKENS_CHUNK_SIZE: they are
+ * never moved once added and a binding can walk through them, chunk by
+ * chunk, without copying them all at once.
+ *
+ * Example:
+ * \code
+ *   size_t c, i, len;
+ *   HighlightTokens *found;
+ *   const HighlightToken *chunk;
+ *
+ *   highlight_tokens(src, src_len, &found, 1, &lexer);
+ *   for (c = 0; NULL != (chunk = highlight_tokens_chunk(found, c, &len)); c++) {
+ *       for (i = 0; i < len; i++) {
+ *           printf("%s: %zu-%zu\n", tokens[chunk[i].type].name, chunk[i].start, chunk[i].end);
+ *       }
+ *   }
+ *   highlight_tokens_destroy(found);
+ * \endcode
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpp.h"
+#include "formatter.h"
+#include "tokenize.h"
+
+#define TOKENS_CHUNK_SIZE 4096
+
+struct HighlightTokens {
+    // the chunks, all full but the last one
+    HighlightToken **chunks;
+    size_t chunks_len;
+    size_t chunks_size;
+    // number of tokens in the last chunk
+    size_t last_len;
+};
+
+typedef struct {
+    HighlightTokens *tokens;
+    const char *src;
+    size_t src_len;
+    int type;
+} TokensFormatterData;
+
+static void tokens_append(HighlightTokens *tokens, int type, size_t start, size_t end)
+{
+    HighlightToken *token;
+
+    if (0 == tokens->chunks_len || TOKENS_CHUNK_SIZE == tokens->last_len) {
+        if (tokens->chunks_len >= tokens->chunks_size) {
+            tokens->chunks_size = 0 == tokens->chunks_size ? 8 : tokens->chunks_size * 2;
+            tokens->chunks = realloc(tokens->chunks, tokens->chunks_size * sizeof(*tokens->chunks));
+        }
+        tokens->chunks[tokens->chunks_len++] = malloc(TOKENS_CHUNK_SIZE * sizeof(**tokens->chunks));
+        tokens->last_len = 0;
+    }
+    token = &tokens->chunks[tokens->chunks_len - 1][tokens->last_len++];
+    token->type = type;
+    token->start = start;
+    token->end = end;
+}
+
+static int tokens_start_token(int token, String *UNUSED(out), FormatterData *data)
+{
+    TokensFormatterData *mydata;
+
+    mydata = (TokensFormatterData *) data;
+    mydata->type = token;
+
+    return 0;
+}
+
+static int tokens_end_token(int UNUSED(token), String *UNUSED(out), FormatterData *UNUSED(data))
+{
+    return 0;
+}
+
+static int tokens_write_token(String *UNUSED(out), const char *token, size_t token_len, FormatterData *data)
+{
+    TokensFormatterData *mydata;
+
+    mydata = (TokensFormatterData *) data;
+    // every token is a part of the source, the test is only a safety net
+    if (token >= mydata->src && token + token_len <= mydata->src + mydata->src_len) {
+        tokens_append(mydata->tokens, mydata->type, token - mydata->src, token - mydata->src + token_len);
+    }
+
+    return 0;
+}
+
+/**
+ * A formatter which writes nothing but keeps the tokens
+ */
+static const FormatterImplementation tokensfmt = {
+    "Tokens", // unused
+    "", // unused
+    formatter_implementation_default_get_option_ptr,
+    NULL,
+    NULL,
+    tokens_start_token,
+    tokens_end_token,
+    tokens_write_token,
+    NULL,
+    NULL,
+    NULL,
+    sizeof(TokensFormatterData),
+    NULL
+};
+
+/**
+ * Tokenizes a string according to given lexer(s)
+ *
+ * @param src the input string
+ * @param src_len its length
+ * @param tokens the tokens found, to free with highlight_tokens_destroy
+ * @param lexerc the number of lexers in lexerv (have to >= 1)
+ * @param lexerv an array of lexers to tokenize the input string
+ * (the top lexer have to be at index 0)
+ *
+ * @return zero if successfull (see highlight_string)
+ */
+SHALL_API int highlight_tokens(const char *src, size_t src_len, HighlightTokens **tokens, size_t lexerc, Lexer **lexerv)
+{
+    int ret;
+    char *dest;
+    Formatter *fmt;
+    TokensFormatterData *mydata;
+
+    *tokens = malloc(sizeof(**tokens));
+    bzero(*tokens, sizeof(**tokens));
+    fmt = formatter_create(&tokensfmt);
+    mydata = (TokensFormatterData *) &fmt->optvals;
+    mydata->tokens = *tokens;
+    mydata->src = src;
+    mydata->src_len = src_len;
+    ret = highlight_string(src, src_len, &dest, NULL, fmt, lexerc, lexerv);
+    free(dest);
+    formatter_destroy(fmt);
+
+    return ret;
+}
+
+/**
+ * Frees the tokens found by highlight_tokens
+ *
+ * @param tokens the tokens
+ */
+SHALL_API void highlight_tokens_destroy(HighlightTokens *tokens)
+{
+    size_t i;
+
+    for (i = 0; i < tokens->chunks_len; i++) {
+        free(tokens->chunks[i]);
+    }
+    free(tokens->chunks);
+    free(tokens);
+}
+
+/**
+ * @param tokens the tokens found by highlight_tokens
+ *
+ * @return the number of tokens
+ */
+SHALL_API size_t highlight_tokens_count(const HighlightTokens *tokens)
+{
+    return 0 == tokens->chunks_len ? 0 : (tokens->chunks_len - 1) * TOKENS_CHUNK_SIZE + tokens->last_len;
+}
+
+/**
+ * Gets a chunk of the tokens found by highlight_tokens
+ *
+ * @param tokens the tokens
+ * @param index the number of the chunk (the first one is 0)
+ * @param len the number of tokens in the chunk
+ *
+ * @return the tokens of the chunk or NULL if index is out of range
+ */
+SHALL_API const HighlightToken *highlight_tokens_chunk(const HighlightTokens *tokens, size_t index, size_t *len)
+{
+    if (index >= tokens->chunks_len) {
+        *len = 0;
+        return NULL;
+    }
+    *len = index == tokens->chunks_len - 1 ? tokens->last_len : TOKENS_CHUNK_SIZE;
+
+    return tokens->chunks[index];
+}
@@ -0,0 +1,416 @@
+/**
+ * @file lib/trace.c
+ * @brief tracing of the tokens produced by the lexers
+ *
+ * A HighlightTrace keeps the last tokens produced by the lexers in a ring
+ * buffer: for each of them, its position and length, its type, the lexer
+ * which produced it and the line of the rule which matched it. It tells
+ * which rule fires in a loop or a lexer gets wrong on a given input
+ * without a DEBUG build.
+ *
+ * As statistics (see lib/stats.c), tokens are only traced for the threads
+ * which bind a HighlightTrace (highlight_trace_bind). Give each thread its
+ * own one then merge them (highlight_trace_merge).
+ *
+ * A trace is saved by highlight_trace_write then loaded back, for example
+ * by shalltrace, with highlight_trace_read. The format of the file is, all
+ * integers being little endian:
+ * - the magic string "SHALLTRC" and a version (32 bits)
+ * - the number of tokens traced (64 bits), which may be greater than the
+ *   number of records kept
+ * - the number of records (32 bits)
+ * - the number of lexers (8 bits) then, for each of them, the length of
+ *   its name (8 bits) followed by the name itself
+ * - the records, from the oldest to the most recent, of 16 bytes each:
+ *   offset (32 bits), length (32 bits), line (32 bits), document (16 bits),
+ *   type and lexer (8 bits each)
+ *
+ * Example:
+ * \code
+ *   FILE *fp;
+ *   HighlightTrace *trace;
+ *
+ *   trace = highlight_trace_create(0);
+ *   highlight_trace_bind(trace);
+ *   highlight_string(...);
+ *   highlight_trace_bind(NULL);
+ *   if (NULL != (fp = fopen("shall.trace", "wb"))) {
+ *       highlight_trace_write(trace, fp);
+ *       fclose(fp);
+ *   }
+ *   highlight_trace_destroy(trace);
+ * \endcode
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpp.h"
+#include "nearest_power.h"
+#include "lexer.h"
+#include "trace_internal.h"
+
+#ifdef _MSC_VER
+# define THREAD_LOCAL __declspec(thread)
+#else
+# define THREAD_LOCAL __thread
+#endif /* _MSC_VER */
+
+#define TRACE_MAGIC "SHALLTRC"
+#define TRACE_VERSION 1
+#define TRACE_RECORD_SIZE 16
+#define TRACE_DEFAULT_CAPACITY 65536
+
+struct HighlightTrace {
+    HighlightTraceRecord *records;
+    // capacity - 1 (the capacity is a power of 2)
+    size_t mask;
+    // number of tokens traced since its creation or last reset (only the last capacity ones are kept)
+    uint64_t count;
+    // number of documents started
+    uint64_t documents;
+    // the names of the lexers, indexed by their identifier
+    char *lexers[UINT8_MAX + 1];
+    size_t lexers_len;
+};
+
+static THREAD_LOCAL HighlightTrace *bound;
+
+/**
+ * Creates a new (empty) trace
+ *
+ * @param capacity the number of tokens to keep (rounded up to a power of 2),
+ * 0 for the default (65536)
+ *
+ * @return the trace
+ */
+SHALL_API HighlightTrace *highlight_trace_create(size_t capacity)
+{
+    HighlightTrace *trace;
+
+    trace = malloc(sizeof(*trace));
+    bzero(trace, sizeof(*trace));
+    capacity = nearest_power(0 == capacity ? TRACE_DEFAULT_CAPACITY : capacity, 2);
+    trace->records = malloc(capacity * sizeof(*trace->records));
+    trace->mask = capacity - 1;
+
+    return trace;
+}
+
+/**
+ * Destroys a trace (it is unbound first if bound to the current thread)
+ *
+ * @param trace the trace to free
+ */
+SHALL_API void highlight_trace_destroy(HighlightTrace *trace)
+{
+    size_t i;
+
+    if (trace == bound) {
+        bound = NULL;
+    }
+    for (i = 0; i < trace->lexers_len; i++) {
+        free(trace->lexers[i]);
+    }
+    free(trace->records);
+    free(trace);
+}
+
+/**
+ * Forgets all the tokens traced so far
+ *
+ * @param trace the trace
+ */
+SHALL_API void highlight_trace_reset(HighlightTrace *trace)
+{
+    trace->count = trace->documents = 0;
+}
+
+/**
+ * Gets the identifier of a lexer, from its name, in a trace
+ *
+ * @return the identifier (added if not yet known), the last one if there are
+ * already too many of them
+ */
+static uint8_t lexer_id(HighlightTrace *trace, const char *name, size_t name_len)
+{
+    size_t i;
+
+    for (i = 0; i < trace->lexers_len; i++) {
+        if (0 == strncmp(trace->lexers[i], name, name_len) && '\0' == trace->lexers[i][name_len]) {
+            return (uint8_t) i;
+        }
+    }
+    if (trace->lexers_len > UINT8_MAX) {
+        return UINT8_MAX;
+    }
+    trace->lexers[trace->lexers_len] = strndup(name, name_len);
+
+    return (uint8_t) trace->lexers_len++;
+}
+
+static HighlightTraceRecord *next_record(HighlightTrace *trace)
+{
+    return &trace->records[trace->count++ & trace->mask];
+}
+
+/**
+ * Appends the records of *src* to *dst*
+ *
+ * @param dst the trace to complete
+ * @param src the trace to add
+ */
+SHALL_API void highlight_trace_merge(HighlightTrace *dst, const HighlightTrace *src)
+{
+    size_t i;
+    uint64_t r, first;
+    uint8_t lexers[UINT8_MAX + 1];
+
+    for (i = 0; i < src->lexers_len; i++) {
+        lexers[i] = lexer_id(dst, src->lexers[i], strlen(src->lexers[i]));
+    }
+    first = src->count > src->mask ? src->count - src->mask - 1 : 0;
+    for (r = first; r < src->count; r++) {
+        HighlightTraceRecord *record;
+
+        record = next_record(dst);
+        *record = src->records[r & src->mask];
+        record->lexer = lexers[record->lexer];
+        record->document += dst->documents;
+    }
+    dst->documents += src->documents;
+}
+
+/**
+ * Sets the trace which the next highlightings done by the calling thread
+ * will record their tokens into
+ *
+ * @param trace the trace, NULL to stop tracing
+ *
+ * @return the trace previously bound to the current thread (NULL if none)
+ */
+SHALL_API HighlightTrace *highlight_trace_bind(HighlightTrace *trace)
+{
+    HighlightTrace *previous;
+
+    previous = bound;
+    bound = trace;
+
+    return previous;
+}
+
+/**
+ * @return the number of tokens traced (only the last ones, according to the
+ * capacity of the trace, are kept)
+ */
+SHALL_API uint64_t highlight_trace_count(const HighlightTrace *trace)
+{
+    return trace->count;
+}
+
+/**
+ * Gets the name of a lexer from its identifier
+ *
+ * @param trace the trace
+ * @param id the identifier of the lexer (HighlightTraceRecord.lexer)
+ *
+ * @return its name, NULL if unknown
+ */
+SHALL_API const char *highlight_trace_lexer_name(const HighlightTrace *trace, uint8_t id)
+{
+    return id < trace->lexers_len ? trace->lexers[id] : NULL;
+}
+
+/**
+ * Executes the given callback for each record kept, from the oldest to the
+ * most recent
+ *
+ * @param trace the trace
+ * @param cb the callback
+ * @param data an additionnal user data to pass on callback invocation
+ */
+SHALL_API void highlight_trace_each(const HighlightTrace *trace, void (*cb)(const HighlightTraceRecord *, void *), void *data)
+{
+    uint64_t r;
+
+    for (r = trace->count > trace->mask ? trace->count - trace->mask - 1 : 0; r < trace->count; r++) {
+        cb(&trace->records[r & trace->mask], data);
+    }
+}
+
+static void put_le(uint8_t *p, uint64_t value, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        p[i] = (value >> (i * 8)) & 0xFF;
+    }
+}
+
+static uint64_t get_le(const uint8_t *p, size_t size)
+{
+    size_t i;
+    uint64_t value;
+
+    for (value = 0, i = 0; i < size; i++) {
+        value |= (uint64_t) p[i] << (i * 8);
+    }
+
+    return value;
+}
+
+/**
+ * Saves a trace (see the format above)
+ *
+ * @param trace the trace
+ * @param fp the file to write into (opened in binary mode)
+ *
+ * @return false on error
+ */
+SHALL_API bool highlight_trace_write(const HighlightTrace *trace, FILE *fp)
+{
+    size_t i;
+    uint64_t r, first;
+    uint8_t header[STR_LEN(TRACE_MAGIC) + 4 + 8 + 4 + 1];
+
+    first = trace->count > trace->mask ? trace->count - trace->mask - 1 : 0;
+    memcpy(header, TRACE_MAGIC, STR_LEN(TRACE_MAGIC));
+    put_le(header + 8, TRACE_VERSION, 4);
+    put_le(header + 12, trace->count, 8);
+    put_le(header + 20, trace->count - first, 4);
+    header[24] = (uint8_t) trace->lexers_len;
+    if (1 != fwrite(header, sizeof(header), 1, fp)) {
+        return false;
+    }
+    for (i = 0; i < trace->lexers_len; i++) {
+        size_t name_len;
+
+        name_len = MIN(strlen(trace->lexers[i]), UINT8_MAX);
+        if (EOF == fputc((int) name_len, fp) || 1 != fwrite(trace->lexers[i], name_len, 1, fp)) {
+            return false;
+        }
+    }
+    for (r = first; r < trace->count; r++) {
+        uint8_t buffer[TRACE_RECORD_SIZE];
+        const HighlightTraceRecord *record;
+
+        record = &trace->records[r & trace->mask];
+        put_le(buffer, record->offset, 4);
+        put_le(buffer + 4, record->length, 4);
+        put_le(buffer + 8, record->line, 4);
+        put_le(buffer + 12, record->document, 2);
+        buffer[14] = record->type;
+        buffer[15] = record->lexer;
+        if (1 != fwrite(buffer, sizeof(buffer), 1, fp)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Loads a trace saved by highlight_trace_write
+ *
+ * @param fp the file to read (opened in binary mode)
+ *
+ * @return NULL if the file is not a valid trace else the trace, to destroy
+ */
+SHALL_API HighlightTrace *highlight_trace_read(FILE *fp)
+{
+    size_t i, lexers_len;
+    HighlightTrace *trace;
+    uint64_t r, count, records;
+    uint8_t header[STR_LEN(TRACE_MAGIC) + 4 + 8 + 4 + 1];
+
+    if (1 != fread(header, sizeof(header), 1, fp) || 0 != memcmp(header, TRACE_MAGIC, STR_LEN(TRACE_MAGIC)) || TRACE_VERSION != get_le(header + 8, 4)) {
+        return NULL;
+    }
+    count = get_le(header + 12, 8);
+    records = get_le(header + 20, 4);
+    lexers_len = header[24];
+    if (records > count) {
+        return NULL;
+    }
+    trace = highlight_trace_create(records);
+    for (i = 0; i < lexers_len; i++) {
+        int name_len;
+        char name[UINT8_MAX];
+
+        if (EOF == (name_len = fgetc(fp)) || (0 != name_len && 1 != fread(name, name_len, 1, fp))) {
+            highlight_trace_destroy(trace);
+            return NULL;
+        }
+        trace->lexers[trace->lexers_len++] = strndup(name, name_len);
+    }
+    for (r = 0; r < records; r++) {
+        uint8_t buffer[TRACE_RECORD_SIZE];
+        HighlightTraceRecord *record;
+
+        if (1 != fread(buffer, sizeof(buffer), 1, fp)) {
+            highlight_trace_destroy(trace);
+            return NULL;
+        }
+        record = next_record(trace);
+        record->offset = (uint32_t) get_le(buffer, 4);
+        record->length = (uint32_t) get_le(buffer + 4, 4);
+        record->line = (uint32_t) get_le(buffer + 8, 4);
+        record->document = (uint16_t) get_le(buffer + 12, 2);
+        record->type = buffer[14];
+        record->lexer = buffer[15];
+        if (record->document >= trace->documents) {
+            trace->documents = record->document + 1;
+        }
+    }
+    // the records which were overwritten when the trace was taken still count
+    trace->count = count;
+
+    return trace;
+}
+
+/**
+ * @return the trace bound to the current thread (NULL if none)
+ */
+HighlightTrace *highlight_trace_bound(void)
+{
+    return bound;
+}
+
+/**
+ * Marks the beginning of a new document: the next records belong to it
+ */
+void highlight_trace_start_document(HighlightTrace *trace)
+{
+    ++trace->documents;
+}
+
+/**
+ * @return the identifier of a lexer implementation in the trace
+ */
+uint8_t highlight_trace_lexer_id(HighlightTrace *trace, const LexerImplementation *imp)
+{
+    return lexer_id(trace, imp->name, strlen(imp->name));
+}
+
+/**
+ * Records a token
+ *
+ * @param trace the trace
+ * @param lexer the identifier of the lexer which produced it
+ * @param offset its position in the document
+ * @param length its length
+ * @param type its type
+ * @param line the line of the rule which matched it
+ */
+void highlight_trace_record(HighlightTrace *trace, uint8_t lexer, size_t offset, size_t length, int type, int line)
+{
+    HighlightTraceRecord *record;
+
+    record = next_record(trace);
+    record->offset = (uint32_t) offset;
+    record->length = (uint32_t) length;
+    record->line = (uint32_t) line;
+    record->document = (uint16_t) (trace->documents - 1);
+    record->type = (uint8_t) type;
+    record->lexer = lexer;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "trace.h"
+
+HighlightTrace *highlight_trace_bound(void);
+void highlight_trace_start_document(HighlightTrace *);
+uint8_t highlight_trace_lexer_id(HighlightTrace *, const LexerImplementation *);
+void highlight_trace_record(HighlightTrace *, uint8_t, size_t, size_t, int, int);
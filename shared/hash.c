@@ -0,0 +1,236 @@
+/**
+ * @file shared/hash.c
+ * @brief a fast, non cryptographic, 128-bit hash (MurmurHash3 x64 128 variant)
+ *
+ * The digest is identical whether the input is hashed in one call (hash128)
+ * or fed by pieces (hash128_init + hash128_update + hash128_final).
+ */
+
+#include <string.h>
+
+#include "cpp.h"
+#include "hash.h"
+
+#define C1 UINT64_C(0x87c37b91114253d5)
+#define C2 UINT64_C(0x4cf5ad432745937f)
+
+static inline uint64_t rotl64(uint64_t x, int8_t r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= UINT64_C(0xff51afd7ed558ccd);
+    k ^= k >> 33;
+    k *= UINT64_C(0xc4ceb9fe1a85ec53);
+    k ^= k >> 33;
+
+    return k;
+}
+
+static inline uint64_t read64le(const uint8_t *p)
+{
+    return (uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16 | (uint64_t) p[3] << 24
+        | (uint64_t) p[4] << 32 | (uint64_t) p[5] << 40 | (uint64_t) p[6] << 48 | (uint64_t) p[7] << 56;
+}
+
+static HOT void hash128_block(Hash128Context *ctxt, const uint8_t *block)
+{
+    uint64_t k1, k2;
+
+    k1 = read64le(block);
+    k2 = read64le(block + 8);
+
+    k1 *= C1; k1 = rotl64(k1, 31); k1 *= C2; ctxt->h1 ^= k1;
+    ctxt->h1 = rotl64(ctxt->h1, 27); ctxt->h1 += ctxt->h2; ctxt->h1 = ctxt->h1 * 5 + 0x52dce729;
+    k2 *= C2; k2 = rotl64(k2, 33); k2 *= C1; ctxt->h2 ^= k2;
+    ctxt->h2 = rotl64(ctxt->h2, 31); ctxt->h2 += ctxt->h1; ctxt->h2 = ctxt->h2 * 5 + 0x38495ab5;
+}
+
+/**
+ * Initialize a context for an incremental hash computation
+ *
+ * @param ctxt the context to initialize
+ * @param seed a seed (use 0 if unsure)
+ */
+void hash128_init(Hash128Context *ctxt, uint64_t seed)
+{
+    ctxt->h1 = ctxt->h2 = seed;
+    ctxt->total_len = ctxt->tail_len = 0;
+}
+
+/**
+ * Feed the context with more data
+ *
+ * @param ctxt the context
+ * @param data the data to hash
+ * @param data_len its length
+ */
+void hash128_update(Hash128Context *ctxt, const void *data, size_t data_len)
+{
+    const uint8_t *p, *end;
+
+    p = (const uint8_t *) data;
+    end = p + data_len;
+    ctxt->total_len += data_len;
+    if (ctxt->tail_len > 0) {
+        size_t missing;
+
+        missing = MIN(sizeof(ctxt->tail) - ctxt->tail_len, data_len);
+        memcpy(ctxt->tail + ctxt->tail_len, p, missing);
+        ctxt->tail_len += missing;
+        p += missing;
+        if (ctxt->tail_len < sizeof(ctxt->tail)) {
+            return;
+        }
+        hash128_block(ctxt, ctxt->tail);
+        ctxt->tail_len = 0;
+    }
+    for (; end - p >= (ptrdiff_t) sizeof(ctxt->tail); p += sizeof(ctxt->tail)) {
+        hash128_block(ctxt, p);
+    }
+    if (p < end) {
+        memcpy(ctxt->tail, p, end - p);
+        ctxt->tail_len = end - p;
+    }
+}
+
+/**
+ * Terminate the computation
+ *
+ * @param ctxt the context
+ * @param h the resulting digest
+ */
+void hash128_final(Hash128Context *ctxt, Hash128 *h)
+{
+    uint64_t k1, k2, h1, h2;
+    const uint8_t *tail;
+
+    k1 = k2 = 0;
+    h1 = ctxt->h1;
+    h2 = ctxt->h2;
+    tail = ctxt->tail;
+    switch (ctxt->tail_len) {
+        case 15: k2 ^= ((uint64_t) tail[14]) << 48; /* fall through */
+        case 14: k2 ^= ((uint64_t) tail[13]) << 40; /* fall through */
+        case 13: k2 ^= ((uint64_t) tail[12]) << 32; /* fall through */
+        case 12: k2 ^= ((uint64_t) tail[11]) << 24; /* fall through */
+        case 11: k2 ^= ((uint64_t) tail[10]) << 16; /* fall through */
+        case 10: k2 ^= ((uint64_t) tail[ 9]) << 8;  /* fall through */
+        case  9: k2 ^= ((uint64_t) tail[ 8]) << 0;
+                 k2 *= C2; k2 = rotl64(k2, 33); k2 *= C1; h2 ^= k2;
+                 /* fall through */
+        case  8: k1 ^= ((uint64_t) tail[ 7]) << 56; /* fall through */
+        case  7: k1 ^= ((uint64_t) tail[ 6]) << 48; /* fall through */
+        case  6: k1 ^= ((uint64_t) tail[ 5]) << 40; /* fall through */
+        case  5: k1 ^= ((uint64_t) tail[ 4]) << 32; /* fall through */
+        case  4: k1 ^= ((uint64_t) tail[ 3]) << 24; /* fall through */
+        case  3: k1 ^= ((uint64_t) tail[ 2]) << 16; /* fall through */
+        case  2: k1 ^= ((uint64_t) tail[ 1]) << 8;  /* fall through */
+        case  1: k1 ^= ((uint64_t) tail[ 0]) << 0;
+                 k1 *= C1; k1 = rotl64(k1, 31); k1 *= C2; h1 ^= k1;
+    }
+    h1 ^= ctxt->total_len;
+    h2 ^= ctxt->total_len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    h->h1 = h1;
+    h->h2 = h2;
+}
+
+/**
+ * Hash a whole buffer at once
+ *
+ * @param data the data to hash
+ * @param data_len its length
+ * @param seed a seed (use 0 if unsure)
+ * @param h the resulting digest
+ */
+void hash128(const void *data, size_t data_len, uint64_t seed, Hash128 *h)
+{
+    Hash128Context ctxt;
+
+    hash128_init(&ctxt, seed);
+    hash128_update(&ctxt, data, data_len);
+    hash128_final(&ctxt, h);
+}
+
+/**
+ * Compare two digests
+ *
+ * @return 0 if they are equal, < 0 if a is lower than b, else > 0
+ */
+int hash128_cmp(const Hash128 *a, const Hash128 *b)
+{
+    if (a->h1 != b->h1) {
+        return a->h1 < b->h1 ? -1 : 1;
+    }
+    if (a->h2 != b->h2) {
+        return a->h2 < b->h2 ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Write the hexadecimal representation of a digest
+ *
+ * @param h the digest
+ * @param buffer the output buffer (NUL terminated on return)
+ *
+ * @return buffer
+ */
+char *hash128_to_hex(const Hash128 *h, char buffer[HASH128_HEX_SIZE])
+{
+    int i;
+    char *w;
+    static const char digits[] = "0123456789abcdef";
+
+    w = buffer;
+    for (i = 60; i >= 0; i -= 4) {
+        *w++ = digits[(h->h1 >> i) & 0xF];
+    }
+    for (i = 60; i >= 0; i -= 4) {
+        *w++ = digits[(h->h2 >> i) & 0xF];
+    }
+    *w = '\0';
+
+    return buffer;
+}
+
+/**
+ * Parse the hexadecimal representation of a digest (as written by hash128_to_hex)
+ *
+ * @param string the string to parse, at least 32 characters
+ * @param h the digest to set
+ *
+ * @return 0 on success
+ */
+int hash128_from_hex(const char *string, Hash128 *h)
+{
+    int i;
+    uint64_t *part;
+
+    h->h1 = h->h2 = 0;
+    for (i = 0; i < HASH128_HEX_SIZE - 1; i++) {
+        uint64_t v;
+
+        if (string[i] >= '0' && string[i] <= '9') {
+            v = string[i] - '0';
+        } else if (string[i] >= 'a' && string[i] <= 'f') {
+            v = 10 + string[i] - 'a';
+        } else {
+            return -1;
+        }
+        part = i < 16 ? &h->h1 : &h->h2;
+        *part = (*part << 4) | v;
+    }
+
+    return 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint\d+_t */
+
+#define HASH128_HEX_SIZE 33
+
+/**
+ * A 128-bit digest
+ */
+typedef struct {
+    uint64_t h1, h2;
+} Hash128;
+
+/**
+ * State of an incremental (streaming) computation of a Hash128
+ */
+typedef struct {
+    uint64_t h1, h2;
+    size_t total_len;
+    size_t tail_len;
+    uint8_t tail[16];
+} Hash128Context;
+
+void hash128_init(Hash128Context *, uint64_t);
+void hash128_update(Hash128Context *, const void *, size_t);
+void hash128_final(Hash128Context *, Hash128 *);
+void hash128(const void *, size_t, uint64_t, Hash128 *);
+
+int hash128_cmp(const Hash128 *, const Hash128 *);
+char *hash128_to_hex(const Hash128 *, char [HASH128_HEX_SIZE]);
+int hash128_from_hex(const char *, Hash128 *);